@@ -46,7 +46,7 @@
 #include "gamestringpool.h"
 #include "jigglebones.h"
 #include "toolframework_client.h"
-#include "vstdlib/jobthread.h"
+#include "vstdlib/jobtasks.h"
 #include "bonetoworldarray.h"
 #include "posedebugger.h"
 #include "tier0/icommandline.h"
@@ -2928,19 +2928,17 @@ ConVar cl_threaded_bone_setup("cl_threaded_bone_setup", "0", 0, "Enable parallel
 // Purpose: Do the default sequence blending rules as done in HL1
 //-----------------------------------------------------------------------------
 
-static void SetupBonesOnBaseAnimating( C_BaseAnimating *&pBaseAnimating )
-{
-	if ( !pBaseAnimating->GetMoveParent() )
-		pBaseAnimating->SetupBones( NULL, -1, -1, gpGlobals->curtime );
-}
-
-static void PreThreadedBoneSetup()
+static void SetupBonesOnBaseAnimatings( int iFirst, int iLast )
 {
 	mdlcache->BeginLock();
-}
 
-static void PostThreadedBoneSetup()
-{
+	for ( int i = iFirst; i < iLast; i++ )
+	{
+		C_BaseAnimating *pBaseAnimating = g_PreviousBoneSetups[i];
+		if ( !pBaseAnimating->GetMoveParent() )
+			pBaseAnimating->SetupBones( NULL, -1, -1, gpGlobals->curtime );
+	}
+
 	mdlcache->EndLock();
 }
 
@@ -2965,7 +2963,7 @@ void C_BaseAnimating::ThreadedBoneSetup()
 		{
 			g_bInThreadedBoneSetup = true;
 
-			ParallelProcess( "C_BaseAnimating::ThreadedBoneSetup", g_PreviousBoneSetups.Base(), nCount, &SetupBonesOnBaseAnimating, &PreThreadedBoneSetup, &PostThreadedBoneSetup );
+			ParallelFor( "C_BaseAnimating::ThreadedBoneSetup", 0, nCount, 1, SetupBonesOnBaseAnimatings );
 
 			g_bInThreadedBoneSetup = false;
 		}
@@ -1001,7 +1001,7 @@ void C_BaseEntity::Interp_HierarchyUpdateInterpolationAmounts()
 	}
 }
 
-inline int C_BaseEntity::Interp_Interpolate( VarMapping_t *map, float currentTime )
+int C_BaseEntity::Interp_Interpolate( VarMapping_t *map, float currentTime )
 {
 	int bNoMoreChanges = 1;
 	if ( currentTime < map->m_lastInterpolationTime )
@@ -1015,6 +1015,10 @@ inline int C_BaseEntity::Interp_Interpolate( VarMapping_t *map, float currentTim
 	}
 	map->m_lastInterpolationTime = currentTime;
 
+	// Vars latched on the same basis share their sample search
+	CInterpolationBracket animBracket, simBracket;
+	bool bBatch = g_bInterpolationBatching;
+
 	for ( int i = 0; i < map->m_nInterpolatedEntries; i++ )
 	{
 		VarMapEntry_t *e = &map->m_Entries[ i ];
@@ -1025,8 +1029,18 @@ inline int C_BaseEntity::Interp_Interpolate( VarMapping_t *map, float currentTim
 		IInterpolatedVar *watcher = e->watcher;
 		Assert( !( watcher->GetType() & EXCLUDE_AUTO_INTERPOLATE ) );
 
+		int bVarNoMoreChanges;
+		if ( bBatch )
+		{
+			CInterpolationBracket &bracket = ( e->type & LATCH_SIMULATION_VAR ) ? simBracket : animBracket;
+			bVarNoMoreChanges = watcher->InterpolateBracketed( currentTime, bracket );
+		}
+		else
+		{
+			bVarNoMoreChanges = watcher->Interpolate( currentTime );
+		}
 
-		if ( watcher->Interpolate( currentTime ) )
+		if ( bVarNoMoreChanges )
 			e->m_bNeedsToInterpolate = false;
 		else
 			bNoMoreChanges = 0;
@@ -243,7 +243,7 @@ public:
 	void							Interp_SetupMappings( VarMapping_t *map );
 	
 	// Returns 1 if there are no more changes (ie: we could call RemoveFromInterpolationList).
-	int								Interp_Interpolate( VarMapping_t *map, float currentTime );
+	static int						Interp_Interpolate( VarMapping_t *map, float currentTime );
 	
 	void							Interp_RestoreToLastNetworked( VarMapping_t *map );
 	void							Interp_UpdateInterpolationAmounts( VarMapping_t *map );
@@ -58,6 +58,7 @@
 #include "igameevents.h"
 #include "datacache/idatacache.h"
 #include "datacache/imdlcache.h"
+#include "bone_setup.h"
 #include "kbutton.h"
 #include "tier0/icommandline.h"
 #include "gamerules_register.h"
@@ -1954,6 +1955,9 @@ void CHLClient::LevelShutdown( void )
 		pClassList = pClassList->m_pNextClassList;
 	}
 
+	// Models may be unloaded after this, so drop anything pointing into their animations
+	Studio_FlushAnimValueIndex();
+
 	// Now do the post-entity shutdown of all systems
 	IGameSystem::LevelShutdownPostEntityAllSystems();
 
@@ -23,6 +23,8 @@
 #include "datacache/imdlcache.h"
 #include "view.h"
 #include "viewrender.h"
+#include "mathlib/ssemath.h"
+#include "renderablecull.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -32,7 +34,8 @@ class VMatrix;  // forward decl
 static ConVar cl_drawleaf("cl_drawleaf", "-1", FCVAR_CHEAT );
 static ConVar r_PortalTestEnts( "r_PortalTestEnts", "1", FCVAR_CHEAT, "Clip entities against portal frustums." );
 static ConVar r_portalsopenall( "r_portalsopenall", "0", FCVAR_CHEAT, "Open all portals" );
-static ConVar cl_threaded_client_leaf_system("cl_threaded_client_leaf_system", "0"  );
+static ConVar cl_threaded_client_leaf_system("cl_threaded_client_leaf_system", "1"  );
+static ConVar cl_simd_renderable_cull( "cl_simd_renderable_cull", "1", 0, "Cull renderables against the view frustum four at a time instead of asking the engine about each one." );
 
 
 DEFINE_FIXEDSIZE_ALLOCATOR( CClientRenderablesList, 1, CUtlMemoryPool::GROW_SLOW );
@@ -163,6 +166,13 @@ private:
 	void InsertIntoTree( ClientRenderHandle_t &handle );
 	void RemoveFromTree( ClientRenderHandle_t handle );
 
+	// Threaded reinsertion of the first nDirty dirty renderables
+	struct DeferredInsert_t;
+	void InsertDirtyRenderablesThreaded( int nDirty );
+	void FlushDeferredChanges();
+	void InsertIntoTreeDeferred( DeferredInsert_t *&pInsert );
+	void EnumerateRenderableLeaves( DeferredInsert_t &insert );
+
 	// Returns if it's a view model render group
 	inline bool IsViewModelRenderGroup( RenderGroup_t group ) const;
 
@@ -178,6 +188,9 @@ private:
 	// Only really used by the static prop fading...
 	void ChangeRenderableRenderGroup( ClientRenderHandle_t handle, RenderGroup_t group );
 
+	// Copies the render group and flags into the culling database
+	void UpdateCullRenderInfo( ClientRenderHandle_t handle );
+
 	// Adds a shadow to a leaf/removes shadow from renderable
 	void AddShadowToRenderable( ClientRenderHandle_t renderHandle, ClientLeafShadowHandle_t shadowHandle );
 	void RemoveShadowFromRenderables( ClientLeafShadowHandle_t handle );
@@ -280,16 +293,21 @@ private:
 		unsigned short	m_Flags;
 	};
 
-	struct EnumResult_t
+	// Leaves found by reinsertions on one thread
+	struct LeafInsertBuffer_t
 	{
-		int leaf;
-		EnumResult_t *pNext;
+		CUtlVector<int>	m_Leaves;
 	};
 
-	struct EnumResultList_t
+	// A renderable being inserted into the tree. With a buffer, its leaves are
+	// appended there to be added to the leaf lists later; without one they're
+	// added right away.
+	struct DeferredInsert_t
 	{
-		EnumResult_t *pHead;
-		ClientRenderHandle_t handle;
+		ClientRenderHandle_t	m_Handle;
+		LeafInsertBuffer_t		*m_pBuffer;
+		int						m_nFirstLeaf;
+		int						m_nLeafCount;
 	};
 
 	// Stores data associated with each leaf.
@@ -323,7 +341,28 @@ private:
 	// A little enumerator to help us when adding shadows to renderables
 	int	m_ShadowEnum;
 
-	CTSList<EnumResultList_t> m_DeferredInserts;
+	// Threaded reinsertion. Each job thread appends to its own leaf buffer, and
+	// the results are merged on the main thread.
+	CUtlVector< DeferredInsert_t >		m_DeferredInserts;
+	CUtlVector< DeferredInsert_t * >	m_ThreadedInserts;
+	CThreadLocalPtr< LeafInsertBuffer_t > m_pThreadLeafInsertBuffer;
+	CUtlVector< LeafInsertBuffer_t * >	m_LeafInsertBuffers;
+	CThreadFastMutex					m_LeafInsertBufferLock;
+
+	// Renderables that changed on a job thread, marked dirty by FlushDeferredChanges
+	CTSList< ClientRenderHandle_t >		m_DeferredChanges;
+
+	// Reused by SortEntities
+	TranslucentSortScratch_t m_TranslucentSortScratch;
+
+	// Bounds, groups and flags for culling, and the per-leaf lists
+	// CollateRenderablesInLeaf culls in one go
+	CRenderableCullDB					m_CullDB;
+	RenderableCullFrustum_t				m_CullFrustum;
+	bool								m_bCullFrustum;
+	CUtlVector< ClientRenderHandle_t >	m_CullCandidates;
+	CUtlVector< unsigned char >			m_CullAlpha;
+	CUtlVector< int >					m_CullVisible;
 };
 
 
@@ -435,7 +474,7 @@ void CalcRenderableWorldSpaceAABB_Fast( IClientRenderable *pRenderable, Vector &
 //-----------------------------------------------------------------------------
 // constructor, destructor
 //-----------------------------------------------------------------------------
-CClientLeafSystem::CClientLeafSystem() : m_DrawStaticProps(true), m_DrawSmallObjects(true)
+CClientLeafSystem::CClientLeafSystem() : m_DrawStaticProps(true), m_DrawSmallObjects(true), m_bCullFrustum(false)
 {
 	// Set up the bi-directional lists...
 	m_RenderablesInLeaf.Init( FirstRenderableInLeaf, FirstLeafInRenderable );
@@ -445,6 +484,7 @@ CClientLeafSystem::CClientLeafSystem() : m_DrawStaticProps(true), m_DrawSmallObj
 
 CClientLeafSystem::~CClientLeafSystem()
 {
+	m_LeafInsertBuffers.PurgeAndDeleteElements();
 }
 
 //-----------------------------------------------------------------------------
@@ -497,6 +537,15 @@ void CClientLeafSystem::LevelShutdownPreEntity()
 
 void CClientLeafSystem::LevelShutdownPostEntity()
 {
+	// The buffers stay registered with their threads, just drop the memory
+	for ( int i = 0; i < m_LeafInsertBuffers.Count(); i++ )
+	{
+		m_LeafInsertBuffers[i]->m_Leaves.Purge();
+	}
+	m_DeferredInserts.Purge();
+	m_ThreadedInserts.Purge();
+	m_CullDB.Purge();
+
 	m_ViewModels.Purge();
 	m_Renderables.Purge();
 	m_RenderablesInLeaf.Purge();
@@ -531,6 +580,9 @@ void CClientLeafSystem::PreRender()
 	int i;
 	int nIterations = 0;
 
+	// Whatever moved on other threads since the last view, whichever path runs below
+	FlushDeferredChanges();
+
 	while ( m_DirtyRenderables.Count() )
 	{
 		if ( ++nIterations > 10 )
@@ -549,7 +601,7 @@ void CClientLeafSystem::PreRender()
 			RemoveFromTree( handle );
 		}
 
-		bool bThreaded = false;//( nDirty > 5 && cl_threaded_client_leaf_system.GetBool() && g_pThreadPool->NumThreads() );
+		bool bThreaded = ( nDirty > 5 && cl_threaded_client_leaf_system.GetBool() && g_pThreadPool->NumThreads() );
 
 		if ( !bThreaded )
 		{
@@ -560,26 +612,7 @@ void CClientLeafSystem::PreRender()
 		}
 		else
 		{
-			// InsertIntoTree can result in new renderables being added, so copy:
-			ClientRenderHandle_t *pDirtyRenderables = (ClientRenderHandle_t *)alloca( sizeof(ClientRenderHandle_t) * nDirty );
-			memcpy( pDirtyRenderables, m_DirtyRenderables.Base(), sizeof(ClientRenderHandle_t) * nDirty );
-			ParallelProcess( "CClientLeafSystem::PreRender", pDirtyRenderables, nDirty, this, &CClientLeafSystem::InsertIntoTree, &CClientLeafSystem::FrameLock, &CClientLeafSystem::FrameUnlock );
-		}
-
-		if ( m_DeferredInserts.Count() )
-		{
-			EnumResultList_t enumResultList;
-			while ( m_DeferredInserts.PopItem( &enumResultList ) )
-			{
-				m_ShadowEnum++;
-				while ( enumResultList.pHead )
-				{
-					EnumResult_t *p = enumResultList.pHead;
-					enumResultList.pHead = p->pNext;
-					AddRenderableToLeaf( p->leaf, enumResultList.handle );
-					delete p;
-				}
-			}
+			InsertDirtyRenderablesThreaded( nDirty );
 		}
 
 		for ( i = nDirty; --i >= 0; )
@@ -635,6 +668,10 @@ void CClientLeafSystem::NewRenderable( IClientRenderable* pRenderable, RenderGro
 		AddToViewModelList( handle );
 	}
 
+	m_CullDB.EnsureCount( handle + 1 );
+	m_CullDB.InvalidateBounds( handle );
+	UpdateCullRenderInfo( handle );
+
 	pRenderable->RenderHandle() = handle;
 }
 
@@ -681,6 +718,14 @@ void CClientLeafSystem::ChangeRenderableRenderGroup( ClientRenderHandle_t handle
 {
 	RenderableInfo_t &info = m_Renderables[handle];
 	info.m_RenderGroup = (unsigned char)group;
+	UpdateCullRenderInfo( handle );
+}
+
+
+void CClientLeafSystem::UpdateCullRenderInfo( ClientRenderHandle_t handle )
+{
+	const RenderableInfo_t &info = m_Renderables[handle];
+	m_CullDB.SetRenderInfo( handle, info.m_RenderGroup, info.m_Flags & ~RENDER_FLAGS_HASCHANGED );
 }
 
 
@@ -698,6 +743,7 @@ void CClientLeafSystem::EnableAlternateSorting( ClientRenderHandle_t handle, boo
 	{
 		info.m_Flags &= ~RENDER_FLAGS_ALTERNATE_SORTING; 
 	}
+	UpdateCullRenderInfo( handle );
 }
 
 
@@ -1134,45 +1180,134 @@ void CClientLeafSystem::AddRenderableToLeaves( ClientRenderHandle_t handle, int
 //-----------------------------------------------------------------------------
 bool CClientLeafSystem::EnumerateLeaf( int leaf, int context )
 {
-	EnumResultList_t *pList = (EnumResultList_t *)context;
-	if ( ThreadInMainThread() )
+	DeferredInsert_t *pInsert = (DeferredInsert_t *)context;
+	if ( !pInsert->m_pBuffer )
 	{
-		AddRenderableToLeaf( leaf, pList->handle );
+		AddRenderableToLeaf( leaf, pInsert->m_Handle );
 	}
 	else
 	{
-		EnumResult_t *p = new EnumResult_t;
-		p->leaf = leaf;
-		p->pNext = pList->pHead;
-		pList->pHead = p;
+		pInsert->m_pBuffer->m_Leaves.AddToTail( leaf );
+		pInsert->m_nLeafCount++;
 	}
 	return true;
 }
 
-void CClientLeafSystem::InsertIntoTree( ClientRenderHandle_t &handle )
+void CClientLeafSystem::EnumerateRenderableLeaves( DeferredInsert_t &insert )
 {
-	if ( ThreadInMainThread() )
-	{
-		// When we insert into the tree, increase the shadow enumerator
-		// to make sure each shadow is added exactly once to each renderable
-		m_ShadowEnum++;
-	}
-
-	EnumResultList_t list = { NULL, handle };
-
 	// NOTE: The render bounds here are relative to the renderable's coordinate system
-	IClientRenderable* pRenderable = m_Renderables[handle].m_pRenderable;
+	IClientRenderable* pRenderable = m_Renderables[insert.m_Handle].m_pRenderable;
 	Vector absMins, absMaxs;
 	
 	CalcRenderableWorldSpaceAABB_Fast( pRenderable, absMins, absMaxs );
 	Assert( absMins.IsValid() && absMaxs.IsValid() );
 
 	ISpatialQuery* pQuery = engine->GetBSPTreeQuery();
-	pQuery->EnumerateLeavesInBox( absMins, absMaxs, this, (int)&list );
+	pQuery->EnumerateLeavesInBox( absMins, absMaxs, this, (int)&insert );
+}
+
+void CClientLeafSystem::InsertIntoTree( ClientRenderHandle_t &handle )
+{
+	// When we insert into the tree, increase the shadow enumerator
+	// to make sure each shadow is added exactly once to each renderable
+	m_ShadowEnum++;
 
-	if ( list.pHead )
+	DeferredInsert_t insert = { handle, NULL, 0, 0 };
+	EnumerateRenderableLeaves( insert );
+}
+
+//-----------------------------------------------------------------------------
+// Finds the leaves into this thread's buffer. Safe on any thread, the leaf
+// lists aren't touched.
+//-----------------------------------------------------------------------------
+void CClientLeafSystem::InsertIntoTreeDeferred( DeferredInsert_t *&pInsert )
+{
+	LeafInsertBuffer_t *pBuffer = m_pThreadLeafInsertBuffer;
+	if ( !pBuffer )
 	{
-		m_DeferredInserts.PushItem( list );
+		pBuffer = new LeafInsertBuffer_t;
+		m_pThreadLeafInsertBuffer = pBuffer;
+
+		AUTO_LOCK( m_LeafInsertBufferLock );
+		m_LeafInsertBuffers.AddToTail( pBuffer );
+	}
+
+	pInsert->m_pBuffer = pBuffer;
+	pInsert->m_nFirstLeaf = pBuffer->m_Leaves.Count();
+	pInsert->m_nLeafCount = 0;
+	EnumerateRenderableLeaves( *pInsert );
+}
+
+//-----------------------------------------------------------------------------
+// Reinserts dirty renderables on the job threads, then adds them to the leaf
+// lists in the same order the serial path does, so both give the same lists
+//-----------------------------------------------------------------------------
+void CClientLeafSystem::InsertDirtyRenderablesThreaded( int nDirty )
+{
+	// InsertIntoTree can result in new renderables being added, so copy:
+	m_DeferredInserts.SetCount( nDirty );
+	m_ThreadedInserts.RemoveAll();
+
+	for ( int i = 0; i < nDirty; i++ )
+	{
+		DeferredInsert_t &insert = m_DeferredInserts[i];
+		insert.m_Handle = m_DirtyRenderables[i];
+		insert.m_pBuffer = NULL;
+		insert.m_nFirstLeaf = 0;
+		insert.m_nLeafCount = 0;
+
+		// Settle the abs transform here so the jobs don't compute shared
+		// parents at the same time. Anything following another entity walks
+		// its parent's bounds, so insert those here too.
+		C_BaseEntity *pEnt = m_Renderables[insert.m_Handle].m_pRenderable->GetIClientUnknown()->GetBaseEntity();
+		if ( pEnt )
+		{
+			pEnt->GetAbsOrigin();
+			if ( pEnt->IsFollowingEntity() )
+			{
+				DeferredInsert_t *pInsert = &insert;
+				InsertIntoTreeDeferred( pInsert );
+				continue;
+			}
+		}
+
+		m_ThreadedInserts.AddToTail( &insert );
+	}
+
+	ParallelProcess( "CClientLeafSystem::PreRender", m_ThreadedInserts.Base(), m_ThreadedInserts.Count(), this, &CClientLeafSystem::InsertIntoTreeDeferred, &CClientLeafSystem::FrameLock, &CClientLeafSystem::FrameUnlock );
+
+	for ( int i = nDirty; --i >= 0; )
+	{
+		const DeferredInsert_t &insert = m_DeferredInserts[i];
+
+		// Same as InsertIntoTree
+		m_ShadowEnum++;
+
+		const int *pLeaves = insert.m_pBuffer ? insert.m_pBuffer->m_Leaves.Base() + insert.m_nFirstLeaf : NULL;
+		for ( int j = 0; j < insert.m_nLeafCount; j++ )
+		{
+			AddRenderableToLeaf( pLeaves[j], insert.m_Handle );
+		}
+	}
+
+	for ( int i = 0; i < m_LeafInsertBuffers.Count(); i++ )
+	{
+		m_LeafInsertBuffers[i]->m_Leaves.RemoveAll();
+	}
+
+	// These get picked up by the next pass in PreRender
+	FlushDeferredChanges();
+}
+
+//-----------------------------------------------------------------------------
+// Marks dirty the renderables RenderableChanged was called for off the main thread
+//-----------------------------------------------------------------------------
+void CClientLeafSystem::FlushDeferredChanges()
+{
+	ClientRenderHandle_t handle;
+	while ( m_DeferredChanges.PopItem( &handle ) )
+	{
+		RenderableChanged( handle );
 	}
 }
 
@@ -1210,6 +1345,16 @@ void CClientLeafSystem::RenderableChanged( ClientRenderHandle_t handle )
 	if ( !m_Renderables.IsValidIndex( handle ) )
 		return;
 
+	if ( !ThreadInMainThread() )
+	{
+		// Moved by a threaded reinsert, the dirty list is the main thread's
+		m_DeferredChanges.PushItem( handle );
+		return;
+	}
+
+	// It's moved, so the bounds cached this frame are stale
+	m_CullDB.InvalidateBounds( handle );
+
 	if ( (m_Renderables[handle].m_Flags & RENDER_FLAGS_HASCHANGED ) == 0 )
 	{
 		m_Renderables[handle].m_Flags |= RENDER_FLAGS_HASCHANGED;
@@ -1290,7 +1435,7 @@ void CClientLeafSystem::SetRenderGroup( ClientRenderHandle_t handle, RenderGroup
 	}
 
 	pInfo->m_RenderGroup = group;
-
+	UpdateCullRenderInfo( handle );
 }
 
 
@@ -1513,7 +1658,11 @@ void CClientLeafSystem::CollateRenderablesInLeaf( int leaf, int worldListLeafInd
 	AddRenderableToRenderList( *info.m_pRenderList, NULL, worldListLeafIndex, RENDER_GROUP_OPAQUE_STATIC, NULL );
 	AddRenderableToRenderList( *info.m_pRenderList, NULL, worldListLeafIndex, RENDER_GROUP_OPAQUE_ENTITY, NULL );
 
-	// Collate everything.
+	// Collate everything. First find what could be drawn and get its bounds...
+	int nFrame = gpGlobals->framecount;
+	m_CullCandidates.RemoveAll();
+	m_CullAlpha.RemoveAll();
+
 	unsigned short idx = m_RenderablesInLeaf.FirstElement(leaf);
 	for ( ;idx != m_RenderablesInLeaf.InvalidIndex(); idx = m_RenderablesInLeaf.NextElement(idx) )
 	{
@@ -1521,7 +1670,7 @@ void CClientLeafSystem::CollateRenderablesInLeaf( int leaf, int worldListLeafInd
 		RenderableInfo_t& renderable = m_Renderables[handle];
 
 		// Early out on static props if we don't want to render them
-		if ((!m_DrawStaticProps) && (renderable.m_Flags & RENDER_FLAGS_STATIC_PROP))
+		if ((!m_DrawStaticProps) && (m_CullDB.GetFlags( handle ) & RENDER_FLAGS_STATIC_PROP))
 			continue;
 
 		// Early out if we're told to not draw small objects (top view only,
@@ -1538,7 +1687,7 @@ void CClientLeafSystem::CollateRenderablesInLeaf( int leaf, int worldListLeafInd
 		Assert( m_DrawSmallObjects ); // MOTODO
 
 		// Don't hit the same ent in multiple leaves twice.
-		if ( renderable.m_RenderGroup != RENDER_GROUP_TRANSLUCENT_ENTITY )
+		if ( m_CullDB.GetRenderGroup( handle ) != RENDER_GROUP_TRANSLUCENT_ENTITY )
 		{
 			if ( renderable.m_RenderFrame2 == info.m_nRenderFrame )
 				continue;
@@ -1566,16 +1715,56 @@ void CClientLeafSystem::CollateRenderablesInLeaf( int leaf, int worldListLeafInd
 				continue;
 		}
 
+		// Other views this frame have usually asked already
+		if ( !m_CullDB.HasBounds( handle, nFrame ) )
+		{
+			Vector absMins, absMaxs;
+			CalcRenderableWorldSpaceAABB( renderable.m_pRenderable, absMins, absMaxs );
+			m_CullDB.SetBounds( handle, nFrame, absMins, absMaxs );
+		}
+
+		m_CullCandidates.AddToTail( handle );
+		m_CullAlpha.AddToTail( nAlpha );
+	}
+
+	// ...then drop everything outside the view frustum in one pass
+	int nCandidates = m_CullCandidates.Count();
+	m_CullVisible.SetCount( nCandidates );
+	int nVisible;
+	if ( m_bCullFrustum )
+	{
+		nVisible = m_CullDB.CullToFrustum( m_CullFrustum, m_CullCandidates.Base(), nCandidates, m_CullVisible.Base() );
+	}
+	else
+	{
+		for ( int i = 0; i < nCandidates; i++ )
+		{
+			m_CullVisible[i] = i;
+		}
+		nVisible = nCandidates;
+	}
+
+	for ( int iVisible = 0; iVisible < nVisible; iVisible++ )
+	{
+		int iCandidate = m_CullVisible[iVisible];
+		ClientRenderHandle_t handle = m_CullCandidates[iCandidate];
+		RenderableInfo_t& renderable = m_Renderables[handle];
+		unsigned char nAlpha = m_CullAlpha[iCandidate];
+		unsigned char nRenderGroup = m_CullDB.GetRenderGroup( handle );
+		unsigned char nFlags = m_CullDB.GetFlags( handle );
+
 		Vector absMins, absMaxs;
-		CalcRenderableWorldSpaceAABB( renderable.m_pRenderable, absMins, absMaxs );
+		m_CullDB.GetBounds( handle, absMins, absMaxs );
+
 		// If the renderable is inside an area, cull it using the frustum for that area.
+		// The area frustums are inside the view frustum, so this only sees what passed that.
 		if ( portalTestEnts && renderable.m_Area != -1 )
 		{
 			VPROF( "r_PortalTestEnts" );
 			if ( !engine->DoesBoxTouchAreaFrustum( absMins, absMaxs, renderable.m_Area ) )
 				continue;
 		}
-		else
+		else if ( !m_bCullFrustum )
 		{
 			// cull with main frustum
 			if ( engine->CullBox( absMins, absMaxs ) )
@@ -1583,7 +1772,7 @@ void CClientLeafSystem::CollateRenderablesInLeaf( int leaf, int worldListLeafInd
 		}
 
 		// UNDONE: Investigate speed tradeoffs of occlusion culling brush models too?
-		if ( renderable.m_Flags & RENDER_FLAGS_STUDIO_MODEL )
+		if ( nFlags & RENDER_FLAGS_STUDIO_MODEL )
 		{
 			// test to see if this renderable is occluded by the engine's occlusion system
 			if ( engine->IsOccluded( absMins, absMaxs ) )
@@ -1609,9 +1798,9 @@ void CClientLeafSystem::CollateRenderablesInLeaf( int leaf, int worldListLeafInd
 		}
 #endif
 
-		if( renderable.m_RenderGroup != RENDER_GROUP_TRANSLUCENT_ENTITY )
+		if( nRenderGroup != RENDER_GROUP_TRANSLUCENT_ENTITY )
 		{
-			RenderGroup_t group = (RenderGroup_t)renderable.m_RenderGroup;
+			RenderGroup_t group = (RenderGroup_t)nRenderGroup;
 
 			// Determine object group offset
 			if ( RENDER_GROUP_CFG_NUM_OPAQUE_ENT_BUCKETS > 1 &&
@@ -1632,13 +1821,13 @@ void CClientLeafSystem::CollateRenderablesInLeaf( int leaf, int worldListLeafInd
 		}
 		else
 		{
-			bool bTwoPass = ((renderable.m_Flags & RENDER_FLAGS_TWOPASS) != 0) && ( nAlpha == 255 );	// Two pass?
+			bool bTwoPass = ((nFlags & RENDER_FLAGS_TWOPASS) != 0) && ( nAlpha == 255 );	// Two pass?
 
 			// Add to appropriate list if drawing translucent objects (shadow depth mapping will skip this)
 			if ( info.m_bDrawTranslucentObjects ) 
 			{
 				AddRenderableToRenderList( *info.m_pRenderList, renderable.m_pRenderable, 
-					worldListLeafIndex, (RenderGroup_t)renderable.m_RenderGroup, handle, bTwoPass );
+					worldListLeafIndex, (RenderGroup_t)nRenderGroup, handle, bTwoPass );
 			}
 			
 			if ( bTwoPass )	// Also add to opaque list if it's a two-pass model... 
@@ -1687,60 +1876,183 @@ void CClientLeafSystem::CollateRenderablesInLeaf( int leaf, int worldListLeafInd
 
 
 //-----------------------------------------------------------------------------
-// Sort entities in a back-to-front ordering
+// Translucent depth sorting
 //-----------------------------------------------------------------------------
-void CClientLeafSystem::SortEntities( const Vector &vecRenderOrigin, const Vector &vecRenderForward, CClientRenderablesList::CEntry *pEntities, int nEntities )
+#define TRANSLUCENT_SORT_INSERTION_MAX	24
+
+void TranslucentSortScratch_t::EnsureCount( int nEntities )
+{
+	if ( m_Keys.Count() >= nEntities )
+		return;
+
+	m_CenterX.SetCount( nEntities );
+	m_CenterY.SetCount( nEntities );
+	m_CenterZ.SetCount( nEntities );
+	m_Depths.SetCount( nEntities );
+	m_Keys.SetCount( nEntities );
+	m_TempKeys.SetCount( nEntities );
+	m_Entries.SetCount( nEntities );
+}
+
+// Maps a float to an unsigned int that sorts in the same order
+static inline unsigned int TranslucentSortKey( float flDepth )
+{
+	unsigned int nBits;
+	memcpy( &nBits, &flDepth, sizeof( nBits ) );
+	return ( nBits & 0x80000000 ) ? ~nBits : ( nBits | 0x80000000 );
+}
+
+void SortTranslucentEntriesByDepth( const Vector &vecRenderOrigin, const Vector &vecRenderForward,
+	CClientRenderablesList::CEntry *pEntities, int nEntities, TranslucentSortScratch_t &scratch )
 {
 	// Don't sort if we only have 1 entity
 	if ( nEntities <= 1 )
 		return;
 
-	float dists[CClientRenderablesList::MAX_GROUP_ENTITIES];
+	Assert( scratch.m_Keys.Count() >= nEntities );
 
-	// First get a distance for each entity.
-	int i;
-	for( i=0; i < nEntities; i++ )
-	{
-		IClientRenderable *pRenderable = pEntities[i].m_pRenderable;
+	const float *pX = scratch.m_CenterX.Base();
+	const float *pY = scratch.m_CenterY.Base();
+	const float *pZ = scratch.m_CenterZ.Base();
+	float *pDepths = scratch.m_Depths.Base();
 
-		// Compute the center of the object (needed for translucent brush models)
-		Vector boxcenter;
-		Vector mins,maxs;
-		pRenderable->GetRenderBounds( mins, maxs );
-		VectorAdd( mins, maxs, boxcenter );
-		VectorMA( pRenderable->GetRenderOrigin(), 0.5f, boxcenter, boxcenter );
+	// Distance along the view direction, same operation order as DotProduct
+	fltx4 fl4OriginX = ReplicateX4( vecRenderOrigin.x );
+	fltx4 fl4OriginY = ReplicateX4( vecRenderOrigin.y );
+	fltx4 fl4OriginZ = ReplicateX4( vecRenderOrigin.z );
+	fltx4 fl4ForwardX = ReplicateX4( vecRenderForward.x );
+	fltx4 fl4ForwardY = ReplicateX4( vecRenderForward.y );
+	fltx4 fl4ForwardZ = ReplicateX4( vecRenderForward.z );
+
+	int i = 0;
+	for ( ; i + 4 <= nEntities; i += 4 )
+	{
+		fltx4 fl4Depth = MulSIMD( SubSIMD( LoadUnalignedSIMD( pX + i ), fl4OriginX ), fl4ForwardX );
+		fl4Depth = AddSIMD( fl4Depth, MulSIMD( SubSIMD( LoadUnalignedSIMD( pY + i ), fl4OriginY ), fl4ForwardY ) );
+		fl4Depth = AddSIMD( fl4Depth, MulSIMD( SubSIMD( LoadUnalignedSIMD( pZ + i ), fl4OriginZ ), fl4ForwardZ ) );
+		StoreUnalignedSIMD( pDepths + i, fl4Depth );
+	}
+	for ( ; i < nEntities; i++ )
+	{
+		pDepths[i] = ( pX[i] - vecRenderOrigin.x ) * vecRenderForward.x + ( pY[i] - vecRenderOrigin.y ) * vecRenderForward.y +
+			( pZ[i] - vecRenderOrigin.z ) * vecRenderForward.z;
+	}
 
-		// Compute distance...
-		Vector delta;
-		VectorSubtract( boxcenter, vecRenderOrigin, delta );
-		dists[i] = DotProduct( delta, vecRenderForward );
+	// The key is the depth in the high half and the entry index in the low
+	// half, so equal depths keep the order they were added in
+	uint64 *pKeys = scratch.m_Keys.Base();
+	for ( i = 0; i < nEntities; i++ )
+	{
+		pKeys[i] = ( (uint64)TranslucentSortKey( pDepths[i] ) << 32 ) | (unsigned int)i;
 	}
 
-	// H-sort.
-	int stepSize = 4;
-	while( stepSize )
+	if ( nEntities <= TRANSLUCENT_SORT_INSERTION_MAX )
 	{
-		int end = nEntities - stepSize;
-		for( i=0; i < end; i += stepSize )
+		// Most leaves only add a few translucent entries
+		for ( i = 1; i < nEntities; i++ )
 		{
-			if( dists[i] > dists[i+stepSize] )
+			uint64 nKey = pKeys[i];
+			int j = i - 1;
+			for ( ; j >= 0 && pKeys[j] > nKey; j-- )
 			{
-				::V_swap( pEntities[i], pEntities[i+stepSize] );
-				::V_swap( dists[i], dists[i+stepSize] );
+				pKeys[j + 1] = pKeys[j];
+			}
+			pKeys[j + 1] = nKey;
+		}
+	}
+	else
+	{
+		// LSD radix sort on the depth bytes
+		int nCounts[4][256];
+		memset( nCounts, 0, sizeof( nCounts ) );
+		for ( i = 0; i < nEntities; i++ )
+		{
+			unsigned int nDepthKey = (unsigned int)( pKeys[i] >> 32 );
+			nCounts[0][nDepthKey & 0xff]++;
+			nCounts[1][( nDepthKey >> 8 ) & 0xff]++;
+			nCounts[2][( nDepthKey >> 16 ) & 0xff]++;
+			nCounts[3][nDepthKey >> 24]++;
+		}
 
-				if( i == 0 )
-				{
-					i = -stepSize;
-				}
-				else
-				{
-					i -= stepSize << 1;
-				}
+		uint64 *pSrc = pKeys;
+		uint64 *pDst = scratch.m_TempKeys.Base();
+		for ( int nPass = 0; nPass < 4; nPass++ )
+		{
+			int nShift = 32 + nPass * 8;
+			int *pCounts = nCounts[nPass];
+
+			// Nothing to do if every key has the same byte here
+			if ( pCounts[( pSrc[0] >> nShift ) & 0xff] == nEntities )
+				continue;
+
+			int nOffset = 0;
+			for ( int b = 0; b < 256; b++ )
+			{
+				int nCount = pCounts[b];
+				pCounts[b] = nOffset;
+				nOffset += nCount;
+			}
+
+			for ( i = 0; i < nEntities; i++ )
+			{
+				pDst[pCounts[( pSrc[i] >> nShift ) & 0xff]++] = pSrc[i];
 			}
+
+			V_swap( pSrc, pDst );
+		}
+		pKeys = pSrc;
+	}
+
+	// Move the entries into place in one pass
+	CClientRenderablesList::CEntry *pSorted = scratch.m_Entries.Base();
+	for ( i = 0; i < nEntities; i++ )
+	{
+		pSorted[i] = pEntities[(unsigned int)pKeys[i]];
+	}
+	memcpy( pEntities, pSorted, nEntities * sizeof( CClientRenderablesList::CEntry ) );
+}
+
+
+//-----------------------------------------------------------------------------
+// Sort entities in a back-to-front ordering
+//-----------------------------------------------------------------------------
+void CClientLeafSystem::SortEntities( const Vector &vecRenderOrigin, const Vector &vecRenderForward, CClientRenderablesList::CEntry *pEntities, int nEntities )
+{
+	// Don't sort if we only have 1 entity
+	if ( nEntities <= 1 )
+		return;
+
+	TranslucentSortScratch_t &scratch = m_TranslucentSortScratch;
+	scratch.EnsureCount( nEntities );
+
+	for ( int i = 0; i < nEntities; i++ )
+	{
+		Vector boxcenter;
+
+		ClientRenderHandle_t handle = pEntities[i].m_RenderHandle;
+		if ( handle != DETAIL_PROP_RENDER_HANDLE && handle != INVALID_CLIENT_RENDER_HANDLE )
+		{
+			// Cached when it was collated for this view
+			Vector absMins, absMaxs;
+			m_CullDB.GetBounds( handle, absMins, absMaxs );
+			VectorLerp( absMins, absMaxs, 0.5f, boxcenter );
+		}
+		else
+		{
+			// Compute the center of the object (needed for translucent brush models)
+			IClientRenderable *pRenderable = pEntities[i].m_pRenderable;
+			Vector mins,maxs;
+			pRenderable->GetRenderBounds( mins, maxs );
+			VectorAdd( mins, maxs, boxcenter );
+			VectorMA( pRenderable->GetRenderOrigin(), 0.5f, boxcenter, boxcenter );
 		}
 
-		stepSize >>= 1;
+		scratch.m_CenterX[i] = boxcenter.x;
+		scratch.m_CenterY[i] = boxcenter.y;
+		scratch.m_CenterZ[i] = boxcenter.z;
 	}
+
+	SortTranslucentEntriesByDepth( vecRenderOrigin, vecRenderForward, pEntities, nEntities, scratch );
 }
 
 
@@ -1753,6 +2065,12 @@ void CClientLeafSystem::BuildRenderablesList( const SetupRenderInfo_t &info )
 	CClientRenderablesList::CEntry *pTranslucentEntries = info.m_pRenderList->m_RenderGroups[RENDER_GROUP_TRANSLUCENT_ENTITY];
 	int &nTranslucentEntries = info.m_pRenderList->m_RenderGroupCounts[RENDER_GROUP_TRANSLUCENT_ENTITY];
 
+	m_bCullFrustum = ( info.m_pFrustum != NULL ) && cl_simd_renderable_cull.GetBool();
+	if ( m_bCullFrustum )
+	{
+		m_CullFrustum.Init( *info.m_pFrustum );
+	}
+
 	for( int i = 0; i < leafCount; i++ )
 	{
 		int nTranslucent = nTranslucentEntries;
@@ -21,6 +21,7 @@
 #include "ivrenderview.h"
 #include "tier1/mempool.h"
 #include "tier1/refcount.h"
+#include "tier1/utlvector.h"
 
 
 //-----------------------------------------------------------------------------
@@ -34,6 +35,7 @@ typedef CGameTrace trace_t;
 struct Ray_t;
 class Vector2D;
 class CStaticProp;
+class Frustum_t;
 
 
 //-----------------------------------------------------------------------------
@@ -73,6 +75,29 @@ public:
 };
 
 
+//-----------------------------------------------------------------------------
+// Back-to-front sorting of translucent entries. The caller fills in the center
+// arrays for the entries; depths are computed from them four at a time and
+// the (depth, index) keys radix sorted, then the entries are moved once.
+// The scratch arrays are reused between calls so sorting doesn't allocate.
+//-----------------------------------------------------------------------------
+struct TranslucentSortScratch_t
+{
+	CUtlVector<float>	m_CenterX;
+	CUtlVector<float>	m_CenterY;
+	CUtlVector<float>	m_CenterZ;
+	CUtlVector<float>	m_Depths;
+	CUtlVector<uint64>	m_Keys;
+	CUtlVector<uint64>	m_TempKeys;
+	CUtlVector<CClientRenderablesList::CEntry> m_Entries;
+
+	void EnsureCount( int nEntities );
+};
+
+void SortTranslucentEntriesByDepth( const Vector &vecRenderOrigin, const Vector &vecRenderForward,
+	CClientRenderablesList::CEntry *pEntities, int nEntities, TranslucentSortScratch_t &scratch );
+
+
 //-----------------------------------------------------------------------------
 // Used by CollateRenderablesInLeaf
 //-----------------------------------------------------------------------------
@@ -85,11 +110,13 @@ struct SetupRenderInfo_t
 	int m_nRenderFrame;
 	int m_nDetailBuildFrame;	// The "render frame" for detail objects
 	float m_flRenderDistSq;
+	const Frustum_t *m_pFrustum;	// The frustum the view was pushed with, NULL to have the engine cull
 	bool m_bDrawDetailObjects : 1;
 	bool m_bDrawTranslucentObjects : 1;
 
 	SetupRenderInfo_t()
 	{
+		m_pFrustum = NULL;
 		m_bDrawDetailObjects = true;
 		m_bDrawTranslucentObjects = true;
 	}
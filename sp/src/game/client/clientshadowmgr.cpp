@@ -70,6 +70,8 @@
 #include "iviewrender.h"
 #include "ivrenderview.h"
 #include "tier0/vprof.h"
+#include "tier0/fasttimer.h"
+#include "vstdlib/random.h"
 #include "engine/ivmodelinfo.h"
 #include "view_shared.h"
 #include "engine/ivdebugoverlay.h"
@@ -119,11 +121,10 @@ ConVar r_flashlightdepthres( "r_flashlightdepthres", "1024" );
 #endif
 #endif
 
-#ifdef ASW_PROJECTED_TEXTURES
-ConVar r_threaded_client_shadow_manager( "r_threaded_client_shadow_manager", "1" );
-#else
-ConVar r_threaded_client_shadow_manager( "r_threaded_client_shadow_manager", "0" );
-#endif
+ConVar r_threaded_client_shadow_manager( "r_threaded_client_shadow_manager", "1", 0, "Project dirty shadows and set up shadow bones on the job threads" );
+
+// Below this many dirty shadows, projecting them isn't worth handing out as jobs
+#define SHADOW_PROJECT_THREAD_MIN	16
 
 #ifdef MAPBASE
 ConVarRef mat_slopescaledepthbias_shadowmap( "mat_slopescaledepthbias_shadowmap" );
@@ -149,13 +150,45 @@ enum
 	INVALID_TEXTURE_HANDLE = (TextureHandle_t)~0
 };
 
+// What the allocator did over a frame, or since it was last reset
+struct TextureAllocatorStats_t
+{
+	int		m_nRequests;		// UseTexture calls
+	int		m_nRerenders;		// Clean textures that had to be redrawn because they were given a new fragment
+	int		m_nEvictions;		// Fragments taken away from another texture
+	int		m_nHotEvictions;	// ...whose texture had been used the frame before
+	int		m_nDeferred;		// Moves put off because the frame's budget was spent
+	int		m_nFailed;			// Requests that found no fragment at all
+
+	void Clear() { memset( this, 0, sizeof( *this ) ); }
+	void Add( const TextureAllocatorStats_t &other )
+	{
+		m_nRequests += other.m_nRequests;
+		m_nRerenders += other.m_nRerenders;
+		m_nEvictions += other.m_nEvictions;
+		m_nHotEvictions += other.m_nHotEvictions;
+		m_nDeferred += other.m_nDeferred;
+		m_nFailed += other.m_nFailed;
+	}
+};
+
 class CTextureAllocator
 {
 public:
+	CTextureAllocator();
+
 	// Initialize the allocator with something that knows how to refresh the bits
 	void			Init();
 	void			Shutdown();
 
+	// By default, fragments go to whichever texture was used least recently,
+	// which thrashes once more shadows are visible than there are fragments.
+	// Prioritized, a fragment only goes to another texture if it wasn't used
+	// last frame or its texture is worth less; a texture's worth is its screen
+	// area, less the more often it has to be redrawn anyway. At most
+	// nRerenderBudget clean textures are moved per frame, 0 for no limit.
+	void			SetPolicy( bool bPrioritized, int nRerenderBudget );
+
 	// Resets the allocator
 	void			Reset();
 
@@ -184,6 +217,10 @@ public:
 
 	void			DebugPrintCache( void );
 
+	const TextureAllocatorStats_t &GetLastFrameStats() const { return m_LastFrameStats; }
+	const TextureAllocatorStats_t &GetTotalStats() const { return m_TotalStats; }
+	void			PrintStats() const;
+
 private:
 	typedef unsigned short FragmentHandle_t;
 
@@ -209,6 +246,10 @@ private:
 		FragmentHandle_t	m_Fragment;
 		unsigned short		m_Size;
 		unsigned short		m_Power;
+
+		// How often the texture is dirty when it's used, 0 to 1
+		float				m_flChangeRate;
+		unsigned int		m_ChangeRateFrame;
 	};
 
 	struct FragmentInfo_t
@@ -219,6 +260,9 @@ private:
 
 		// Makes sure we don't overflow
 		unsigned int	m_FrameUsed;
+
+		// What losing the texture would cost, as of when it was last used
+		float			m_flCost;
 	};
 
 	struct BlockInfo_t
@@ -238,7 +282,10 @@ private:
 	void UnlinkFragmentFromCache( Cache_t& cache, FragmentHandle_t fragment );
 
 	// Mark something as being used (MRU)..
-	void MarkUsed( FragmentHandle_t fragment );
+	void MarkUsed( FragmentHandle_t fragment, float flCost );
+
+	// Finds a fragment of the given size to give to a texture worth flCost
+	FragmentHandle_t FindFragment( int power, float flCost ) const;
 
 	// Mark something as being unused (LRU)..
 	void MarkUnused( FragmentHandle_t fragment );
@@ -258,8 +305,31 @@ private:
 	Cache_t		m_Cache[MAX_TEXTURE_POWER+1]; 
 	BlockInfo_t	m_Blocks[BLOCK_COUNT];
 	unsigned int m_CurrentFrame;
+
+	bool		m_bPrioritized;
+	int			m_nRerenderBudget;
+
+	TextureAllocatorStats_t	m_FrameStats;
+	TextureAllocatorStats_t	m_LastFrameStats;
+	TextureAllocatorStats_t	m_TotalStats;
 };
 
+CTextureAllocator::CTextureAllocator()
+{
+	m_CurrentFrame = 0;
+	m_bPrioritized = true;
+	m_nRerenderBudget = 0;
+	m_FrameStats.Clear();
+	m_LastFrameStats.Clear();
+	m_TotalStats.Clear();
+}
+
+void CTextureAllocator::SetPolicy( bool bPrioritized, int nRerenderBudget )
+{
+	m_bPrioritized = bPrioritized;
+	m_nRerenderBudget = MAX( nRerenderBudget, 0 );
+}
+
 //-----------------------------------------------------------------------------
 // Allocate/deallocate the texture page
 //-----------------------------------------------------------------------------
@@ -342,6 +412,9 @@ void CTextureAllocator::Reset()
 	}
 
 	m_CurrentFrame = 0;
+	m_FrameStats.Clear();
+	m_LastFrameStats.Clear();
+	m_TotalStats.Clear();
 }
 
 void CTextureAllocator::DeallocateAllTextures()
@@ -383,6 +456,17 @@ void CTextureAllocator::DebugPrintCache( void )
 
 }
 
+void CTextureAllocator::PrintStats() const
+{
+	Msg( "Shadow textures (%s, re-render budget %d):\n", m_bPrioritized ? "prioritized" : "LRU", m_nRerenderBudget );
+	Msg( "  last frame: %d requests, %d re-rendered, %d evicted (%d hot), %d deferred, %d failed\n",
+		m_LastFrameStats.m_nRequests, m_LastFrameStats.m_nRerenders, m_LastFrameStats.m_nEvictions,
+		m_LastFrameStats.m_nHotEvictions, m_LastFrameStats.m_nDeferred, m_LastFrameStats.m_nFailed );
+	Msg( "  %u frames: %d requests, %d re-rendered, %d evicted (%d hot), %d deferred, %d failed\n", m_CurrentFrame,
+		m_TotalStats.m_nRequests, m_TotalStats.m_nRerenders, m_TotalStats.m_nEvictions,
+		m_TotalStats.m_nHotEvictions, m_TotalStats.m_nDeferred, m_TotalStats.m_nFailed );
+}
+
 
 //-----------------------------------------------------------------------------
 // Adds a block worth of fragments to the LRU
@@ -405,6 +489,7 @@ void CTextureAllocator::AddBlockToLRU( int block )
 		m_Fragments[f].m_Index = fragmentCount;
 		m_Fragments[f].m_Texture = INVALID_TEXTURE_HANDLE;
 		m_Fragments[f].m_FrameUsed = 0xFFFFFFFF;
+		m_Fragments[f].m_flCost = 0.0f;
 		m_Fragments.LinkToHead( m_Cache[power].m_List, f );
 	}
 }
@@ -422,7 +507,7 @@ void CTextureAllocator::UnlinkFragmentFromCache( Cache_t& cache, FragmentHandle_
 //-----------------------------------------------------------------------------
 // Mark something as being used (MRU)..
 //-----------------------------------------------------------------------------
-void CTextureAllocator::MarkUsed( FragmentHandle_t fragment )
+void CTextureAllocator::MarkUsed( FragmentHandle_t fragment, float flCost )
 {
 	int block = m_Fragments[fragment].m_Block;
 	int power = m_Blocks[block].m_FragmentPower;
@@ -431,6 +516,7 @@ void CTextureAllocator::MarkUsed( FragmentHandle_t fragment )
 	Cache_t& cache = m_Cache[power];
 	m_Fragments.LinkToTail( cache.m_List, fragment );
 	m_Fragments[fragment].m_FrameUsed = m_CurrentFrame;
+	m_Fragments[fragment].m_flCost = flCost;
 }
 
 
@@ -465,6 +551,8 @@ TextureHandle_t	CTextureAllocator::AllocateTexture( int w, int h )
 	TextureHandle_t handle = m_Textures.AddToTail();
 	m_Textures[handle].m_Fragment = INVALID_FRAGMENT_HANDLE;
 	m_Textures[handle].m_Size = w;
+	m_Textures[handle].m_flChangeRate = 0.0f;
+	m_Textures[handle].m_ChangeRateFrame = m_CurrentFrame - 1;
 
 	// Find the power of two
 	int power = 0;
@@ -531,6 +619,51 @@ bool CTextureAllocator::HasValidTexture( TextureHandle_t h )
 }
 
 
+//-----------------------------------------------------------------------------
+// Finds a fragment of the given size that nothing used this frame. Least
+// recently used first; prioritized, a fragment whose texture was used last
+// frame only goes if it's the cheapest such and cheaper than flCost. Costs
+// on both sides are area scaled down by how often the texture is redrawn
+// anyway, see UseTexture.
+//-----------------------------------------------------------------------------
+CTextureAllocator::FragmentHandle_t CTextureAllocator::FindFragment( int power, float flCost ) const
+{
+	FragmentHandle_t f = m_Fragments.Head( m_Cache[power].m_List );
+	if ( !m_bPrioritized )
+	{
+		// This represents an overflow condition (used too many textures of
+		// the same size in a single frame).
+		if ( (f != m_Fragments.InvalidIndex()) && (m_Fragments[f].m_FrameUsed != m_CurrentFrame) )
+			return f;
+		return INVALID_FRAGMENT_HANDLE;
+	}
+
+	FragmentHandle_t best = INVALID_FRAGMENT_HANDLE;
+	float flBestCost = flCost;
+	for ( ; f != m_Fragments.InvalidIndex(); f = m_Fragments.Next( f ) )
+	{
+		const FragmentInfo_t &fragment = m_Fragments[f];
+
+		// Fragments are kept in the order they were used, so everything
+		// after this was used this frame too
+		if ( fragment.m_FrameUsed == m_CurrentFrame )
+			break;
+
+		// Free, or its texture has gone out of view
+		if ( fragment.m_Texture == INVALID_TEXTURE_HANDLE || fragment.m_FrameUsed != m_CurrentFrame - 1 )
+			return f;
+
+		if ( fragment.m_flCost < flBestCost )
+		{
+			best = f;
+			flBestCost = fragment.m_flCost;
+		}
+	}
+
+	return best;
+}
+
+
 //-----------------------------------------------------------------------------
 // Mark texture as being used...
 //-----------------------------------------------------------------------------
@@ -540,6 +673,16 @@ bool CTextureAllocator::UseTexture( TextureHandle_t h, bool bWillRedraw, float f
 //	DebugPrintCache();
 
 	TextureInfo_t& info = m_Textures[h];
+	++m_FrameStats.m_nRequests;
+
+	// Textures that are dirty most frames lose little when they're moved.
+	// Only counted once a frame, however many views use the texture.
+	if ( info.m_ChangeRateFrame != m_CurrentFrame )
+	{
+		info.m_flChangeRate = info.m_flChangeRate * 0.75f + ( bWillRedraw ? 0.25f : 0.0f );
+		info.m_ChangeRateFrame = m_CurrentFrame;
+	}
+	float flCost = flArea * ( 1.0f - info.m_flChangeRate );
 
 	// spin up to the best fragment size
 	int nDesiredPower = MIN_TEXTURE_POWER;
@@ -568,35 +711,39 @@ bool CTextureAllocator::UseTexture( TextureHandle_t h, bool bWillRedraw, float f
 		if ((nCurrentPower == nDesiredPower) || bShouldKeepTexture)
 		{
 			// Move to the back of the LRU
-			MarkUsed( currentFragment );
+			MarkUsed( currentFragment, flCost );
 			return false;
 		}
 	}
 
+	// Moving a clean texture costs a redraw it wouldn't otherwise need, so
+	// only so many of those happen a frame; the rest wait for the next one
+	if ( m_bPrioritized && !bWillRedraw && m_nRerenderBudget > 0 && m_FrameStats.m_nRerenders >= m_nRerenderBudget )
+	{
+		++m_FrameStats.m_nDeferred;
+		if (currentFragment != INVALID_FRAGMENT_HANDLE)
+		{
+			MarkUsed( currentFragment, flCost );
+		}
+		return false;
+	}
+
 //	Warning( "\n\nUseTexture B\n" );
 //	DebugPrintCache();
 
 	// Grab the LRU fragment from the appropriate cache
 	// If that fragment is connected to a texture, disconnect it.
+	// If there's none of the right size, just use a texture of lower res.
 	int power = nDesiredPower;
 
 	FragmentHandle_t f = INVALID_FRAGMENT_HANDLE;
-	bool done = false;
-	while (!done && power >= 0)
+	while ( power >= 0 )
 	{
-		f = m_Fragments.Head( m_Cache[power].m_List );
-	
-		// This represents an overflow condition (used too many textures of
-		// the same size in a single frame). It that happens, just use a texture
-		// of lower res.
-		if ( (f != m_Fragments.InvalidIndex()) && (m_Fragments[f].m_FrameUsed != m_CurrentFrame) )
-		{
-			done = true;
-		}
-		else
-		{
-			--power;
-		}
+		f = FindFragment( power, flCost );
+		if ( f != INVALID_FRAGMENT_HANDLE )
+			break;
+
+		--power;
 	}
 
 
@@ -610,7 +757,7 @@ bool CTextureAllocator::UseTexture( TextureHandle_t h, bool bWillRedraw, float f
 		{
 			// Oops... we're not. Let's leave well enough alone
 			// Move to the back of the LRU
-			MarkUsed( currentFragment );
+			MarkUsed( currentFragment, flCost );
 			return false;
 		}
 		else
@@ -622,10 +769,19 @@ bool CTextureAllocator::UseTexture( TextureHandle_t h, bool bWillRedraw, float f
 
 	if ( f == INVALID_FRAGMENT_HANDLE )
 	{
+		++m_FrameStats.m_nFailed;
 		return false;
 	}
 
 	// Disconnect existing texture from this fragment (if necessary)
+	if ( m_Fragments[f].m_Texture != INVALID_TEXTURE_HANDLE )
+	{
+		++m_FrameStats.m_nEvictions;
+		if ( m_Fragments[f].m_FrameUsed == m_CurrentFrame - 1 )
+		{
+			++m_FrameStats.m_nHotEvictions;
+		}
+	}
 	DisconnectTextureFromFragment(f);
 
 	// Connnect new texture to this fragment
@@ -633,7 +789,12 @@ bool CTextureAllocator::UseTexture( TextureHandle_t h, bool bWillRedraw, float f
 	m_Fragments[f].m_Texture = h;
 
 	// Move to the back of the LRU
-	MarkUsed( f );
+	MarkUsed( f, flCost );
+
+	if ( !bWillRedraw )
+	{
+		++m_FrameStats.m_nRerenders;
+	}
 
 	// Indicate we need a redraw
 	return true;
@@ -657,6 +818,10 @@ void CTextureAllocator::AdvanceFrame()
 	// Be sure that this is called as infrequently as possible (i.e. once per frame,
 	// NOT once per view) to prevent cache thrash when rendering multiple views in a single frame
 	m_CurrentFrame++;
+
+	m_LastFrameStats = m_FrameStats;
+	m_TotalStats.Add( m_FrameStats );
+	m_FrameStats.Clear();
 }
 
 
@@ -712,8 +877,155 @@ void CTextureAllocator::GetTextureRect(TextureHandle_t handle, int& x, int& y, i
 
 static ConVar r_shadows( "r_shadows", "1" ); // hook into engine's cvars..
 static ConVar r_shadowmaxrendered("r_shadowmaxrendered", "32");
+static ConVar r_shadow_texture_priority( "r_shadow_texture_priority", "1", 0, "Give shadow texture space to the shadows that are biggest on screen and change least, instead of the least recently used" );
+static ConVar r_shadow_texture_rerender_budget( "r_shadow_texture_rerender_budget", "8", 0, "Most shadow textures moved to new texture space (and so re-rendered) per frame, 0 for no limit. Needs r_shadow_texture_priority." );
 static ConVar r_shadows_gamecontrol( "r_shadows_gamecontrol", "-1", FCVAR_CHEAT );	 // hook into engine's cvars..
 
+
+//-----------------------------------------------------------------------------
+// Runs the texture allocator against a made up crowd of shadow casters, the
+// way ComputeShadowTextures drives it. CPU only, doesn't need a map.
+//-----------------------------------------------------------------------------
+struct ShadowTextureSimCaster_t
+{
+	TextureHandle_t	m_Texture;
+	float			m_flArea;
+	bool			m_bAnimating;
+	bool			m_bVisible;
+	bool			m_bDirty;
+};
+
+struct ShadowTextureSimOrder_t
+{
+	float	m_flArea;
+	int		m_nCaster;
+};
+
+static int __cdecl ShadowTextureSim_SortFunc( const ShadowTextureSimOrder_t *pLeft, const ShadowTextureSimOrder_t *pRight )
+{
+	if ( pLeft->m_flArea != pRight->m_flArea )
+		return ( pLeft->m_flArea > pRight->m_flArea ) ? -1 : 1;
+	return pLeft->m_nCaster - pRight->m_nCaster;
+}
+
+static void ShadowTextureSim_Run( const char *pName, bool bPrioritized, int nBudget, int nCasters, int nFrames )
+{
+	// Same crowd every run so results can be compared between builds
+	CUniformRandomStream random;
+	random.SetSeed( 0 );
+
+	CTextureAllocator allocator;
+	allocator.Reset();
+	allocator.SetPolicy( bPrioritized, nBudget );
+
+	// A third are animating NPCs, the rest props; sizes on screen from a
+	// few pixels to most of the view
+	CUtlVector<ShadowTextureSimCaster_t> casters;
+	casters.SetCount( nCasters );
+	for ( int i = 0; i < nCasters; i++ )
+	{
+		ShadowTextureSimCaster_t &caster = casters[i];
+		int nSize = ( random.RandomInt( 0, 3 ) == 0 ) ? 256 : 128;
+		caster.m_Texture = allocator.AllocateTexture( nSize, nSize );
+		caster.m_flArea = expf( random.RandomFloat( logf( 16.0f * 16.0f ), logf( 320.0f * 320.0f ) ) );
+		caster.m_bAnimating = ( random.RandomFloat() < 0.3f );
+		caster.m_bVisible = ( random.RandomFloat() < 0.75f );
+		caster.m_bDirty = true;
+	}
+
+	CUtlVector<ShadowTextureSimOrder_t> order;
+	int nMaxRendered = r_shadowmaxrendered.GetInt();
+	int nRedraws = 0, nMaxFrameRedraws = 0, nBlobby = 0;
+
+	for ( int iFrame = 0; iFrame < nFrames; iFrame++ )
+	{
+		// Casters wander in and out of view; the ones that move change size
+		// on screen faster
+		order.RemoveAll();
+		for ( int i = 0; i < nCasters; i++ )
+		{
+			ShadowTextureSimCaster_t &caster = casters[i];
+			if ( random.RandomFloat() < 0.02f )
+			{
+				caster.m_bVisible = !caster.m_bVisible;
+			}
+
+			float flChange = caster.m_bAnimating ? 0.1f : 0.02f;
+			caster.m_flArea = clamp( caster.m_flArea * random.RandomFloat( 1.0f - flChange, 1.0f + flChange ), 64.0f, 320.0f * 320.0f );
+			caster.m_bDirty |= caster.m_bAnimating;
+
+			if ( caster.m_bVisible )
+			{
+				ShadowTextureSimOrder_t &entry = order[ order.AddToTail() ];
+				entry.m_flArea = caster.m_flArea;
+				entry.m_nCaster = i;
+			}
+		}
+
+		// Biggest first, like CVisibleShadowList
+		order.Sort( ShadowTextureSim_SortFunc );
+
+		int nRendered = 0;
+		for ( int i = 0; i < order.Count(); i++ )
+		{
+			ShadowTextureSimCaster_t &caster = casters[ order[i].m_nCaster ];
+			if ( nRendered >= nMaxRendered )
+			{
+				++nBlobby;
+				continue;
+			}
+
+			bool bNeedsRedraw = allocator.UseTexture( caster.m_Texture, caster.m_bDirty, caster.m_flArea );
+			if ( !allocator.HasValidTexture( caster.m_Texture ) )
+			{
+				++nBlobby;
+				continue;
+			}
+
+			if ( bNeedsRedraw || caster.m_bDirty )
+			{
+				++nRendered;
+				caster.m_bDirty = false;
+			}
+		}
+
+		nRedraws += nRendered;
+		nMaxFrameRedraws = MAX( nMaxFrameRedraws, nRendered );
+		allocator.AdvanceFrame();
+	}
+
+	const TextureAllocatorStats_t &stats = allocator.GetTotalStats();
+	float flFrames = (float)nFrames;
+	Msg( "  %-12s %5.1f redraws/frame (max %d), %5.1f moved, %5.1f evicted (%5.1f hot), %5.1f deferred, %5.1f blobby\n", pName,
+		nRedraws / flFrames, nMaxFrameRedraws, stats.m_nRerenders / flFrames, stats.m_nEvictions / flFrames,
+		stats.m_nHotEvictions / flFrames, stats.m_nDeferred / flFrames, nBlobby / flFrames );
+}
+
+CON_COMMAND( r_shadow_texture_sim, "Simulate a crowd of render to texture shadows with the LRU and the prioritized texture allocator. Usage: r_shadow_texture_sim [casters] [frames]" )
+{
+	int nFrames = ( args.ArgC() > 2 ) ? MAX( atoi( args[2] ), 1 ) : 600;
+
+	static const int s_nCasters[] = { 50, 200, 800 };
+	int nSizes = ARRAYSIZE( s_nCasters );
+	const int *pCasters = s_nCasters;
+
+	int nCasters;
+	if ( args.ArgC() > 1 )
+	{
+		nCasters = clamp( atoi( args[1] ), 1, 4096 );
+		pCasters = &nCasters;
+		nSizes = 1;
+	}
+
+	Msg( "%d frames, per frame:\n", nFrames );
+	for ( int i = 0; i < nSizes; i++ )
+	{
+		Msg( "%d casters:\n", pCasters[i] );
+		ShadowTextureSim_Run( "LRU", false, 0, pCasters[i], nFrames );
+		ShadowTextureSim_Run( "prioritized", true, r_shadow_texture_rerender_budget.GetInt(), pCasters[i], nFrames );
+	}
+}
+
 //-----------------------------------------------------------------------------
 // The class responsible for dealing with shadows on the client side
 // Oh, and let's take a moment and notice how happy Robin and John must be 
@@ -723,6 +1035,7 @@ class CClientShadowMgr : public IClientShadowMgr
 {
 public:
 	CClientShadowMgr();
+	~CClientShadowMgr();
 
 	virtual char const *Name() { return "CCLientShadowMgr"; }
 
@@ -822,6 +1135,11 @@ public:
 	// Are we the child of a shadow with render-to-texture?
 	bool ShouldUseParentShadow( IClientRenderable *pRenderable );
 
+	// Times projecting every shadow in the level serially and on the job threads
+	void BenchmarkShadowProjection( int nPasses );
+
+	void PrintShadowTextureStats() const { m_ShadowAllocator.PrintStats(); }
+
 	void SetShadowsDisabled( bool bDisabled ) 
 	{ 
 		r_shadows_gamecontrol.SetValue( bDisabled != 1 );
@@ -873,6 +1191,14 @@ private:
 	void UpdateBrushShadow( IClientRenderable *pRenderable, ClientShadowHandle_t handle );
 	void UpdateShadow( ClientShadowHandle_t handle, bool force );
 
+	// Does everything UpdateShadow does short of projecting the shadow. Returns
+	// true if it moved; *ppRenderable is left NULL if the shadow mustn't be
+	// marked clean afterwards.
+	bool CheckShadowMoved( ClientShadowHandle_t handle, bool force, IClientRenderable **ppRenderable );
+
+	// Projects the dirty shadows on the job threads
+	void UpdateDirtyShadowsThreaded();
+
 #ifdef DYNAMIC_RTT_SHADOWS
 	// Updates shadow cast direction when shadowing from world lights
 	void UpdateShadowDirectionFromLocalLightSource( ClientShadowHandle_t shadowHandle );
@@ -903,8 +1229,7 @@ private:
 	void UpdateProjectedTextureInternal( ClientShadowHandle_t handle, bool force );
 
 	// Compute the shadow origin and attenuation start distance
-	float ComputeLocalShadowOrigin( IClientRenderable* pRenderable, 
-		const Vector& mins, const Vector& maxs, const Vector& localShadowDir, float backupFactor, Vector& origin );
+	float ComputeLocalShadowOrigin( const Vector& mins, const Vector& maxs, const Vector& localShadowDir, float backupFactor, Vector& origin );
 
 	// Remove a shadow from the dirty list
 	void RemoveShadowFromDirtyList( ClientShadowHandle_t handle );
@@ -913,12 +1238,60 @@ private:
 	ShadowType_t GetActualShadowCastType( ClientShadowHandle_t handle ) const;
 	ShadowType_t GetActualShadowCastType( IClientRenderable *pRenderable ) const;
 
+	// Leaves found by shadow projections on one thread
+	struct ShadowLeafBuffer_t
+	{
+		CUtlVector<int>	m_Leaves;
+	};
+
+	// A blobby or render to texture shadow being projected. Everything read off
+	// the renderable is filled in on the main thread, so the matrices and leaf
+	// list can be built on any thread; the engine and the leaf system are only
+	// told about the result on the main thread.
+	struct ShadowProjection_t
+	{
+		ClientShadowHandle_t	m_Handle;
+		bool					m_bRenderToTexture;
+		bool					m_bRenderingClipPlane;
+		Vector					m_vecMins;
+		Vector					m_vecMaxs;
+		Vector					m_vecBasis[3];
+		Vector					m_vecRenderOrigin;
+		Vector					m_vecShadowDir;
+		float					m_flShadowCastDistance;
+		float					m_flRenderingClipPlane[4];
+
+		// Filled in by BuildShadowProjection
+		Vector					m_vecWorldOrigin;
+		VMatrix					m_matWorldToTexture;
+		Vector2D				m_vecSize;
+		float					m_flMaxHeight;
+		float					m_flFalloffStart;
+		int						m_nClipPlanes;		// -1 leaves the shadow's clip planes alone
+		Vector					m_vecClipNormal[4];
+		float					m_flClipDist[4];
+		ShadowLeafBuffer_t		*m_pBuffer;
+		int						m_nFirstLeaf;
+		int						m_nLeafCount;
+	};
+
+	// Projects a blobby or render to texture shadow right away
+	void BuildShadow( IClientRenderable* pRenderable, ClientShadowHandle_t handle );
+
+	// Reads what a projection needs off the renderable
+	void PrepareShadowProjection( IClientRenderable* pRenderable, ClientShadowHandle_t handle, ShadowProjection_t &projection );
+
+	// Builds the shadow matrices and finds the leaves, safe on any thread
+	void BuildShadowProjection( ShadowProjection_t &projection );
+
+	// Hands a built projection to the engine and the leaf system
+	void ApplyShadowProjection( const ShadowProjection_t &projection );
+
 	// Builds a simple blobby shadow
-	void BuildOrthoShadow( IClientRenderable* pRenderable, ClientShadowHandle_t handle, const Vector& mins, const Vector& maxs);
+	void BuildOrthoShadow( ShadowProjection_t &projection );
 
 	// Builds a more complex shadow...
-	void BuildRenderToTextureShadow( IClientRenderable* pRenderable, 
-			ClientShadowHandle_t handle, const Vector& mins, const Vector& maxs );
+	void BuildRenderToTextureShadow( ShadowProjection_t &projection );
 
 	// Build a projected-texture flashlight
 	void BuildFlashlight( ClientShadowHandle_t handle );
@@ -928,9 +1301,7 @@ private:
 	void CleanUpRenderToTextureShadow( ClientShadowHandle_t h );
 
 	// Compute the extra shadow planes
-	void ComputeExtraClipPlanes( IClientRenderable* pRenderable, 
-		ClientShadowHandle_t handle, const Vector* vec, 
-		const Vector& mins, const Vector& maxs, const Vector& localShadowDir );
+	void ComputeExtraClipPlanes( ShadowProjection_t &projection, const Vector& localShadowDir );
 
 	// Set extra clip planes related to shadows...
 	void ClearExtraClipPlanes( ClientShadowHandle_t h );
@@ -1037,6 +1408,13 @@ private:
 	CUtlRBTree< ClientShadowHandle_t, unsigned short >	m_DirtyShadows;
 	CUtlVector< ClientShadowHandle_t > m_TransparentShadows;
 
+	// Threaded projection. Each job thread appends to its own leaf buffer, and
+	// the results are applied on the main thread.
+	CUtlVector< ShadowProjection_t >	m_ShadowProjections;
+	CThreadLocalPtr< ShadowLeafBuffer_t > m_pThreadShadowLeafBuffer;
+	CUtlVector< ShadowLeafBuffer_t * >	m_ShadowLeafBuffers;
+	CThreadFastMutex					m_ShadowLeafBufferLock;
+
 #ifdef ASW_PROJECTED_TEXTURES
 	int m_nPrevFrameCount;
 #endif
@@ -1091,8 +1469,22 @@ private:
 	float ComputeScreenArea( const Vector &vecCenter, float r ) const;
 	void PrioritySort();
 
+	struct ShadowPriority_t
+	{
+		float	m_flArea;
+		int		m_nIndex;
+	};
+
+	static int __cdecl ShadowPriorityCompare( const ShadowPriority_t *pLeft, const ShadowPriority_t *pRight )
+	{
+		if ( pLeft->m_flArea != pRight->m_flArea )
+			return ( pLeft->m_flArea > pRight->m_flArea ) ? -1 : 1;
+		return pLeft->m_nIndex - pRight->m_nIndex;
+	}
+
 	CUtlVector<VisibleShadowInfo_t> m_ShadowsInView;
 	CUtlVector<int>	m_PriorityIndex;
+	CUtlVector<ShadowPriority_t> m_PrioritySort;
 };
 
 
@@ -1208,30 +1600,20 @@ void CVisibleShadowList::EnumShadow( unsigned short clientShadowHandle )
 void CVisibleShadowList::PrioritySort()
 {
 	int nCount = m_ShadowsInView.Count();
-	m_PriorityIndex.EnsureCapacity( nCount );
 
-	m_PriorityIndex.RemoveAll();
-
-	int i, j;
-	for ( i = 0; i < nCount; ++i )
+	// Biggest first; equal areas keep the order they were found in
+	m_PrioritySort.SetCount( nCount );
+	for ( int i = 0; i < nCount; ++i )
 	{
-		m_PriorityIndex.AddToTail(i);
+		m_PrioritySort[i].m_flArea = m_ShadowsInView[i].m_flArea;
+		m_PrioritySort[i].m_nIndex = i;
 	}
+	m_PrioritySort.Sort( ShadowPriorityCompare );
 
-	for ( i = 0; i < nCount - 1; ++i )
+	m_PriorityIndex.SetCount( nCount );
+	for ( int i = 0; i < nCount; ++i )
 	{
-		int nLargestInd = i;
-		float flLargestArea = m_ShadowsInView[m_PriorityIndex[i]].m_flArea;
-		for ( j = i + 1; j < nCount; ++j )
-		{
-			int nIndex = m_PriorityIndex[j];
-			if ( flLargestArea < m_ShadowsInView[nIndex].m_flArea )
-			{
-				nLargestInd = j;
-				flLargestArea = m_ShadowsInView[nIndex].m_flArea;
-			}
-		}
-		::V_swap( m_PriorityIndex[i], m_PriorityIndex[nLargestInd] );
+		m_PriorityIndex[i] = m_PrioritySort[i].m_nIndex;
 	}
 }
 
@@ -1274,6 +1656,11 @@ CClientShadowMgr::CClientShadowMgr() :
 	m_bThreaded = false;
 }
 
+CClientShadowMgr::~CClientShadowMgr()
+{
+	m_ShadowLeafBuffers.PurgeAndDeleteElements();
+}
+
 
 //-----------------------------------------------------------------------------
 // Changes the shadow direction...
@@ -1711,6 +2098,13 @@ void CClientShadowMgr::LevelShutdownPostEntity()
 		m_ShadowAllocator.DeallocateAllTextures();
 	}
 
+	// The buffers stay registered with their threads, just drop the memory
+	for ( int i = 0; i < m_ShadowLeafBuffers.Count(); i++ )
+	{
+		m_ShadowLeafBuffers[i]->m_Leaves.Purge();
+	}
+	m_ShadowProjections.Purge();
+
 	r_shadows_gamecontrol.SetValue( -1 );
 }
 
@@ -2391,8 +2785,7 @@ void CClientShadowMgr::BuildOrthoWorldToFlashlightMatrix( VMatrix& matWorldToSha
 //-----------------------------------------------------------------------------
 // Compute the shadow origin and attenuation start distance
 //-----------------------------------------------------------------------------
-float CClientShadowMgr::ComputeLocalShadowOrigin( IClientRenderable* pRenderable, 
-	const Vector& mins, const Vector& maxs, const Vector& localShadowDir, float backupFactor, Vector& origin )
+float CClientShadowMgr::ComputeLocalShadowOrigin( const Vector& mins, const Vector& maxs, const Vector& localShadowDir, float backupFactor, Vector& origin )
 {
 	// Compute the centroid of the object...
 	Vector vecCentroid;
@@ -2540,13 +2933,13 @@ void CClientShadowMgr::AddExtraClipPlane( ClientShadowHandle_t h, const Vector&
 //-----------------------------------------------------------------------------
 // Compute the extra shadow planes
 //-----------------------------------------------------------------------------
-void CClientShadowMgr::ComputeExtraClipPlanes( IClientRenderable* pRenderable, 
-	ClientShadowHandle_t handle, const Vector* vec, 
-	const Vector& mins, const Vector& maxs, const Vector& localShadowDir )
+void CClientShadowMgr::ComputeExtraClipPlanes( ShadowProjection_t &projection, const Vector& localShadowDir )
 {
+	const Vector *vec = projection.m_vecBasis;
+
 	// Compute the world-space position of the corner of the bounding box
 	// that's got the highest dotproduct with the local shadow dir...
-	Vector origin = pRenderable->GetRenderOrigin( );
+	Vector origin = projection.m_vecRenderOrigin;
 	float dir[3];
 
 	int i;
@@ -2554,38 +2947,35 @@ void CClientShadowMgr::ComputeExtraClipPlanes( IClientRenderable* pRenderable,
 	{
 		if (localShadowDir[i] < 0.0f)
 		{
-			VectorMA( origin, maxs[i], vec[i], origin );
+			VectorMA( origin, projection.m_vecMaxs[i], vec[i], origin );
 			dir[i] = 1;
 		}
 		else
 		{
-			VectorMA( origin, mins[i], vec[i], origin );
+			VectorMA( origin, projection.m_vecMins[i], vec[i], origin );
 			dir[i] = -1;
 		}
 	}
 
 	// Now that we have it, create 3 planes...
-	Vector normal;
-	ClearExtraClipPlanes(handle);
 	for ( i = 0; i < 3; ++i )
 	{
-		VectorMultiply( vec[i], dir[i], normal );
-		float dist = DotProduct( normal, origin );
-		AddExtraClipPlane( handle, normal, dist );
+		VectorMultiply( vec[i], dir[i], projection.m_vecClipNormal[i] );
+		projection.m_flClipDist[i] = DotProduct( projection.m_vecClipNormal[i], origin );
 	}
+	projection.m_nClipPlanes = 3;
 
-	ClientShadow_t& shadow = m_Shadows[handle];
-	C_BaseEntity *pEntity = ClientEntityList().GetBaseEntityFromHandle( shadow.m_Entity );
-	if ( pEntity && pEntity->m_bEnableRenderingClipPlane )
+	if ( projection.m_bRenderingClipPlane )
 	{
-		normal[ 0 ] = -pEntity->m_fRenderingClipPlane[ 0 ];
-		normal[ 1 ] = -pEntity->m_fRenderingClipPlane[ 1 ];
-		normal[ 2 ] = -pEntity->m_fRenderingClipPlane[ 2 ];
-		AddExtraClipPlane( handle, normal, -pEntity->m_fRenderingClipPlane[ 3 ] - 0.5f );
+		Vector &normal = projection.m_vecClipNormal[3];
+		normal[ 0 ] = -projection.m_flRenderingClipPlane[ 0 ];
+		normal[ 1 ] = -projection.m_flRenderingClipPlane[ 1 ];
+		normal[ 2 ] = -projection.m_flRenderingClipPlane[ 2 ];
+		projection.m_flClipDist[3] = -projection.m_flRenderingClipPlane[ 3 ] - 0.5f;
+		projection.m_nClipPlanes = 4;
 	}
 }
 
-
 inline ShadowType_t CClientShadowMgr::GetActualShadowCastType( ClientShadowHandle_t handle ) const
 {
 	if ( handle == CLIENTSHADOW_INVALID_HANDLE )
@@ -2628,11 +3018,26 @@ public:
 	CUtlVectorFixedGrowable< int, 512 > m_LeafList;
 };
 
+// Appends to a thread's leaf buffer instead
+class CShadowLeafBufferEnum : public ISpatialLeafEnumerator
+{
+public:
+	CShadowLeafBufferEnum( CUtlVector<int> &leaves ) : m_Leaves( leaves ) {}
+
+	bool EnumerateLeaf( int leaf, int context )
+	{
+		m_Leaves.AddToTail( leaf );
+		return true;
+	}
+
+	CUtlVector<int> &m_Leaves;
+};
+
 
 //-----------------------------------------------------------------------------
 // Builds a list of leaves inside the shadow volume
 //-----------------------------------------------------------------------------
-static void BuildShadowLeafList( CShadowLeafEnum *pEnum, const Vector& origin, 
+static void BuildShadowLeafList( ISpatialLeafEnumerator *pEnum, const Vector& origin, 
 	const Vector& dir, const Vector2D& size, float maxDist )
 {
 	Ray_t ray;
@@ -2653,19 +3058,11 @@ static void BuildShadowLeafList( CShadowLeafEnum *pEnum, const Vector& origin,
 //-----------------------------------------------------------------------------
 // Builds a simple blobby shadow
 //-----------------------------------------------------------------------------
-void CClientShadowMgr::BuildOrthoShadow( IClientRenderable* pRenderable, 
-		ClientShadowHandle_t handle, const Vector& mins, const Vector& maxs)
+void CClientShadowMgr::BuildOrthoShadow( ShadowProjection_t &projection )
 {
 	// Get the object's basis
-	Vector vec[3];
-	AngleVectors( pRenderable->GetRenderAngles(), &vec[0], &vec[1], &vec[2] );
-	vec[1] *= -1.0f;
-
-#ifdef DYNAMIC_RTT_SHADOWS
-	Vector vecShadowDir = GetShadowDirection( handle );
-#else
-	Vector vecShadowDir = GetShadowDirection( pRenderable );
-#endif
+	const Vector *vec = projection.m_vecBasis;
+	const Vector &vecShadowDir = projection.m_vecShadowDir;
 
 	// Project the shadow casting direction into the space of the object
 	Vector localShadowDir;
@@ -2692,7 +3089,7 @@ void CClientShadowMgr::BuildOrthoShadow( IClientRenderable* pRenderable,
 
 	// Compute the box size
 	Vector boxSize;
-	VectorSubtract( maxs, mins, boxSize );
+	VectorSubtract( projection.m_vecMaxs, projection.m_vecMins, boxSize );
 
 	// We project the two longest sides into the vectors perpendicular
 	// to the projection direction, then add in the projection of the perp direction
@@ -2713,10 +3110,10 @@ void CClientShadowMgr::BuildOrthoShadow( IClientRenderable* pRenderable,
 
 	// Place the origin at the point with min dot product with shadow dir
 	Vector org;
-	float falloffStart = ComputeLocalShadowOrigin( pRenderable, mins, maxs, localShadowDir, 2.0f, org );
+	float falloffStart = ComputeLocalShadowOrigin( projection.m_vecMins, projection.m_vecMaxs, localShadowDir, 2.0f, org );
 
 	// Transform the local origin into world coordinates
-	Vector worldOrigin = pRenderable->GetRenderOrigin( );
+	Vector worldOrigin = projection.m_vecRenderOrigin;
 	VectorMA( worldOrigin, org.x, vec[0], worldOrigin );
 	VectorMA( worldOrigin, org.y, vec[1], worldOrigin );
 	VectorMA( worldOrigin, org.z, vec[2], worldOrigin );
@@ -2728,41 +3125,29 @@ void CClientShadowMgr::BuildOrthoShadow( IClientRenderable* pRenderable,
 	worldOrigin.z = (int)(worldOrigin.z / dx) * dx;
 
 	// NOTE: We gotta use the general matrix because xvec and yvec aren't perp
-	VMatrix matWorldToShadow, matWorldToTexture;
-	BuildGeneralWorldToShadowMatrix( m_Shadows[handle].m_WorldToShadow, worldOrigin, vecShadowDir, xvec, yvec );
-	BuildWorldToTextureMatrix( m_Shadows[handle].m_WorldToShadow, size, matWorldToTexture );
-	Vector2DCopy( size, m_Shadows[handle].m_WorldSize );
+	ClientShadow_t &shadow = m_Shadows[projection.m_Handle];
+	BuildGeneralWorldToShadowMatrix( shadow.m_WorldToShadow, worldOrigin, vecShadowDir, xvec, yvec );
+	BuildWorldToTextureMatrix( shadow.m_WorldToShadow, size, projection.m_matWorldToTexture );
+	Vector2DCopy( size, shadow.m_WorldSize );
 	
 	// Compute the falloff attenuation
 	// Area computation isn't exact since xvec is not perp to yvec, but close enough
 //	float shadowArea = size.x * size.y;	
 
-	// The entity may be overriding our shadow cast distance
-	float flShadowCastDistance = GetShadowDistance( pRenderable );
-	float maxHeight = flShadowCastDistance + falloffStart; //3.0f * sqrt( shadowArea );
-
-	CShadowLeafEnum leafList;
-	BuildShadowLeafList( &leafList, worldOrigin, vecShadowDir, size, maxHeight );
-	int nCount = leafList.m_LeafList.Count();
-	const int *pLeafList = leafList.m_LeafList.Base();
-
-	shadowmgr->ProjectShadow( m_Shadows[handle].m_ShadowHandle, worldOrigin,
-		vecShadowDir, matWorldToTexture, size, nCount, pLeafList, maxHeight, falloffStart, MAX_FALLOFF_AMOUNT, pRenderable->GetRenderOrigin() );
+	projection.m_vecWorldOrigin = worldOrigin;
+	projection.m_vecSize = size;
+	projection.m_flFalloffStart = falloffStart;
+	projection.m_flMaxHeight = projection.m_flShadowCastDistance + falloffStart; //3.0f * sqrt( shadowArea );
 
 	// Compute extra clip planes to prevent poke-thru
 // FIXME!!!!!!!!!!!!!!  Removing this for now since it seems to mess up the blobby shadows.
 #ifdef ASW_PROJECTED_TEXTURES
-	ComputeExtraClipPlanes( pRenderable, handle, vec, mins, maxs, localShadowDir );
+	ComputeExtraClipPlanes( projection, localShadowDir );
 #else
-//	ComputeExtraClipPlanes( pEnt, handle, vec, mins, maxs, localShadowDir );
+//	ComputeExtraClipPlanes( projection, localShadowDir );
 #endif
-
-	// Add the shadow to the client leaf system so it correctly marks 
-	// leafs as being affected by a particular shadow
-	ClientLeafSystem()->ProjectShadow( m_Shadows[handle].m_ClientLeafShadowHandle, nCount, pLeafList );
 }
 
-
 //-----------------------------------------------------------------------------
 // Visualization....
 //-----------------------------------------------------------------------------
@@ -2838,29 +3223,11 @@ extern ConVar cl_shadowtextureoverlaysize;
 //-----------------------------------------------------------------------------
 // Builds a more complex shadow...
 //-----------------------------------------------------------------------------
-void CClientShadowMgr::BuildRenderToTextureShadow( IClientRenderable* pRenderable, 
-		ClientShadowHandle_t handle, const Vector& mins, const Vector& maxs)
+void CClientShadowMgr::BuildRenderToTextureShadow( ShadowProjection_t &projection )
 {
-	if ( cl_drawshadowtexture.GetInt() )
-	{
-		// Red wireframe bounding box around objects whose RTT shadows are being updated that frame
-		DrawRenderToTextureDebugInfo( pRenderable, mins, maxs );
-	}
-
 	// Get the object's basis
-	Vector vec[3];
-	AngleVectors( pRenderable->GetRenderAngles(), &vec[0], &vec[1], &vec[2] );
-	vec[1] *= -1.0f;
-
-#ifdef DYNAMIC_RTT_SHADOWS
-	Vector vecShadowDir = GetShadowDirection( handle );
-#else
-	Vector vecShadowDir = GetShadowDirection( pRenderable );
-#endif
-
-//	Debugging aid
-//	const model_t *pModel = pRenderable->GetModel();
-//	const char *pDebugName = modelinfo->GetModelName( pModel );
+	const Vector *vec = projection.m_vecBasis;
+	const Vector &vecShadowDir = projection.m_vecShadowDir;
 
 	// Project the shadow casting direction into the space of the object
 	Vector localShadowDir;
@@ -2870,7 +3237,7 @@ void CClientShadowMgr::BuildRenderToTextureShadow( IClientRenderable* pRenderabl
 
 	// Compute the box size
 	Vector boxSize;
-	VectorSubtract( maxs, mins, boxSize );
+	VectorSubtract( projection.m_vecMaxs, projection.m_vecMins, boxSize );
 	
 	Vector yvec;
 	float fProjMax = 0.0f;
@@ -2907,42 +3274,155 @@ void CClientShadowMgr::BuildRenderToTextureShadow( IClientRenderable* pRenderabl
 
 	// Place the origin at the point with min dot product with shadow dir
 	Vector org;
-	float falloffStart = ComputeLocalShadowOrigin( pRenderable, mins, maxs, localShadowDir, 1.0f, org );
+	float falloffStart = ComputeLocalShadowOrigin( projection.m_vecMins, projection.m_vecMaxs, localShadowDir, 1.0f, org );
 
 	// Transform the local origin into world coordinates
-	Vector worldOrigin = pRenderable->GetRenderOrigin( );
+	Vector worldOrigin = projection.m_vecRenderOrigin;
 	VectorMA( worldOrigin, org.x, vec[0], worldOrigin );
 	VectorMA( worldOrigin, org.y, vec[1], worldOrigin );
 	VectorMA( worldOrigin, org.z, vec[2], worldOrigin );
 
-	VMatrix matWorldToTexture;
-	BuildOrthoWorldToShadowMatrix( m_Shadows[handle].m_WorldToShadow, worldOrigin, vecShadowDir, xvec, yvec );
-	BuildWorldToTextureMatrix( m_Shadows[handle].m_WorldToShadow, size, matWorldToTexture );
-	Vector2DCopy( size, m_Shadows[handle].m_WorldSize );
+	ClientShadow_t &shadow = m_Shadows[projection.m_Handle];
+	BuildOrthoWorldToShadowMatrix( shadow.m_WorldToShadow, worldOrigin, vecShadowDir, xvec, yvec );
+	BuildWorldToTextureMatrix( shadow.m_WorldToShadow, size, projection.m_matWorldToTexture );
+	Vector2DCopy( size, shadow.m_WorldSize );
 
 	// Compute the falloff attenuation
 	// Area computation isn't exact since xvec is not perp to yvec, but close enough
 	// Extra factor of 4 in the maxHeight due to the size being half as big
 //	float shadowArea = size.x * size.y;	
 
+	projection.m_vecWorldOrigin = worldOrigin;
+	projection.m_vecSize = size;
+	projection.m_flFalloffStart = falloffStart;
+	projection.m_flMaxHeight = projection.m_flShadowCastDistance + falloffStart; //3.0f * sqrt( shadowArea );
+
+	// Compute extra clip planes to prevent poke-thru
+	ComputeExtraClipPlanes( projection, localShadowDir );
+}
+
+
+//-----------------------------------------------------------------------------
+// Reads everything a blobby or render to texture shadow projection needs
+// off the renderable. Main thread only.
+//-----------------------------------------------------------------------------
+void CClientShadowMgr::PrepareShadowProjection( IClientRenderable* pRenderable, ClientShadowHandle_t handle, ShadowProjection_t &projection )
+{
+	projection.m_Handle = handle;
+	projection.m_bRenderToTexture = ( GetActualShadowCastType( handle ) == SHADOWS_RENDER_TO_TEXTURE );
+
+	// Compute the bounding box in the space of the shadow...
+	ComputeHierarchicalBounds( pRenderable, projection.m_vecMins, projection.m_vecMaxs );
+
+	if ( projection.m_bRenderToTexture && cl_drawshadowtexture.GetInt() )
+	{
+		// Red wireframe bounding box around objects whose RTT shadows are being updated that frame
+		DrawRenderToTextureDebugInfo( pRenderable, projection.m_vecMins, projection.m_vecMaxs );
+	}
+
+	// Get the object's basis
+	Vector *vec = projection.m_vecBasis;
+	AngleVectors( pRenderable->GetRenderAngles(), &vec[0], &vec[1], &vec[2] );
+	vec[1] *= -1.0f;
+
+	projection.m_vecRenderOrigin = pRenderable->GetRenderOrigin();
+
+#ifdef DYNAMIC_RTT_SHADOWS
+	projection.m_vecShadowDir = GetShadowDirection( handle );
+#else
+	projection.m_vecShadowDir = GetShadowDirection( pRenderable );
+#endif
+
 	// The entity may be overriding our shadow cast distance
-	float flShadowCastDistance = GetShadowDistance( pRenderable );
-	float maxHeight = flShadowCastDistance + falloffStart; //3.0f * sqrt( shadowArea );
+	projection.m_flShadowCastDistance = GetShadowDistance( pRenderable );
 
-	CShadowLeafEnum leafList;
-	BuildShadowLeafList( &leafList, worldOrigin, vecShadowDir, size, maxHeight );
-	int nCount = leafList.m_LeafList.Count();
-	const int *pLeafList = leafList.m_LeafList.Base();
+	C_BaseEntity *pEntity = ClientEntityList().GetBaseEntityFromHandle( m_Shadows[handle].m_Entity );
+	projection.m_bRenderingClipPlane = ( pEntity && pEntity->m_bEnableRenderingClipPlane );
+	if ( projection.m_bRenderingClipPlane )
+	{
+		memcpy( projection.m_flRenderingClipPlane, pEntity->m_fRenderingClipPlane, sizeof( projection.m_flRenderingClipPlane ) );
+	}
 
-	shadowmgr->ProjectShadow( m_Shadows[handle].m_ShadowHandle, worldOrigin, 
-		vecShadowDir, matWorldToTexture, size, nCount, pLeafList, maxHeight, falloffStart, MAX_FALLOFF_AMOUNT, pRenderable->GetRenderOrigin() );
+	projection.m_nClipPlanes = -1;
+	projection.m_pBuffer = NULL;
+	projection.m_nFirstLeaf = 0;
+	projection.m_nLeafCount = 0;
+}
 
-	// Compute extra clip planes to prevent poke-thru
-	ComputeExtraClipPlanes( pRenderable, handle, vec, mins, maxs, localShadowDir );
+
+//-----------------------------------------------------------------------------
+// Builds the matrices and finds the leaves into this thread's buffer. Safe on
+// any thread: it only writes the shadow's own matrices, and the engine and
+// the leaf system aren't told anything.
+//-----------------------------------------------------------------------------
+void CClientShadowMgr::BuildShadowProjection( ShadowProjection_t &projection )
+{
+	if ( projection.m_bRenderToTexture )
+	{
+		BuildRenderToTextureShadow( projection );
+	}
+	else
+	{
+		BuildOrthoShadow( projection );
+	}
+
+	ShadowLeafBuffer_t *pBuffer = m_pThreadShadowLeafBuffer;
+	if ( !pBuffer )
+	{
+		pBuffer = new ShadowLeafBuffer_t;
+		m_pThreadShadowLeafBuffer = pBuffer;
+
+		AUTO_LOCK( m_ShadowLeafBufferLock );
+		m_ShadowLeafBuffers.AddToTail( pBuffer );
+	}
+
+	projection.m_pBuffer = pBuffer;
+	projection.m_nFirstLeaf = pBuffer->m_Leaves.Count();
+
+	CShadowLeafBufferEnum leafList( pBuffer->m_Leaves );
+	BuildShadowLeafList( &leafList, projection.m_vecWorldOrigin, projection.m_vecShadowDir, projection.m_vecSize, projection.m_flMaxHeight );
+	projection.m_nLeafCount = pBuffer->m_Leaves.Count() - projection.m_nFirstLeaf;
+}
+
+
+//-----------------------------------------------------------------------------
+// Hands a built projection to the engine and the leaf system
+//-----------------------------------------------------------------------------
+void CClientShadowMgr::ApplyShadowProjection( const ShadowProjection_t &projection )
+{
+	const ClientShadow_t &shadow = m_Shadows[projection.m_Handle];
+	const int *pLeafList = projection.m_pBuffer->m_Leaves.Base() + projection.m_nFirstLeaf;
+
+	shadowmgr->ProjectShadow( shadow.m_ShadowHandle, projection.m_vecWorldOrigin, projection.m_vecShadowDir, projection.m_matWorldToTexture,
+		projection.m_vecSize, projection.m_nLeafCount, pLeafList, projection.m_flMaxHeight, projection.m_flFalloffStart, MAX_FALLOFF_AMOUNT, projection.m_vecRenderOrigin );
+
+	// Extra clip planes to prevent poke-thru
+	if ( projection.m_nClipPlanes >= 0 )
+	{
+		ClearExtraClipPlanes( projection.m_Handle );
+		for ( int i = 0; i < projection.m_nClipPlanes; ++i )
+		{
+			AddExtraClipPlane( projection.m_Handle, projection.m_vecClipNormal[i], projection.m_flClipDist[i] );
+		}
+	}
 
 	// Add the shadow to the client leaf system so it correctly marks 
 	// leafs as being affected by a particular shadow
-	ClientLeafSystem()->ProjectShadow( m_Shadows[handle].m_ClientLeafShadowHandle, nCount, pLeafList );
+	ClientLeafSystem()->ProjectShadow( shadow.m_ClientLeafShadowHandle, projection.m_nLeafCount, pLeafList );
+}
+
+
+//-----------------------------------------------------------------------------
+// Projects a blobby or render to texture shadow right away
+//-----------------------------------------------------------------------------
+void CClientShadowMgr::BuildShadow( IClientRenderable* pRenderable, ClientShadowHandle_t handle )
+{
+	ShadowProjection_t projection;
+	PrepareShadowProjection( pRenderable, handle, projection );
+	BuildShadowProjection( projection );
+	ApplyShadowProjection( projection );
+
+	projection.m_pBuffer->m_Leaves.RemoveMultipleFromTail( projection.m_nLeafCount );
 }
 
 static void LineDrawHelper( const Vector &startShadowSpace, const Vector &endShadowSpace, 
@@ -3139,18 +3619,7 @@ void CClientShadowMgr::UpdateStudioShadow( IClientRenderable *pRenderable, Clien
 {
 	if( !( m_Shadows[handle].m_Flags & SHADOW_FLAGS_FLASHLIGHT ) )
 	{
-		Vector mins, maxs;
-		ComputeHierarchicalBounds( pRenderable, mins, maxs );
-
-		ShadowType_t shadowType = GetActualShadowCastType( handle );
-		if ( shadowType != SHADOWS_RENDER_TO_TEXTURE )
-		{
-			BuildOrthoShadow( pRenderable, handle, mins, maxs );
-		}
-		else
-		{
-			BuildRenderToTextureShadow( pRenderable, handle, mins, maxs );
-		}
+		BuildShadow( pRenderable, handle );
 	}
 	else
 	{
@@ -3162,19 +3631,7 @@ void CClientShadowMgr::UpdateBrushShadow( IClientRenderable *pRenderable, Client
 {
 	if( !( m_Shadows[handle].m_Flags & SHADOW_FLAGS_FLASHLIGHT ) )
 	{
-		// Compute the bounding box in the space of the shadow...
-		Vector mins, maxs;
-		ComputeHierarchicalBounds( pRenderable, mins, maxs );
-
-		ShadowType_t shadowType = GetActualShadowCastType( handle );
-		if ( shadowType != SHADOWS_RENDER_TO_TEXTURE )
-		{
-			BuildOrthoShadow( pRenderable, handle, mins, maxs );
-		}
-		else
-		{
-			BuildRenderToTextureShadow( pRenderable, handle, mins, maxs );
-		}
+		BuildShadow( pRenderable, handle );
 	}
 	else
 	{
@@ -3322,18 +3779,25 @@ void CClientShadowMgr::PreRender()
 
 	m_bUpdatingDirtyShadows = true;
 
-	unsigned short i = m_DirtyShadows.FirstInorder();
-	while ( i != m_DirtyShadows.InvalidIndex() )
+	if ( r_threaded_client_shadow_manager.GetBool() && g_pThreadPool->NumIdleThreads() && m_DirtyShadows.Count() >= SHADOW_PROJECT_THREAD_MIN )
 	{
-		MDLCACHE_CRITICAL_SECTION();
-		ClientShadowHandle_t& handle = m_DirtyShadows[ i ];
+		UpdateDirtyShadowsThreaded();
+	}
+	else
+	{
+		unsigned short i = m_DirtyShadows.FirstInorder();
+		while ( i != m_DirtyShadows.InvalidIndex() )
+		{
+			MDLCACHE_CRITICAL_SECTION();
+			ClientShadowHandle_t& handle = m_DirtyShadows[ i ];
 #ifdef DYNAMIC_RTT_SHADOWS
-		UpdateDirtyShadow(handle);
+			UpdateDirtyShadow(handle);
 #else
-		Assert( m_Shadows.IsValidIndex( handle ) );
-		UpdateProjectedTextureInternal( handle, false );
+			Assert( m_Shadows.IsValidIndex( handle ) );
+			UpdateProjectedTextureInternal( handle, false );
 #endif
-		i = m_DirtyShadows.NextInorder(i);
+			i = m_DirtyShadows.NextInorder(i);
+		}
 	}
 	m_DirtyShadows.RemoveAll();
 
@@ -3348,6 +3812,187 @@ void CClientShadowMgr::PreRender()
 	m_bUpdatingDirtyShadows = false;
 }
 
+//-----------------------------------------------------------------------------
+// Same as updating each dirty shadow in turn, except the blobby and render to
+// texture shadows that moved are built on the job threads. Flashlights are
+// still updated as they're found; the rest are applied in dirty list order
+// afterwards, so they reach the engine and the leaf system in the same order
+// as from the serial path.
+//-----------------------------------------------------------------------------
+void CClientShadowMgr::UpdateDirtyShadowsThreaded()
+{
+	m_ShadowProjections.RemoveAll();
+
+	unsigned short i = m_DirtyShadows.FirstInorder();
+	while ( i != m_DirtyShadows.InvalidIndex() )
+	{
+		MDLCACHE_CRITICAL_SECTION();
+		ClientShadowHandle_t handle = m_DirtyShadows[ i ];
+		i = m_DirtyShadows.NextInorder(i);
+
+		Assert( m_Shadows.IsValidIndex( handle ) );
+#ifdef DYNAMIC_RTT_SHADOWS
+		if ( IsShadowingFromWorldLights() )
+		{
+			UpdateShadowDirectionFromLocalLightSource( handle );
+		}
+#endif
+
+		// Flashlights go straight to the engine
+		if ( m_Shadows[handle].m_Flags & SHADOW_FLAGS_FLASHLIGHT )
+		{
+			UpdateProjectedTextureInternal( handle, false );
+			continue;
+		}
+
+		IClientRenderable *pRenderable;
+		if ( CheckShadowMoved( handle, false, &pRenderable ) )
+		{
+			int nModelType = modelinfo->GetModelType( pRenderable->GetModel() );
+			if ( nModelType == mod_brush || nModelType == mod_studio )
+			{
+				PrepareShadowProjection( pRenderable, handle, m_ShadowProjections[ m_ShadowProjections.AddToTail() ] );
+			}
+			else
+			{
+				// Shouldn't get here if not a brush or studio
+				Assert(0);
+			}
+		}
+
+		// See UpdateShadow
+		if ( pRenderable )
+		{
+			pRenderable->MarkShadowDirty( false );
+		}
+	}
+
+	ParallelProcess( "CClientShadowMgr::PreRender", m_ShadowProjections.Base(), m_ShadowProjections.Count(), this, &CClientShadowMgr::BuildShadowProjection );
+
+	CMatRenderContextPtr pRenderContext( materials );
+	MaterialFogMode_t fogMode = pRenderContext->GetFogMode();
+	pRenderContext->FogMode( MATERIAL_FOG_NONE );
+	for ( int j = 0; j < m_ShadowProjections.Count(); j++ )
+	{
+		ApplyShadowProjection( m_ShadowProjections[j] );
+	}
+	pRenderContext->FogMode( fogMode );
+
+	for ( int j = 0; j < m_ShadowLeafBuffers.Count(); j++ )
+	{
+		m_ShadowLeafBuffers[j]->m_Leaves.RemoveAll();
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Reprojects every blobby and render to texture shadow in place, once one at
+// a time and once the way UpdateDirtyShadowsThreaded does it. Load a map
+// with plenty of NPCs and props for numbers that mean anything.
+//-----------------------------------------------------------------------------
+void CClientShadowMgr::BenchmarkShadowProjection( int nPasses )
+{
+	MDLCACHE_CRITICAL_SECTION();
+
+	CUtlVector< ClientShadowHandle_t > handles;
+	CUtlVector< IClientRenderable * > renderables;
+	for ( ClientShadowHandle_t h = m_Shadows.Head(); h != m_Shadows.InvalidIndex(); h = m_Shadows.Next( h ) )
+	{
+		if ( m_Shadows[h].m_Flags & SHADOW_FLAGS_FLASHLIGHT )
+			continue;
+
+		IClientRenderable *pRenderable = ClientEntityList().GetClientRenderableFromHandle( m_Shadows[h].m_Entity );
+		if ( !pRenderable || !pRenderable->GetModel() )
+			continue;
+
+		int nModelType = modelinfo->GetModelType( pRenderable->GetModel() );
+		if ( nModelType != mod_brush && nModelType != mod_studio )
+			continue;
+
+		if ( ShouldUseParentShadow( pRenderable ) || WillParentRenderBlobbyShadow( pRenderable ) )
+			continue;
+
+		handles.AddToTail( h );
+		renderables.AddToTail( pRenderable );
+	}
+
+	int nShadows = handles.Count();
+	if ( !nShadows )
+	{
+		Msg( "No shadows to project, load a map first\n" );
+		return;
+	}
+
+	CMatRenderContextPtr pRenderContext( materials );
+	MaterialFogMode_t fogMode = pRenderContext->GetFogMode();
+	pRenderContext->FogMode( MATERIAL_FOG_NONE );
+
+	CUtlVector< int > serialLeaves;
+	serialLeaves.SetCount( nShadows );
+
+	CFastTimer timer;
+	CCycleCount serialTime, threadedTime;
+	bool bMismatch = false;
+
+	for ( int iPass = 0; iPass < nPasses; iPass++ )
+	{
+		timer.Start();
+		for ( int i = 0; i < nShadows; i++ )
+		{
+			ShadowProjection_t projection;
+			PrepareShadowProjection( renderables[i], handles[i], projection );
+			BuildShadowProjection( projection );
+			ApplyShadowProjection( projection );
+			projection.m_pBuffer->m_Leaves.RemoveMultipleFromTail( projection.m_nLeafCount );
+			serialLeaves[i] = projection.m_nLeafCount;
+		}
+		timer.End();
+		serialTime += timer.GetDuration();
+
+		timer.Start();
+		m_ShadowProjections.SetCount( nShadows );
+		for ( int i = 0; i < nShadows; i++ )
+		{
+			PrepareShadowProjection( renderables[i], handles[i], m_ShadowProjections[i] );
+		}
+		ParallelProcess( "CClientShadowMgr::BenchmarkShadowProjection", m_ShadowProjections.Base(), nShadows, this, &CClientShadowMgr::BuildShadowProjection );
+		for ( int i = 0; i < nShadows; i++ )
+		{
+			ApplyShadowProjection( m_ShadowProjections[i] );
+		}
+		for ( int i = 0; i < m_ShadowLeafBuffers.Count(); i++ )
+		{
+			m_ShadowLeafBuffers[i]->m_Leaves.RemoveAll();
+		}
+		timer.End();
+		threadedTime += timer.GetDuration();
+
+		for ( int i = 0; i < nShadows; i++ )
+		{
+			bMismatch |= ( m_ShadowProjections[i].m_nLeafCount != serialLeaves[i] );
+		}
+	}
+
+	m_ShadowProjections.RemoveAll();
+	pRenderContext->FogMode( fogMode );
+
+	double flSerialUS = serialTime.GetMicrosecondsF() / nPasses;
+	double flThreadedUS = threadedTime.GetMicrosecondsF() / nPasses;
+	Msg( "%d shadows, %d job threads: serial %.2fus, threaded %.2fus (%.2fx)%s\n", nShadows, g_pThreadPool->NumThreads(), flSerialUS, flThreadedUS,
+		flThreadedUS > 0.0 ? flSerialUS / flThreadedUS : 0.0, bMismatch ? " MISMATCH" : "" );
+}
+
+CON_COMMAND( r_shadow_texture_stats, "Print what the render to texture shadow allocator did last frame and since the level started" )
+{
+	s_ClientShadowMgr.PrintShadowTextureStats();
+}
+
+CON_COMMAND( r_shadow_project_benchmark, "Time projecting every shadow in the level serially and on the job threads. Usage: r_shadow_project_benchmark [passes]" )
+{
+	int nPasses = ( args.ArgC() > 1 ) ? MAX( atoi( args[1] ), 1 ) : 100;
+	s_ClientShadowMgr.BenchmarkShadowProjection( nPasses );
+}
+
 #ifdef DYNAMIC_RTT_SHADOWS
 //-----------------------------------------------------------------------------
 // Updates a single dirty shadow
@@ -3482,8 +4127,49 @@ void CClientShadowMgr::MarkRenderToTextureShadowDirty( ClientShadowHandle_t hand
 // Update a shadow
 //-----------------------------------------------------------------------------
 void CClientShadowMgr::UpdateShadow( ClientShadowHandle_t handle, bool force )
+{
+	IClientRenderable *pRenderable;
+	if ( CheckShadowMoved( handle, force, &pRenderable ) )
+	{
+		CMatRenderContextPtr pRenderContext( materials );
+		const model_t *pModel = pRenderable->GetModel();
+		MaterialFogMode_t fogMode = pRenderContext->GetFogMode();
+		pRenderContext->FogMode( MATERIAL_FOG_NONE );
+		switch( modelinfo->GetModelType( pModel ) )
+		{
+		case mod_brush:
+			UpdateBrushShadow( pRenderable, handle );
+			break;
+
+		case mod_studio:
+			UpdateStudioShadow( pRenderable, handle );
+			break;
+
+		default:
+			// Shouldn't get here if not a brush or studio
+			Assert(0);
+			break;
+		}
+		pRenderContext->FogMode( fogMode );
+	}
+
+	// NOTE: We can't do this earlier because pEnt->GetRenderOrigin() can
+	// provoke a recomputation of render origin, which, for aiments, can cause everything
+	// to be marked as dirty. So don't clear the flag until this point.
+	if ( pRenderable )
+	{
+		pRenderable->MarkShadowDirty( false );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Checks whether a shadow needs to be projected again
+//-----------------------------------------------------------------------------
+bool CClientShadowMgr::CheckShadowMoved( ClientShadowHandle_t handle, bool force, IClientRenderable **ppRenderable )
 {
 	ClientShadow_t& shadow = m_Shadows[handle];
+	*ppRenderable = NULL;
 
 	// Get the client entity....
 	IClientRenderable *pRenderable = ClientEntityList().GetClientRenderableFromHandle( shadow.m_Entity );
@@ -3491,14 +4177,14 @@ void CClientShadowMgr::UpdateShadow( ClientShadowHandle_t handle, bool force )
 	{
 		// Retire the shadow if the entity is gone
 		DestroyShadow( handle );
-		return;
+		return false;
 	}
 
 	// Don't bother if there's no model on the renderable
 	if ( !pRenderable->GetModel() )
 	{
 		pRenderable->MarkShadowDirty( false );
-		return;
+		return false;
 	}
 
 	// FIXME: NOTE! Because this is called from PreRender, the falloff bias is
@@ -3510,7 +4196,7 @@ void CClientShadowMgr::UpdateShadow( ClientShadowHandle_t handle, bool force )
 	{
 		shadowmgr->EnableShadow( shadow.m_ShadowHandle, false );
 		m_TransparentShadows.AddToTail( handle );
-		return;
+		return false;
 	}
 
 #ifdef _DEBUG
@@ -3525,10 +4211,11 @@ void CClientShadowMgr::UpdateShadow( ClientShadowHandle_t handle, bool force )
 	{
 		shadowmgr->EnableShadow( shadow.m_ShadowHandle, false );
 		pRenderable->MarkShadowDirty( false );
-		return;
+		return false;
 	}
 
 	shadowmgr->EnableShadow( shadow.m_ShadowHandle, true );
+	*ppRenderable = pRenderable;
 
 	// Figure out if the shadow moved...
 	// Even though we have dirty bits, some entities
@@ -3545,33 +4232,10 @@ void CClientShadowMgr::UpdateShadow( ClientShadowHandle_t handle, bool force )
 		// Store off the new pos/orientation
 		VectorCopy( origin, shadow.m_LastOrigin );
 		VectorCopy( angles, shadow.m_LastAngles );
-
-		CMatRenderContextPtr pRenderContext( materials );
-		const model_t *pModel = pRenderable->GetModel();
-		MaterialFogMode_t fogMode = pRenderContext->GetFogMode();
-		pRenderContext->FogMode( MATERIAL_FOG_NONE );
-		switch( modelinfo->GetModelType( pModel ) )
-		{
-		case mod_brush:
-			UpdateBrushShadow( pRenderable, handle );
-			break;
-
-		case mod_studio:
-			UpdateStudioShadow( pRenderable, handle );
-			break;
-
-		default:
-			// Shouldn't get here if not a brush or studio
-			Assert(0);
-			break;
-		}
-		pRenderContext->FogMode( fogMode );
+		return true;
 	}
 
-	// NOTE: We can't do this earlier because pEnt->GetRenderOrigin() can
-	// provoke a recomputation of render origin, which, for aiments, can cause everything
-	// to be marked as dirty. So don't clear the flag until this point.
-	pRenderable->MarkShadowDirty( false );
+	return false;
 }
 
 
@@ -4588,6 +5252,8 @@ void CClientShadowMgr::ComputeShadowTextures( const CViewSetup &view, int leafCo
 	m_bThreaded = false;//( r_threaded_client_shadow_manager.GetBool() && g_pThreadPool->NumIdleThreads() );
 #endif
 
+	m_ShadowAllocator.SetPolicy( r_shadow_texture_priority.GetBool(), r_shadow_texture_rerender_budget.GetInt() );
+
 	MDLCACHE_CRITICAL_SECTION();
 	// First grab all shadow textures we may want to render
 	int nCount = s_VisibleShadowList.FindShadows( &view, leafCount, pLeafList );
@@ -21,6 +21,7 @@
 #include "env_detail_controller.h"
 #include "tier0/icommandline.h"
 #include "c_world.h"
+#include "vstdlib/jobthread.h"
 
 #include "tier0/valve_minmax_off.h"
 #include <algorithm>
@@ -56,6 +57,13 @@ ConVar cl_detail_avoid_radius( "cl_detail_avoid_radius", "0", FCVAR_ARCHIVE, "ra
 ConVar cl_detail_avoid_force( "cl_detail_avoid_force", "0", FCVAR_ARCHIVE, "force with which to avoid players ( in units, percentage of the width of the detail sprite )" );
 ConVar cl_detail_avoid_recover_speed( "cl_detail_avoid_recover_speed", "0", FCVAR_ARCHIVE, "how fast to recover position after avoiding players" );
 #endif
+static ConVar cl_threaded_detail_props( "cl_threaded_detail_props", "1", 0, "Fade and screen align detail props on the job threads" );
+
+// Fewer detail objects than this in view aren't worth handing out to threads
+#define DETAIL_PREPARE_THREAD_MIN	512
+
+// How many detail objects PrepareDetailObjects fades at once
+#define DETAIL_PREPARE_BATCH_SIZE	64
 
 // Per detail instance information
 struct DetailModelAdvInfo_t
@@ -77,7 +85,22 @@ struct DetailModelAdvInfo_t
 	int m_iShapeAngle;
 	float m_flSwayAmount;
 
+	// Frame m_vecCurrentAvoid was last updated
+	int m_nAvoidFrame;
+};
+
+#ifdef USE_DETAIL_SHAPES
+// Players near the view that detail sprites bend away from. Found once per
+// view, instead of every sprite searching the partition for them.
+struct DetailPlayerAvoiders_t
+{
+	int m_nFrame;
+	float m_flForce;
+	float m_flRadius;
+	float m_flRecoverSpeed;
+	CUtlVector<Vector> m_Origins;
 };
+#endif
 
 class CDetailObjectSystemPerLeafData
 {
@@ -189,6 +212,7 @@ public:
 
 	// Computes the render angles for screen alignment
 	void ComputeAngles( void );
+	void ComputeAngles( const Vector &vecViewOrigin );
 
 	// Calls the correct rendering func
 	void DrawSprite( CMeshBuilder &meshBuilder );
@@ -205,7 +229,7 @@ public:
 	void DrawTypeShapeTri( CMeshBuilder &meshBuilder );
 
 	// check for players nearby and angle away from them
-	void UpdatePlayerAvoid( void );
+	void UpdatePlayerAvoid( const DetailPlayerAvoiders_t &avoiders );
 
 	void InitShapedSprite( unsigned char shapeAngle, unsigned char shapeSize, unsigned char swayAmount );
 	void InitShapeTri();
@@ -410,6 +434,10 @@ public:
 	DetailPropLightstylesLump_t& DetailLighting( int i ) { return m_DetailLighting[i]; }
 	DetailPropSpriteDict_t& DetailSpriteDict( int i ) { return m_DetailSpriteDict[i]; }
 
+#ifdef USE_DETAIL_SHAPES
+	const DetailPlayerAvoiders_t& PlayerAvoiders() const { return m_PlayerAvoiders; }
+#endif
+
 private:
 	struct DetailModelDict_t
 	{
@@ -418,7 +446,6 @@ private:
 
 	struct EnumContext_t
 	{
-		Vector m_vViewOrigin;
 		int	m_BuildWorldListNumber;
 	};
 
@@ -428,6 +455,13 @@ private:
 		float m_flDistance;
 	};
 
+	// The detail objects in one leaf the view can see
+	struct DetailObjectRange_t
+	{
+		int m_nFirst;
+		int m_nCount;
+	};
+
 	int BuildOutSortedSprites( CFastDetailLeafSpriteList *pData,
 							   Vector const &viewOrigin,
 							   Vector const &viewForward,
@@ -463,6 +497,16 @@ private:
 	static bool SortLessFunc( const SortInfo_t &left, const SortInfo_t &right );
 	int SortSpritesBackToFront( int nLeaf, const Vector &viewOrigin, const Vector &viewForward, SortInfo_t *pSortInfo );
 
+	// Sets alpha from the distance to the view, returns the ones inside the max distance
+	int FadeDetailObjects( int nFirst, int nCount, const Vector &viewOrigin, float flMaxSqDist, float flFalloffFactor, SortInfo_t *pVisible );
+
+	// Fades and screen aligns the objects the view enumerated
+	void PrepareDetailObjects( DetailObjectRange_t &range );
+
+#ifdef USE_DETAIL_SHAPES
+	void GatherPlayerAvoiders( const Vector &vecViewOrigin );
+#endif
+
 	// For fast detail object insertion
 	IterationRetval_t EnumElement( int userId, int context );
 
@@ -495,6 +539,15 @@ private:
 	float m_flCurFadeSqDist;
 	float m_flCurFalloffFactor;
 
+	// What BuildDetailObjectRenderLists found, prepared after the leaf enumeration
+	CUtlVector<DetailObjectRange_t> m_PrepareRanges;
+	int m_nPrepareObjectCount;
+	Vector m_vecPrepareViewOrigin;
+	Vector m_vecPrepareAlignOrigin;
+
+#ifdef USE_DETAIL_SHAPES
+	DetailPlayerAvoiders_t m_PlayerAvoiders;
+#endif
 };
 
 
@@ -831,6 +884,7 @@ void CDetailModel::InitShapedSprite( unsigned char shapeAngle, unsigned char sha
 		m_pAdvInfo->m_flShapeSize = (float)shapeSize / 255.0f;
 		m_pAdvInfo->m_vecCurrentAvoid = vec3_origin;
 		m_pAdvInfo->m_flSwayYaw = random->RandomFloat( 0, 180 );
+		m_pAdvInfo->m_nAvoidFrame = -1;
 	}
 
 	switch ( m_Type )
@@ -947,6 +1001,11 @@ bool CDetailModel::IsDetailModelTranslucent()
 // Computes the render angles for screen alignment
 //-----------------------------------------------------------------------------
 void CDetailModel::ComputeAngles( void )
+{
+	ComputeAngles( CurrentViewOrigin() );
+}
+
+void CDetailModel::ComputeAngles( const Vector &vecViewOrigin )
 {
 	switch( m_Orientation )
 	{
@@ -956,7 +1015,7 @@ void CDetailModel::ComputeAngles( void )
 	case 1:
 		{
 			Vector vecDir;
-			VectorSubtract( CurrentViewOrigin(), m_Origin, vecDir );
+			VectorSubtract( vecViewOrigin, m_Origin, vecDir );
 			VectorAngles( vecDir, m_Angles );
 		}
 		break;
@@ -964,7 +1023,7 @@ void CDetailModel::ComputeAngles( void )
 	case 2:
 		{
 			Vector vecDir;
-			VectorSubtract( CurrentViewOrigin(), m_Origin, vecDir );
+			VectorSubtract( vecViewOrigin, m_Origin, vecDir );
 			vecDir.z = 0.0f;
 			VectorAngles( vecDir, m_Angles );
 		}
@@ -1027,7 +1086,7 @@ void CDetailModel::DrawTypeSprite( CMeshBuilder &meshBuilder )
 	Vector2DMultiply( dict.m_LR, scale, lr );
 
 #ifdef USE_DETAIL_SHAPES
-	UpdatePlayerAvoid();
+	UpdatePlayerAvoid( s_DetailObjectSystem.PlayerAvoiders() );
 
 	Vector vecSway = vec3_origin;
 
@@ -1139,7 +1198,7 @@ void CDetailModel::DrawTypeShapeCross( CMeshBuilder &meshBuilder )
 	float flSizeX = ( lr.x - ul.x ) / 2;
 	float flSizeY = ( lr.y - ul.y );
 
-	UpdatePlayerAvoid();
+	UpdatePlayerAvoid( s_DetailObjectSystem.PlayerAvoiders() );
 
 	// sway based on time plus a random seed that is constant for this instance of the sprite
 	Vector vecSway = ( m_pAdvInfo->m_vecCurrentAvoid * flSizeX * 2 );
@@ -1263,7 +1322,7 @@ void CDetailModel::DrawTypeShapeTri( CMeshBuilder &meshBuilder )
 	Vector vecOrigin;
 	Vector vecHeight, vecWidth;
 
-	UpdatePlayerAvoid();
+	UpdatePlayerAvoid( s_DetailObjectSystem.PlayerAvoiders() );
 
 	Vector vecSwayYaw = UTIL_YawToVector( m_pAdvInfo->m_flSwayYaw );
 	float flSwayAmplitude = m_pAdvInfo->m_flSwayAmount * cl_detail_max_sway.GetFloat();
@@ -1296,9 +1355,9 @@ void CDetailModel::DrawTypeShapeTri( CMeshBuilder &meshBuilder )
 // checks for nearby players and pushes the detail to the side
 //-----------------------------------------------------------------------------
 #ifdef USE_DETAIL_SHAPES
-void CDetailModel::UpdatePlayerAvoid( void )
+void CDetailModel::UpdatePlayerAvoid( const DetailPlayerAvoiders_t &avoiders )
 {
-	float flForce = cl_detail_avoid_force.GetFloat();
+	float flForce = avoiders.m_flForce;
 
 	if ( flForce < 0.1 )
 		return;
@@ -1306,32 +1365,28 @@ void CDetailModel::UpdatePlayerAvoid( void )
 	if ( m_pAdvInfo == NULL )
 		return;
 
-	// get players in a radius
-	float flRadius = cl_detail_avoid_radius.GetFloat();
-	float flRecoverSpeed = cl_detail_avoid_recover_speed.GetFloat();
+	// Once a frame, however many views draw it
+	if ( m_pAdvInfo->m_nAvoidFrame == avoiders.m_nFrame )
+		return;
+
+	m_pAdvInfo->m_nAvoidFrame = avoiders.m_nFrame;
+
+	float flRadius = avoiders.m_flRadius;
+	float flRecoverSpeed = avoiders.m_flRecoverSpeed;
 
 	Vector vecAvoid;
-	C_BaseEntity *pEnt;
 
 	float flMaxForce = 0;
 	Vector vecMaxAvoid(0,0,0);
 
-	CPlayerEnumerator avoid( flRadius, m_Origin );
-	::partition->EnumerateElementsInSphere( PARTITION_CLIENT_SOLID_EDICTS, m_Origin, flRadius, false, &avoid );
-
 	// Okay, decide how to avoid if there's anything close by
-	int c = avoid.GetObjectCount();
-	for ( int i=0; i<c+1; i++ )	// +1 for the local player we tack on the end
+	int c = avoiders.m_Origins.Count();
+	for ( int i=0; i<c; i++ )
 	{
-		if ( i == c )
-		{
-			pEnt = C_BasePlayer::GetLocalPlayer();
-			if ( !pEnt ) continue;
-		}
-		else
-			pEnt = avoid.GetObject( i );
-		
-		vecAvoid = m_Origin - pEnt->GetAbsOrigin();
+		vecAvoid = m_Origin - avoiders.m_Origins[i];
+		if ( vecAvoid.LengthSqr() > flRadius * flRadius )
+			continue;
+
 		vecAvoid.z = 0;
 
 		float flDist = vecAvoid.Length2D();
@@ -1402,6 +1457,14 @@ CDetailObjectSystem::CDetailObjectSystem() : m_DetailSpriteDict( 0, 32 ), m_Deta
 	m_pSortInfo = NULL;
 	m_pFastSortInfo = NULL;
 	m_pBuildoutBuffer = NULL;
+	m_nPrepareObjectCount = 0;
+
+#ifdef USE_DETAIL_SHAPES
+	m_PlayerAvoiders.m_nFrame = -1;
+	m_PlayerAvoiders.m_flForce = 0.0f;
+	m_PlayerAvoiders.m_flRadius = 0.0f;
+	m_PlayerAvoiders.m_flRecoverSpeed = 0.0f;
+#endif
 }
 
 void CDetailObjectSystem::FreeSortBuffers( void )
@@ -1570,6 +1633,7 @@ void CDetailObjectSystem::LevelShutdownPreEntity()
 	m_DetailSpriteDictFlipped.Purge();
 	m_DetailLighting.Purge();
 	m_DetailSpriteMaterial.Shutdown();
+	m_PrepareRanges.Purge();
 	if ( m_pFastSpriteData )
 	{
 		MemAlloc_FreeAligned( m_pFastSpriteData );
@@ -2098,42 +2162,21 @@ int CDetailObjectSystem::SortSpritesBackToFront( int nLeaf, const Vector &viewOr
 	{
 		flFadeSqDist = 0;
 	}
-	float flFalloffFactor = 255.0f / (flMaxSqDist - flFadeSqDist);
+	// With no fade distance everything inside the max distance is opaque
+	float flFalloffFactor = ( flFadeSqDist > 0 ) ? 255.0f / (flMaxSqDist - flFadeSqDist) : FLT_MAX;
+
+	int nInRange = FadeDetailObjects( nFirstDetailObject, nDetailObjectCount, viewOrigin, flMaxSqDist, flFalloffFactor, pSortInfo );
 
-	Vector vecDelta;
 	int nCount = 0;
-	nDetailObjectCount += nFirstDetailObject;
-	for ( int j = nFirstDetailObject; j < nDetailObjectCount; ++j )
+	for ( int j = 0; j < nInRange; ++j )
 	{
-		CDetailModel &model = m_DetailObjects[j];
-
-		Vector v;
-		VectorSubtract( model.GetRenderOrigin(), viewOrigin, vecDelta );
-		float flSqDist = vecDelta.LengthSqr();
-		if ( flSqDist >= flMaxSqDist )
-			continue;
-
-		if ((flFadeSqDist > 0) && (flSqDist > flFadeSqDist))
-		{
-			model.SetAlpha( flFalloffFactor * ( flMaxSqDist - flSqDist ) );
-		}
-		else
-		{
-			model.SetAlpha( 255 );
-		}
-
+		CDetailModel &model = m_DetailObjects[pSortInfo[j].m_nIndex];
 		if ( (model.GetType() == DETAIL_PROP_TYPE_MODEL) || (model.GetAlpha() == 0) )
 			continue;
 
 		// Perform screen alignment if necessary.
 		model.ComputeAngles();
-		SortInfo_t *pSortInfoCurrent = &pSortInfo[nCount];
-
-		pSortInfoCurrent->m_nIndex = j;
-
-		// Compute distance from the camera to each object
-		pSortInfoCurrent->m_flDistance = flSqDist;
-		++nCount;
+		pSortInfo[nCount++] = pSortInfo[j];
 	}
 
 	if ( nCount )
@@ -2147,6 +2190,67 @@ int CDetailObjectSystem::SortSpritesBackToFront( int nLeaf, const Vector &viewOr
 }
 
 
+//-----------------------------------------------------------------------------
+// Sets the alpha of a run of detail objects from their distance to the view,
+// four at a time: opaque up to the fade distance, then fading out to zero at
+// flMaxSqDist. Writes the ones inside the max distance to pVisible with their
+// squared distance, in order, and returns how many there are.
+//-----------------------------------------------------------------------------
+int CDetailObjectSystem::FadeDetailObjects( int nFirst, int nCount, const Vector &viewOrigin, float flMaxSqDist, float flFalloffFactor, SortInfo_t *pVisible )
+{
+	fltx4 fl4ViewX = ReplicateX4( viewOrigin.x );
+	fltx4 fl4ViewY = ReplicateX4( viewOrigin.y );
+	fltx4 fl4ViewZ = ReplicateX4( viewOrigin.z );
+	fltx4 fl4MaxSqDist = ReplicateX4( flMaxSqDist );
+	fltx4 fl4Falloff = ReplicateX4( flFalloffFactor );
+	fltx4 fl4Opaque = ReplicateX4( 255.0f );
+
+	ALIGN16 float flOrigin[3][4] ALIGN16_POST;
+	ALIGN16 float flSqDist[4] ALIGN16_POST;
+	ALIGN16 float flAlpha[4] ALIGN16_POST;
+
+	int nVisible = 0;
+	for ( int i = 0; i < nCount; i += 4 )
+	{
+		int nGroup = MIN( 4, nCount - i );
+		for ( int j = 0; j < 4; ++j )
+		{
+			// Pad a short group with the last object, its result is ignored
+			const Vector &vecOrigin = m_DetailObjects[nFirst + i + MIN( j, nGroup - 1 )].GetRenderOrigin();
+			flOrigin[0][j] = vecOrigin.x;
+			flOrigin[1][j] = vecOrigin.y;
+			flOrigin[2][j] = vecOrigin.z;
+		}
+
+		fltx4 fl4DeltaX = SubSIMD( LoadAlignedSIMD( flOrigin[0] ), fl4ViewX );
+		fltx4 fl4DeltaY = SubSIMD( LoadAlignedSIMD( flOrigin[1] ), fl4ViewY );
+		fltx4 fl4DeltaZ = SubSIMD( LoadAlignedSIMD( flOrigin[2] ), fl4ViewZ );
+		fltx4 fl4SqDist = AddSIMD( MulSIMD( fl4DeltaX, fl4DeltaX ), AddSIMD( MulSIMD( fl4DeltaY, fl4DeltaY ), MulSIMD( fl4DeltaZ, fl4DeltaZ ) ) );
+
+		// The falloff reaches 255 at the fade distance, so clamping it covers the opaque range too
+		fltx4 fl4Alpha = MulSIMD( fl4Falloff, SubSIMD( fl4MaxSqDist, fl4SqDist ) );
+		fl4Alpha = MinSIMD( MaxSIMD( fl4Alpha, Four_Zeros ), fl4Opaque );
+		int nInRangeMask = TestSignSIMD( CmpLtSIMD( fl4SqDist, fl4MaxSqDist ) );
+
+		StoreAlignedSIMD( flSqDist, fl4SqDist );
+		StoreAlignedSIMD( flAlpha, fl4Alpha );
+
+		for ( int j = 0; j < nGroup; ++j )
+		{
+			m_DetailObjects[nFirst + i + j].SetAlpha( (unsigned char)flAlpha[j] );
+			if ( nInRangeMask & ( 1 << j ) )
+			{
+				pVisible[nVisible].m_nIndex = nFirst + i + j;
+				pVisible[nVisible].m_flDistance = flSqDist[j];
+				++nVisible;
+			}
+		}
+	}
+
+	return nVisible;
+}
+
+
 #define MAGIC_NUMBER (1<<23)
 #ifdef VALVE_BIG_ENDIAN
 #define MANTISSA_LSB_OFFSET 3
@@ -2741,45 +2845,88 @@ void CDetailObjectSystem::RenderTranslucentDetailObjectsInLeaf( const Vector &vi
 bool CDetailObjectSystem::EnumerateLeaf( int leaf, int context )
 {
 	VPROF_BUDGET( "CDetailObjectSystem::EnumerateLeaf", VPROF_BUDGETGROUP_DETAILPROP_RENDERING );
-	Vector v;
 	int firstDetailObject, detailObjectCount;
 
 	EnumContext_t* pCtx = (EnumContext_t*)context;
 	ClientLeafSystem()->DrawDetailObjectsInLeaf( leaf, pCtx->m_BuildWorldListNumber, 
 		firstDetailObject, detailObjectCount );
 
-	// Compute the translucency. Need to do it now cause we need to
-	// know that when we're rendering (opaque stuff is rendered first)
-	for ( int i = 0; i < detailObjectCount; ++i)
+	// They're faded once every leaf is in, see BuildDetailObjectRenderLists
+	if ( detailObjectCount )
 	{
-		// Calculate distance (badly)
-		CDetailModel& model = m_DetailObjects[firstDetailObject+i];
-		VectorSubtract( model.GetRenderOrigin(), pCtx->m_vViewOrigin, v );
+		DetailObjectRange_t &range = m_PrepareRanges[ m_PrepareRanges.AddToTail() ];
+		range.m_nFirst = firstDetailObject;
+		range.m_nCount = detailObjectCount;
+		m_nPrepareObjectCount += detailObjectCount;
+	}
+	return true;
+}
 
-		float sqDist = v.LengthSqr();
 
-		model.SetAlpha( 255 );
-		if ( sqDist < m_flCurMaxSqDist )
+//-----------------------------------------------------------------------------
+// Fades and screen aligns the detail objects in one leaf for the current view.
+// Only touches the objects in that leaf, so leaves can go to different threads.
+//-----------------------------------------------------------------------------
+void CDetailObjectSystem::PrepareDetailObjects( DetailObjectRange_t &range )
+{
+	SortInfo_t visible[DETAIL_PREPARE_BATCH_SIZE];
+	for ( int i = 0; i < range.m_nCount; i += DETAIL_PREPARE_BATCH_SIZE )
+	{
+		int nBatch = MIN( DETAIL_PREPARE_BATCH_SIZE, range.m_nCount - i );
+		int nVisible = FadeDetailObjects( range.m_nFirst + i, nBatch, m_vecPrepareViewOrigin, m_flCurMaxSqDist, m_flCurFalloffFactor, visible );
+		for ( int j = 0; j < nVisible; ++j )
 		{
-			if ( sqDist > m_flCurFadeSqDist ) 
-			{
-				model.SetAlpha( m_flCurFalloffFactor * ( m_flCurMaxSqDist - sqDist ) );
-			}
-			else
-			{
-				model.SetAlpha( 255 );
-			}
-			
+			CDetailModel &model = m_DetailObjects[visible[j].m_nIndex];
+
 			// Perform screen alignment if necessary.
-			model.ComputeAngles();
+			model.ComputeAngles( m_vecPrepareAlignOrigin );
+
+#ifdef USE_DETAIL_SHAPES
+			model.UpdatePlayerAvoid( m_PlayerAvoiders );
+#endif
 		}
-		else
+	}
+}
+
+
+#ifdef USE_DETAIL_SHAPES
+//-----------------------------------------------------------------------------
+// Finds the players any detail sprite this view draws could bend away from
+//-----------------------------------------------------------------------------
+void CDetailObjectSystem::GatherPlayerAvoiders( const Vector &vecViewOrigin )
+{
+	DetailPlayerAvoiders_t &avoiders = m_PlayerAvoiders;
+	avoiders.m_nFrame = gpGlobals->framecount;
+	avoiders.m_flForce = cl_detail_avoid_force.GetFloat();
+	avoiders.m_flRadius = cl_detail_avoid_radius.GetFloat();
+	avoiders.m_flRecoverSpeed = cl_detail_avoid_recover_speed.GetFloat();
+	avoiders.m_Origins.RemoveAll();
+
+	if ( avoiders.m_flForce < 0.1 )
+		return;
+
+	float flSearchRadius = sqrt( m_flCurMaxSqDist ) + avoiders.m_flRadius;
+	CPlayerEnumerator avoid( flSearchRadius, vecViewOrigin );
+	::partition->EnumerateElementsInSphere( PARTITION_CLIENT_SOLID_EDICTS, vecViewOrigin, flSearchRadius, false, &avoid );
+
+	C_BasePlayer *pLocalPlayer = C_BasePlayer::GetLocalPlayer();
+	int c = avoid.GetObjectCount();
+	for ( int i = 0; i < c; i++ )
+	{
+		C_BaseEntity *pEnt = avoid.GetObject( i );
+		if ( pEnt && pEnt != pLocalPlayer )
 		{
-			model.SetAlpha( 0 );
+			avoiders.m_Origins.AddToTail( pEnt->GetAbsOrigin() );
 		}
 	}
-	return true;
+
+	// The local player isn't always in the partition
+	if ( pLocalPlayer )
+	{
+		avoiders.m_Origins.AddToTail( pLocalPlayer->GetAbsOrigin() );
+	}
 }
+#endif
 
 
 //-----------------------------------------------------------------------------
@@ -2797,7 +2944,6 @@ void CDetailObjectSystem::BuildDetailObjectRenderLists( const Vector &vViewOrigi
 		return;
 
 	EnumContext_t ctx;
-	ctx.m_vViewOrigin = vViewOrigin;
  	ctx.m_BuildWorldListNumber = view->BuildWorldListsNumber();
 
 	// We need to recompute translucency information for all detail props
@@ -2834,9 +2980,33 @@ void CDetailObjectSystem::BuildDetailObjectRenderLists( const Vector &vViewOrigi
 	m_flCurFadeSqDist = MIN( m_flCurFadeSqDist, m_flCurMaxSqDist -1  );
 	m_flCurFalloffFactor = 255.0f / ( m_flCurMaxSqDist - m_flCurFadeSqDist );
 
+	// Captured here so the job threads don't touch the view state
+	m_vecPrepareViewOrigin = vViewOrigin;
+	m_vecPrepareAlignOrigin = CurrentViewOrigin();
+
+#ifdef USE_DETAIL_SHAPES
+	GatherPlayerAvoiders( CurrentViewOrigin() );
+#endif
+
+	m_PrepareRanges.RemoveAll();
+	m_nPrepareObjectCount = 0;
 
 	ISpatialQuery* pQuery = engine->GetBSPTreeQuery();
 	pQuery->EnumerateLeavesInSphere( CurrentViewOrigin(), 
 									 cl_detaildist.GetFloat(), this, (int)&ctx );
+
+	// Compute the translucency. Need to do it now cause we need to
+	// know that when we're rendering (opaque stuff is rendered first)
+	if ( cl_threaded_detail_props.GetBool() && m_nPrepareObjectCount >= DETAIL_PREPARE_THREAD_MIN )
+	{
+		ParallelProcess( "CDetailObjectSystem::PrepareDetailObjects", m_PrepareRanges.Base(), m_PrepareRanges.Count(), this, &CDetailObjectSystem::PrepareDetailObjects );
+	}
+	else
+	{
+		for ( int i = 0; i < m_PrepareRanges.Count(); ++i )
+		{
+			PrepareDetailObjects( m_PrepareRanges[i] );
+		}
+	}
 }
 
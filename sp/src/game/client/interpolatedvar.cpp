@@ -28,3 +28,12 @@ float g_flLastPacketTimestamp = 0;
 
 ConVar cl_extrapolate_amount( "cl_extrapolate_amount", "0.25", FCVAR_CHEAT, "Set how many seconds the client will extrapolate entities for." );
 
+bool g_bInterpolationBatching = true;
+
+static void InterpolationBatchingChangedCallback( IConVar *pConVar, const char *pOldString, float flOldValue )
+{
+	ConVarRef var( pConVar );
+	g_bInterpolationBatching = var.GetBool();
+}
+
+ConVar cl_interp_batch( "cl_interp_batch", "1", 0, "Share interpolation sample lookups between the vars of an entity and interpolate float arrays with SIMD.", InterpolationBatchingChangedCallback );
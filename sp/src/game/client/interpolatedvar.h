@@ -15,6 +15,7 @@
 #include "lerp_functions.h"
 #include "animationlayer.h"
 #include "convar.h"
+#include "mathlib/ssemath.h"
 
 
 #include "tier0/memdbgon.h"
@@ -122,6 +123,160 @@ private:
 
 extern ConVar cl_extrapolate_amount;
 
+// Set by cl_interp_batch. Shares sample lookups between the vars of an entity
+// and interpolates float arrays four at a time.
+extern bool g_bInterpolationBatching;
+
+
+// -------------------------------------------------------------------------------------------------------------- //
+// CInterpolationBracket - which history samples a var is between at a given time.
+//
+// Vars on an entity that are latched together get the same change times, so
+// C_BaseEntity::Interp_Interpolate has the first var of each latch type do the
+// search and the rest only check that their change times match before reusing it.
+// -------------------------------------------------------------------------------------------------------------- //
+
+#define INTERPOLATION_BRACKET_MAX_TIMES 8
+
+class CInterpolationBracket
+{
+public:
+	enum
+	{
+		HOLD_NEVER = 0,
+		HOLD_ALWAYS,		// past the newest sample
+		HOLD_IF_UNCHANGED,	// holds if the samples being blended are identical
+	};
+
+	CInterpolationBracket()
+	{
+		Invalidate();
+	}
+
+	void Invalidate()
+	{
+		m_nTimes = 0;
+	}
+
+	bool IsValid() const
+	{
+		return m_nTimes > 0;
+	}
+
+	float	m_flTargetTime;
+	int		m_fLinearOnly;
+	bool	m_bFound;
+	bool	m_bHermite;
+	int		m_nHold;
+	int		m_iOldest;
+	int		m_iOlder;
+	int		m_iNewer;
+	float	m_flFrac;
+
+	// The change times the search looked at. If it ran off the end of the
+	// history, the other var has to have exactly as many samples too.
+	bool	m_bEndOfHistory;
+	int		m_nTimes;
+	float	m_flChangeTimes[INTERPOLATION_BRACKET_MAX_TIMES];
+};
+
+
+// -------------------------------------------------------------------------------------------------------------- //
+// SIMD helpers for float arrays (pose parameters, flex weights, bone controllers). These do the
+// same operations in the same order as Lerp and Lerp_Hermite so the results match exactly.
+// Looping elements are left to the scalar code.
+// -------------------------------------------------------------------------------------------------------------- //
+
+template< class T >
+inline bool InterpolatedVar_LerpSIMD( T *out, float frac, const T *start, const T *end, const byte *pLooping, int count )
+{
+	return false;
+}
+
+template<>
+inline bool InterpolatedVar_LerpSIMD( float *out, float frac, const float *start, const float *end, const byte *pLooping, int count )
+{
+	if ( count < 4 || !g_bInterpolationBatching )
+		return false;
+
+	fltx4 fl4Frac = ReplicateX4( frac );
+
+	int i = 0;
+	for ( ; i + 4 <= count; i += 4 )
+	{
+		if ( pLooping[i] | pLooping[i+1] | pLooping[i+2] | pLooping[i+3] )
+		{
+			for ( int j = i; j < i + 4; j++ )
+			{
+				out[j] = pLooping[j] ? LoopingLerp( frac, start[j], end[j] ) : Lerp( frac, start[j], end[j] );
+			}
+			continue;
+		}
+
+		fltx4 fl4Start = LoadUnalignedSIMD( start + i );
+		fltx4 fl4End = LoadUnalignedSIMD( end + i );
+		StoreUnalignedSIMD( out + i, AddSIMD( fl4Start, MulSIMD( SubSIMD( fl4End, fl4Start ), fl4Frac ) ) );
+	}
+
+	for ( ; i < count; i++ )
+	{
+		out[i] = pLooping[i] ? LoopingLerp( frac, start[i], end[i] ) : Lerp( frac, start[i], end[i] );
+	}
+
+	return true;
+}
+
+template< class T >
+inline bool InterpolatedVar_HermiteSIMD( T *out, float frac, const T *prev, const T *start, const T *end, const byte *pLooping, int count )
+{
+	return false;
+}
+
+template<>
+inline bool InterpolatedVar_HermiteSIMD( float *out, float frac, const float *prev, const float *start, const float *end, const byte *pLooping, int count )
+{
+	if ( count < 4 || !g_bInterpolationBatching )
+		return false;
+
+	// The basis weights from Lerp_Hermite
+	float tSqr = frac*frac;
+	float tCube = frac*tSqr;
+	fltx4 fl4Start = ReplicateX4( 2*tCube-3*tSqr+1 );
+	fltx4 fl4End = ReplicateX4( -2*tCube+3*tSqr );
+	fltx4 fl4D1 = ReplicateX4( tCube-2*tSqr+frac );
+	fltx4 fl4D2 = ReplicateX4( tCube-tSqr );
+
+	int i = 0;
+	for ( ; i + 4 <= count; i += 4 )
+	{
+		if ( pLooping[i] | pLooping[i+1] | pLooping[i+2] | pLooping[i+3] )
+		{
+			for ( int j = i; j < i + 4; j++ )
+			{
+				out[j] = pLooping[j] ? LoopingLerp_Hermite( frac, prev[j], start[j], end[j] ) : Lerp_Hermite( frac, prev[j], start[j], end[j] );
+			}
+			continue;
+		}
+
+		fltx4 p0 = LoadUnalignedSIMD( prev + i );
+		fltx4 p1 = LoadUnalignedSIMD( start + i );
+		fltx4 p2 = LoadUnalignedSIMD( end + i );
+
+		fltx4 result = MulSIMD( p1, fl4Start );
+		result = AddSIMD( result, MulSIMD( p2, fl4End ) );
+		result = AddSIMD( result, MulSIMD( SubSIMD( p1, p0 ), fl4D1 ) );
+		result = AddSIMD( result, MulSIMD( SubSIMD( p2, p1 ), fl4D2 ) );
+		StoreUnalignedSIMD( out + i, result );
+	}
+
+	for ( ; i < count; i++ )
+	{
+		out[i] = pLooping[i] ? LoopingLerp_Hermite( frac, prev[i], start[i], end[i] ) : Lerp_Hermite( frac, prev[i], start[i], end[i] );
+	}
+
+	return true;
+}
+
 
 template< class T >
 inline T ExtrapolateInterpolatedVarType( const T &oldVal, const T &newVal, float divisor, float flExtrapolationAmount )
@@ -164,6 +319,10 @@ public:
 	
 	// Returns 1 if the value will always be the same if currentTime is always increasing.
 	virtual int Interpolate( float currentTime ) = 0;
+
+	// Same as above, but reuses the sample search in bracket if it applies to this
+	// var's history, otherwise searches and fills bracket in for the next var.
+	virtual int InterpolateBracketed( float currentTime, CInterpolationBracket &bracket ) = 0;
 	
 	virtual int	 GetType() const = 0;
 	virtual void RestoreToLastNetworked() = 0;
@@ -451,6 +610,7 @@ public:
 	virtual bool NoteChanged( float changetime, bool bUpdateLastNetworkedValue );
 	virtual void Reset();
 	virtual int Interpolate( float currentTime );
+	virtual int InterpolateBracketed( float currentTime, CInterpolationBracket &bracket );
 	virtual int GetType() const;
 	virtual void RestoreToLastNetworked();
 	virtual void Copy( IInterpolatedVar *pInSrc );
@@ -514,6 +674,7 @@ protected:
 		int older;
 		int newer;
 		float frac;
+		int hold;	// CInterpolationBracket::HOLD_ constants
 	};
 
 
@@ -528,6 +689,12 @@ protected:
 		float interpolation_amount,
 		int *pNoMoreChanges );
 
+	// Blends m_pValue from the samples GetInterpolationInfo picked
+	int InterpolateFromInfo( const CInterpolationInfo &info, int noMoreChanges, float currentTime, float interpolation_amount );
+
+	bool MatchesBracket( const CInterpolationBracket &bracket ) const;
+	void FillBracket( CInterpolationBracket &bracket, const CInterpolationInfo &info, bool bFound, float targettime ) const;
+
 	void TimeFixup_Hermite( 
 		CInterpolatedVarEntry &fixup,
 		CInterpolatedVarEntry*& prev, 
@@ -812,6 +979,7 @@ inline bool CInterpolatedVarArrayBase<Type, IS_ARRAY>::GetInterpolationInfo(
 	pInfo->m_bHermite = false;
 	pInfo->frac = 0;
 	pInfo->oldest = pInfo->older = pInfo->newer = varHistory.InvalidIndex();
+	pInfo->hold = CInterpolationBracket::HOLD_NEVER;
 	
 	for ( int i = 0; i < varHistory.Count(); i++ )
 	{
@@ -834,6 +1002,7 @@ inline bool CInterpolatedVarArrayBase<Type, IS_ARRAY>::GetInterpolationInfo(
 
 			// Since the time given is PAST all of our entries, then as long
 			// as time continues to increase, we'll be returning the same value.
+			pInfo->hold = CInterpolationBracket::HOLD_ALWAYS;
 			if ( pNoMoreChanges )
 				*pNoMoreChanges = 1;
 			return true;
@@ -862,13 +1031,14 @@ inline bool CInterpolatedVarArrayBase<Type, IS_ARRAY>::GetInterpolationInfo(
 			// If pInfo->newer is the most recent entry we have, and all 2 or 3 other
 			// entries are identical, then we're always going to return the same value
 			// if currentTime increases.
-			if ( pNoMoreChanges && pInfo->newer == m_VarHistory.Head() )
+			if ( pInfo->newer == m_VarHistory.Head() )
 			{
-				 if ( COMPARE_HISTORY( pInfo->newer, pInfo->older ) )
-				 {
+				pInfo->hold = CInterpolationBracket::HOLD_IF_UNCHANGED;
+				if ( pNoMoreChanges && COMPARE_HISTORY( pInfo->newer, pInfo->older ) )
+				{
 					if ( !pInfo->m_bHermite || COMPARE_HISTORY( pInfo->newer, pInfo->oldest ) )
 						*pNoMoreChanges = 1;
-				 }
+				}
 			}
 		}
 		return true;
@@ -964,6 +1134,105 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::DebugInterpolate( Type *p
 	}
 }
 
+template< typename Type, bool IS_ARRAY >
+inline bool CInterpolatedVarArrayBase<Type, IS_ARRAY>::MatchesBracket( const CInterpolationBracket &bracket ) const
+{
+	const CVarHistory &varHistory = m_VarHistory;
+
+	int nCount = varHistory.Count();
+	if ( bracket.m_bEndOfHistory ? ( nCount != bracket.m_nTimes ) : ( nCount < bracket.m_nTimes ) )
+		return false;
+
+	for ( int i = 0; i < bracket.m_nTimes; i++ )
+	{
+		if ( varHistory[i].changetime != bracket.m_flChangeTimes[i] )
+			return false;
+	}
+
+	return true;
+}
+
+
+template< typename Type, bool IS_ARRAY >
+inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::FillBracket( CInterpolationBracket &bracket, const CInterpolationInfo &info, bool bFound, float targettime ) const
+{
+	const CVarHistory &varHistory = m_VarHistory;
+
+	// The search, the hermite check and extrapolation read as far back as the sample after older
+	int nCount = varHistory.Count();
+	int nTimes = MIN( nCount, MAX( info.older, info.newer ) + 2 );
+	if ( nTimes <= 0 || nTimes > INTERPOLATION_BRACKET_MAX_TIMES )
+	{
+		bracket.Invalidate();
+		return;
+	}
+
+	bracket.m_flTargetTime = targettime;
+	bracket.m_fLinearOnly = ( m_fType & INTERPOLATE_LINEAR_ONLY );
+	bracket.m_bFound = bFound;
+	bracket.m_bHermite = info.m_bHermite;
+	bracket.m_nHold = info.hold;
+	bracket.m_iOldest = info.oldest;
+	bracket.m_iOlder = info.older;
+	bracket.m_iNewer = info.newer;
+	bracket.m_flFrac = info.frac;
+	bracket.m_bEndOfHistory = ( nTimes == nCount );
+	bracket.m_nTimes = nTimes;
+	for ( int i = 0; i < nTimes; i++ )
+	{
+		bracket.m_flChangeTimes[i] = varHistory[i].changetime;
+	}
+}
+
+
+template< typename Type, bool IS_ARRAY >
+inline int CInterpolatedVarArrayBase<Type, IS_ARRAY>::InterpolateBracketed( float currentTime, CInterpolationBracket &bracket )
+{
+	float interpolation_amount = m_InterpolationAmount;
+	float targettime = currentTime - interpolation_amount;
+
+	if ( !bracket.IsValid() ||
+		bracket.m_flTargetTime != targettime ||
+		bracket.m_fLinearOnly != ( m_fType & INTERPOLATE_LINEAR_ONLY ) ||
+		!MatchesBracket( bracket ) )
+	{
+		int noMoreChanges = 0;
+		CInterpolationInfo info;
+		bool bFound = GetInterpolationInfo( &info, currentTime, interpolation_amount, &noMoreChanges );
+		FillBracket( bracket, info, bFound, targettime );
+		if ( !bFound )
+			return noMoreChanges;
+
+		return InterpolateFromInfo( info, noMoreChanges, currentTime, interpolation_amount );
+	}
+
+	if ( !bracket.m_bFound )
+		return 0;
+
+	CInterpolationInfo info;
+	info.m_bHermite = bracket.m_bHermite;
+	info.oldest = bracket.m_iOldest;
+	info.older = bracket.m_iOlder;
+	info.newer = bracket.m_iNewer;
+	info.frac = bracket.m_flFrac;
+	info.hold = bracket.m_nHold;
+
+	// The samples are shared, but whether they're identical depends on this var's values
+	int noMoreChanges = 0;
+	if ( info.hold == CInterpolationBracket::HOLD_ALWAYS )
+	{
+		noMoreChanges = 1;
+	}
+	else if ( info.hold == CInterpolationBracket::HOLD_IF_UNCHANGED && COMPARE_HISTORY( info.newer, info.older ) )
+	{
+		if ( !info.m_bHermite || COMPARE_HISTORY( info.newer, info.oldest ) )
+			noMoreChanges = 1;
+	}
+
+	return InterpolateFromInfo( info, noMoreChanges, currentTime, interpolation_amount );
+}
+
+
 template< typename Type, bool IS_ARRAY >
 inline int CInterpolatedVarArrayBase<Type, IS_ARRAY>::Interpolate( float currentTime, float interpolation_amount )
 {
@@ -973,7 +1242,13 @@ inline int CInterpolatedVarArrayBase<Type, IS_ARRAY>::Interpolate( float current
 	if (!GetInterpolationInfo( &info, currentTime, interpolation_amount, &noMoreChanges ))
 		return noMoreChanges;
 
-	
+	return InterpolateFromInfo( info, noMoreChanges, currentTime, interpolation_amount );
+}
+
+
+template< typename Type, bool IS_ARRAY >
+inline int CInterpolatedVarArrayBase<Type, IS_ARRAY>::InterpolateFromInfo( const CInterpolationInfo &info, int noMoreChanges, float currentTime, float interpolation_amount )
+{
 	CVarHistory &history = m_VarHistory;
 
 	if ( m_bDebug )
@@ -1325,6 +1600,9 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::_Interpolate( Type *out,
 
 	Assert( frac >= 0.0f && frac <= 1.0f );
 
+	if ( InterpolatedVar_LerpSIMD( out, frac, start->GetValue(), end->GetValue(), m_bLooping, m_nMaxCount ) )
+		return;
+
 	// Note that QAngle has a specialization that will do quaternion interpolation here...
 	for ( int i = 0; i < m_nMaxCount; i++ )
 	{
@@ -1437,6 +1715,9 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::_Interpolate_Hermite(
 	fixup.Init(m_nMaxCount);
 	TimeFixup_Hermite( fixup, prev, start, end );
 
+	if ( InterpolatedVar_HermiteSIMD( out, frac, prev->GetValue(), start->GetValue(), end->GetValue(), m_bLooping, m_nMaxCount ) )
+		return;
+
 	for( int i = 0; i < m_nMaxCount; i++ )
 	{
 		// Note that QAngle has a specialization that will do quaternion interpolation here...
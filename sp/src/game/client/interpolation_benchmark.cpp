@@ -0,0 +1,227 @@
+//=============================================================================//
+//
+// Purpose: Times C_BaseEntity::Interp_Interpolate over a set of stand-in
+//			entities with and without cl_interp_batch, and checks that both
+//			give the same values. Doesn't need a map or any rendering.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "c_baseentity.h"
+#include "interpolatedvar.h"
+#include "studio.h"
+#include "tier0/fasttimer.h"
+#include "vstdlib/random.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define INTERP_BENCHMARK_TICK_INTERVAL	0.015f
+#define INTERP_BENCHMARK_FRAME_INTERVAL	( 1.0f / 144.0f )
+#define INTERP_BENCHMARK_AMOUNT			0.1f
+
+//-----------------------------------------------------------------------------
+// Purpose: The interpolated vars of a typical animating, flexing NPC
+//-----------------------------------------------------------------------------
+class CInterpBenchmarkEntity
+{
+public:
+	CInterpBenchmarkEntity();
+
+	void	Latch( float flChangeTime, CUniformRandomStream &random );
+	int		Interpolate( float flCurrentTime );
+	float	MaxDifference( const CInterpBenchmarkEntity &other ) const;
+
+private:
+	void	AddVar( void *pData, IInterpolatedVar *pWatcher, int type );
+
+	Vector	m_vecOrigin;
+	QAngle	m_angRotation;
+	float	m_flCycle;
+	float	m_flPoseParameter[MAXSTUDIOPOSEPARAM];
+	float	m_flexWeight[MAXSTUDIOFLEXCTRL];
+
+	CInterpolatedVar< Vector >							m_iv_vecOrigin;
+	CInterpolatedVar< QAngle >							m_iv_angRotation;
+	CInterpolatedVar< float >							m_iv_flCycle;
+	CInterpolatedVarArray< float, MAXSTUDIOPOSEPARAM >	m_iv_flPoseParameter;
+	CInterpolatedVarArray< float, MAXSTUDIOFLEXCTRL >	m_iv_flexWeight;
+
+	VarMapping_t	m_VarMap;
+};
+
+CInterpBenchmarkEntity::CInterpBenchmarkEntity() :
+	m_iv_vecOrigin( "m_iv_vecOrigin" ),
+	m_iv_angRotation( "m_iv_angRotation" ),
+	m_iv_flCycle( "m_iv_flCycle" ),
+	m_iv_flPoseParameter( "m_iv_flPoseParameter" ),
+	m_iv_flexWeight( "m_iv_flexWeight" )
+{
+	m_vecOrigin.Init();
+	m_angRotation.Init();
+	m_flCycle = 0.0f;
+	memset( m_flPoseParameter, 0, sizeof( m_flPoseParameter ) );
+	memset( m_flexWeight, 0, sizeof( m_flexWeight ) );
+
+	m_VarMap.m_lastInterpolationTime = 0.0f;
+
+	AddVar( &m_vecOrigin, &m_iv_vecOrigin, LATCH_SIMULATION_VAR );
+	AddVar( &m_angRotation, &m_iv_angRotation, LATCH_SIMULATION_VAR );
+	AddVar( &m_flCycle, &m_iv_flCycle, LATCH_ANIMATION_VAR );
+	AddVar( m_flPoseParameter, &m_iv_flPoseParameter, LATCH_ANIMATION_VAR );
+	AddVar( m_flexWeight, &m_iv_flexWeight, LATCH_ANIMATION_VAR );
+
+	m_iv_flCycle.SetLooping( true );
+}
+
+void CInterpBenchmarkEntity::AddVar( void *pData, IInterpolatedVar *pWatcher, int type )
+{
+	VarMapEntry_t entry;
+	entry.data = pData;
+	entry.watcher = pWatcher;
+	entry.type = type;
+	entry.m_bNeedsToInterpolate = true;
+	m_VarMap.m_Entries.AddToTail( entry );
+	m_VarMap.m_nInterpolatedEntries++;
+
+	pWatcher->Setup( pData, type );
+	pWatcher->SetInterpolationAmount( INTERP_BENCHMARK_AMOUNT );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: A network update. Flex weights mostly sit still, like they do in game.
+//-----------------------------------------------------------------------------
+void CInterpBenchmarkEntity::Latch( float flChangeTime, CUniformRandomStream &random )
+{
+	m_vecOrigin += Vector( random.RandomFloat( -4.0f, 4.0f ), random.RandomFloat( -4.0f, 4.0f ), 0.0f );
+	m_angRotation.y = AngleNormalize( m_angRotation.y + random.RandomFloat( -5.0f, 5.0f ) );
+	m_flCycle = fmodf( m_flCycle + 0.05f, 1.0f );
+
+	for ( int i = 0; i < MAXSTUDIOPOSEPARAM; i++ )
+	{
+		m_flPoseParameter[i] = clamp( m_flPoseParameter[i] + random.RandomFloat( -0.05f, 0.05f ), 0.0f, 1.0f );
+	}
+
+	for ( int i = 0; i < MAXSTUDIOFLEXCTRL / 4; i++ )
+	{
+		m_flexWeight[i] = random.RandomFloat( 0.0f, 1.0f );
+	}
+
+	for ( int i = 0; i < m_VarMap.m_Entries.Count(); i++ )
+	{
+		VarMapEntry_t *e = &m_VarMap.m_Entries[i];
+		if ( e->watcher->NoteChanged( flChangeTime, false ) )
+		{
+			e->m_bNeedsToInterpolate = true;
+		}
+	}
+}
+
+int CInterpBenchmarkEntity::Interpolate( float flCurrentTime )
+{
+	return C_BaseEntity::Interp_Interpolate( &m_VarMap, flCurrentTime );
+}
+
+float CInterpBenchmarkEntity::MaxDifference( const CInterpBenchmarkEntity &other ) const
+{
+	float flMax = 0.0f;
+	for ( int i = 0; i < 3; i++ )
+	{
+		flMax = MAX( flMax, fabs( m_vecOrigin[i] - other.m_vecOrigin[i] ) );
+		flMax = MAX( flMax, fabs( m_angRotation[i] - other.m_angRotation[i] ) );
+	}
+
+	flMax = MAX( flMax, fabs( m_flCycle - other.m_flCycle ) );
+
+	for ( int i = 0; i < MAXSTUDIOPOSEPARAM; i++ )
+	{
+		flMax = MAX( flMax, fabs( m_flPoseParameter[i] - other.m_flPoseParameter[i] ) );
+	}
+
+	for ( int i = 0; i < MAXSTUDIOFLEXCTRL; i++ )
+	{
+		flMax = MAX( flMax, fabs( m_flexWeight[i] - other.m_flexWeight[i] ) );
+	}
+
+	return flMax;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Runs two identical sets of entities side by side, one with each path
+//-----------------------------------------------------------------------------
+static void InterpBenchmark_Run( int nEntities, int nFrames )
+{
+	CInterpBenchmarkEntity *pScalar = new CInterpBenchmarkEntity[nEntities];
+	CInterpBenchmarkEntity *pBatched = new CInterpBenchmarkEntity[nEntities];
+
+	// Same updates every run so results can be compared between builds
+	CUniformRandomStream scalarRandom, batchedRandom;
+	scalarRandom.SetSeed( 0 );
+	batchedRandom.SetSeed( 0 );
+
+	bool bOldBatching = g_bInterpolationBatching;
+
+	CCycleCount scalarTime, batchedTime;
+	float flMaxError = 0.0f;
+	float flBaseTime = gpGlobals->curtime;
+	float flNextTick = flBaseTime;
+
+	for ( int iFrame = 0; iFrame < nFrames; iFrame++ )
+	{
+		float flFrameTime = flBaseTime + iFrame * INTERP_BENCHMARK_FRAME_INTERVAL;
+		while ( flNextTick <= flFrameTime )
+		{
+			for ( int i = 0; i < nEntities; i++ )
+			{
+				pScalar[i].Latch( flNextTick, scalarRandom );
+				pBatched[i].Latch( flNextTick, batchedRandom );
+			}
+			flNextTick += INTERP_BENCHMARK_TICK_INTERVAL;
+		}
+
+		CFastTimer timer;
+
+		g_bInterpolationBatching = false;
+		timer.Start();
+		for ( int i = 0; i < nEntities; i++ )
+		{
+			pScalar[i].Interpolate( flFrameTime );
+		}
+		timer.End();
+		scalarTime += timer.GetDuration();
+
+		g_bInterpolationBatching = true;
+		timer.Start();
+		for ( int i = 0; i < nEntities; i++ )
+		{
+			pBatched[i].Interpolate( flFrameTime );
+		}
+		timer.End();
+		batchedTime += timer.GetDuration();
+
+		for ( int i = 0; i < nEntities; i++ )
+		{
+			flMaxError = MAX( flMaxError, pScalar[i].MaxDifference( pBatched[i] ) );
+		}
+	}
+
+	g_bInterpolationBatching = bOldBatching;
+
+	double flScalarUS = scalarTime.GetMicrosecondsF() / nFrames;
+	double flBatchedUS = batchedTime.GetMicrosecondsF() / nFrames;
+
+	Msg( "%d entities, %d frames: unbatched %.2fus, batched %.2fus per frame (%.2fx), max error %g%s\n",
+		nEntities, nFrames, flScalarUS, flBatchedUS, flBatchedUS > 0.0 ? flScalarUS / flBatchedUS : 0.0,
+		flMaxError, ( flMaxError > 1e-4f ) ? " MISMATCH" : "" );
+
+	delete [] pScalar;
+	delete [] pBatched;
+}
+
+CON_COMMAND( cl_interp_benchmark, "Compare interpolation with and without cl_interp_batch. Usage: cl_interp_benchmark [entities] [frames]" )
+{
+	int nEntities = ( args.ArgC() > 1 ) ? MAX( atoi( args[1] ), 1 ) : 500;
+	int nFrames = ( args.ArgC() > 2 ) ? MAX( atoi( args[2] ), 1 ) : 1000;
+
+	InterpBenchmark_Run( nEntities, nFrames );
+}
@@ -0,0 +1,283 @@
+//=============================================================================//
+//
+// Purpose: Times ParallelProcess handing out items one at a time off a shared
+//			counter, the way it used to, against the range stealing it does
+//			now, and the cost of a task on CJobStealingScheduler, on private
+//			pools of 1 to 64 threads. CPU only, doesn't need a map.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "vstdlib/jobthread.h"
+#include "vstdlib/jobstealing.h"
+#include "tier0/fasttimer.h"
+#include "vstdlib/random.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+struct JobStealingBenchmarkItem_t
+{
+	int		m_nWork;
+	uint32	m_nResult;
+};
+
+static void JobStealingBenchmark_Process( JobStealingBenchmarkItem_t &item )
+{
+	uint32 nHash = (uint32)item.m_nWork;
+	for ( int i = 0; i < item.m_nWork; i++ )
+	{
+		nHash = nHash * 1664525 + 1013904223;
+	}
+	item.m_nResult = nHash;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: The old ParallelProcess, for comparison. Every item is an
+//			interlocked increment on the same counter.
+//-----------------------------------------------------------------------------
+class CJobStealingBenchmarkCentral
+{
+public:
+	void Run( JobStealingBenchmarkItem_t *pItems, int nItems, int nMaxParallel, IThreadPool *pThreadPool )
+	{
+		m_pItems = pItems;
+		m_pLimit = pItems + nItems;
+
+		int nJobs = MIN( MIN( nItems - 1, nMaxParallel ), pThreadPool->NumThreads() );
+		if ( nJobs < 1 )
+		{
+			DoExecute();
+			return;
+		}
+
+		CJob **jobs = (CJob **)stackalloc( nJobs * sizeof( CJob * ) );
+		for ( int i = 0; i < nJobs; i++ )
+		{
+			jobs[i] = pThreadPool->QueueCall( this, &CJobStealingBenchmarkCentral::DoExecute );
+		}
+
+		DoExecute();
+
+		for ( int i = 0; i < nJobs; i++ )
+		{
+			jobs[i]->Abort();
+			jobs[i]->Release();
+		}
+	}
+
+private:
+	void DoExecute()
+	{
+		for (;;)
+		{
+			JobStealingBenchmarkItem_t *pCurrent = m_pItems++;
+			if ( pCurrent >= m_pLimit )
+				break;
+
+			JobStealingBenchmark_Process( *pCurrent );
+		}
+	}
+
+	CInterlockedPtr<JobStealingBenchmarkItem_t>	m_pItems;
+	JobStealingBenchmarkItem_t					*m_pLimit;
+};
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Splits its range in half, spawning the back half, until it's down
+//			to a single item. Tasks come out of a preallocated array so only
+//			scheduling is timed.
+//-----------------------------------------------------------------------------
+class CJobStealingBenchmarkTask : public CJobStealingTask
+{
+public:
+	virtual void Execute( CJobStealingWorker *pWorker )
+	{
+		while ( m_nCount > 1 )
+		{
+			int nHalf = m_nCount / 2;
+			CJobStealingBenchmarkTask *pChild = &m_pTasks[++( *m_pnNextTask ) - 1];
+			pChild->m_pItems = m_pItems + nHalf;
+			pChild->m_nCount = m_nCount - nHalf;
+			pChild->m_pTasks = m_pTasks;
+			pChild->m_pnNextTask = m_pnNextTask;
+			pWorker->Spawn( pChild );
+
+			m_nCount = nHalf;
+		}
+
+		if ( m_nCount )
+		{
+			JobStealingBenchmark_Process( *m_pItems );
+		}
+	}
+
+	JobStealingBenchmarkItem_t	*m_pItems;
+	int							m_nCount;
+	CJobStealingBenchmarkTask	*m_pTasks;
+	CInterlockedInt				*m_pnNextTask;
+};
+
+static void JobStealingBenchmark_RunTasks( CJobStealingScheduler &scheduler, JobStealingBenchmarkItem_t *pItems, int nItems, int nMaxParallel, CUtlVector<CJobStealingBenchmarkTask> &tasks )
+{
+	CInterlockedInt nNextTask = 1;
+	CJobStealingBenchmarkTask &root = tasks[0];
+	root.m_pItems = pItems;
+	root.m_nCount = nItems;
+	root.m_pTasks = tasks.Base();
+	root.m_pnNextTask = &nNextTask;
+	scheduler.Run( &root, nMaxParallel );
+}
+
+// Results start out as something no item produces, so a skipped item shows up
+static void JobStealingBenchmark_Reset( JobStealingBenchmarkItem_t *pItems, const int *pWork, int nItems )
+{
+	for ( int i = 0; i < nItems; i++ )
+	{
+		pItems[i].m_nWork = pWork[i];
+		pItems[i].m_nResult = 0xffffffff;
+	}
+}
+
+static bool JobStealingBenchmark_Check( const JobStealingBenchmarkItem_t *pItems, const uint32 *pExpected, int nItems )
+{
+	for ( int i = 0; i < nItems; i++ )
+	{
+		if ( pItems[i].m_nResult != pExpected[i] )
+			return false;
+	}
+	return true;
+}
+
+static void JobStealingBenchmark_Run( int nThreads, int nItems, int nPasses, const int *pWork, const int *pNoWork, const uint32 *pExpected, const uint32 *pExpectedEmpty,
+	double *pflBaseline )
+{
+	// The calling thread takes part too
+	IThreadPool *pThreadPool = CreateThreadPool();
+	ThreadPoolStartParams_t startParams( false, MAX( nThreads - 1, 1 ) );
+	pThreadPool->Start( startParams );
+	int nMaxParallel = nThreads - 1;
+
+	CUtlVector<JobStealingBenchmarkItem_t> items;
+	items.SetCount( nItems );
+	CUtlVector<CJobStealingBenchmarkTask> tasks;
+	tasks.SetCount( nItems );
+
+	CJobStealingBenchmarkCentral central;
+	CParallelProcessor<JobStealingBenchmarkItem_t, CFuncJobItemProcessor<JobStealingBenchmarkItem_t> > stealing( "JobStealingBenchmark" );
+	stealing.m_ItemProcessor.Init( &JobStealingBenchmark_Process, NULL, NULL );
+	CJobStealingScheduler scheduler( pThreadPool, "JobStealingBenchmark" );
+
+	CFastTimer timer;
+	CCycleCount centralTime, stealingTime, taskTime;
+	CCycleCount centralEmptyTime, stealingEmptyTime, taskEmptyTime;
+	bool bMismatch = false;
+
+	for ( int iPass = 0; iPass < nPasses; iPass++ )
+	{
+		JobStealingBenchmark_Reset( items.Base(), pWork, nItems );
+		timer.Start();
+		central.Run( items.Base(), nItems, nMaxParallel, pThreadPool );
+		timer.End();
+		centralTime += timer.GetDuration();
+		bMismatch |= !JobStealingBenchmark_Check( items.Base(), pExpected, nItems );
+
+		JobStealingBenchmark_Reset( items.Base(), pWork, nItems );
+		timer.Start();
+		stealing.Run( items.Base(), nItems, nMaxParallel, pThreadPool );
+		timer.End();
+		stealingTime += timer.GetDuration();
+		bMismatch |= !JobStealingBenchmark_Check( items.Base(), pExpected, nItems );
+
+		JobStealingBenchmark_Reset( items.Base(), pWork, nItems );
+		timer.Start();
+		JobStealingBenchmark_RunTasks( scheduler, items.Base(), nItems, nMaxParallel, tasks );
+		timer.End();
+		taskTime += timer.GetDuration();
+		bMismatch |= !JobStealingBenchmark_Check( items.Base(), pExpected, nItems );
+
+		// Same again with nothing to do per item, which is all scheduling
+		JobStealingBenchmark_Reset( items.Base(), pNoWork, nItems );
+		timer.Start();
+		central.Run( items.Base(), nItems, nMaxParallel, pThreadPool );
+		timer.End();
+		centralEmptyTime += timer.GetDuration();
+		bMismatch |= !JobStealingBenchmark_Check( items.Base(), pExpectedEmpty, nItems );
+
+		JobStealingBenchmark_Reset( items.Base(), pNoWork, nItems );
+		timer.Start();
+		stealing.Run( items.Base(), nItems, nMaxParallel, pThreadPool );
+		timer.End();
+		stealingEmptyTime += timer.GetDuration();
+		bMismatch |= !JobStealingBenchmark_Check( items.Base(), pExpectedEmpty, nItems );
+
+		JobStealingBenchmark_Reset( items.Base(), pNoWork, nItems );
+		timer.Start();
+		JobStealingBenchmark_RunTasks( scheduler, items.Base(), nItems, nMaxParallel, tasks );
+		timer.End();
+		taskEmptyTime += timer.GetDuration();
+		bMismatch |= !JobStealingBenchmark_Check( items.Base(), pExpectedEmpty, nItems );
+	}
+
+	pThreadPool->Stop();
+	DestroyThreadPool( pThreadPool );
+
+	double flCentralUS = centralTime.GetMicrosecondsF() / nPasses;
+	double flStealingUS = stealingTime.GetMicrosecondsF() / nPasses;
+	double flTaskUS = taskTime.GetMicrosecondsF() / nPasses;
+	if ( nThreads == 1 )
+	{
+		*pflBaseline = flStealingUS;
+	}
+
+	// Nanoseconds of scheduling per item with no work in it
+	double flItemsNS = 1000.0 / ( (double)nItems * nPasses );
+	Msg( "  %2d threads: central %.0fus, stealing %.0fus (%.2fx, scaling %.2fx), tasks %.0fus; overhead per item central %.1fns, stealing %.1fns, tasks %.1fns%s\n",
+		nThreads, flCentralUS, flStealingUS, flStealingUS > 0.0 ? flCentralUS / flStealingUS : 0.0, flStealingUS > 0.0 ? *pflBaseline / flStealingUS : 0.0, flTaskUS,
+		centralEmptyTime.GetMicrosecondsF() * flItemsNS, stealingEmptyTime.GetMicrosecondsF() * flItemsNS, taskEmptyTime.GetMicrosecondsF() * flItemsNS,
+		bMismatch ? " MISMATCH" : "" );
+}
+
+CON_COMMAND( cl_job_stealing_benchmark, "Time parallel processing on pools of 1 to 64 threads. Usage: cl_job_stealing_benchmark [items] [passes]" )
+{
+	int nItems = ( args.ArgC() > 1 ) ? clamp( atoi( args[1] ), 1, 1000000 ) : 10000;
+	int nPasses = ( args.ArgC() > 2 ) ? MAX( atoi( args[2] ), 1 ) : 20;
+
+	// Same work every run so results can be compared between builds
+	CUniformRandomStream random;
+	random.SetSeed( 0 );
+
+	CUtlVector<int> work, noWork;
+	CUtlVector<uint32> expected, expectedEmpty;
+	work.SetCount( nItems );
+	noWork.SetCount( nItems );
+	expected.SetCount( nItems );
+	expectedEmpty.SetCount( nItems );
+	for ( int i = 0; i < nItems; i++ )
+	{
+		// Mostly cheap items with the odd expensive one, like bone setup with
+		// a few characters on screen
+		work[i] = ( random.RandomInt( 0, 31 ) == 0 ) ? random.RandomInt( 5000, 20000 ) : random.RandomInt( 50, 500 );
+		noWork[i] = 0;
+
+		JobStealingBenchmarkItem_t item;
+		item.m_nWork = work[i];
+		JobStealingBenchmark_Process( item );
+		expected[i] = item.m_nResult;
+
+		item.m_nWork = 0;
+		JobStealingBenchmark_Process( item );
+		expectedEmpty[i] = item.m_nResult;
+	}
+
+	Msg( "%d items, %d passes, time per pass:\n", nItems, nPasses );
+
+	double flBaseline = 0.0;
+	static const int s_nThreads[] = { 1, 2, 4, 8, 16, 32, 64 };
+	for ( int i = 0; i < ARRAYSIZE( s_nThreads ); i++ )
+	{
+		JobStealingBenchmark_Run( s_nThreads[i], nItems, nPasses, work.Base(), noWork.Base(), expected.Base(), expectedEmpty.Base(), &flBaseline );
+	}
+}
@@ -0,0 +1,328 @@
+//=============================================================================//
+//
+// Purpose: Runs CJobTaskGraph chains with a continuation at the end, over and
+//			over without rebuilding the graph, with the links working in
+//			CJobScratchAllocator memory that's reset between passes, and
+//			CJobTaskGroup fork-join, on private pools of 1 to 64 threads.
+//			Results are checked against a serial run. CPU only, doesn't need
+//			a map.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "vstdlib/jobtasks.h"
+#include "tier0/fasttimer.h"
+#include "vstdlib/random.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// Small enough that the expensive links need blocks of their own
+#define JOB_TASKS_BENCHMARK_SCRATCH_BLOCK_SIZE	4096
+
+static uint32 JobTasksBenchmark_Hash( uint32 nHash, int nWork )
+{
+	for ( int i = 0; i < nWork; i++ )
+	{
+		nHash = nHash * 1664525 + 1013904223;
+	}
+	return nHash;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: One step of a chain. Writes its work out to pScratch and folds it
+//			back in, so running a step out of order, or another thread writing
+//			over the scratch memory, changes the result.
+//-----------------------------------------------------------------------------
+static uint32 JobTasksBenchmark_Step( uint32 nChain, int iStep, int nWork, uint32 *pScratch )
+{
+	uint32 nHash = nChain ^ (uint32)iStep;
+	for ( int i = 0; i < nWork; i++ )
+	{
+		nHash = nHash * 1664525 + 1013904223;
+		pScratch[i] = nHash;
+	}
+
+	uint32 nResult = nChain;
+	for ( int i = 0; i < nWork; i++ )
+	{
+		nResult = nResult * 31 + pScratch[i];
+	}
+	return nResult;
+}
+
+static uint32 JobTasksBenchmark_Combine( const uint32 *pChains, int nChains )
+{
+	uint32 nTotal = 0;
+	for ( int i = 0; i < nChains; i++ )
+	{
+		nTotal = nTotal * 31 + pChains[i];
+	}
+	return nTotal;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: A link in a chain of the graph
+//-----------------------------------------------------------------------------
+class CJobTasksBenchmarkLink : public CJobStealingTask
+{
+public:
+	virtual void Execute( CJobStealingWorker *pWorker )
+	{
+		uint32 *pScratch = m_pScratch->Alloc<uint32>( MAX( m_nWork, 1 ) );
+		*m_pnChain = JobTasksBenchmark_Step( *m_pnChain, m_iStep, m_nWork, pScratch );
+	}
+
+	uint32					*m_pnChain;
+	int						m_iStep;
+	int						m_nWork;
+	CJobScratchAllocator	*m_pScratch;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: The continuation, which has to see every chain finished
+//-----------------------------------------------------------------------------
+class CJobTasksBenchmarkTotal : public CJobStealingTask
+{
+public:
+	virtual void Execute( CJobStealingWorker *pWorker )
+	{
+		*m_pnTotal = JobTasksBenchmark_Combine( m_pChains, m_nChains );
+	}
+
+	const uint32	*m_pChains;
+	int				m_nChains;
+	uint32			*m_pnTotal;
+};
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Splits its range in half, spawning the back half into a group of
+//			its own, until it's down to a single item, then waits on the group.
+//			Tasks come out of a preallocated array so only scheduling is timed.
+//-----------------------------------------------------------------------------
+class CJobTasksBenchmarkSplit;
+
+struct JobTasksBenchmarkSplitContext_t
+{
+	const int				*m_pWork;
+	uint32					*m_pResults;
+	CJobTasksBenchmarkSplit	*m_pTasks;
+	CInterlockedInt			m_nNextTask;
+};
+
+static void JobTasksBenchmark_Split( CJobStealingWorker *pWorker, JobTasksBenchmarkSplitContext_t *pContext, int iFirst, int nCount );
+
+class CJobTasksBenchmarkSplit : public CJobGroupTask
+{
+public:
+	virtual void Run( CJobStealingWorker *pWorker )
+	{
+		JobTasksBenchmark_Split( pWorker, m_pContext, m_iFirst, m_nCount );
+	}
+
+	JobTasksBenchmarkSplitContext_t	*m_pContext;
+	int								m_iFirst;
+	int								m_nCount;
+};
+
+static void JobTasksBenchmark_Split( CJobStealingWorker *pWorker, JobTasksBenchmarkSplitContext_t *pContext, int iFirst, int nCount )
+{
+	CJobTaskGroup group;
+	while ( nCount > 1 )
+	{
+		int nHalf = nCount / 2;
+		CJobTasksBenchmarkSplit *pChild = &pContext->m_pTasks[++pContext->m_nNextTask - 1];
+		pChild->m_pContext = pContext;
+		pChild->m_iFirst = iFirst + nHalf;
+		pChild->m_nCount = nCount - nHalf;
+		group.Spawn( pWorker, pChild );
+
+		nCount = nHalf;
+	}
+
+	if ( nCount )
+	{
+		pContext->m_pResults[iFirst] = JobTasksBenchmark_Hash( (uint32)iFirst, pContext->m_pWork[iFirst] );
+	}
+
+	group.Wait( pWorker );
+}
+
+class CJobTasksBenchmarkSplitRoot : public CJobStealingTask
+{
+public:
+	virtual void Execute( CJobStealingWorker *pWorker )
+	{
+		JobTasksBenchmark_Split( pWorker, m_pContext, 0, m_nCount );
+	}
+
+	JobTasksBenchmarkSplitContext_t	*m_pContext;
+	int								m_nCount;
+};
+
+
+// Results start out as something no run produces, so a skipped task shows up
+static void JobTasksBenchmark_Reset( uint32 *pValues, int nValues )
+{
+	for ( int i = 0; i < nValues; i++ )
+	{
+		pValues[i] = 0xffffffff;
+	}
+}
+
+static bool JobTasksBenchmark_Check( const uint32 *pValues, const uint32 *pExpected, int nValues )
+{
+	for ( int i = 0; i < nValues; i++ )
+	{
+		if ( pValues[i] != pExpected[i] )
+			return false;
+	}
+	return true;
+}
+
+static void JobTasksBenchmark_Run( int nThreads, int nChains, int nLength, int nPasses, const int *pWork, const uint32 *pExpectedChains, uint32 nExpectedTotal,
+	const uint32 *pExpectedItems, double *pflGraphBaseline, double *pflGroupBaseline )
+{
+	// The calling thread takes part too
+	IThreadPool *pThreadPool = CreateThreadPool();
+	ThreadPoolStartParams_t startParams( false, MAX( nThreads - 1, 1 ) );
+	pThreadPool->Start( startParams );
+	int nMaxParallel = nThreads - 1;
+	int nItems = nChains * nLength;
+
+	CJobScratchAllocator scratch( JOB_TASKS_BENCHMARK_SCRATCH_BLOCK_SIZE );
+
+	CUtlVector<uint32> chains;
+	chains.SetCount( nChains );
+	uint32 nTotal;
+
+	// Built once and run every pass
+	CUtlVector<CJobTasksBenchmarkLink> links;
+	links.SetCount( nItems );
+	CJobTasksBenchmarkTotal total;
+	CJobTaskGraph graph( "JobTasksBenchmark", pThreadPool );
+	for ( int iChain = 0; iChain < nChains; iChain++ )
+	{
+		JobTaskHandle_t hPrevious = JOB_TASK_HANDLE_INVALID;
+		for ( int iStep = 0; iStep < nLength; iStep++ )
+		{
+			CJobTasksBenchmarkLink &link = links[iChain * nLength + iStep];
+			link.m_pnChain = &chains[iChain];
+			link.m_iStep = iStep;
+			link.m_nWork = pWork[iChain * nLength + iStep];
+			link.m_pScratch = &scratch;
+			hPrevious = graph.AddTask( &link, hPrevious );
+		}
+	}
+	total.m_pChains = chains.Base();
+	total.m_nChains = nChains;
+	total.m_pnTotal = &nTotal;
+	graph.AddContinuation( &total );
+
+	CUtlVector<uint32> items;
+	items.SetCount( nItems );
+	CUtlVector<CJobTasksBenchmarkSplit> splits;
+	splits.SetCount( nItems );
+	JobTasksBenchmarkSplitContext_t context;
+	context.m_pWork = pWork;
+	context.m_pResults = items.Base();
+	context.m_pTasks = splits.Base();
+	CJobTasksBenchmarkSplitRoot root;
+	root.m_pContext = &context;
+	root.m_nCount = nItems;
+	CJobStealingScheduler scheduler( pThreadPool, "JobTasksBenchmark" );
+
+	CFastTimer timer;
+	CCycleCount graphTime, groupTime;
+	bool bMismatch = false;
+
+	for ( int iPass = 0; iPass < nPasses; iPass++ )
+	{
+		for ( int i = 0; i < nChains; i++ )
+		{
+			chains[i] = (uint32)i;
+		}
+		nTotal = 0xffffffff;
+
+		timer.Start();
+		graph.Run( nMaxParallel );
+		scratch.Reset();
+		timer.End();
+		graphTime += timer.GetDuration();
+		bMismatch |= !JobTasksBenchmark_Check( chains.Base(), pExpectedChains, nChains ) || nTotal != nExpectedTotal;
+
+		JobTasksBenchmark_Reset( items.Base(), nItems );
+		context.m_nNextTask = 0;
+		timer.Start();
+		scheduler.Run( &root, nMaxParallel );
+		timer.End();
+		groupTime += timer.GetDuration();
+		bMismatch |= !JobTasksBenchmark_Check( items.Base(), pExpectedItems, nItems );
+	}
+
+	pThreadPool->Stop();
+	DestroyThreadPool( pThreadPool );
+
+	double flGraphUS = graphTime.GetMicrosecondsF() / nPasses;
+	double flGroupUS = groupTime.GetMicrosecondsF() / nPasses;
+	if ( nThreads == 1 )
+	{
+		*pflGraphBaseline = flGraphUS;
+		*pflGroupBaseline = flGroupUS;
+	}
+
+	Msg( "  %2d threads: graph %.0fus (scaling %.2fx), group %.0fus (scaling %.2fx)%s\n",
+		nThreads, flGraphUS, flGraphUS > 0.0 ? *pflGraphBaseline / flGraphUS : 0.0, flGroupUS, flGroupUS > 0.0 ? *pflGroupBaseline / flGroupUS : 0.0,
+		bMismatch ? " MISMATCH" : "" );
+}
+
+CON_COMMAND( cl_job_tasks_benchmark, "Time task graphs and groups on pools of 1 to 64 threads. Usage: cl_job_tasks_benchmark [chains] [length] [passes]" )
+{
+	int nChains = ( args.ArgC() > 1 ) ? clamp( atoi( args[1] ), 1, 1000 ) : 64;
+	int nLength = ( args.ArgC() > 2 ) ? clamp( atoi( args[2] ), 1, 1000 ) : 32;
+	int nPasses = ( args.ArgC() > 3 ) ? MAX( atoi( args[3] ), 1 ) : 20;
+	int nItems = nChains * nLength;
+
+	// Same work every run so results can be compared between builds
+	CUniformRandomStream random;
+	random.SetSeed( 0 );
+
+	CUtlVector<int> work;
+	CUtlVector<uint32> expectedItems;
+	work.SetCount( nItems );
+	expectedItems.SetCount( nItems );
+	int nMaxWork = 1;
+	for ( int i = 0; i < nItems; i++ )
+	{
+		// Mostly cheap links with the odd expensive one
+		work[i] = ( random.RandomInt( 0, 31 ) == 0 ) ? random.RandomInt( 2000, 8000 ) : random.RandomInt( 50, 500 );
+		nMaxWork = MAX( nMaxWork, work[i] );
+		expectedItems[i] = JobTasksBenchmark_Hash( (uint32)i, work[i] );
+	}
+
+	CUtlVector<uint32> expectedChains, scratch;
+	expectedChains.SetCount( nChains );
+	scratch.SetCount( nMaxWork );
+	for ( int iChain = 0; iChain < nChains; iChain++ )
+	{
+		uint32 nChain = (uint32)iChain;
+		for ( int iStep = 0; iStep < nLength; iStep++ )
+		{
+			nChain = JobTasksBenchmark_Step( nChain, iStep, work[iChain * nLength + iStep], scratch.Base() );
+		}
+		expectedChains[iChain] = nChain;
+	}
+	uint32 nExpectedTotal = JobTasksBenchmark_Combine( expectedChains.Base(), nChains );
+
+	Msg( "%d chains of %d tasks, %d passes, time per pass:\n", nChains, nLength, nPasses );
+
+	double flGraphBaseline = 0.0, flGroupBaseline = 0.0;
+	static const int s_nThreads[] = { 1, 2, 4, 8, 16, 32, 64 };
+	for ( int i = 0; i < ARRAYSIZE( s_nThreads ); i++ )
+	{
+		JobTasksBenchmark_Run( s_nThreads[i], nChains, nLength, nPasses, work.Base(), expectedChains.Base(), nExpectedTotal, expectedItems.Base(),
+			&flGraphBaseline, &flGroupBaseline );
+	}
+}
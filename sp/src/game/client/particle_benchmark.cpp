@@ -0,0 +1,170 @@
+//=============================================================================//
+//
+// Purpose: Spawns a field of CSimpleEmitter explosions and times allocating
+//			and simulating them with the heap or per-effect pools, serially or
+//			on the job threads. Run it on a loaded map.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "particles_simple.h"
+#include "tier0/fasttimer.h"
+#include "vstdlib/random.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define PARTICLE_BENCHMARK_FRAME_INTERVAL	( 1.0f / 60.0f )
+
+extern bool g_cl_particle_pool;
+
+enum ParticleBenchmarkMode_t
+{
+	PARTICLE_BENCHMARK_HEAP_SERIAL = 0,
+	PARTICLE_BENCHMARK_POOL_SERIAL,
+	PARTICLE_BENCHMARK_POOL_PARALLEL,
+
+	PARTICLE_BENCHMARK_MODE_COUNT
+};
+
+static const char *s_pszParticleBenchmarkModes[PARTICLE_BENCHMARK_MODE_COUNT] =
+{
+	"heap, serial",
+	"pool, serial",
+	"pool, parallel",
+};
+
+struct ParticleBenchmarkResult_t
+{
+	CCycleCount	m_SpawnTime;
+	CCycleCount	m_SimulateTime;
+	int			m_nSpawned;
+	int			m_nAlive;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: A fireball and debris burst, roughly what the explosion effects make
+//-----------------------------------------------------------------------------
+static void ParticleBenchmark_Explode( CSimpleEmitter *pEmitter, PMaterialHandle hMaterial, int nParticles, CUniformRandomStream &random, ParticleBenchmarkResult_t &result )
+{
+	Vector vecOrigin( random.RandomFloat( -2048.0f, 2048.0f ), random.RandomFloat( -2048.0f, 2048.0f ), random.RandomFloat( 0.0f, 512.0f ) );
+	pEmitter->SetSortOrigin( vecOrigin );
+
+	for ( int i = 0; i < nParticles; i++ )
+	{
+		SimpleParticle *pParticle = pEmitter->AddSimpleParticle( hMaterial, vecOrigin, random.RandomFloat( 1.0f, 3.0f ), random.RandomInt( 8, 32 ) );
+		if ( !pParticle )
+			return;
+
+		Vector vecDir( random.RandomFloat( -1.0f, 1.0f ), random.RandomFloat( -1.0f, 1.0f ), random.RandomFloat( -0.25f, 1.0f ) );
+		VectorNormalize( vecDir );
+
+		pParticle->m_vecVelocity = vecDir * random.RandomFloat( 64.0f, 512.0f );
+		pParticle->m_flRoll = random.RandomFloat( 0.0f, 360.0f );
+		pParticle->m_flRollDelta = random.RandomFloat( -2.0f, 2.0f );
+		pParticle->m_uchStartAlpha = 255;
+		pParticle->m_uchEndAlpha = 0;
+		pParticle->m_uchEndSize = pParticle->m_uchStartSize * 4;
+
+		result.m_nSpawned++;
+	}
+}
+
+static void ParticleBenchmark_Run( ParticleBenchmarkMode_t mode, int nExplosions, int nParticles, int nFrames, ParticleBenchmarkResult_t &result )
+{
+	memset( &result, 0, sizeof( result ) );
+
+	// Same explosions every run so results can be compared between modes and builds
+	CUniformRandomStream random;
+	random.SetSeed( 0 );
+
+	bool bOldPooling = g_cl_particle_pool;
+	g_cl_particle_pool = ( mode != PARTICLE_BENCHMARK_HEAP_SERIAL );
+
+	CSmartPtr<CSimpleEmitter> *pEmitters = new CSmartPtr<CSimpleEmitter>[nExplosions];
+	CParticleEffectBinding **ppBindings = new CParticleEffectBinding*[nExplosions];
+
+	CFastTimer timer;
+	timer.Start();
+	for ( int i = 0; i < nExplosions; i++ )
+	{
+		pEmitters[i] = CSimpleEmitter::Create( "ParticleBenchmark" );
+		ppBindings[i] = &pEmitters[i]->GetBinding();
+
+		PMaterialHandle hMaterial = pEmitters[i]->GetPMaterial( "particle/particle_smokegrenade" );
+		ParticleBenchmark_Explode( pEmitters[i].GetObject(), hMaterial, nParticles, random, result );
+	}
+	timer.End();
+	result.m_SpawnTime = timer.GetDuration();
+
+	for ( int iFrame = 0; iFrame < nFrames; iFrame++ )
+	{
+		timer.Start();
+		if ( mode == PARTICLE_BENCHMARK_POOL_PARALLEL )
+		{
+			ParticleMgr()->SimulateEffectsParallel( ppBindings, nExplosions, PARTICLE_BENCHMARK_FRAME_INTERVAL );
+		}
+		else
+		{
+			for ( int i = 0; i < nExplosions; i++ )
+			{
+				ppBindings[i]->SimulateParticles( PARTICLE_BENCHMARK_FRAME_INTERVAL );
+			}
+		}
+		timer.End();
+		result.m_SimulateTime += timer.GetDuration();
+	}
+
+	// Take them out now rather than next frame, so the next run has the whole particle budget
+	for ( int i = 0; i < nExplosions; i++ )
+	{
+		result.m_nAlive += ppBindings[i]->GetNumActiveParticles();
+
+		pEmitters[i] = NULL;
+		ParticleMgr()->RemoveEffect( ppBindings[i] );
+	}
+
+	delete [] pEmitters;
+	delete [] ppBindings;
+
+	g_cl_particle_pool = bOldPooling;
+}
+
+CON_COMMAND( cl_particle_explosion_benchmark, "Time legacy particle allocation and simulation over a field of explosions. Usage: cl_particle_explosion_benchmark [explosions] [particles] [frames]" )
+{
+	if ( !engine->IsInGame() )
+	{
+		Msg( "%s needs a map loaded.\n", args[0] );
+		return;
+	}
+
+	int nExplosions = ( args.ArgC() > 1 ) ? MAX( atoi( args[1] ), 1 ) : 32;
+	int nParticles = ( args.ArgC() > 2 ) ? MAX( atoi( args[2] ), 1 ) : 48;
+	int nFrames = ( args.ArgC() > 3 ) ? MAX( atoi( args[3] ), 1 ) : 180;
+
+	if ( nExplosions * nParticles > MAX_TOTAL_PARTICLES )
+	{
+		Warning( "%d explosions of %d particles is over the %d particle limit, some won't spawn.\n", nExplosions, nParticles, MAX_TOTAL_PARTICLES );
+	}
+
+	ParticleBenchmarkResult_t results[PARTICLE_BENCHMARK_MODE_COUNT];
+	for ( int i = 0; i < PARTICLE_BENCHMARK_MODE_COUNT; i++ )
+	{
+		ParticleBenchmark_Run( (ParticleBenchmarkMode_t)i, nExplosions, nParticles, nFrames, results[i] );
+	}
+
+	double flBaseUS = results[PARTICLE_BENCHMARK_HEAP_SERIAL].m_SimulateTime.GetMicrosecondsF() / nFrames;
+
+	Msg( "%d explosions, %d frames:\n", nExplosions, nFrames );
+	for ( int i = 0; i < PARTICLE_BENCHMARK_MODE_COUNT; i++ )
+	{
+		const ParticleBenchmarkResult_t &result = results[i];
+		double flSimulateUS = result.m_SimulateTime.GetMicrosecondsF() / nFrames;
+		bool bMismatch = ( result.m_nSpawned != results[0].m_nSpawned || result.m_nAlive != results[0].m_nAlive );
+
+		Msg( "  %-16s spawn %.2fus (%d particles), simulate %.2fus per frame (%.2fx), %d left%s\n",
+			s_pszParticleBenchmarkModes[i], result.m_SpawnTime.GetMicrosecondsF(), result.m_nSpawned,
+			flSimulateUS, flSimulateUS > 0.0 ? flBaseUS / flSimulateUS : 0.0, result.m_nAlive,
+			bMismatch ? " MISMATCH" : "" );
+	}
+}
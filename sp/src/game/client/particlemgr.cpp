@@ -43,10 +43,12 @@ static ConVar particle_simulateoverflow( "particle_simulateoverflow", "0", FCVAR
 ConVar cl_particleeffect_aabb_buffer( "cl_particleeffect_aabb_buffer", "2", FCVAR_CHEAT, "Add this amount to a particle effect's bbox in the leaf system so if it's growing slowly, it won't have to be reinserted as often." );
 ConVar cl_particle_show_bbox( "cl_particle_show_bbox", "0", FCVAR_CHEAT );
 ConVar cl_particle_show_bbox_cost( "cl_particle_show_bbox_cost", "0", FCVAR_CHEAT, "Show # of particles: green->blue->red. Use a negative number to show ALL particles even cheap ones" );
+static ConVar cl_particle_pool( "cl_particle_pool", "1", 0, "Allocate each legacy particle effect's particles from its own pool instead of the heap." );
 
 // These reflect the convars so we don't parse the string every particle!
 bool g_cl_particle_show_bbox = false;
 int g_cl_particle_show_bbox_cost = 0;
+bool g_cl_particle_pool = true;
 
 
 static void StatsParticlesStart();
@@ -69,6 +71,9 @@ static ConVar cl_particle_stats_trigger_count( "cl_particle_stats_trigger_count"
 
 #define PARTICLE_SIZE	96
 
+// Particles in an effect's first pool blob. Later blobs grow by this much each time.
+#define PARTICLE_POOL_BLOB_SIZE	16
+
 CParticleMgr *ParticleMgr()
 {
 	static CParticleMgr s_ParticleMgr;
@@ -153,6 +158,7 @@ CParticleEffectBinding::CParticleEffectBinding()
 	m_ListIndex = 0xFFFF; 
 
 	m_UpdateBBoxCounter = 0;
+	m_pParticlePool = NULL;
 
 	memset( m_EffectMaterialHash, 0, sizeof( m_EffectMaterialHash ) );
 }
@@ -512,9 +518,15 @@ Particle* CParticleEffectBinding::AddParticle( int sizeInBytes, PMaterialHandle
 			return NULL;
 	}
 	
+	// Only start a pool while the effect is empty, so its particles never come from both places
+	if ( !m_pParticlePool && m_nActiveParticles == 0 && g_cl_particle_pool )
+	{
+		m_pParticlePool = new CUtlMemoryPool( PARTICLE_SIZE, PARTICLE_POOL_BLOB_SIZE, CUtlMemoryPool::GROW_FAST, "CParticleEffectBinding", 16 );
+	}
+
 	// Allocate the puppy. We are actually allocating space for the
 	// internals + the actual data
-	Particle* pParticle = m_pParticleMgr->AllocParticle( PARTICLE_SIZE );
+	Particle* pParticle = m_pParticleMgr->AllocParticle( PARTICLE_SIZE, m_pParticlePool );
 	if( !pParticle )
 		return NULL;
 
@@ -954,6 +966,9 @@ void CParticleEffectBinding::Term()
 	}	
 	m_Materials.Purge();
 
+	delete m_pParticlePool;
+	m_pParticlePool = NULL;
+
 	memset( m_EffectMaterialHash, 0, sizeof( m_EffectMaterialHash ) );
 }
 
@@ -970,7 +985,7 @@ void CParticleEffectBinding::RemoveParticle( Particle *pParticle )
 	m_pSim->NotifyDestroyParticle(pParticle);
 
 	// Remove it from the list of particles and deallocate
-	m_pParticleMgr->FreeParticle(pParticle);
+	m_pParticleMgr->FreeParticle( pParticle, m_pParticlePool );
 }
 
 
@@ -1166,26 +1181,35 @@ void CParticleMgr::LevelInit()
 }
 
 
-Particle *CParticleMgr::AllocParticle( int size )
+Particle *CParticleMgr::AllocParticle( int size, CUtlMemoryPool *pPool )
 {
-	// Enforce max particle limit.
-	if ( m_nCurrentParticlesAllocated >= MAX_TOTAL_PARTICLES )
+	// Enforce max particle limit. Take the slot first since effects being simulated
+	// on other threads can be allocating at the same time.
+	if ( ++m_nCurrentParticlesAllocated > MAX_TOTAL_PARTICLES )
+	{
+		--m_nCurrentParticlesAllocated;
 		return NULL;
+	}
 		
-	Particle *pRet = (Particle *)malloc( size );
-	if ( pRet )
-		++m_nCurrentParticlesAllocated;
+	Particle *pRet = (Particle *)( pPool ? pPool->Alloc() : malloc( size ) );
+	if ( !pRet )
+		--m_nCurrentParticlesAllocated;
 
 	return pRet;
 }
 
-void CParticleMgr::FreeParticle( Particle *pParticle )
+void CParticleMgr::FreeParticle( Particle *pParticle, CUtlMemoryPool *pPool )
 {
+	if ( !pParticle )
+		return;
+
 	Assert( m_nCurrentParticlesAllocated > 0 );
-	if ( pParticle )
-		--m_nCurrentParticlesAllocated;
+	--m_nCurrentParticlesAllocated;
 	
-	free( pParticle );
+	if ( pPool )
+		pPool->Free( pParticle );
+	else
+		free( pParticle );
 }
 
 
@@ -1537,6 +1561,7 @@ void EndSimulateParticles( void )
 
 
 static ConVar r_threaded_particles( "r_threaded_particles", "1" );
+static ConVar r_threaded_legacy_particles( "r_threaded_legacy_particles", "1", 0, "Simulate legacy particle effects that are marked thread-safe on the job threads." );
 
 static float s_flThreadedPSystemTimeStep;
 
@@ -1907,12 +1932,49 @@ void CParticleMgr::UpdateNewEffects( float flTimeDelta )
 	}
 }
 
+static float s_flThreadedLegacyTimeStep;
+
+static void ProcessLegacyEffect( CParticleEffectBinding *&pEffect )
+{
+	// Enable FP exceptions here when FP_EXCEPTIONS_ENABLED is defined,
+	// to help track down bad math.
+	FPExceptionEnabler enableExceptions;
+
+	pEffect->SimulateParticles( s_flThreadedLegacyTimeStep );
+}
+
+//-----------------------------------------------------------------------------
+// Simulates effects that said they can be. Each job owns one effect, and the
+// particles it frees go back to that effect's pool, so the jobs share nothing
+// but the particle count.
+//-----------------------------------------------------------------------------
+void CParticleMgr::SimulateEffectsParallel( CParticleEffectBinding **ppEffects, int nCount, float flTimeDelta )
+{
+	VPROF_BUDGET( "CParticleMgr::SimulateEffectsParallel", VPROF_BUDGETGROUP_PARTICLE_SIMULATION );
+
+	if ( nCount < 2 )
+	{
+		for ( int i = 0; i < nCount; i++ )
+		{
+			ppEffects[i]->SimulateParticles( flTimeDelta );
+		}
+		return;
+	}
+
+	s_flThreadedLegacyTimeStep = flTimeDelta;
+	ParallelProcess( "CParticleMgr::SimulateEffectsParallel", ppEffects, nCount, ProcessLegacyEffect );
+}
+
 void CParticleMgr::UpdateAllEffects( float flTimeDelta )
 {
 	// These reflect the convars so we don't parse the strings every particle.
 	g_cl_particle_show_bbox = cl_particle_show_bbox.GetBool();
 	g_cl_particle_show_bbox_cost = cl_particle_show_bbox_cost.GetInt();
+	g_cl_particle_pool = cl_particle_pool.GetBool();
 
+	// Thread-safe effects are simulated together once the others are done
+	CUtlVectorFixedGrowable< CParticleEffectBinding*, 64 > threadedEffects;
+	bool bThreaded = r_threaded_legacy_particles.GetBool();
 
 	m_bUpdatingEffects = true;
 
@@ -1947,14 +2009,34 @@ void CParticleMgr::UpdateAllEffects( float flTimeDelta )
 		pEffect->m_pSim->Update( flTimeDelta );
 
 		if ( pEffect->GetFirstFrameFlag() )
+		{
 			pEffect->SetFirstFrameFlag( false );
+		}
+		else if ( bThreaded && pEffect->m_pSim->IsSimulationThreadSafe() )
+		{
+			threadedEffects.AddToTail( pEffect );
+			continue;
+		}
 		else
+		{
 			pEffect->SimulateParticles( flTimeDelta );
+		}
 
 		// Update its position in the leaf system if its bbox changed.
 		pEffect->DetectChanges();
 	}
 
+	if ( threadedEffects.Count() )
+	{
+		SimulateEffectsParallel( threadedEffects.Base(), threadedEffects.Count(), flTimeDelta );
+
+		// The leaf system isn't thread-safe
+		for ( int i = 0; i < threadedEffects.Count(); i++ )
+		{
+			threadedEffects[i]->DetectChanges();
+		}
+	}
+
 	if ( g_bMeasureParticlePerformance )					// use fixed time step
 	{
 		for( float dt=0.0f; dt <= flTimeDelta ; dt+= 0.01f )
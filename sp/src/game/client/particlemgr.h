@@ -126,6 +126,7 @@ entities. Each one is useful under different conditions.
 #endif
 #include "tier1/utlintrusivelist.h"
 #include "tier1/utlstring.h"
+#include "tier1/mempool.h"
 
 
 //-----------------------------------------------------------------------------
@@ -269,6 +270,10 @@ public:
 	virtual void	SetShouldSimulate( bool bSim ) = 0;
 	virtual void	SimulateParticles( CParticleSimulateIterator *pIterator ) = 0;
 
+	// Return true if SimulateParticles (and NotifyDestroyParticle) only touch this effect and
+	// its own particles. Those effects are simulated on the job threads when r_threaded_legacy_particles is set.
+	virtual bool	IsSimulationThreadSafe() const { return false; }
+
 	// Render the particles.
 	virtual void	RenderParticles( CParticleRenderIterator *pIterator ) = 0;
 
@@ -587,6 +592,10 @@ private:
 
 	// auto updates the bbox after N frames
 	unsigned short					m_UpdateBBoxCounter;
+
+	// This effect's particles, if it was created while cl_particle_pool was set. Keeping them
+	// together means a job simulating this effect never has to touch a shared heap.
+	CUtlMemoryPool					*m_pParticlePool;
 };
 
 
@@ -658,8 +667,13 @@ public:
 	// Returns the modelview matrix
 	VMatrix&		GetModelView();
 
-	Particle		*AllocParticle( int size );
-	void			FreeParticle( Particle * );
+	// Particles come out of pPool if there is one, otherwise the heap. These can be called
+	// from a job simulating a thread-safe effect.
+	Particle		*AllocParticle( int size, CUtlMemoryPool *pPool = NULL );
+	void			FreeParticle( Particle *pParticle, CUtlMemoryPool *pPool = NULL );
+
+	// Simulates legacy effects that are IsSimulationThreadSafe() on the job threads.
+	void			SimulateEffectsParallel( CParticleEffectBinding **ppEffects, int nCount, float flTimeDelta );
 
 	PMaterialHandle	GetPMaterial( const char *pMaterialName );
 	IMaterial*		PMaterialToIMaterial( PMaterialHandle hMaterial );
@@ -721,7 +735,7 @@ private:
 
 private:
 
-	int m_nCurrentParticlesAllocated;
+	CInterlockedInt m_nCurrentParticlesAllocated;
 
 	// Directional lighting info.
 	CParticleLightInfo m_DirectionalLight;
@@ -171,6 +171,7 @@ public:
 
 	virtual void	SimulateParticles( CParticleSimulateIterator *pIterator );
 	virtual void	RenderParticles( CParticleRenderIterator *pIterator );
+	virtual bool	IsSimulationThreadSafe() const { return m_bThreadSafeSimulation; }
 
 	void			SetNearClip( float nearClipMin, float nearClipMax );
 
@@ -192,6 +193,10 @@ protected:
 	float			m_flNearClipMin;
 	float			m_flNearClipMax;
 
+	// Only set for plain CSimpleEmitters. Variants override the Update* functions
+	// above and have to check their own before setting it.
+	bool			m_bThreadSafeSimulation;
+
 private:
 	CSimpleEmitter( const CSimpleEmitter & ); // not defined, not accessible
 };
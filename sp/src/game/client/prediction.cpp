@@ -52,6 +52,24 @@ static ConVar	cl_predictionentitydump( "cl_pdump", "-1", FCVAR_CHEAT, "Dump info
 static ConVar	cl_predictionentitydumpbyclass( "cl_pclass", "", FCVAR_CHEAT, "Dump entity by prediction classname." );
 static ConVar	cl_pred_optimize( "cl_pred_optimize", "2", 0, "Optimize for not copying data if didn't receive a network update (1), and also for not repredicting if there were no errors (2)." );
 
+CON_COMMAND( cl_pred_restore_stats, "Show how much predicted entity state has been restored, and how much of it had changed. Pass 'reset' to clear." )
+{
+	if ( args.ArgC() > 1 && !Q_stricmp( args[1], "reset" ) )
+	{
+		g_PredictionRestoreStats.Reset();
+		return;
+	}
+
+	const PredictionRestoreStats_t &stats = g_PredictionRestoreStats;
+	int nFrames = MAX( stats.m_nFrames, 1 );
+
+	Msg( "Prediction restores: %d frames, %d restores\n", stats.m_nFrames, stats.m_nRestores );
+	Msg( "  %.0f bytes restored, %.0f changed and copied per frame (%.1f%%)\n",
+		(double)stats.m_nBytesRestored / nFrames, (double)stats.m_nBytesCopied / nFrames,
+		stats.m_nBytesRestored ? 100.0 * stats.m_nBytesCopied / stats.m_nBytesRestored : 0.0 );
+	Msg( "  last frame: %d bytes restored, %d copied\n", stats.m_nLastFrameBytesRestored, stats.m_nLastFrameBytesCopied );
+}
+
 #endif
 
 extern IGameMovement *g_pGameMovement;
@@ -1646,6 +1664,11 @@ void CPrediction::Update( int startframe, bool validframe,
 
 	_Update( received_new_world_update, validframe, incoming_acknowledged, outgoing_command );
 
+	if ( validframe && cl_predict->GetInt() )
+	{
+		g_PredictionRestoreStats.EndFrame();
+	}
+
 	// Restore current timer values, etc.
 	*gpGlobals = saveVars;
 #endif
@@ -0,0 +1,162 @@
+//=============================================================================//
+//
+// Purpose: Structure-of-arrays copy of what the client leaf system culls
+//			renderables with, and a frustum test that runs four at a time
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "renderablecull.h"
+#include "mathlib/ssemath.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// Boxes have to be this far behind a plane to be culled, so rounding never
+// culls something the engine's own test would keep
+#define RENDERABLE_CULL_EPSILON		1.0f
+
+
+//-----------------------------------------------------------------------------
+// RenderableCullFrustum_t
+//-----------------------------------------------------------------------------
+void RenderableCullFrustum_t::Init( const Frustum_t &frustum )
+{
+	static const int s_nPlanes[] = { FRUSTUM_RIGHT, FRUSTUM_LEFT, FRUSTUM_TOP, FRUSTUM_BOTTOM, FRUSTUM_FARZ };
+
+	m_nPlanes = ARRAYSIZE( s_nPlanes );
+	for ( int i = 0; i < m_nPlanes; i++ )
+	{
+		const cplane_t *pPlane = frustum.GetPlane( s_nPlanes[i] );
+		m_vecNormal[i] = pPlane->normal;
+		m_flDist[i] = pPlane->dist - RENDERABLE_CULL_EPSILON;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CRenderableCullDB
+//-----------------------------------------------------------------------------
+void CRenderableCullDB::EnsureCount( int nCount )
+{
+	int nOldCount = m_BoundsFrame.Count();
+	if ( nCount <= nOldCount )
+		return;
+
+	m_MinX.SetCount( nCount );
+	m_MinY.SetCount( nCount );
+	m_MinZ.SetCount( nCount );
+	m_MaxX.SetCount( nCount );
+	m_MaxY.SetCount( nCount );
+	m_MaxZ.SetCount( nCount );
+	m_BoundsFrame.SetCount( nCount );
+	m_RenderGroup.SetCount( nCount );
+	m_Flags.SetCount( nCount );
+
+	for ( int i = nOldCount; i < nCount; i++ )
+	{
+		m_BoundsFrame[i] = -1;
+		m_RenderGroup[i] = 0;
+		m_Flags[i] = 0;
+	}
+}
+
+void CRenderableCullDB::Purge()
+{
+	m_MinX.Purge();
+	m_MinY.Purge();
+	m_MinZ.Purge();
+	m_MaxX.Purge();
+	m_MaxY.Purge();
+	m_MaxZ.Purge();
+	m_BoundsFrame.Purge();
+	m_RenderGroup.Purge();
+	m_Flags.Purge();
+}
+
+void CRenderableCullDB::SetBounds( ClientRenderHandle_t handle, int nFrame, const Vector &vecMins, const Vector &vecMaxs )
+{
+	m_MinX[handle] = vecMins.x;
+	m_MinY[handle] = vecMins.y;
+	m_MinZ[handle] = vecMins.z;
+	m_MaxX[handle] = vecMaxs.x;
+	m_MaxY[handle] = vecMaxs.y;
+	m_MaxZ[handle] = vecMaxs.z;
+	m_BoundsFrame[handle] = nFrame;
+}
+
+void CRenderableCullDB::GetBounds( ClientRenderHandle_t handle, Vector &vecMins, Vector &vecMaxs ) const
+{
+	vecMins.Init( m_MinX[handle], m_MinY[handle], m_MinZ[handle] );
+	vecMaxs.Init( m_MaxX[handle], m_MaxY[handle], m_MaxZ[handle] );
+}
+
+
+//-----------------------------------------------------------------------------
+// For each plane, the farthest point of a box along the normal is found by
+// taking the larger of normal * min and normal * max on each axis; if that's
+// still behind the plane the whole box is. Handles in a leaf aren't
+// contiguous, so each group of four is gathered first.
+//-----------------------------------------------------------------------------
+int CRenderableCullDB::CullToFrustum( const RenderableCullFrustum_t &frustum, const ClientRenderHandle_t *pHandles, int nCount, int *pVisible ) const
+{
+	fltx4 fl4NormalX[RenderableCullFrustum_t::MAX_PLANES];
+	fltx4 fl4NormalY[RenderableCullFrustum_t::MAX_PLANES];
+	fltx4 fl4NormalZ[RenderableCullFrustum_t::MAX_PLANES];
+	fltx4 fl4Dist[RenderableCullFrustum_t::MAX_PLANES];
+	for ( int p = 0; p < frustum.m_nPlanes; p++ )
+	{
+		fl4NormalX[p] = ReplicateX4( frustum.m_vecNormal[p].x );
+		fl4NormalY[p] = ReplicateX4( frustum.m_vecNormal[p].y );
+		fl4NormalZ[p] = ReplicateX4( frustum.m_vecNormal[p].z );
+		fl4Dist[p] = ReplicateX4( frustum.m_flDist[p] );
+	}
+
+	ALIGN16 float flGather[6][4] ALIGN16_POST;
+
+	int nVisible = 0;
+	for ( int i = 0; i < nCount; i += 4 )
+	{
+		int nGroup = MIN( 4, nCount - i );
+		for ( int j = 0; j < 4; j++ )
+		{
+			// Pad a short group with the last box, its result is ignored
+			ClientRenderHandle_t handle = pHandles[i + MIN( j, nGroup - 1 )];
+			Assert( m_BoundsFrame[handle] != -1 );
+
+			flGather[0][j] = m_MinX[handle];
+			flGather[1][j] = m_MinY[handle];
+			flGather[2][j] = m_MinZ[handle];
+			flGather[3][j] = m_MaxX[handle];
+			flGather[4][j] = m_MaxY[handle];
+			flGather[5][j] = m_MaxZ[handle];
+		}
+
+		fltx4 fl4MinX = LoadAlignedSIMD( flGather[0] );
+		fltx4 fl4MinY = LoadAlignedSIMD( flGather[1] );
+		fltx4 fl4MinZ = LoadAlignedSIMD( flGather[2] );
+		fltx4 fl4MaxX = LoadAlignedSIMD( flGather[3] );
+		fltx4 fl4MaxY = LoadAlignedSIMD( flGather[4] );
+		fltx4 fl4MaxZ = LoadAlignedSIMD( flGather[5] );
+
+		fltx4 fl4Culled = Four_Zeros;
+		for ( int p = 0; p < frustum.m_nPlanes; p++ )
+		{
+			fltx4 fl4Far = MaxSIMD( MulSIMD( fl4NormalX[p], fl4MinX ), MulSIMD( fl4NormalX[p], fl4MaxX ) );
+			fl4Far = AddSIMD( fl4Far, MaxSIMD( MulSIMD( fl4NormalY[p], fl4MinY ), MulSIMD( fl4NormalY[p], fl4MaxY ) ) );
+			fl4Far = AddSIMD( fl4Far, MaxSIMD( MulSIMD( fl4NormalZ[p], fl4MinZ ), MulSIMD( fl4NormalZ[p], fl4MaxZ ) ) );
+			fl4Culled = OrSIMD( fl4Culled, CmpLtSIMD( fl4Far, fl4Dist[p] ) );
+		}
+
+		int nCulledMask = TestSignSIMD( fl4Culled );
+		for ( int j = 0; j < nGroup; j++ )
+		{
+			if ( !( nCulledMask & ( 1 << j ) ) )
+			{
+				pVisible[nVisible++] = i + j;
+			}
+		}
+	}
+
+	return nVisible;
+}
@@ -0,0 +1,87 @@
+//=============================================================================//
+//
+// Purpose: Structure-of-arrays copy of what the client leaf system culls
+//			renderables with, and a frustum test that runs four at a time
+//
+//=============================================================================//
+
+#ifndef RENDERABLECULL_H
+#define RENDERABLECULL_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "client_render_handle.h"
+#include "tier1/utlvector.h"
+#include "mathlib/vector.h"
+
+class Frustum_t;
+
+
+//-----------------------------------------------------------------------------
+// Frustum planes as the cull kernel reads them. A box is outside when it's
+// entirely behind any plane.
+//-----------------------------------------------------------------------------
+struct RenderableCullFrustum_t
+{
+	enum
+	{
+		MAX_PLANES = 6,
+	};
+
+	int		m_nPlanes;
+	Vector	m_vecNormal[MAX_PLANES];
+	float	m_flDist[MAX_PLANES];
+
+	// The near plane is left out, like R_CullBoxSkipNear: anything between
+	// the eye and the near plane is inside the side planes anyway.
+	void Init( const Frustum_t &frustum );
+};
+
+
+//-----------------------------------------------------------------------------
+// World bounds, render group and flags for every renderable, indexed by
+// ClientRenderHandle_t. Bounds are cached for a frame, so the extra views
+// in a frame (water, monitors, shadow depth) don't ask every renderable
+// for its bounds again.
+//-----------------------------------------------------------------------------
+class CRenderableCullDB
+{
+public:
+	// Makes room for handles up to nCount - 1
+	void EnsureCount( int nCount );
+	void Purge();
+
+	void SetRenderInfo( ClientRenderHandle_t handle, unsigned char nRenderGroup, unsigned char nFlags )
+	{
+		m_RenderGroup[handle] = nRenderGroup;
+		m_Flags[handle] = nFlags;
+	}
+
+	unsigned char GetRenderGroup( ClientRenderHandle_t handle ) const { return m_RenderGroup[handle]; }
+	unsigned char GetFlags( ClientRenderHandle_t handle ) const { return m_Flags[handle]; }
+
+	bool HasBounds( ClientRenderHandle_t handle, int nFrame ) const { return m_BoundsFrame[handle] == nFrame; }
+	void InvalidateBounds( ClientRenderHandle_t handle ) { m_BoundsFrame[handle] = -1; }
+	void SetBounds( ClientRenderHandle_t handle, int nFrame, const Vector &vecMins, const Vector &vecMaxs );
+	void GetBounds( ClientRenderHandle_t handle, Vector &vecMins, Vector &vecMaxs ) const;
+
+	// Writes the indices into pHandles of the renderables that aren't
+	// entirely outside the frustum to pVisible, in order, and returns how
+	// many there are. Every handle must have bounds.
+	int CullToFrustum( const RenderableCullFrustum_t &frustum, const ClientRenderHandle_t *pHandles, int nCount, int *pVisible ) const;
+
+private:
+	CUtlVector<float>			m_MinX;
+	CUtlVector<float>			m_MinY;
+	CUtlVector<float>			m_MinZ;
+	CUtlVector<float>			m_MaxX;
+	CUtlVector<float>			m_MaxY;
+	CUtlVector<float>			m_MaxZ;
+	CUtlVector<int>				m_BoundsFrame;
+	CUtlVector<unsigned char>	m_RenderGroup;
+	CUtlVector<unsigned char>	m_Flags;
+};
+
+#endif // RENDERABLECULL_H
@@ -0,0 +1,126 @@
+//=============================================================================//
+//
+// Purpose: Times frustum culling synthetic renderables one box at a time, the
+//			way the engine's cull does, against CRenderableCullDB's four at a
+//			time kernel. CPU only, doesn't need a map.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "renderablecull.h"
+#include "tier0/fasttimer.h"
+#include "vstdlib/random.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+static void RenderableCullBenchmark_Run( int nRenderables, int nFrames )
+{
+	// Same scenes every run so results can be compared between builds
+	CUniformRandomStream random;
+	random.SetSeed( 0 );
+
+	// Props and NPCs spread around a level-sized area
+	CUtlVector<Vector> mins, maxs;
+	CUtlVector<ClientRenderHandle_t> handles;
+	mins.SetCount( nRenderables );
+	maxs.SetCount( nRenderables );
+	handles.SetCount( nRenderables );
+	for ( int i = 0; i < nRenderables; i++ )
+	{
+		Vector vecCenter( random.RandomFloat( -8192.0f, 8192.0f ), random.RandomFloat( -8192.0f, 8192.0f ), random.RandomFloat( -1024.0f, 2048.0f ) );
+		Vector vecExtents( random.RandomFloat( 4.0f, 128.0f ), random.RandomFloat( 4.0f, 128.0f ), random.RandomFloat( 4.0f, 128.0f ) );
+		mins[i] = vecCenter - vecExtents;
+		maxs[i] = vecCenter + vecExtents;
+
+		// Leaves hand out handles in no particular order
+		handles[i] = (ClientRenderHandle_t)i;
+	}
+
+	for ( int i = nRenderables - 1; i > 0; i-- )
+	{
+		V_swap( handles[i], handles[random.RandomInt( 0, i )] );
+	}
+
+	CRenderableCullDB db;
+	db.EnsureCount( nRenderables );
+
+	CUtlVector<int> visible;
+	CUtlVector<bool> kept;
+	visible.SetCount( nRenderables );
+	kept.SetCount( nRenderables );
+
+	CFastTimer timer;
+	CCycleCount scalarTime, simdTime;
+	int nScalarVisible = 0, nSimdVisible = 0;
+	bool bMismatch = false;
+
+	for ( int iFrame = 0; iFrame < nFrames; iFrame++ )
+	{
+		// Everything moves a little each frame, so the bounds have to be stored again
+		for ( int i = 0; i < nRenderables; i++ )
+		{
+			Vector vecJitter( random.RandomFloat( -8.0f, 8.0f ), random.RandomFloat( -8.0f, 8.0f ), random.RandomFloat( -8.0f, 8.0f ) );
+			mins[i] += vecJitter;
+			maxs[i] += vecJitter;
+			db.SetBounds( (ClientRenderHandle_t)i, iFrame, mins[i], maxs[i] );
+		}
+
+		Vector vecOrigin( random.RandomFloat( -4096.0f, 4096.0f ), random.RandomFloat( -4096.0f, 4096.0f ), random.RandomFloat( 0.0f, 1024.0f ) );
+		QAngle angView( random.RandomFloat( -60.0f, 60.0f ), random.RandomFloat( 0.0f, 360.0f ), 0.0f );
+		Frustum_t frustum;
+		GeneratePerspectiveFrustum( vecOrigin, angView, 7.0f, 28000.0f, 90.0f, 16.0f / 9.0f, frustum );
+
+		timer.Start();
+		int nFrameScalar = 0;
+		for ( int i = 0; i < nRenderables; i++ )
+		{
+			ClientRenderHandle_t handle = handles[i];
+			kept[i] = !R_CullBoxSkipNear( mins[handle], maxs[handle], frustum );
+			nFrameScalar += kept[i];
+		}
+		timer.End();
+		scalarTime += timer.GetDuration();
+
+		timer.Start();
+		RenderableCullFrustum_t cullFrustum;
+		cullFrustum.Init( frustum );
+		int nFrameSimd = db.CullToFrustum( cullFrustum, handles.Base(), nRenderables, visible.Base() );
+		timer.End();
+		simdTime += timer.GetDuration();
+
+		// The kernel is allowed to keep a little more than the exact test, never less
+		int nFound = 0;
+		for ( int i = 0; i < nFrameSimd; i++ )
+		{
+			nFound += kept[visible[i]];
+		}
+		bMismatch |= ( nFound != nFrameScalar );
+
+		nScalarVisible += nFrameScalar;
+		nSimdVisible += nFrameSimd;
+	}
+
+	double flScalarUS = scalarTime.GetMicrosecondsF() / nFrames;
+	double flSimdUS = simdTime.GetMicrosecondsF() / nFrames;
+	Msg( "  %6d renderables: scalar %.2fus, simd %.2fus (%.2fx), %d / %d visible per frame%s\n", nRenderables, flScalarUS, flSimdUS,
+		flSimdUS > 0.0 ? flScalarUS / flSimdUS : 0.0, nScalarVisible / nFrames, nSimdVisible / nFrames, bMismatch ? " MISMATCH" : "" );
+}
+
+CON_COMMAND( cl_renderable_cull_benchmark, "Time frustum culling synthetic renderables. Usage: cl_renderable_cull_benchmark [renderables] [frames]" )
+{
+	int nFrames = ( args.ArgC() > 2 ) ? MAX( atoi( args[2] ), 1 ) : 100;
+
+	Msg( "%d frames per size, time per frame:\n", nFrames );
+	if ( args.ArgC() > 1 )
+	{
+		RenderableCullBenchmark_Run( clamp( atoi( args[1] ), 1, 65535 ), nFrames );
+		return;
+	}
+
+	static const int s_nSizes[] = { 100, 1000, 10000 };
+	for ( int i = 0; i < ARRAYSIZE( s_nSizes ); i++ )
+	{
+		RenderableCullBenchmark_Run( s_nSizes[i], nFrames );
+	}
+}
@@ -0,0 +1,167 @@
+//=============================================================================//
+//
+// Purpose: Times sorting synthetic translucent render lists with the h-sort
+//			CClientLeafSystem::SortEntities used to run against the radix
+//			sort it runs now. CPU only, doesn't need a map.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "clientleafsystem.h"
+#include "tier0/fasttimer.h"
+#include "vstdlib/random.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+//-----------------------------------------------------------------------------
+// Purpose: The old sort, for comparison
+//-----------------------------------------------------------------------------
+static void TranslucentSortBenchmark_HSort( float *dists, CClientRenderablesList::CEntry *pEntities, int nEntities )
+{
+	int i;
+	int stepSize = 4;
+	while( stepSize )
+	{
+		int end = nEntities - stepSize;
+		for( i=0; i < end; i += stepSize )
+		{
+			if( dists[i] > dists[i+stepSize] )
+			{
+				::V_swap( pEntities[i], pEntities[i+stepSize] );
+				::V_swap( dists[i], dists[i+stepSize] );
+
+				if( i == 0 )
+				{
+					i = -stepSize;
+				}
+				else
+				{
+					i -= stepSize << 1;
+				}
+			}
+		}
+
+		stepSize >>= 1;
+	}
+}
+
+// Checks the list is a back-to-front permutation of the original entries
+static bool TranslucentSortBenchmark_Check( const CClientRenderablesList::CEntry *pEntities, int nEntities, const Vector *pCenters,
+	const Vector &vecOrigin, const Vector &vecForward, CUtlVector<bool> &seen )
+{
+	seen.SetCount( nEntities );
+	memset( seen.Base(), 0, nEntities * sizeof( bool ) );
+
+	float flLastDepth = -FLT_MAX;
+	for ( int i = 0; i < nEntities; i++ )
+	{
+		int iEntry = pEntities[i].m_RenderHandle;
+		if ( iEntry >= nEntities || seen[iEntry] )
+			return false;
+		seen[iEntry] = true;
+
+		float flDepth = DotProduct( pCenters[iEntry] - vecOrigin, vecForward );
+		if ( flDepth < flLastDepth - 0.01f )
+			return false;
+		flLastDepth = flDepth;
+	}
+	return true;
+}
+
+static void TranslucentSortBenchmark_Run( int nEntities, int nLists )
+{
+	// Same scenes every run so results can be compared between builds
+	CUniformRandomStream random;
+	random.SetSeed( 0 );
+
+	// Renderables spread around a level-sized area, added in leaf order rather than by depth
+	CUtlVector<Vector> centers;
+	CUtlVector<CClientRenderablesList::CEntry> original;
+	centers.SetCount( nEntities );
+	original.SetCount( nEntities );
+	for ( int i = 0; i < nEntities; i++ )
+	{
+		centers[i].Init( random.RandomFloat( -4096.0f, 4096.0f ), random.RandomFloat( -4096.0f, 4096.0f ), random.RandomFloat( -512.0f, 1024.0f ) );
+
+		CClientRenderablesList::CEntry &entry = original[i];
+		entry.m_pRenderable = NULL;
+		entry.m_iWorldListInfoLeaf = i;
+		entry.m_TwoPass = 0;
+		entry.m_RenderHandle = (ClientRenderHandle_t)i;
+	}
+
+	CUtlVector<CClientRenderablesList::CEntry> entries;
+	CUtlVector<float> dists;
+	CUtlVector<bool> seen;
+	entries.SetCount( nEntities );
+	dists.SetCount( nEntities );
+
+	TranslucentSortScratch_t scratch;
+	scratch.EnsureCount( nEntities );
+
+	CFastTimer timer;
+	CCycleCount hsortTime, radixTime;
+	bool bMismatch = false;
+
+	for ( int iList = 0; iList < nLists; iList++ )
+	{
+		// A new view each list, like the main, reflection and refraction views
+		Vector vecOrigin( random.RandomFloat( -2048.0f, 2048.0f ), random.RandomFloat( -2048.0f, 2048.0f ), random.RandomFloat( 0.0f, 512.0f ) );
+		QAngle angView( random.RandomFloat( -30.0f, 30.0f ), random.RandomFloat( 0.0f, 360.0f ), 0.0f );
+		Vector vecForward;
+		AngleVectors( angView, &vecForward );
+
+		memcpy( entries.Base(), original.Base(), nEntities * sizeof( CClientRenderablesList::CEntry ) );
+		timer.Start();
+		for ( int i = 0; i < nEntities; i++ )
+		{
+			Vector delta;
+			VectorSubtract( centers[i], vecOrigin, delta );
+			dists[i] = DotProduct( delta, vecForward );
+		}
+		TranslucentSortBenchmark_HSort( dists.Base(), entries.Base(), nEntities );
+		timer.End();
+		hsortTime += timer.GetDuration();
+
+		bMismatch |= !TranslucentSortBenchmark_Check( entries.Base(), nEntities, centers.Base(), vecOrigin, vecForward, seen );
+
+		memcpy( entries.Base(), original.Base(), nEntities * sizeof( CClientRenderablesList::CEntry ) );
+		timer.Start();
+		for ( int i = 0; i < nEntities; i++ )
+		{
+			scratch.m_CenterX[i] = centers[i].x;
+			scratch.m_CenterY[i] = centers[i].y;
+			scratch.m_CenterZ[i] = centers[i].z;
+		}
+		SortTranslucentEntriesByDepth( vecOrigin, vecForward, entries.Base(), nEntities, scratch );
+		timer.End();
+		radixTime += timer.GetDuration();
+
+		bMismatch |= !TranslucentSortBenchmark_Check( entries.Base(), nEntities, centers.Base(), vecOrigin, vecForward, seen );
+	}
+
+	double flHSortUS = hsortTime.GetMicrosecondsF() / nLists;
+	double flRadixUS = radixTime.GetMicrosecondsF() / nLists;
+	Msg( "  %5d entities: h-sort %.2fus, radix %.2fus (%.2fx)%s\n", nEntities, flHSortUS, flRadixUS,
+		flRadixUS > 0.0 ? flHSortUS / flRadixUS : 0.0, bMismatch ? " MISMATCH" : "" );
+}
+
+CON_COMMAND( cl_translucent_sort_benchmark, "Time depth sorting synthetic translucent render lists. Usage: cl_translucent_sort_benchmark [entities] [lists]" )
+{
+	int nLists = ( args.ArgC() > 2 ) ? MAX( atoi( args[2] ), 1 ) : 200;
+
+	Msg( "%d lists per size, time per list:\n", nLists );
+	if ( args.ArgC() > 1 )
+	{
+		TranslucentSortBenchmark_Run( clamp( atoi( args[1] ), 2, (int)CClientRenderablesList::MAX_GROUP_ENTITIES ), nLists );
+		return;
+	}
+
+	// From a few per leaf up to a view full of particles and sprites
+	static const int s_nSizes[] = { 8, 32, 128, 512, 2048 };
+	for ( int i = 0; i < ARRAYSIZE( s_nSizes ); i++ )
+	{
+		TranslucentSortBenchmark_Run( s_nSizes[i], nLists );
+	}
+}
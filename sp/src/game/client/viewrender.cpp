@@ -3897,6 +3897,18 @@ void CRendering3dView::SetupRenderablesList( int viewID )
 		setupInfo.m_flRenderDistSq = (viewID == VIEW_SHADOW_DEPTH_TEXTURE) ? MIN(zFar, fMaxDist) : fMaxDist;
 		setupInfo.m_flRenderDistSq *= setupInfo.m_flRenderDistSq;
 
+		// Lets the leaf system cull against the view itself rather than asking
+		// the engine one renderable at a time. Ortho, off-center and custom
+		// projection views (each VR eye) don't fit a symmetric frustum, so
+		// the engine still does those.
+		Frustum_t frustum;
+		if ( !m_bOrtho && !m_bOffCenter && !m_bViewToProjectionOverride )
+		{
+			float flAspectRatio = ( m_flAspectRatio > 0.0f ) ? m_flAspectRatio : ( (float)width / (float)MAX( height, 1 ) );
+			GeneratePerspectiveFrustum( origin, angles, zNear, zFar, fov, flAspectRatio, frustum );
+			setupInfo.m_pFrustum = &frustum;
+		}
+
 		ClientLeafSystem()->BuildRenderablesList( setupInfo );
 	}
 }
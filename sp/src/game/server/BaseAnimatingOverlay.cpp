@@ -12,6 +12,7 @@
 #include "bone_setup.h"
 #include "ai_basenpc.h"
 #include "npcevent.h"
+#include "animlod.h"
 
 #include "saverestore_utlvector.h"
 #include "dt_utlvector_send.h"
@@ -495,10 +496,15 @@ void CBaseAnimatingOverlay::GetSkeleton( CStudioHdr *pStudioHdr, Vector pos[], Q
 		return;
 	}
 
+	// Lower animation LODs skip IK and blend fewer layers
+	AnimLOD_t lod = (AnimLOD_t)GetAnimLOD();
+	CIKContext *pIk = ( lod == ANIMLOD_FULL ) ? m_pIk : NULL;
+	int nMaxLayers = AnimLOD_MaxLayers( lod );
+
 	IBoneSetup boneSetup( pStudioHdr, boneMask, GetPoseParameterArray() );
 	boneSetup.InitPose( pos, q );
 
-	boneSetup.AccumulatePose( pos, q, GetSequence(), GetCycle(), 1.0, gpGlobals->curtime, m_pIk );
+	boneSetup.AccumulatePose( pos, q, GetSequence(), GetCycle(), 1.0, gpGlobals->curtime, pIk );
 
 	// sort the layers
 	int layer[MAX_OVERLAYS] = {};
@@ -515,17 +521,19 @@ void CBaseAnimatingOverlay::GetSkeleton( CStudioHdr *pStudioHdr, Vector pos[], Q
 			layer[pLayer.m_nOrder] = i;
 		}
 	}
-	for (i = 0; i < m_AnimOverlay.Count(); i++)
+	int nLayers = 0;
+	for (i = 0; i < m_AnimOverlay.Count() && nLayers < nMaxLayers; i++)
 	{
 		if (layer[i] >= 0 && layer[i] < m_AnimOverlay.Count())
 		{
 			CAnimationLayer &pLayer = m_AnimOverlay[layer[i]];
 			// UNDONE: Is it correct to use overlay weight for IK too?
-			boneSetup.AccumulatePose( pos, q, pLayer.m_nSequence, pLayer.m_flCycle, pLayer.m_flWeight, gpGlobals->curtime, m_pIk );
+			boneSetup.AccumulatePose( pos, q, pLayer.m_nSequence, pLayer.m_flCycle, pLayer.m_flWeight, gpGlobals->curtime, pIk );
+			nLayers++;
 		}
 	}
 
-	if ( m_pIk )
+	if ( pIk )
 	{
 		CIKContext auto_ik;
 		auto_ik.Init( pStudioHdr, GetAbsAngles(), GetAbsOrigin(), gpGlobals->curtime, 0, boneMask );
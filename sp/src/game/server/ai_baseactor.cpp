@@ -1652,7 +1652,7 @@ void CAI_BaseActor::MaintainLookTargets( float flInterval )
 	MaintainTurnActivity( );
 	DoBodyLean( );
 	UpdateBodyControl( );
-	InvalidateBoneCache();
+	InvalidateBoneCacheForPlayback();
 
 	// cached versions of the current eye position
 	Vector vEyePosition = EyePosition( );
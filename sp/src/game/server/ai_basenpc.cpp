@@ -86,6 +86,7 @@
 #include "death_pose.h"
 #include "datacache/imdlcache.h"
 #include "vstdlib/jobthread.h"
+#include "ilagcompensationmanager.h"
 
 #ifdef HL2_EPISODIC
 #include "npc_alyx_episodic.h"
@@ -121,6 +122,7 @@ extern ConVar sk_healthkit;
 
 #include "utlbuffer.h"
 #include "gamestats.h"
+#include "serverbenchmark_base.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -3499,7 +3501,7 @@ void CAI_BaseNPC::PostMovement()
 {
 	AI_PROFILE_SCOPE( CAI_BaseNPC_PostMovement );
 
-	InvalidateBoneCache();
+	InvalidateBoneCacheForPlayback();
 
 	if ( GetModelPtr() && GetModelPtr()->SequencesAvailable() )
 	{
@@ -3704,6 +3706,18 @@ bool CAI_BaseNPC::ShouldAlwaysThink()
 	return HasSpawnFlags(SF_NPC_ALWAYSTHINK);
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: NPCs the player isn't close to or looking at can afford to fall a
+//			tick or two behind when the server is over budget
+//-----------------------------------------------------------------------------
+bool CAI_BaseNPC::CanDeferThink()
+{
+	if ( ShouldAlwaysThink() || m_bInChoreo )
+		return false;
+
+	return ( GetEfficiency() >= AIE_EFFICIENT );
+}
+
 
 //-----------------------------------------------------------------------------
 // Purpose: Return true if the Player should be running the auto-move-out-of-way
@@ -4550,6 +4564,8 @@ bool CAI_BaseNPC::CheckPVSCondition()
 
 void CAI_BaseNPC::NPCThink( void )
 {
+	SERVER_BENCHMARK_SCOPE( SERVER_BENCHMARK_AI );
+
 	if ( m_bCheckContacts )
 	{
 		CheckPhysicsContacts();
@@ -8042,6 +8058,9 @@ void CAI_BaseNPC::NPCInit ( void )
 	// set eye position
 	SetDefaultEyeOffset();
 
+	// Let players shoot at where we were on their screen
+	lagcompensation->AddAdditionalEntity( this );
+
 	// Only give weapon of allowed to have one
 	if (CapabilitiesGet() & bits_CAP_USE_WEAPONS)
 	{	// Does this npc spawn with a weapon
@@ -13343,6 +13362,8 @@ void CAI_BaseNPC::UpdateOnRemove(void)
 		CleanupOnDeath( NULL, false );
 	}
 
+	lagcompensation->RemoveAdditionalEntity( this );
+
 	// Chain at end to mimic destructor unwind order
 	BaseClass::UpdateOnRemove();
 }
@@ -708,6 +708,7 @@ public:
 	virtual void		PlayerPenetratingVPhysics( void );
 
 	virtual bool		ShouldAlwaysThink();
+	virtual bool		CanDeferThink();
 	void				ForceGatherConditions()	{ m_bForceConditionsGather = true; SetEfficiency( AIE_NORMAL ); }	// Force an NPC out of PVS to call GatherConditions on next think
 	bool				IsForceGatherConditionsSet() { return m_bForceConditionsGather; }
 
@@ -0,0 +1,164 @@
+//=============================================================================//
+//
+// Purpose: Animation level of detail for server side bone setup.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "animlod.h"
+#include "baseanimating.h"
+#include "BaseAnimatingOverlay.h"
+#include "ai_basenpc.h"
+#include "sceneentity.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+ConVar sv_anim_lod( "sv_anim_lod", "0", 0, "Cut back on bone setup for NPCs far from every player. See sv_anim_lod_report." );
+ConVar sv_anim_lod_medium_distance( "sv_anim_lod_medium_distance", "1024", 0, "Past this distance from the closest player NPCs skip IK and blend fewer layers." );
+ConVar sv_anim_lod_low_distance( "sv_anim_lod_low_distance", "2048", 0, "Past this distance from the closest player NPCs only set up their hitbox and attachment bones, without layers, and less often." );
+ConVar sv_anim_lod_medium_layers( "sv_anim_lod_medium_layers", "2", 0, "The most overlay layers blended at medium animation LOD." );
+ConVar sv_anim_lod_low_interval( "sv_anim_lod_low_interval", "0.1", 0, "Seconds a low animation LOD NPC's bones are reused for, moved along with it, before being set up again.", true, 0, true, 0.1 );
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+AnimLOD_t AnimLOD_Select( CBaseAnimating *pAnimating )
+{
+	if ( !sv_anim_lod.GetBool() )
+		return ANIMLOD_FULL;
+
+	CAI_BaseNPC *pNPC = pAnimating->MyNPCPointer();
+	if ( !pNPC )
+		return ANIMLOD_FULL;
+
+	// Anything scripted or carrying the player needs to look right wherever it is
+	if ( pAnimating->GetBoneCacheFlags() & ( BCF_NO_ANIMATION_SKIP | BCF_IS_IN_SPAWN ) )
+		return ANIMLOD_FULL;
+
+	if ( pNPC->IsInAScript() || pNPC->GetState() == NPC_STATE_SCRIPT || IsRunningScriptedScene( pNPC, false ) || pAnimating->DoesHavePlayerChild() )
+		return ANIMLOD_FULL;
+
+	float flDistSqr = FLT_MAX;
+	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
+	{
+		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
+		if ( pPlayer )
+		{
+			flDistSqr = MIN( flDistSqr, pPlayer->GetAbsOrigin().DistToSqr( pAnimating->GetAbsOrigin() ) );
+		}
+	}
+
+	// NPCs fighting a player are treated as half as far away
+	CBaseEntity *pEnemy = pNPC->GetEnemy();
+	if ( pEnemy && pEnemy->IsPlayer() )
+	{
+		flDistSqr *= 0.25f;
+	}
+
+	if ( flDistSqr >= Square( sv_anim_lod_low_distance.GetFloat() ) )
+		return ANIMLOD_LOW;
+
+	if ( flDistSqr >= Square( sv_anim_lod_medium_distance.GetFloat() ) )
+		return ANIMLOD_MEDIUM;
+
+	return ANIMLOD_FULL;
+}
+
+int AnimLOD_MaxLayers( AnimLOD_t lod )
+{
+	switch ( lod )
+	{
+	case ANIMLOD_MEDIUM:
+		return sv_anim_lod_medium_layers.GetInt();
+	case ANIMLOD_LOW:
+		return 0;
+	default:
+		return CBaseAnimatingOverlay::MAX_OVERLAYS;
+	}
+}
+
+int AnimLOD_BoneCacheMask( AnimLOD_t lod, int boneMask )
+{
+	// Hitbox bones include everything up to the root. Attachments are kept
+	// too, or GetBoneTransform would put muzzles and held props at the
+	// entity's origin; bone merged children fall back to their own animation
+	// below the nearest hitbox bone.
+	if ( lod == ANIMLOD_LOW )
+		return boneMask & ( BONE_USED_BY_HITBOX | BONE_USED_BY_ATTACHMENT );
+
+	return boneMask;
+}
+
+// The last pose is held and moved along with the entity rather than blended
+// towards the next one. Interpolating would mean serving hitboxes a whole
+// interval behind the animation, which hurts more on the server than the pose
+// stepping does.
+float AnimLOD_ReuseInterval( AnimLOD_t lod )
+{
+	return ( lod == ANIMLOD_LOW ) ? sv_anim_lod_low_interval.GetFloat() : 0.0f;
+}
+
+//-----------------------------------------------------------------------------
+// Stats
+//-----------------------------------------------------------------------------
+static int64 volatile s_nSetups[ANIMLOD_COUNT];
+static int64 volatile s_nBones[ANIMLOD_COUNT];
+static int64 volatile s_nReuses[ANIMLOD_COUNT];
+static int64 volatile s_nReusedBones[ANIMLOD_COUNT];
+static float s_flStatsStartTime = 0.0f;
+
+void AnimLOD_RecordSetup( AnimLOD_t lod, int nBones )
+{
+	ThreadInterlockedExchangeAdd64( &s_nSetups[lod], 1 );
+	ThreadInterlockedExchangeAdd64( &s_nBones[lod], nBones );
+}
+
+void AnimLOD_RecordReuse( AnimLOD_t lod, int nBones )
+{
+	ThreadInterlockedExchangeAdd64( &s_nReuses[lod], 1 );
+	ThreadInterlockedExchangeAdd64( &s_nReusedBones[lod], nBones );
+}
+
+static void AnimLOD_ResetStats()
+{
+	for ( int i = 0; i < ANIMLOD_COUNT; i++ )
+	{
+		s_nSetups[i] = 0;
+		s_nBones[i] = 0;
+		s_nReuses[i] = 0;
+		s_nReusedBones[i] = 0;
+	}
+	s_flStatsStartTime = gpGlobals->curtime;
+}
+
+CON_COMMAND( sv_anim_lod_report, "Bones set up per second at each animation LOD. Pass 'reset' to start counting again." )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	// curtime goes back to zero on a level change
+	if ( s_flStatsStartTime > gpGlobals->curtime || ( args.ArgC() > 1 && !Q_stricmp( args[1], "reset" ) ) )
+	{
+		AnimLOD_ResetStats();
+		Msg( "Animation LOD stats reset\n" );
+		return;
+	}
+
+	static const char *s_pszLODNames[ANIMLOD_COUNT] = { "full", "medium", "low" };
+
+	float flSeconds = MAX( gpGlobals->curtime - s_flStatsStartTime, 0.001f );
+	Msg( "Animation LOD %s, over %.1f seconds of game time:\n", sv_anim_lod.GetBool() ? "on" : "off", flSeconds );
+	Msg( "lod      setups/s   bones/s  bones/setup  reused/s  reused bones/s\n" );
+
+	int64 nTotalBones = 0;
+	for ( int i = 0; i < ANIMLOD_COUNT; i++ )
+	{
+		nTotalBones += s_nBones[i];
+		Msg( "%-7s  %8.1f  %8.0f  %11.1f  %8.1f  %14.0f\n", s_pszLODNames[i],
+			s_nSetups[i] / flSeconds, s_nBones[i] / flSeconds,
+			s_nSetups[i] ? (float)s_nBones[i] / s_nSetups[i] : 0.0f,
+			s_nReuses[i] / flSeconds, s_nReusedBones[i] / flSeconds );
+	}
+	Msg( "total bones/s: %.0f\n", nTotalBones / flSeconds );
+}
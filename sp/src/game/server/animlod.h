@@ -0,0 +1,42 @@
+//=============================================================================//
+//
+// Purpose: Animation level of detail for server side bone setup. NPCs far
+//			from every player skip IK, blend fewer layers, keep fewer bones
+//			and set their bones up less often. Enabled with sv_anim_lod.
+//
+//=============================================================================//
+
+#ifndef ANIMLOD_H
+#define ANIMLOD_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+class CBaseAnimating;
+
+enum AnimLOD_t
+{
+	ANIMLOD_FULL = 0,	// everything, same as with sv_anim_lod 0
+	ANIMLOD_MEDIUM,		// no IK, fewer overlay layers
+	ANIMLOD_LOW,		// no IK or layers, hitbox and attachment bones only, bones reused for a while
+
+	ANIMLOD_COUNT
+};
+
+// Picks the LOD from the distance to the closest player and how much the entity matters
+AnimLOD_t	AnimLOD_Select( CBaseAnimating *pAnimating );
+
+// How many overlay layers to blend at a LOD
+int			AnimLOD_MaxLayers( AnimLOD_t lod );
+
+// Bones kept in the bone cache at a LOD
+int			AnimLOD_BoneCacheMask( AnimLOD_t lod, int boneMask );
+
+// How long the bone cache is reused for, moving it along with the entity, rather than set up again
+float		AnimLOD_ReuseInterval( AnimLOD_t lod );
+
+// Accounting for sv_anim_lod_report; safe to call from bone setup jobs
+void		AnimLOD_RecordSetup( AnimLOD_t lod, int nBones );
+void		AnimLOD_RecordReuse( AnimLOD_t lod, int nBones );
+
+#endif // ANIMLOD_H
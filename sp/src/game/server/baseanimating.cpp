@@ -26,6 +26,8 @@
 #include "physics_prop_ragdoll.h"
 #include "datacache/idatacache.h"
 #include "smoke_trail.h"
+#include "animlod.h"
+#include "vstdlib/jobtasks.h"
 #include "props.h"
 #ifdef MAPBASE
 #include "ai_speech.h"
@@ -381,6 +383,12 @@ CBaseAnimating::CBaseAnimating()
 	m_nNewSequenceParity = 0;
 	m_nResetEventsParity = 0;
 	m_boneCacheHandle = 0;
+	m_iMostRecentBoneCacheRequest = -1;
+	m_bBoneCachePrewarmed = false;
+	m_iAnimLODTick = -1;
+	m_nAnimLOD = ANIMLOD_FULL;
+	m_flBoneCacheSetupTime = -1.0f;
+	SetIdentityMatrix( m_BoneCacheEntityToWorld );
 	m_pStudioHdr = NULL;
 	m_fadeMinDist = 0;
 	m_fadeMaxDist = 0;
@@ -538,7 +546,10 @@ void CBaseAnimating::StudioFrameAdvanceInternal( CStudioHdr *pStudioHdr, float f
 		m_bSequenceFinished = true;
 	}
 
-	SetCycle( flNewCycle );
+	// Not SetCycle; playing on from here is what low animation LOD reuses the
+	// last pose through
+	m_flCycle = flNewCycle;
+	InvalidateBoneCacheIfPrewarmed();
 
 	/*
 	if (!IsPlayer())
@@ -560,7 +571,8 @@ void CBaseAnimating::InvalidateBoneCacheIfOlderThan( float deltaTime )
 	CBoneCache *pcache = Studio_GetBoneCache( m_boneCacheHandle );
 	if ( !pcache || !pcache->IsValid( gpGlobals->curtime, deltaTime ) )
 	{
-		InvalidateBoneCache();
+		// Only called as the animation plays on
+		InvalidateBoneCacheForPlayback();
 	}
 }
 
@@ -1088,7 +1100,12 @@ bool CBaseAnimating::IsValidSequence( int iSequence )
 void CBaseAnimating::SetSequence( int nSequence )
 {
 	Assert( nSequence == 0 || IsDynamicModelLoading() || ( GetModelPtr( ) && ( nSequence < GetModelPtr( )->GetNumSeq() ) && ( GetModelPtr( )->GetNumSeq() < (1 << ANIMATION_SEQUENCE_BITS) ) ) );
+	if ( nSequence != m_nSequence )
+	{
+		m_flBoneCacheSetupTime = -1.0f;
+	}
 	m_nSequence = nSequence;
+	InvalidateBoneCacheIfPrewarmed();
 }
 
 //=========================================================
@@ -1976,6 +1993,29 @@ bool CBaseAnimating::CanSkipAnimation( void )
 }
 
 
+int CBaseAnimating::GetAnimLOD( void )
+{
+	if ( m_iAnimLODTick != gpGlobals->tickcount )
+	{
+		m_nAnimLOD = AnimLOD_Select( this );
+		m_iAnimLODTick = gpGlobals->tickcount;
+	}
+	return m_nAnimLOD;
+}
+
+static int CountBonesInMask( const CStudioHdr *pStudioHdr, int boneMask )
+{
+	int nBones = 0;
+	for ( int i = 0; i < pStudioHdr->numbones(); i++ )
+	{
+		if ( pStudioHdr->boneFlags( i ) & boneMask )
+		{
+			nBones++;
+		}
+	}
+	return nBones;
+}
+
 void CBaseAnimating::SetupBones( matrix3x4_t *pBoneToWorld, int boneMask )
 {
 	AUTO_LOCK( m_BoneSetupMutex );
@@ -2012,7 +2052,10 @@ void CBaseAnimating::SetupBones( matrix3x4_t *pBoneToWorld, int boneMask )
 	}
 	else 
 	{
-		if ( m_pIk )
+		AnimLOD_t lod = (AnimLOD_t)GetAnimLOD();
+		AnimLOD_RecordSetup( lod, CountBonesInMask( pStudioHdr, boneMask ) );
+
+		if ( m_pIk && lod == ANIMLOD_FULL )
 		{
 			// FIXME: pass this into Studio_BuildMatrices to skip transforms
 			CBoneBitList boneComputed;
@@ -2872,6 +2915,81 @@ void CBaseAnimating::UnlockStudioHdr()
 	}
 }
 
+ConVar sv_threaded_bone_setup( "sv_threaded_bone_setup", "0", 0, "Set up the bones of NPCs and players that needed them last tick in parallel, at the start of the tick" );
+
+static CUtlVector< CHandle< CBaseAnimating > > g_PreviousBoneCacheRequests;
+static bool g_bInThreadedBoneSetup;
+int CBaseAnimating::s_iPrewarmedBoneCacheTick = -1;
+
+class CThreadedBoneSetupBody
+{
+public:
+	CThreadedBoneSetupBody( CBaseAnimating **ppAnimating ) : m_ppAnimating( ppAnimating ) {}
+
+	void operator()( int iFirst, int iLast )
+	{
+		mdlcache->BeginLock();
+
+		for ( int i = iFirst; i < iLast; i++ )
+		{
+			m_ppAnimating[i]->GetBoneCache();
+		}
+
+		mdlcache->EndLock();
+	}
+
+private:
+	CBaseAnimating **m_ppAnimating;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Most of what GetBoneCache() asks for at any point in a tick is for
+//			entities that haven't moved or animated yet this tick, so their
+//			bones can be worked out ahead of time. These caches are marked as
+//			prewarmed and dropped as soon as the entity animates, changes
+//			sequence or cycle, or moves, so it gets set up again lazily from
+//			wherever it is by then.
+//-----------------------------------------------------------------------------
+void CBaseAnimating::ThreadedBoneSetup()
+{
+	if ( sv_threaded_bone_setup.GetBool() && !ai_setupbones_debug.GetBool() )
+	{
+		CUtlVector< CBaseAnimating * > list( 0, g_PreviousBoneCacheRequests.Count() );
+		for ( int i = 0; i < g_PreviousBoneCacheRequests.Count(); i++ )
+		{
+			CBaseAnimating *pAnimating = g_PreviousBoneCacheRequests[i];
+			if ( !pAnimating || !( pAnimating->IsNPC() || pAnimating->IsPlayer() ) )
+				continue;
+
+			// IK traces against the world and bone merging reads the parent's cache,
+			// so leave those to the main thread
+			if ( pAnimating->m_pIk || pAnimating->GetMoveParent() || pAnimating->IsEFlagSet( EFL_SETTING_UP_BONES ) )
+				continue;
+
+			// These are computed on demand, so do it here rather than on the workers
+			if ( !pAnimating->GetModelPtr() )
+				continue;
+			pAnimating->GetAbsOrigin();
+			pAnimating->GetAbsAngles();
+
+			list.AddToTail( pAnimating );
+		}
+
+		if ( list.Count() > 1 )
+		{
+			g_bInThreadedBoneSetup = true;
+			s_iPrewarmedBoneCacheTick = gpGlobals->tickcount;
+
+			CThreadedBoneSetupBody body( list.Base() );
+			ParallelFor( "CBaseAnimating::ThreadedBoneSetup", 0, list.Count(), 1, body );
+
+			g_bInThreadedBoneSetup = false;
+		}
+	}
+
+	g_PreviousBoneCacheRequests.RemoveAll();
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: return the index to the shared bone cache
 // Output :
@@ -2881,6 +2999,12 @@ CBoneCache *CBaseAnimating::GetBoneCache( void )
 	CStudioHdr *pStudioHdr = GetModelPtr( );
 	Assert(pStudioHdr);
 
+	if ( !g_bInThreadedBoneSetup && m_iMostRecentBoneCacheRequest != gpGlobals->tickcount )
+	{
+		m_iMostRecentBoneCacheRequest = gpGlobals->tickcount;
+		g_PreviousBoneCacheRequests.AddToTail( this );
+	}
+
 	CBoneCache *pcache = Studio_GetBoneCache( m_boneCacheHandle );
 	int boneMask = BONE_USED_BY_HITBOX | BONE_USED_BY_ATTACHMENT;
 
@@ -2888,6 +3012,9 @@ CBoneCache *CBaseAnimating::GetBoneCache( void )
 #if defined( TF_DLL )
 	boneMask |= BONE_USED_BY_BONE_MERGE;
 #endif
+
+	AnimLOD_t lod = (AnimLOD_t)GetAnimLOD();
+	boneMask = AnimLOD_BoneCacheMask( lod, boneMask );
 	if ( pcache )
 	{
 		if ( pcache->IsValid( gpGlobals->curtime ) && (pcache->m_boneMask & boneMask) == boneMask && pcache->m_timeValid <= gpGlobals->curtime)
@@ -2905,9 +3032,30 @@ CBoneCache *CBaseAnimating::GetBoneCache( void )
 		}
 	}
 
+	// Low animation LODs keep the last pose for a while and just move it along with the entity
+	float flReuseInterval = AnimLOD_ReuseInterval( lod );
+	if ( pcache && flReuseInterval > 0.0f && m_flBoneCacheSetupTime >= 0.0f && 
+		gpGlobals->curtime >= m_flBoneCacheSetupTime && gpGlobals->curtime - m_flBoneCacheSetupTime < flReuseInterval )
+	{
+		matrix3x4_t worldToEntity, entityMove;
+		MatrixInvert( m_BoneCacheEntityToWorld, worldToEntity );
+		ConcatTransforms( EntityToWorldTransform(), worldToEntity, entityMove );
+		pcache->TransformBones( entityMove );
+		pcache->m_timeValid = gpGlobals->curtime;
+		MatrixCopy( EntityToWorldTransform(), m_BoneCacheEntityToWorld );
+		m_bBoneCachePrewarmed = g_bInThreadedBoneSetup;
+
+		AnimLOD_RecordReuse( lod, pcache->CachedBoneCount() );
+		return pcache;
+	}
+
 	matrix3x4_t bonetoworld[MAXSTUDIOBONES];
 	SetupBones( bonetoworld, boneMask );
 
+	m_flBoneCacheSetupTime = gpGlobals->curtime;
+	MatrixCopy( EntityToWorldTransform(), m_BoneCacheEntityToWorld );
+	m_bBoneCachePrewarmed = g_bInThreadedBoneSetup;
+
 	if ( pcache )
 	{
 		// still in memory but out of date, refresh the bones.
@@ -2932,6 +3080,16 @@ CBoneCache *CBaseAnimating::GetBoneCache( void )
 void CBaseAnimating::InvalidateBoneCache( void )
 {
 	Studio_InvalidateBoneCache( m_boneCacheHandle );
+	m_bBoneCachePrewarmed = false;
+
+	// Whatever changed, the last pose can't just be moved along with the entity
+	m_flBoneCacheSetupTime = -1.0f;
+}
+
+void CBaseAnimating::InvalidateBoneCacheForPlayback( void )
+{
+	Studio_InvalidateBoneCache( m_boneCacheHandle );
+	m_bBoneCachePrewarmed = false;
 }
 
 bool CBaseAnimating::TestCollision( const Ray_t &ray, unsigned int fContentsMask, trace_t& tr )
@@ -3102,12 +3260,15 @@ void CBaseAnimating::GetSkeleton( CStudioHdr *pStudioHdr, Vector pos[], Quaterni
 		return;
 	}
 
+	// IK is skipped at lower animation LODs
+	CIKContext *pIk = ( GetAnimLOD() == ANIMLOD_FULL ) ? m_pIk : NULL;
+
 	IBoneSetup boneSetup( pStudioHdr, boneMask, GetPoseParameterArray() );
 	boneSetup.InitPose( pos, q );
 
-	boneSetup.AccumulatePose( pos, q, GetSequence(), GetCycle(), 1.0, gpGlobals->curtime, m_pIk );
+	boneSetup.AccumulatePose( pos, q, GetSequence(), GetCycle(), 1.0, gpGlobals->curtime, pIk );
 
-	if ( m_pIk )
+	if ( pIk )
 	{
 		CIKContext auto_ik;
 		auto_ik.Init( pStudioHdr, GetAbsAngles(), GetAbsOrigin(), gpGlobals->curtime, 0, boneMask );
@@ -289,6 +289,18 @@ public:
 	class CBoneCache *GetBoneCache( void );
 	void InvalidateBoneCache();
 	void InvalidateBoneCacheIfOlderThan( float deltaTime );
+
+	// For when the animation has just played on, rather than jumped; the pose low
+	// animation LOD reuses is left alone
+	void InvalidateBoneCacheForPlayback();
+
+	// Sets up the bone caches of everything that used them last tick in parallel (sv_threaded_bone_setup)
+	static void ThreadedBoneSetup();
+
+	// A cache ThreadedBoneSetup made is stamped with this tick's time but was set up
+	// before anything moved or animated, so it has to go as soon as either happens
+	void InvalidateBoneCacheIfPrewarmed() { if ( m_bBoneCachePrewarmed ) InvalidateBoneCache(); }
+	static bool HasPrewarmedBoneCaches() { return s_iPrewarmedBoneCacheTick == gpGlobals->tickcount; }
 	virtual int DrawDebugTextOverlays( void );
 	
 	// See note in code re: bandwidth usage!!!
@@ -401,6 +413,9 @@ public: // From Alien Swarm SDK
 
 	bool CanSkipAnimation( void );
 
+	// Animation level of detail for this tick, see animlod.h
+	int GetAnimLOD( void );
+
 public:
 	CNetworkVar( int, m_nForceBone );
 	CNetworkVector( m_vecForce );
@@ -472,6 +487,13 @@ private:
 
 	memhandle_t		m_boneCacheHandle;
 	unsigned short	m_fBoneCacheFlags;		// Used for bone cache state on model
+	int				m_iMostRecentBoneCacheRequest;	// tick GetBoneCache was last called
+	bool			m_bBoneCachePrewarmed;			// the cache was set up by ThreadedBoneSetup
+	static int		s_iPrewarmedBoneCacheTick;		// tick ThreadedBoneSetup last set up any caches
+	int				m_iAnimLODTick;
+	unsigned char	m_nAnimLOD;
+	float			m_flBoneCacheSetupTime;			// when the bone cache was last set up rather than reused
+	matrix3x4_t		m_BoneCacheEntityToWorld;		// the entity's transform at the time
 
 protected:
 	CNetworkVar( float, m_fadeMinDist );	// Point at which fading is absolute
@@ -578,6 +600,10 @@ inline float CBaseAnimating::GetCycle() const
 inline void CBaseAnimating::SetCycle( float flCycle )
 {
 	m_flCycle = flCycle;
+	InvalidateBoneCacheIfPrewarmed();
+
+	// The pose reused at low animation LOD is from somewhere else in the sequence now
+	m_flBoneCacheSetupTime = -1.0f;
 }
 
 
@@ -0,0 +1,436 @@
+//=============================================================================//
+//
+// Purpose: Continuous accounting of the time spent thinking and simulating,
+//			per entity, per class and per think context.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "entitythinkprofiler.h"
+#include "filesystem.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+static void SV_ThinkProfileChanged( IConVar *pConVar, const char *pOldString, float flOldValue );
+
+static ConVar sv_thinkprofile( "sv_thinkprofile", "0", FCVAR_NONE, "Profile the time spent in every entity's thinks and physics simulation. Changing it resets the collected data.", SV_ThinkProfileChanged );
+static ConVar sv_thinkprofile_dump_interval( "sv_thinkprofile_dump_interval", "0", 0, "If > 0 and sv_thinkprofile is on, write the collected think profile to disk every this many seconds." );
+static ConVar sv_thinkprofile_dump_format( "sv_thinkprofile_dump_format", "csv", 0, "Format of the think profile dump: csv (appended to) or json (overwritten)." );
+static ConVar sv_thinkprofile_dump_file( "sv_thinkprofile_dump_file", "thinkprofile", 0, "Name of the think profile dump, without extension. Written to the game directory." );
+
+CEntityThinkProfiler g_EntityThinkProfiler( "CEntityThinkProfiler" );
+
+static void SV_ThinkProfileChanged( IConVar *pConVar, const char *pOldString, float flOldValue )
+{
+	ConVarRef var( pConVar );
+	g_EntityThinkProfiler.SetEnabled( var.GetBool() );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: One line of a report, flattened from any of the three tables
+//-----------------------------------------------------------------------------
+struct ThinkProfileRow_t
+{
+	const char					*m_pszType;
+	int							m_nIndex;
+	const char					*m_pszName;
+	const char					*m_pszClassname;
+	const char					*m_pszContext;
+	const ThinkProfileStats_t	*m_pThink;
+	const ThinkProfileStats_t	*m_pSimulate;
+
+	// Simulation includes the thinks run from it, so rank by whichever is larger
+	uint64 GetSortCycles() const
+	{
+		uint64 nThink = m_pThink ? m_pThink->m_Total.GetLongCycles() : 0;
+		uint64 nSimulate = m_pSimulate ? m_pSimulate->m_Total.GetLongCycles() : 0;
+		return MAX( nThink, nSimulate );
+	}
+
+	int GetCalls() const
+	{
+		return m_pThink && m_pThink->m_nCalls ? m_pThink->m_nCalls : ( m_pSimulate ? m_pSimulate->m_nCalls : 0 );
+	}
+
+	double GetThinkMS() const { return m_pThink ? m_pThink->m_Total.GetMillisecondsF() : 0.0; }
+	double GetSimulateMS() const { return m_pSimulate ? m_pSimulate->m_Total.GetMillisecondsF() : 0.0; }
+
+	double GetPeakUS() const
+	{
+		double flThink = m_pThink ? m_pThink->m_Peak.GetMicrosecondsF() : 0.0;
+		double flSimulate = m_pSimulate ? m_pSimulate->m_Peak.GetMicrosecondsF() : 0.0;
+		return MAX( flThink, flSimulate );
+	}
+};
+
+static int __cdecl ThinkProfileRowSort( const ThinkProfileRow_t *pLeft, const ThinkProfileRow_t *pRight )
+{
+	uint64 nLeft = pLeft->GetSortCycles();
+	uint64 nRight = pRight->GetSortCycles();
+	if ( nLeft == nRight )
+		return 0;
+
+	return ( nLeft > nRight ) ? -1 : 1;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+CEntityThinkProfiler::CEntityThinkProfiler( char const *name ) : CAutoGameSystemPerFrame( name ),
+	m_Classes( DefLessFunc( const char * ) ),
+	m_Contexts( ContextLessFunc )
+{
+	m_bEnabled = false;
+	m_flNextDumpTime = 0;
+	Reset();
+}
+
+bool CEntityThinkProfiler::ContextLessFunc( const ContextKey_t &lhs, const ContextKey_t &rhs )
+{
+	int nCompare = Q_strcmp( lhs.m_pszClassname, rhs.m_pszClassname );
+	if ( nCompare != 0 )
+		return nCompare < 0;
+
+	return Q_strcmp( lhs.m_pszContext, rhs.m_pszContext ) < 0;
+}
+
+void CEntityThinkProfiler::SetEnabled( bool bEnabled )
+{
+	Reset();
+	m_bEnabled = bEnabled;
+	m_flNextDumpTime = Plat_FloatTime() + sv_thinkprofile_dump_interval.GetFloat();
+}
+
+void CEntityThinkProfiler::Reset()
+{
+	for ( int i = 0; i < NUM_ENT_ENTRIES; i++ )
+	{
+		m_Entities[i].m_nSerial = -1;
+	}
+
+	m_Classes.RemoveAll();
+	m_Contexts.RemoveAll();
+	m_nStartTick = gpGlobals ? gpGlobals->tickcount : 0;
+}
+
+int CEntityThinkProfiler::GetProfiledTicks() const
+{
+	return MAX( gpGlobals->tickcount - m_nStartTick, 1 );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Entity indices and think contexts don't survive a level change, and
+//			the class and context keys point into the level's string pool, so
+//			they go whether or not we're profiling.
+//-----------------------------------------------------------------------------
+void CEntityThinkProfiler::LevelShutdownPostEntity()
+{
+	Reset();
+}
+
+void CEntityThinkProfiler::LevelInitPostEntity()
+{
+	if ( m_bEnabled )
+	{
+		Reset();
+	}
+}
+
+void CEntityThinkProfiler::FrameUpdatePostEntityThink()
+{
+	if ( !m_bEnabled || sv_thinkprofile_dump_interval.GetFloat() <= 0 )
+		return;
+
+	double flNow = Plat_FloatTime();
+	if ( flNow < m_flNextDumpTime )
+		return;
+
+	m_flNextDumpTime = flNow + sv_thinkprofile_dump_interval.GetFloat();
+	Dump();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+void CEntityThinkProfiler::Record( const CBaseHandle &hEntity, const char *pszClassname, string_t iszName,
+	const char *pszContext, bool bSimulate, const CCycleCount &duration )
+{
+	// Index reused by a new entity, start over
+	EntityStats_t &entity = m_Entities[hEntity.GetEntryIndex()];
+	if ( entity.m_nSerial != hEntity.GetSerialNumber() )
+	{
+		entity.m_nSerial = hEntity.GetSerialNumber();
+		entity.m_Think.Reset();
+		entity.m_Simulate.Reset();
+	}
+
+	entity.m_pszClassname = pszClassname;
+	entity.m_iszName = iszName;
+
+	unsigned short iClass = m_Classes.Find( pszClassname );
+	if ( iClass == m_Classes.InvalidIndex() )
+	{
+		iClass = m_Classes.Insert( pszClassname );
+	}
+
+	if ( bSimulate )
+	{
+		entity.m_Simulate.Add( duration );
+		m_Classes[iClass].m_Simulate.Add( duration );
+		return;
+	}
+
+	entity.m_Think.Add( duration );
+	m_Classes[iClass].m_Think.Add( duration );
+
+	ContextKey_t key;
+	key.m_pszClassname = pszClassname;
+	key.m_pszContext = pszContext ? pszContext : "";
+
+	unsigned short iContext = m_Contexts.Find( key );
+	if ( iContext == m_Contexts.InvalidIndex() )
+	{
+		iContext = m_Contexts.Insert( key );
+	}
+
+	m_Contexts[iContext].Add( duration );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Prints the N most expensive entities, classes or contexts
+//-----------------------------------------------------------------------------
+void CEntityThinkProfiler::ReportTop( int nCount, const char *pszWhat )
+{
+	CUtlVector< ThinkProfileRow_t > rows;
+
+	if ( !Q_stricmp( pszWhat, "classes" ) )
+	{
+		FOR_EACH_MAP_FAST( m_Classes, i )
+		{
+			ThinkProfileRow_t row = { "class", -1, "", m_Classes.Key( i ), "", &m_Classes[i].m_Think, &m_Classes[i].m_Simulate };
+			rows.AddToTail( row );
+		}
+	}
+	else if ( !Q_stricmp( pszWhat, "contexts" ) )
+	{
+		FOR_EACH_MAP_FAST( m_Contexts, i )
+		{
+			ThinkProfileRow_t row = { "context", -1, "", m_Contexts.Key( i ).m_pszClassname, m_Contexts.Key( i ).m_pszContext, &m_Contexts[i], NULL };
+			rows.AddToTail( row );
+		}
+	}
+	else
+	{
+		for ( int i = 0; i < NUM_ENT_ENTRIES; i++ )
+		{
+			if ( m_Entities[i].m_nSerial == -1 )
+				continue;
+
+			ThinkProfileRow_t row = { "entity", i, STRING( m_Entities[i].m_iszName ), m_Entities[i].m_pszClassname, "", &m_Entities[i].m_Think, &m_Entities[i].m_Simulate };
+			rows.AddToTail( row );
+		}
+	}
+
+	rows.Sort( ThinkProfileRowSort );
+
+	int nTicks = GetProfiledTicks();
+	Msg( "Think profile over %d ticks (%.1f seconds), top %d %s:\n", nTicks, TICKS_TO_TIME( nTicks ), nCount, pszWhat );
+	Msg( "  %-6s %-32s %-24s %-24s %8s %10s %10s %9s\n", "index", "class", "name", "context", "calls", "think/tick", "sim/tick", "peak" );
+
+	for ( int i = 0; i < rows.Count() && i < nCount; i++ )
+	{
+		const ThinkProfileRow_t &row = rows[i];
+		Msg( "  %-6d %-32s %-24s %-24s %8d %8.3fms %8.3fms %7.1fus\n",
+			row.m_nIndex, row.m_pszClassname, row.m_pszName, row.m_pszContext, row.GetCalls(),
+			row.GetThinkMS() / nTicks, row.GetSimulateMS() / nTicks, row.GetPeakUS() );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Writes everything collected so far in the sv_thinkprofile_dump_format
+//-----------------------------------------------------------------------------
+void CEntityThinkProfiler::Dump()
+{
+	char szFilename[MAX_PATH];
+	if ( !Q_stricmp( sv_thinkprofile_dump_format.GetString(), "json" ) )
+	{
+		Q_snprintf( szFilename, sizeof( szFilename ), "%s.json", sv_thinkprofile_dump_file.GetString() );
+		DumpJSON( szFilename );
+	}
+	else
+	{
+		Q_snprintf( szFilename, sizeof( szFilename ), "%s.csv", sv_thinkprofile_dump_file.GetString() );
+		DumpCSV( szFilename );
+	}
+}
+
+// Names come from the map, so don't trust them to be free of separators
+static void ThinkProfile_SanitizeName( const char *pszIn, char *pszOut, int nOutSize )
+{
+	int j = 0;
+	for ( int i = 0; pszIn[i] && j < nOutSize - 1; i++ )
+	{
+		char c = pszIn[i];
+		if ( c == '"' || c == '\\' || c == ',' || c < ' ' )
+		{
+			c = '_';
+		}
+		pszOut[j++] = c;
+	}
+	pszOut[j] = 0;
+}
+
+void CEntityThinkProfiler::DumpCSV( const char *pszFilename )
+{
+	bool bNewFile = !filesystem->FileExists( pszFilename, "DEFAULT_WRITE_PATH" );
+
+	FileHandle_t fh = filesystem->Open( pszFilename, "at", "DEFAULT_WRITE_PATH" );
+	if ( !fh )
+	{
+		Warning( "Unable to open %s for writing\n", pszFilename );
+		return;
+	}
+
+	if ( bNewFile )
+	{
+		filesystem->FPrintf( fh, "time,tick,map,type,index,name,class,context,calls,think_ms,simulate_ms,peak_us\n" );
+	}
+
+	float flTime = gpGlobals->curtime;
+	int nTick = gpGlobals->tickcount;
+	const char *pszMap = STRING( gpGlobals->mapname );
+	char szName[128];
+
+	FOR_EACH_MAP_FAST( m_Classes, i )
+	{
+		const ClassStats_t &stats = m_Classes[i];
+		filesystem->FPrintf( fh, "%.3f,%d,%s,class,-1,,%s,,%d,%.4f,%.4f,%.1f\n", flTime, nTick, pszMap,
+			m_Classes.Key( i ), stats.m_Think.m_nCalls ? stats.m_Think.m_nCalls : stats.m_Simulate.m_nCalls,
+			stats.m_Think.m_Total.GetMillisecondsF(), stats.m_Simulate.m_Total.GetMillisecondsF(),
+			MAX( stats.m_Think.m_Peak.GetMicrosecondsF(), stats.m_Simulate.m_Peak.GetMicrosecondsF() ) );
+	}
+
+	FOR_EACH_MAP_FAST( m_Contexts, i )
+	{
+		const ThinkProfileStats_t &stats = m_Contexts[i];
+		filesystem->FPrintf( fh, "%.3f,%d,%s,context,-1,,%s,%s,%d,%.4f,0,%.1f\n", flTime, nTick, pszMap,
+			m_Contexts.Key( i ).m_pszClassname, m_Contexts.Key( i ).m_pszContext, stats.m_nCalls,
+			stats.m_Total.GetMillisecondsF(), stats.m_Peak.GetMicrosecondsF() );
+	}
+
+	for ( int i = 0; i < NUM_ENT_ENTRIES; i++ )
+	{
+		const EntityStats_t &stats = m_Entities[i];
+		if ( stats.m_nSerial == -1 )
+			continue;
+
+		ThinkProfile_SanitizeName( STRING( stats.m_iszName ), szName, sizeof( szName ) );
+		filesystem->FPrintf( fh, "%.3f,%d,%s,entity,%d,%s,%s,,%d,%.4f,%.4f,%.1f\n", flTime, nTick, pszMap,
+			i, szName, stats.m_pszClassname, stats.m_Think.m_nCalls ? stats.m_Think.m_nCalls : stats.m_Simulate.m_nCalls,
+			stats.m_Think.m_Total.GetMillisecondsF(), stats.m_Simulate.m_Total.GetMillisecondsF(),
+			MAX( stats.m_Think.m_Peak.GetMicrosecondsF(), stats.m_Simulate.m_Peak.GetMicrosecondsF() ) );
+	}
+
+	filesystem->Close( fh );
+}
+
+void CEntityThinkProfiler::DumpJSON( const char *pszFilename )
+{
+	FileHandle_t fh = filesystem->Open( pszFilename, "wt", "DEFAULT_WRITE_PATH" );
+	if ( !fh )
+	{
+		Warning( "Unable to open %s for writing\n", pszFilename );
+		return;
+	}
+
+	char szName[128];
+
+	filesystem->FPrintf( fh, "{\n\t\"time\": %.3f,\n\t\"tick\": %d,\n\t\"ticks\": %d,\n\t\"map\": \"%s\",\n",
+		gpGlobals->curtime, gpGlobals->tickcount, GetProfiledTicks(), STRING( gpGlobals->mapname ) );
+
+	const char *pszSeparator = "";
+	filesystem->FPrintf( fh, "\t\"classes\": [" );
+	FOR_EACH_MAP_FAST( m_Classes, i )
+	{
+		const ClassStats_t &stats = m_Classes[i];
+		filesystem->FPrintf( fh, "%s\n\t\t{ \"class\": \"%s\", \"think_calls\": %d, \"think_ms\": %.4f, \"think_peak_us\": %.1f, \"simulate_calls\": %d, \"simulate_ms\": %.4f, \"simulate_peak_us\": %.1f }",
+			pszSeparator, m_Classes.Key( i ),
+			stats.m_Think.m_nCalls, stats.m_Think.m_Total.GetMillisecondsF(), stats.m_Think.m_Peak.GetMicrosecondsF(),
+			stats.m_Simulate.m_nCalls, stats.m_Simulate.m_Total.GetMillisecondsF(), stats.m_Simulate.m_Peak.GetMicrosecondsF() );
+		pszSeparator = ",";
+	}
+	filesystem->FPrintf( fh, "\n\t],\n" );
+
+	pszSeparator = "";
+	filesystem->FPrintf( fh, "\t\"contexts\": [" );
+	FOR_EACH_MAP_FAST( m_Contexts, i )
+	{
+		const ThinkProfileStats_t &stats = m_Contexts[i];
+		filesystem->FPrintf( fh, "%s\n\t\t{ \"class\": \"%s\", \"context\": \"%s\", \"calls\": %d, \"ms\": %.4f, \"peak_us\": %.1f }",
+			pszSeparator, m_Contexts.Key( i ).m_pszClassname, m_Contexts.Key( i ).m_pszContext,
+			stats.m_nCalls, stats.m_Total.GetMillisecondsF(), stats.m_Peak.GetMicrosecondsF() );
+		pszSeparator = ",";
+	}
+	filesystem->FPrintf( fh, "\n\t],\n" );
+
+	pszSeparator = "";
+	filesystem->FPrintf( fh, "\t\"entities\": [" );
+	for ( int i = 0; i < NUM_ENT_ENTRIES; i++ )
+	{
+		const EntityStats_t &stats = m_Entities[i];
+		if ( stats.m_nSerial == -1 )
+			continue;
+
+		ThinkProfile_SanitizeName( STRING( stats.m_iszName ), szName, sizeof( szName ) );
+		filesystem->FPrintf( fh, "%s\n\t\t{ \"index\": %d, \"name\": \"%s\", \"class\": \"%s\", \"think_calls\": %d, \"think_ms\": %.4f, \"think_peak_us\": %.1f, \"simulate_calls\": %d, \"simulate_ms\": %.4f, \"simulate_peak_us\": %.1f }",
+			pszSeparator, i, szName, stats.m_pszClassname,
+			stats.m_Think.m_nCalls, stats.m_Think.m_Total.GetMillisecondsF(), stats.m_Think.m_Peak.GetMicrosecondsF(),
+			stats.m_Simulate.m_nCalls, stats.m_Simulate.m_Total.GetMillisecondsF(), stats.m_Simulate.m_Peak.GetMicrosecondsF() );
+		pszSeparator = ",";
+	}
+	filesystem->FPrintf( fh, "\n\t]\n}\n" );
+
+	filesystem->Close( fh );
+}
+
+//-----------------------------------------------------------------------------
+// Console commands
+//-----------------------------------------------------------------------------
+CON_COMMAND( sv_thinkprofile_top, "Show the most expensive thinkers. Usage: sv_thinkprofile_top [count] [entities|classes|contexts]" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( !g_EntityThinkProfiler.IsEnabled() )
+	{
+		Msg( "sv_thinkprofile is off.\n" );
+		return;
+	}
+
+	int nCount = ( args.ArgC() > 1 ) ? MAX( atoi( args[1] ), 1 ) : 20;
+	const char *pszWhat = ( args.ArgC() > 2 ) ? args[2] : "entities";
+	g_EntityThinkProfiler.ReportTop( nCount, pszWhat );
+}
+
+CON_COMMAND( sv_thinkprofile_reset, "Clear the data collected by sv_thinkprofile." )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	g_EntityThinkProfiler.Reset();
+}
+
+CON_COMMAND( sv_thinkprofile_dump, "Write the data collected by sv_thinkprofile to sv_thinkprofile_dump_file." )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( !g_EntityThinkProfiler.IsEnabled() )
+	{
+		Msg( "sv_thinkprofile is off.\n" );
+		return;
+	}
+
+	g_EntityThinkProfiler.Dump();
+}
@@ -0,0 +1,158 @@
+//=============================================================================//
+//
+// Purpose: Continuous accounting of the time spent thinking and simulating,
+//			per entity, per class and per think context. Enabled with
+//			sv_thinkprofile; see sv_thinkprofile_top and sv_thinkprofile_dump.
+//
+//=============================================================================//
+
+#ifndef ENTITYTHINKPROFILER_H
+#define ENTITYTHINKPROFILER_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "igamesystem.h"
+#include "tier0/fasttimer.h"
+#include "tier1/utlmap.h"
+
+//-----------------------------------------------------------------------------
+// Purpose: Call count, total and worst single call of one kind of work
+//-----------------------------------------------------------------------------
+struct ThinkProfileStats_t
+{
+	ThinkProfileStats_t()
+	{
+		Reset();
+	}
+
+	void Reset()
+	{
+		m_Total.Init();
+		m_Peak.Init();
+		m_nCalls = 0;
+	}
+
+	void Add( const CCycleCount &duration )
+	{
+		m_Total += duration;
+		if ( m_Peak.IsLessThan( duration ) )
+		{
+			m_Peak = duration;
+		}
+		++m_nCalls;
+	}
+
+	CCycleCount	m_Total;
+	CCycleCount	m_Peak;
+	int			m_nCalls;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Accumulates think and simulate cost since the last reset
+//-----------------------------------------------------------------------------
+class CEntityThinkProfiler : public CAutoGameSystemPerFrame
+{
+public:
+	CEntityThinkProfiler( char const *name );
+
+	// game system
+	virtual void LevelInitPostEntity();
+	virtual void LevelShutdownPostEntity();
+	virtual void FrameUpdatePostEntityThink();
+
+	bool	IsEnabled() const { return m_bEnabled; }
+	void	SetEnabled( bool bEnabled );
+
+	// pszContext is NULL for the base think. bSimulate is set for the whole of
+	// Physics_SimulateEntity, which includes the thinks run from it.
+	void	Record( const CBaseHandle &hEntity, const char *pszClassname, string_t iszName,
+					const char *pszContext, bool bSimulate, const CCycleCount &duration );
+
+	void	Reset();
+	void	ReportTop( int nCount, const char *pszWhat );
+	void	Dump();
+
+private:
+	struct EntityStats_t
+	{
+		int					m_nSerial;		// -1 when the slot is unused
+		const char			*m_pszClassname;
+		string_t			m_iszName;
+		ThinkProfileStats_t	m_Think;
+		ThinkProfileStats_t	m_Simulate;
+	};
+
+	struct ClassStats_t
+	{
+		ThinkProfileStats_t	m_Think;
+		ThinkProfileStats_t	m_Simulate;
+	};
+
+	struct ContextKey_t
+	{
+		const char	*m_pszClassname;
+		const char	*m_pszContext;
+	};
+
+	static bool ContextLessFunc( const ContextKey_t &lhs, const ContextKey_t &rhs );
+
+	void	DumpCSV( const char *pszFilename );
+	void	DumpJSON( const char *pszFilename );
+	int		GetProfiledTicks() const;
+
+	bool	m_bEnabled;
+	int		m_nStartTick;
+	double	m_flNextDumpTime;
+
+	EntityStats_t									m_Entities[NUM_ENT_ENTRIES];
+	CUtlMap< const char *, ClassStats_t >			m_Classes;
+	CUtlMap< ContextKey_t, ThinkProfileStats_t >	m_Contexts;
+};
+
+extern CEntityThinkProfiler g_EntityThinkProfiler;
+
+//-----------------------------------------------------------------------------
+// Purpose: Times the enclosing block and charges it to an entity
+//-----------------------------------------------------------------------------
+class CEntityThinkProfileScope
+{
+public:
+	CEntityThinkProfileScope( CBaseEntity *pEntity, const char *pszContext, bool bSimulate = false );
+	~CEntityThinkProfileScope();
+
+private:
+	bool		m_bActive;
+	bool		m_bSimulate;
+	CBaseHandle	m_hEntity;
+	const char	*m_pszClassname;
+	const char	*m_pszContext;
+	string_t	m_iszName;
+	CFastTimer	m_Timer;
+};
+
+inline CEntityThinkProfileScope::CEntityThinkProfileScope( CBaseEntity *pEntity, const char *pszContext, bool bSimulate )
+{
+	m_bActive = g_EntityThinkProfiler.IsEnabled();
+	if ( !m_bActive )
+		return;
+
+	// The entity may be removed by the time we're done, so grab what we need now
+	m_bSimulate = bSimulate;
+	m_hEntity = pEntity->GetRefEHandle();
+	m_pszClassname = pEntity->GetClassname();
+	m_pszContext = pszContext;
+	m_iszName = pEntity->GetEntityName();
+	m_Timer.Start();
+}
+
+inline CEntityThinkProfileScope::~CEntityThinkProfileScope()
+{
+	if ( !m_bActive )
+		return;
+
+	m_Timer.End();
+	g_EntityThinkProfiler.Record( m_hEntity, m_pszClassname, m_iszName, m_pszContext, m_bSimulate, m_Timer.GetDuration() );
+}
+
+#endif // ENTITYTHINKPROFILER_H
@@ -67,6 +67,7 @@
 #include "util.h"
 #include "tier0/icommandline.h"
 #include "datacache/imdlcache.h"
+#include "bone_setup.h"
 #include "engine/iserverplugin.h"
 #ifdef _WIN32
 #include "ienginevgui.h"
@@ -1275,6 +1276,8 @@ void CServerGameDLL::GameFrame( bool simulating )
 	UpdateQueryCache();
 	g_pServerBenchmark->UpdateBenchmark();
 
+	CBaseAnimating::ThreadedBoneSetup();
+
 	Physics_RunThinkFunctions( simulating );
 	
 	IGameSystem::FrameUpdatePostEntityThinkAllSystems();
@@ -1423,6 +1426,9 @@ void CServerGameDLL::LevelShutdown( void )
 
 	InvalidateQueryCache();
 
+	// Models may be unloaded after this, so drop anything pointing into their animations
+	Studio_FlushAnimValueIndex();
+
 	IGameSystem::LevelShutdownPostEntityAllSystems();
 
 	// In case we quit out during initial load
@@ -2565,6 +2571,8 @@ inline void CServerNetworkProperty::CheckTransmit( CCheckTransmitInfo *pInfo )
 
 void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned short *pEdictIndices, int nEdicts )
 {
+	SERVER_BENCHMARK_SCOPE( SERVER_BENCHMARK_TRANSMIT );
+
 	// NOTE: for speed's sake, this assumes that all networkables are CBaseEntities and that the edict list
 	// is consecutive in memory. If either of these things change, then this routine needs to change, but
 	// ideally we won't be calling any virtual from this routine. This speedy routine was added as an
@@ -46,6 +46,7 @@ public:
 	void DieThink( void );
 	void LimitVelocity( void );
 	virtual bool SUB_AllowedToFade( void );
+	virtual bool CanDeferThink() { return true; }
 
 	void Use( CBaseEntity *pActivator, CBaseEntity *pCaller, USE_TYPE useType, float value );
 
@@ -586,7 +586,7 @@ void CHL2MP_Player::PlayerDeathThink()
 void CHL2MP_Player::FireBullets ( const FireBulletsInfo_t &info )
 {
 	// Move other players back to history positions based on local player's lag
-	lagcompensation->StartLagCompensation( this, this->GetCurrentCommand() );
+	lagcompensation->StartBulletLagCompensation( this, this->GetCurrentCommand() );
 
 	FireBulletsInfo_t modinfo = info;
 
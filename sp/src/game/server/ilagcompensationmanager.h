@@ -11,8 +11,13 @@
 #pragma once
 #endif
 
+class CBaseEntity;
 class CBasePlayer;
 class CUserCmd;
+class CTraceFilterSimpleList;
+class CGameTrace;
+typedef CGameTrace trace_t;
+struct Ray_t;
 
 //-----------------------------------------------------------------------------
 // Purpose: This is also an IServerSystem
@@ -23,6 +28,22 @@ public:
 	// Called during player movement to set up/restore after lag compensation
 	virtual void	StartLagCompensation( CBasePlayer *player, CUserCmd *cmd ) = 0;
 	virtual void	FinishLagCompensation( CBasePlayer *player ) = 0;
+
+	// For callers that only fire bullets through FireBullets. With sv_unlag_hitboxes
+	// this leaves entities where they are and has the bullets tested against their
+	// recorded hitboxes; StartLagCompensation always moves them back.
+	virtual void	StartBulletLagCompensation( CBasePlayer *player, CUserCmd *cmd ) = 0;
+
+	// Non-player entities (NPCs, vehicles) that should be lag compensated too
+	virtual void	AddAdditionalEntity( CBaseEntity *pEntity ) = 0;
+	virtual void	RemoveAdditionalEntity( CBaseEntity *pEntity ) = 0;
+
+	// With sv_unlag_hitboxes, StartBulletLagCompensation leaves entities where they are.
+	// Bullet traces should ignore the compensated entities and then be clipped
+	// against their recorded hitboxes instead.
+	virtual bool	IsCompensatingHitboxes() const = 0;
+	virtual void	IgnoreHitboxCompensatedEntities( CTraceFilterSimpleList *pFilter ) = 0;
+	virtual bool	ClipRayToHitboxHistory( const Ray_t &ray, unsigned int fMask, trace_t *pTrace ) = 0;
 };
 
 extern ILagCompensationManager *lagcompensation;
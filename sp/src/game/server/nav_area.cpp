@@ -14,7 +14,7 @@
 #include "tier0/vprof.h"
 #include "tier0/tslist.h"
 #include "tier1/utlhash.h"
-#include "vstdlib/jobthread.h"
+#include "vstdlib/jobtasks.h"
 
 #include "nav_mesh.h"
 #include "nav_node.h"
@@ -5525,7 +5525,8 @@ void CNavArea::ResetPotentiallyVisibleAreas()
  */
 
 CNavArea *g_pCurVisArea;
-CTSListWithFreeList< CNavArea::AreaBindInfo > g_ComputedVis;
+CUtlVector< CNavArea * > *g_pVisAreas;
+CJobPerThread< CUtlVector< CNavArea::AreaBindInfo > > g_ComputedVis;
 
 void CNavArea::ComputeVisToArea( CNavArea *&pOtherArea )
 {
@@ -5560,7 +5561,7 @@ void CNavArea::ComputeVisToArea( CNavArea *&pOtherArea )
 	{
 		info.area = area;
 		info.attributes = visThisToOther;
-		g_ComputedVis.PushItem( info );
+		g_ComputedVis.Local().AddToTail( info );
 	}
 
 	if ( visOtherToThis != NOT_VISIBLE )
@@ -5571,6 +5572,14 @@ void CNavArea::ComputeVisToArea( CNavArea *&pOtherArea )
 	}
 }
 
+void CNavArea::ComputeVisToAreas( int iFirst, int iLast )
+{
+	for ( int i = iFirst; i < iLast; i++ )
+	{
+		ComputeVisToArea( g_pVisAreas->Element( i ) );
+	}
+}
+
 
 //--------------------------------------------------------------------------------------------------------
 /**
@@ -5609,12 +5618,25 @@ void CNavArea::ComputeVisibilityToMesh( void )
 	SetupPVS();
 
 	g_pCurVisArea = this;
-	ParallelProcess( "CNavArea::ComputeVisibilityToMesh", collector.m_area.Base(), collector.m_area.Count(), &ComputeVisToArea );
+	g_pVisAreas = &collector.m_area;
+	ParallelFor( "CNavArea::ComputeVisibilityToMesh", 0, collector.m_area.Count(), 1, ComputeVisToAreas );
+	g_pVisAreas = NULL;
 
-	m_potentiallyVisibleAreas.EnsureCapacity( g_ComputedVis.Count() );
-	while ( g_ComputedVis.Count() )
+	int nComputed = 0;
+	for ( int i = 0; i < g_ComputedVis.Count(); i++ )
 	{
-		g_ComputedVis.PopItem( &m_potentiallyVisibleAreas[ m_potentiallyVisibleAreas.AddToTail() ] );
+		nComputed += g_ComputedVis[i].Count();
+	}
+
+	m_potentiallyVisibleAreas.EnsureCapacity( m_potentiallyVisibleAreas.Count() + nComputed );
+	for ( int i = 0; i < g_ComputedVis.Count(); i++ )
+	{
+		CUtlVector< AreaBindInfo > &computed = g_ComputedVis[i];
+		for ( int j = 0; j < computed.Count(); j++ )
+		{
+			m_potentiallyVisibleAreas.AddToTail( computed[j] );
+		}
+		computed.RemoveAll();
 	}
 
 	FOR_EACH_VEC( collector.m_area, it )
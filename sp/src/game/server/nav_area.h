@@ -739,6 +739,7 @@ private:
 	void ComputeVisibilityToMesh( void );						// compute visibility to surrounding mesh
 	void ResetPotentiallyVisibleAreas();
 	static void ComputeVisToArea( CNavArea *&pOtherArea );
+	static void ComputeVisToAreas( int iFirst, int iLast );		// ComputeVisToArea for a range of g_pVisAreas
 
 #ifndef _X360
 	typedef CUtlVectorConservative<AreaBindInfo> CAreaBindInfoArray; // shaves 8 bytes off structure caused by need to support editing
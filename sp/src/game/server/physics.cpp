@@ -45,6 +45,7 @@
 #include "positionwatcher.h"
 #include "tier1/callqueue.h"
 #include "vphysics/constraints.h"
+#include "serverbenchmark_base.h"
 
 #ifdef PORTAL
 #include "portal_physics_collisionevent.h"
@@ -374,6 +375,7 @@ bool CPhysicsHook::FindOrAddVehicleScript( const char *pScriptName, vehicleparam
 void CPhysicsHook::FrameUpdatePostEntityThink( ) 
 {
 	VPROF_BUDGET( "CPhysicsHook::FrameUpdatePostEntityThink", VPROF_BUDGETGROUP_PHYSICS );
+	SERVER_BENCHMARK_SCOPE( SERVER_BENCHMARK_PHYSICS );
 
 	// Tracker 24846:  If game is paused, don't simulate vphysics
 	float interval = ( gpGlobals->frametime > 0.0f ) ? TICK_INTERVAL : 0.0f;
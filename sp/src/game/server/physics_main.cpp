@@ -33,6 +33,9 @@
 #include "vphysicsupdateai.h"
 #include "tier0/vcrmode.h"
 #include "pushentity.h"
+#include "entitythinkprofiler.h"
+#include "thinkbudget.h"
+#include "serverbenchmark_base.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -1966,6 +1969,7 @@ void Physics_SimulateEntity( CBaseEntity *pEntity )
 #endif
 
 		MDLCACHE_CRITICAL_SECTION();
+		CEntityThinkProfileScope profileSimulate( pEntity, NULL, true );
 
 #if !defined( NO_ENTITY_PREDICTION )
 		// If an object was at one point player simulated, but had that status revoked (as just
@@ -2019,6 +2023,7 @@ void Physics_SimulateEntity( CBaseEntity *pEntity )
 void Physics_RunThinkFunctions( bool simulating )
 {
 	VPROF( "Physics_RunThinkFunctions");
+	SERVER_BENCHMARK_SCOPE( SERVER_BENCHMARK_THINK );
 
 	g_bTestMoveTypeStepSimulation = sv_teststepsimulation.GetBool();
 
@@ -2055,14 +2060,18 @@ void Physics_RunThinkFunctions( bool simulating )
 		int count = SimThink_ListCopy( list, listMax );
 
 		//DevMsg(1, "Count: %d\n", count );
+		g_ThinkBudget.BeginThinks();
 		for ( int i = 0; i < count; i++ )
 		{
 			if ( !list[i] )
 				continue;
+			// Deferred entities still move, only their thinks wait
+			g_ThinkBudget.SetDeferredEntity( g_ThinkBudget.ShouldDefer( list[i] ) ? list[i] : NULL );
 			// Always reset clock to real sv.time
 			gpGlobals->curtime = starttime;
 			Physics_SimulateEntity( list[i] );
 		}
+		g_ThinkBudget.EndThinks();
 
 		stackfree( list );
 		UTIL_EnableRemoveImmediate();
@@ -14,6 +14,7 @@
 #include "movehelper_server.h"
 #include "iservervehicle.h"
 #include "tier0/vprof.h"
+#include "serverbenchmark_base.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -449,12 +450,14 @@ void CPlayerMove::RunCommand ( CBasePlayer *player, CUserCmd *ucmd, IMoveHelper
 	if ( !pVehicle )
 	{
 		VPROF( "g_pGameMovement->ProcessMovement()" );
+		SERVER_BENCHMARK_SCOPE( SERVER_BENCHMARK_GAMEMOVEMENT );
 		Assert( g_pGameMovement );
 		g_pGameMovement->ProcessMovement( player, g_pMoveData );
 	}
 	else
 	{
 		VPROF( "pVehicle->ProcessMovement()" );
+		SERVER_BENCHMARK_SCOPE( SERVER_BENCHMARK_GAMEMOVEMENT );
 		pVehicle->ProcessMovement( player, g_pMoveData );
 	}
 
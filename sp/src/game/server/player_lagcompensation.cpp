@@ -10,9 +10,12 @@
 #include "igamesystem.h"
 #include "ilagcompensationmanager.h"
 #include "inetchannelinfo.h"
-#include "utllinkedlist.h"
 #include "BaseAnimatingOverlay.h"
+#include "bone_setup.h"
+#include "collisionutils.h"
+#include "physics.h"
 #include "tier0/vprof.h"
+#include "serverbenchmark_base.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -36,6 +39,7 @@ ConVar sv_lagflushbonecache( "sv_lagflushbonecache", "1", FCVAR_DEVELOPMENTONLY,
 ConVar sv_showlagcompensation( "sv_showlagcompensation", "0", FCVAR_CHEAT, "Show lag compensated hitboxes whenever a player is lag compensated." );
 
 ConVar sv_unlag_fixstuck( "sv_unlag_fixstuck", "0", FCVAR_DEVELOPMENTONLY, "Disallow backtracking a player for lag compensation if it will cause them to become stuck" );
+ConVar sv_unlag_hitboxes( "sv_unlag_hitboxes", "0", 0, "Record hitboxes every tick and trace bullets against the recorded hitboxes instead of moving lag compensated entities back in time. Only applies to bullets fired through FireBullets after StartBulletLagCompensation; melee, use and other traces still move entities back." );
 
 //-----------------------------------------------------------------------------
 // Purpose: 
@@ -115,6 +119,129 @@ public:
 };
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Hitbox transforms of one record, kept when sv_unlag_hitboxes is on
+//-----------------------------------------------------------------------------
+#define MAX_LAG_HITBOXES	32
+
+struct LagHitboxRecord
+{
+	int						m_nModelIndex;
+	int						m_nHitboxSet;
+	int						m_nHitboxes;		// 0 if the model has none, or too many to cache
+	float					m_flModelScale;
+	Vector					m_vecAbsOrigin;
+
+	// World space bounds of all hitboxes, for early out
+	Vector					m_vecWorldMins;
+	Vector					m_vecWorldMaxs;
+
+	// Bone to world for the bone of each hitbox, by hitbox index
+	matrix3x4_t				m_HitboxBoneToWorld[ MAX_LAG_HITBOXES ];
+};
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Fixed-size history of lag records for one entity.
+//
+// Records live in a ring with one array per field, so searching by time only
+// touches m_flSimulationTime. Every record gets a serial number which only
+// ever increases; its slot in the ring is ( serial & LAG_HISTORY_MASK ).
+// Serials in [m_nTail, m_nHead) are live, oldest first.
+//
+// At 100 ticks and sv_maxunlag 1.0 a track holds at most ~100 records. If the
+// tick rate is high enough to overflow the ring, the oldest records are
+// dropped, which only shortens how far back we can rewind.
+//-----------------------------------------------------------------------------
+#define LAG_HISTORY_SIZE	128	// Must be a power of two
+#define LAG_HISTORY_MASK	( LAG_HISTORY_SIZE - 1 )
+
+class CLagRecordTrack
+{
+public:
+	CLagRecordTrack()
+	{
+		m_pHitboxes = NULL;
+		RemoveAll();
+	}
+
+	~CLagRecordTrack()
+	{
+		delete [] m_pHitboxes;
+	}
+
+	void	RemoveAll()				{ m_nTail = m_nHead = m_nFirstValid = 0; }
+	int		Count() const			{ return m_nHead - m_nTail; }
+	int		Head() const			{ return m_nHead - 1; }
+	int		Tail() const			{ return m_nTail; }
+	bool	IsValidIndex( int serial ) const { return serial >= m_nTail && serial < m_nHead; }
+	static int Slot( int serial )	{ return serial & LAG_HISTORY_MASK; }
+
+	void	RemoveTail()			{ Assert( Count() > 0 ); ++m_nTail; }
+
+	// Returns the slot to fill in. Drops the oldest record if the ring is full.
+	int		AddToHead()
+	{
+		if ( Count() == LAG_HISTORY_SIZE )
+		{
+			++m_nTail;
+		}
+		return Slot( m_nHead++ );
+	}
+
+	// Backtracking walks from the newest record to the oldest and gives up at
+	// the first dead record or teleport. Rather than walking, remember the
+	// oldest serial that can be reached without crossing either.
+	void	InvalidateOlderThan( int serial ) { m_nFirstValid = serial; }
+	bool	IsReachable( int serial ) const { return serial >= m_nFirstValid; }
+
+	// Returns the serial of the newest record at or before flTime, or
+	// m_nTail - 1 if every record is newer than flTime.
+	int		FindNewestAtOrBefore( float flTime ) const
+	{
+		// Simulation times are strictly increasing from tail to head.
+		int lo = m_nTail;
+		int hi = m_nHead;
+		while ( lo < hi )
+		{
+			int mid = ( lo + hi ) >> 1;
+			if ( m_flSimulationTime[ Slot( mid ) ] <= flTime )
+			{
+				lo = mid + 1;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+		return lo - 1;
+	}
+
+	float					m_flSimulationTime[ LAG_HISTORY_SIZE ];
+	int						m_fFlags[ LAG_HISTORY_SIZE ];
+	Vector					m_vecOrigin[ LAG_HISTORY_SIZE ];
+	QAngle					m_vecAngles[ LAG_HISTORY_SIZE ];
+	Vector					m_vecMinsPreScaled[ LAG_HISTORY_SIZE ];
+	Vector					m_vecMaxsPreScaled[ LAG_HISTORY_SIZE ];
+	int						m_masterSequence[ LAG_HISTORY_SIZE ];
+	float					m_masterCycle[ LAG_HISTORY_SIZE ];
+	LayerRecord				m_layerRecords[ LAG_HISTORY_SIZE ][ MAX_LAYER_RECORDS ];
+
+	// Only allocated once sv_unlag_hitboxes has been turned on
+	LagHitboxRecord			*m_pHitboxes;
+
+private:
+	int						m_nTail;
+	int						m_nHead;
+	int						m_nFirstValid;
+};
+
+// Tracks 0 .. MAX_PLAYERS-1 belong to players, the rest to entities
+// registered through AddAdditionalEntity (NPCs, vehicles).
+#define MAX_LAG_ADDITIONAL_ENTITIES	256
+#define MAX_LAG_TRACKS				( MAX_PLAYERS + MAX_LAG_ADDITIONAL_ENTITIES )
+
+
 //
 // Try to take the player from his current origin to vWantedPos.
 // If it can't get there, leave the player where he is.
@@ -122,22 +249,33 @@ public:
 
 ConVar sv_unlag_debug( "sv_unlag_debug", "0", FCVAR_GAMEDLL | FCVAR_DEVELOPMENTONLY );
 
+//-----------------------------------------------------------------------------
+// Purpose: Name to use in debug spew for a lag compensated entity
+//-----------------------------------------------------------------------------
+static const char *GetLagCompensationName( CBaseEntity *pEntity )
+{
+	CBasePlayer *pPlayer = ToBasePlayer( pEntity );
+	return pPlayer ? pPlayer->GetPlayerName() : pEntity->GetDebugName();
+}
+
 float g_flFractionScale = 0.95;
-static void RestorePlayerTo( CBasePlayer *pPlayer, const Vector &vWantedPos )
+static void RestorePlayerTo( CBaseEntity *pPlayer, const Vector &vWantedPos )
 {
 	// Try to move to the wanted position from our current position.
 	trace_t tr;
 	VPROF_BUDGET( "RestorePlayerTo", "CLagCompensationManager" );
-	UTIL_TraceEntity( pPlayer, vWantedPos, vWantedPos, MASK_PLAYERSOLID, pPlayer, COLLISION_GROUP_PLAYER_MOVEMENT, &tr );
+	unsigned int mask = pPlayer->IsPlayer() ? MASK_PLAYERSOLID : pPlayer->PhysicsSolidMaskForEntity();
+	int collisionGroup = pPlayer->IsPlayer() ? COLLISION_GROUP_PLAYER_MOVEMENT : pPlayer->GetCollisionGroup();
+	UTIL_TraceEntity( pPlayer, vWantedPos, vWantedPos, mask, pPlayer, collisionGroup, &tr );
 	if ( tr.startsolid || tr.allsolid )
 	{
 		if ( sv_unlag_debug.GetBool() )
 		{
 			DevMsg( "RestorePlayerTo() could not restore player position for client \"%s\" ( %.1f %.1f %.1f )\n",
-					pPlayer->GetPlayerName(), vWantedPos.x, vWantedPos.y, vWantedPos.z );
+					GetLagCompensationName( pPlayer ), vWantedPos.x, vWantedPos.y, vWantedPos.z );
 		}
 
-		UTIL_TraceEntity( pPlayer, pPlayer->GetLocalOrigin(), vWantedPos, MASK_PLAYERSOLID, pPlayer, COLLISION_GROUP_PLAYER_MOVEMENT, &tr );
+		UTIL_TraceEntity( pPlayer, pPlayer->GetLocalOrigin(), vWantedPos, mask, pPlayer, collisionGroup, &tr );
 		if ( tr.startsolid || tr.allsolid )
 		{
 			// In this case, the guy got stuck back wherever we lag compensated him to. Nasty.
@@ -163,6 +301,14 @@ static void RestorePlayerTo( CBasePlayer *pPlayer, const Vector &vWantedPos )
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Players and NPCs carry animation layers, other entities don't
+//-----------------------------------------------------------------------------
+static inline CBaseAnimatingOverlay *GetAnimOverlays( CBaseEntity *pEntity )
+{
+	return pEntity->MyCombatCharacterPointer();
+}
+
 
 //-----------------------------------------------------------------------------
 // Purpose: 
@@ -172,17 +318,25 @@ class CLagCompensationManager : public CAutoGameSystemPerFrame, public ILagCompe
 public:
 	CLagCompensationManager( char const *name ) : CAutoGameSystemPerFrame( name ), m_flTeleportDistanceSqr( 64 *64 )
 	{
+		Q_memset( m_pTrack, 0, sizeof( m_pTrack ) );
+		m_pCurrentPlayer = NULL;
+		m_bNeedToRestore = false;
+		m_bCompensatingHitboxes = false;
+		m_bStartingForBullets = false;
 	}
 
 	// IServerSystem stuff
 	virtual void Shutdown()
 	{
-		ClearHistory();
+		PurgeHistory();
 	}
 
 	virtual void LevelShutdownPostEntity()
 	{
 		ClearHistory();
+
+		for ( int i = MAX_PLAYERS; i < MAX_LAG_TRACKS; i++ )
+			m_hTrackEntity[i] = NULL;
 	}
 
 	// called after entities think
@@ -192,30 +346,67 @@ public:
 
 	// Called during player movement to set up/restore after lag compensation
 	void			StartLagCompensation( CBasePlayer *player, CUserCmd *cmd );
+	void			StartBulletLagCompensation( CBasePlayer *player, CUserCmd *cmd );
 	void			FinishLagCompensation( CBasePlayer *player );
 
+	void			AddAdditionalEntity( CBaseEntity *pEntity );
+	void			RemoveAdditionalEntity( CBaseEntity *pEntity );
+
+	bool			IsCompensatingHitboxes() const { return m_bCompensatingHitboxes; }
+	void			IgnoreHitboxCompensatedEntities( CTraceFilterSimpleList *pFilter );
+	bool			ClipRayToHitboxHistory( const Ray_t &ray, unsigned int fMask, trace_t *pTrace );
+
 private:
-	void			BacktrackPlayer( CBasePlayer *player, float flTargetTime );
+	void			RecordEntity( CBaseEntity *pEntity, int nTrack );
+	void			RecordHitboxes( CBaseAnimating *pAnimating, LagHitboxRecord *pRecord );
+	bool			FindBacktrackRecords( CBaseEntity *pEntity, int nTrack, float flTargetTime, int *pRecord, int *pPrevRecord, float *pFrac );
+	bool			CompensateHitboxes( CBaseEntity *pEntity, int nTrack, float flTargetTime );
+	void			BacktrackPlayer( CBaseEntity *player, int nTrack, float flTargetTime );
+	void			RestoreEntity( CBaseEntity *pEntity, int nTrack );
 
 	void ClearHistory()
 	{
-		for ( int i=0; i<MAX_PLAYERS; i++ )
-			m_PlayerTrack[i].Purge();
+		for ( int i=0; i<MAX_LAG_TRACKS; i++ )
+		{
+			if ( m_pTrack[i] )
+				m_pTrack[i]->RemoveAll();
+		}
+	}
+
+	void PurgeHistory()
+	{
+		for ( int i=0; i<MAX_LAG_TRACKS; i++ )
+		{
+			delete m_pTrack[i];
+			m_pTrack[i] = NULL;
+		}
 	}
 
-	// keep a list of lag records for each player
-	CUtlFixedLinkedList< LagRecord >	m_PlayerTrack[ MAX_PLAYERS ];
+	// keep a ring of lag records for each player and additional entity,
+	// allocated the first time something is recorded into it
+	CLagRecordTrack			*m_pTrack[ MAX_LAG_TRACKS ];
+
+	// Entities that own the tracks past MAX_PLAYERS
+	EHANDLE					m_hTrackEntity[ MAX_LAG_TRACKS ];
 
 	// Scratchpad for determining what needs to be restored
-	CBitVec<MAX_PLAYERS>	m_RestorePlayer;
+	CBitVec<MAX_LAG_TRACKS>	m_RestorePlayer;
 	bool					m_bNeedToRestore;
 	
-	LagRecord				m_RestoreData[ MAX_PLAYERS ];	// player data before we moved him back
-	LagRecord				m_ChangeData[ MAX_PLAYERS ];	// player data where we moved him back
+	LagRecord				m_RestoreData[ MAX_LAG_TRACKS ];	// player data before we moved him back
+	LagRecord				m_ChangeData[ MAX_LAG_TRACKS ];		// player data where we moved him back
 
 	CBasePlayer				*m_pCurrentPlayer;	// The player we are doing lag compensation for
 
 	float					m_flTeleportDistanceSqr;
+
+	// Hitbox-only compensation: which tracks bullets should test, and at which records
+	bool					m_bStartingForBullets;	// set by StartBulletLagCompensation, the only caller allowed it
+	bool					m_bCompensatingHitboxes;
+	CBitVec<MAX_LAG_TRACKS>	m_HitboxTrack;
+	int						m_nHitboxRecord[ MAX_LAG_TRACKS ];
+	int						m_nHitboxPrevRecord[ MAX_LAG_TRACKS ];
+	float					m_flHitboxFrac[ MAX_LAG_TRACKS ];
 };
 
 static CLagCompensationManager g_LagCompensationManager( "CLagCompensationManager" );
@@ -236,20 +427,29 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 	m_flTeleportDistanceSqr = sv_lagcompensation_teleport_dist.GetFloat() * sv_lagcompensation_teleport_dist.GetFloat();
 
 	VPROF_BUDGET( "FrameUpdatePostEntityThink", "CLagCompensationManager" );
+	SERVER_BENCHMARK_SCOPE( SERVER_BENCHMARK_LAGCOMPENSATION );
 
 	// remove all records before that time:
 	int flDeadtime = gpGlobals->curtime - sv_maxunlag.GetFloat();
 
-	// Iterate all active players
-	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
+	// Iterate all active players and additional entities
+	for ( int i = 0; i < MAX_LAG_TRACKS; i++ )
 	{
-		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
+		CBaseEntity *pEntity;
+		if ( i < MAX_PLAYERS )
+		{
+			pEntity = ( i < gpGlobals->maxClients ) ? UTIL_PlayerByIndex( i + 1 ) : NULL;
+		}
+		else
+		{
+			pEntity = m_hTrackEntity[i];
+		}
 
-		CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[i-1];
+		CLagRecordTrack *track = m_pTrack[i];
 
-		if ( !pPlayer )
+		if ( !pEntity )
 		{
-			if ( track->Count() > 0 )
+			if ( track && track->Count() > 0 )
 			{
 				track->RemoveAll();
 			}
@@ -257,66 +457,219 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 			continue;
 		}
 
-		Assert( track->Count() < 1000 ); // insanity check
+		if ( !track )
+		{
+			track = m_pTrack[i] = new CLagRecordTrack;
+		}
 
 		// remove tail records that are too old
-		int tailIndex = track->Tail();
-		while ( track->IsValidIndex( tailIndex ) )
+		while ( track->Count() > 0 && track->m_flSimulationTime[ CLagRecordTrack::Slot( track->Tail() ) ] < flDeadtime )
 		{
-			LagRecord &tail = track->Element( tailIndex );
-
-			// if tail is within limits, stop
-			if ( tail.m_flSimulationTime >= flDeadtime )
-				break;
-			
-			// remove tail, get new tail
-			track->Remove( tailIndex );
-			tailIndex = track->Tail();
+			track->RemoveTail();
 		}
 
 		// check if head has same simulation time
 		if ( track->Count() > 0 )
 		{
-			LagRecord &head = track->Element( track->Head() );
-
 			// check if player changed simulation time since last time updated
-			if ( head.m_flSimulationTime >= pPlayer->GetSimulationTime() )
+			if ( track->m_flSimulationTime[ CLagRecordTrack::Slot( track->Head() ) ] >= pEntity->GetSimulationTime() )
 				continue; // don't add new entry for same or older time
 		}
 
-		// add new record to player track
-		LagRecord &record = track->Element( track->AddToHead() );
+		RecordEntity( pEntity, i );
+	}
 
-		record.m_fFlags = 0;
-		if ( pPlayer->IsAlive() )
-		{
-			record.m_fFlags |= LC_ALIVE;
-		}
+	//Clear the current player.
+	m_pCurrentPlayer = NULL;
+}
 
-		record.m_flSimulationTime	= pPlayer->GetSimulationTime();
-		record.m_vecAngles			= pPlayer->GetLocalAngles();
-		record.m_vecOrigin			= pPlayer->GetLocalOrigin();
-		record.m_vecMinsPreScaled	= pPlayer->CollisionProp()->OBBMinsPreScaled();
-		record.m_vecMaxsPreScaled	= pPlayer->CollisionProp()->OBBMaxsPreScaled();
+//-----------------------------------------------------------------------------
+// Purpose: Adds a new record to the head of the entity's track
+//-----------------------------------------------------------------------------
+void CLagCompensationManager::RecordEntity( CBaseEntity *pEntity, int nTrack )
+{
+	CLagRecordTrack *track = m_pTrack[ nTrack ];
+
+	bool bHadRecords = track->Count() > 0;
+	int prevSlot = CLagRecordTrack::Slot( track->Head() );
+
+	// add new record to player track
+	int serial = track->Head() + 1;
+	int slot = track->AddToHead();
+
+	int fFlags = 0;
+	if ( pEntity->IsAlive() )
+	{
+		fFlags |= LC_ALIVE;
+	}
+
+	track->m_fFlags[slot]				= fFlags;
+	track->m_flSimulationTime[slot]		= pEntity->GetSimulationTime();
+	track->m_vecAngles[slot]			= pEntity->GetLocalAngles();
+	track->m_vecOrigin[slot]			= pEntity->GetLocalOrigin();
+	track->m_vecMinsPreScaled[slot]		= pEntity->CollisionProp()->OBBMinsPreScaled();
+	track->m_vecMaxsPreScaled[slot]		= pEntity->CollisionProp()->OBBMaxsPreScaled();
+
+	// Backtracking can't get past a dead record, nor past a jump between
+	// neighbouring records larger than the teleport distance.
+	if ( !( fFlags & LC_ALIVE ) )
+	{
+		track->InvalidateOlderThan( serial + 1 );
+	}
+	else if ( bHadRecords && ( track->m_vecOrigin[slot] - track->m_vecOrigin[prevSlot] ).Length2DSqr() > m_flTeleportDistanceSqr )
+	{
+		track->InvalidateOlderThan( serial );
+	}
 
-		int layerCount = pPlayer->GetNumAnimOverlays();
+	CBaseAnimatingOverlay *pOverlay = GetAnimOverlays( pEntity );
+	if ( pOverlay )
+	{
+		LayerRecord *layerRecords = track->m_layerRecords[slot];
+		int layerCount = pOverlay->GetNumAnimOverlays();
 		for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
 		{
-			CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
+			CAnimationLayer *currentLayer = pOverlay->GetAnimOverlay(layerIndex);
 			if( currentLayer )
 			{
-				record.m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
-				record.m_layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
-				record.m_layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
-				record.m_layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
+				layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
+				layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
+				layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
+				layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
 			}
 		}
-		record.m_masterSequence = pPlayer->GetSequence();
-		record.m_masterCycle = pPlayer->GetCycle();
 	}
 
-	//Clear the current player.
-	m_pCurrentPlayer = NULL;
+	CBaseAnimating *pAnimating = pEntity->GetBaseAnimating();
+	if ( pAnimating )
+	{
+		track->m_masterSequence[slot] = pAnimating->GetSequence();
+		track->m_masterCycle[slot] = pAnimating->GetCycle();
+	}
+
+	if ( sv_unlag_hitboxes.GetBool() && !track->m_pHitboxes )
+	{
+		// Zeroed, so slots that haven't been written yet have no hitboxes
+		track->m_pHitboxes = new LagHitboxRecord[ LAG_HISTORY_SIZE ]();
+	}
+
+	if ( track->m_pHitboxes )
+	{
+		// Cleared even while sv_unlag_hitboxes is off, or turning it back on
+		// would find hitboxes from an older record in this slot
+		LagHitboxRecord *pHitboxes = &track->m_pHitboxes[slot];
+		pHitboxes->m_nHitboxes = 0;
+		if ( sv_unlag_hitboxes.GetBool() && pAnimating && fFlags & LC_ALIVE )
+		{
+			RecordHitboxes( pAnimating, pHitboxes );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Caches the current hitbox transforms of an entity
+//-----------------------------------------------------------------------------
+void CLagCompensationManager::RecordHitboxes( CBaseAnimating *pAnimating, LagHitboxRecord *pRecord )
+{
+	CStudioHdr *pStudioHdr = pAnimating->GetModelPtr();
+	if ( !pStudioHdr )
+		return;
+
+	mstudiohitboxset_t *set = pStudioHdr->pHitboxSet( pAnimating->GetHitboxSet() );
+	if ( !set || !set->numhitboxes || set->numhitboxes > MAX_LAG_HITBOXES )
+		return;
+
+	VPROF_BUDGET( "RecordHitboxes", "CLagCompensationManager" );
+
+	CBoneCache *pcache = pAnimating->GetBoneCache();
+	if ( !pcache )
+		return;
+
+	pRecord->m_nModelIndex = pAnimating->GetModelIndex();
+	pRecord->m_nHitboxSet = pAnimating->GetHitboxSet();
+	pRecord->m_flModelScale = pAnimating->GetModelScale();
+	pRecord->m_vecAbsOrigin = pAnimating->GetAbsOrigin();
+	ClearBounds( pRecord->m_vecWorldMins, pRecord->m_vecWorldMaxs );
+
+	for ( int i = 0; i < set->numhitboxes; i++ )
+	{
+		mstudiobbox_t *pbox = set->pHitbox( i );
+		matrix3x4_t *pBone = pcache->GetCachedBone( pbox->bone );
+		if ( !pBone )
+			return;
+
+		MatrixCopy( *pBone, pRecord->m_HitboxBoneToWorld[i] );
+
+		Vector vecMins, vecMaxs;
+		TransformAABB( *pBone, pbox->bbmin, pbox->bbmax, vecMins, vecMaxs );
+		AddPointToBounds( vecMins, pRecord->m_vecWorldMins, pRecord->m_vecWorldMaxs );
+		AddPointToBounds( vecMaxs, pRecord->m_vecWorldMins, pRecord->m_vecWorldMaxs );
+	}
+
+	pRecord->m_nHitboxes = set->numhitboxes;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Registers a non-player entity (NPC, vehicle) for lag compensation.
+//			The entity is dropped automatically once its handle goes stale.
+//-----------------------------------------------------------------------------
+void CLagCompensationManager::AddAdditionalEntity( CBaseEntity *pEntity )
+{
+	// no lag compensation in single player
+	if ( !pEntity || pEntity->IsPlayer() || gpGlobals->maxClients <= 1 )
+		return;
+
+	int nFree = -1;
+	for ( int i = MAX_PLAYERS; i < MAX_LAG_TRACKS; i++ )
+	{
+		CBaseEntity *pTracked = m_hTrackEntity[i];
+		if ( pTracked == pEntity )
+			return;
+
+		if ( !pTracked && nFree < 0 )
+		{
+			nFree = i;
+		}
+	}
+
+	if ( nFree < 0 )
+	{
+		DevWarning( "CLagCompensationManager: too many lag compensated entities, not tracking %s\n", pEntity->GetDebugName() );
+		return;
+	}
+
+	if ( m_pTrack[nFree] )
+	{
+		m_pTrack[nFree]->RemoveAll();
+	}
+	m_hTrackEntity[nFree] = pEntity;
+}
+
+void CLagCompensationManager::RemoveAdditionalEntity( CBaseEntity *pEntity )
+{
+	for ( int i = MAX_PLAYERS; i < MAX_LAG_TRACKS; i++ )
+	{
+		if ( m_hTrackEntity[i] == pEntity )
+		{
+			m_hTrackEntity[i] = NULL;
+			if ( m_pTrack[i] )
+			{
+				m_pTrack[i]->RemoveAll();
+			}
+			return;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: For callers whose traces all go through FireBullets, which knows to
+//			clip against the recorded hitboxes. Anyone else might trace against
+//			where the entities are now, so they're only moved back in time.
+//-----------------------------------------------------------------------------
+void CLagCompensationManager::StartBulletLagCompensation( CBasePlayer *player, CUserCmd *cmd )
+{
+	m_bStartingForBullets = true;
+	StartLagCompensation( player, cmd );
+	m_bStartingForBullets = false;
 }
 
 // Called during player movement to set up/restore after lag compensation
@@ -334,6 +687,8 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 	// Assume no players need to be restored
 	m_RestorePlayer.ClearAll();
 	m_bNeedToRestore = false;
+	m_HitboxTrack.ClearAll();
+	m_bCompensatingHitboxes = false;
 
 	m_pCurrentPlayer = player;
 	
@@ -347,8 +702,7 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 
 	// NOTE: Put this here so that it won't show up in single player mode.
 	VPROF_BUDGET( "StartLagCompensation", VPROF_BUDGETGROUP_OTHER_NETWORKING );
-	Q_memset( m_RestoreData, 0, sizeof( m_RestoreData ) );
-	Q_memset( m_ChangeData, 0, sizeof( m_ChangeData ) );
+	SERVER_BENCHMARK_SCOPE( SERVER_BENCHMARK_LAGCOMPENSATION );
 
 	// Get true latency
 
@@ -407,112 +761,287 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 			continue;
 
 		// Move other player back in time
-		BacktrackPlayer( pPlayer, TICKS_TO_TIME( targettick ) );
+		if ( !CompensateHitboxes( pPlayer, i - 1, TICKS_TO_TIME( targettick ) ) )
+		{
+			BacktrackPlayer( pPlayer, i - 1, TICKS_TO_TIME( targettick ) );
+		}
 	}
-}
 
-void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTargetTime )
-{
-	Vector org;
-	Vector minsPreScaled;
-	Vector maxsPreScaled;
-	QAngle ang;
+	// Then everything else that asked to be lag compensated
+	for ( int i = MAX_PLAYERS; i < MAX_LAG_TRACKS; i++ )
+	{
+		CBaseEntity *pEntity = m_hTrackEntity[i];
+		if ( !pEntity )
+			continue;
 
-	VPROF_BUDGET( "BacktrackPlayer", "CLagCompensationManager" );
-	int pl_index = pPlayer->entindex() - 1;
+		if ( !player->WantsLagCompensationOnAdditionalEntity( pEntity, cmd, pEntityTransmitBits ) )
+			continue;
+
+		if ( !CompensateHitboxes( pEntity, i, TICKS_TO_TIME( targettick ) ) )
+		{
+			BacktrackPlayer( pEntity, i, TICKS_TO_TIME( targettick ) );
+		}
+	}
+}
 
+//-----------------------------------------------------------------------------
+// Purpose: Finds the record(s) to backtrack an entity to. pPrevRecord is the
+//			next newer record to interpolate towards, or -1 if there is none.
+//-----------------------------------------------------------------------------
+bool CLagCompensationManager::FindBacktrackRecords( CBaseEntity *pPlayer, int pl_index, float flTargetTime, int *pRecord, int *pPrevRecord, float *pFrac )
+{
 	// get track history of this player
-	CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[ pl_index ];
+	CLagRecordTrack *track = m_pTrack[ pl_index ];
 
 	// check if we have at leat one entry
-	if ( track->Count() <= 0 )
-		return;
+	if ( !track || track->Count() <= 0 )
+		return false;
+
+	// lost track, too much difference between where he is now and our newest record
+	Vector delta = track->m_vecOrigin[ CLagRecordTrack::Slot( track->Head() ) ] - pPlayer->GetLocalOrigin();
+	if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
+		return false;
+
+	// Find the newest record no newer than the target time. If they are all
+	// newer, use the oldest one we have.
+	int recordSerial = track->FindNewestAtOrBefore( flTargetTime );
+	if ( !track->IsValidIndex( recordSerial ) )
+	{
+		recordSerial = track->Tail();
+	}
 
-	int curr = track->Head();
+	// player must be alive and can't have teleported between now and then, lost track
+	if ( !track->IsReachable( recordSerial ) )
+		return false;
 
-	LagRecord *prevRecord = NULL;
-	LagRecord *record = NULL;
+	// the next newer record, if any, is what we interpolate towards
+	int prevSerial = recordSerial + 1;
+	bool bHasPrev = track->IsValidIndex( prevSerial );
 
-	Vector prevOrg = pPlayer->GetLocalOrigin();
-	
-	// Walk context looking for any invalidating event
-	while( track->IsValidIndex(curr) )
+	int record = CLagRecordTrack::Slot( recordSerial );
+	int prevRecord = bHasPrev ? CLagRecordTrack::Slot( prevSerial ) : -1;
+
+	float frac = 0.0f;
+	if ( bHasPrev && 
+		 (track->m_flSimulationTime[record] < flTargetTime) &&
+		 (track->m_flSimulationTime[record] < track->m_flSimulationTime[prevRecord]) )
 	{
-		// remember last record
-		prevRecord = record;
+		// we didn't find the exact time but have a valid previous record
+		// so interpolate between these two records;
+
+		Assert( track->m_flSimulationTime[prevRecord] > track->m_flSimulationTime[record] );
+		Assert( flTargetTime < track->m_flSimulationTime[prevRecord] );
+
+		// calc fraction between both records
+		frac = ( flTargetTime - track->m_flSimulationTime[record] ) / 
+			( track->m_flSimulationTime[prevRecord] - track->m_flSimulationTime[record] );
 
-		// get next record
-		record = &track->Element( curr );
+		Assert( frac > 0 && frac < 1 ); // should never extrapolate
+	}
+
+	*pRecord = record;
+	*pPrevRecord = prevRecord;
+	*pFrac = frac;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: In hitbox-only mode, remembers which recorded hitboxes bullets
+//			should be tested against instead of moving the entity back.
+//			Returns false if the entity has to be backtracked the old way.
+//-----------------------------------------------------------------------------
+bool CLagCompensationManager::CompensateHitboxes( CBaseEntity *pEntity, int nTrack, float flTargetTime )
+{
+	if ( !m_bStartingForBullets || !sv_unlag_hitboxes.GetBool() )
+		return false;
+
+	CLagRecordTrack *track = m_pTrack[ nTrack ];
+	CBaseAnimating *pAnimating = pEntity->GetBaseAnimating();
+	if ( !track || !track->m_pHitboxes || !pAnimating )
+		return false;
+
+	int record, prevRecord;
+	float frac;
+	if ( !FindBacktrackRecords( pEntity, nTrack, flTargetTime, &record, &prevRecord, &frac ) )
+		return true; // lost track, leave him where he is
+
+	// Recorded before hitbox caching was turned on, or the model changed since
+	const LagHitboxRecord &hitboxes = track->m_pHitboxes[record];
+	if ( !hitboxes.m_nHitboxes || hitboxes.m_nModelIndex != pAnimating->GetModelIndex() )
+		return false;
+
+	m_nHitboxRecord[nTrack] = record;
+	m_nHitboxPrevRecord[nTrack] = prevRecord;
+	m_flHitboxFrac[nTrack] = frac;
+	m_HitboxTrack.Set( nTrack );
+	m_bCompensatingHitboxes = true;
 
-		if ( !(record->m_fFlags & LC_ALIVE) )
+	if( sv_showlagcompensation.GetInt() == 1 )
+	{
+		for ( int i = 0; i < hitboxes.m_nHitboxes; i++ )
 		{
-			// player most be alive, lost track
-			return;
+			mstudiobbox_t *pbox = pAnimating->GetModelPtr()->pHitboxSet( hitboxes.m_nHitboxSet )->pHitbox( i );
+
+			Vector position;
+			QAngle angles;
+			MatrixAngles( hitboxes.m_HitboxBoneToWorld[i], angles, position );
+			NDebugOverlay::BoxAngles( position, pbox->bbmin, pbox->bbmax, angles, 0, 0, 255, 0, 4 );
 		}
+	}
 
-		Vector delta = record->m_vecOrigin - prevOrg;
-		if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Bullet traces skip where hitbox compensated entities are now...
+//-----------------------------------------------------------------------------
+void CLagCompensationManager::IgnoreHitboxCompensatedEntities( CTraceFilterSimpleList *pFilter )
+{
+	for ( int i = m_HitboxTrack.FindNextSetBit( 0 ); i >= 0; i = m_HitboxTrack.FindNextSetBit( i + 1 ) )
+	{
+		CBaseEntity *pEntity = ( i < MAX_PLAYERS ) ? UTIL_PlayerByIndex( i + 1 ) : m_hTrackEntity[i].Get();
+		if ( pEntity )
 		{
-			// lost track, too much difference
-			return; 
+			pFilter->AddEntityToIgnore( pEntity );
 		}
+	}
+}
 
-		// did we find a context smaller than target time ?
-		if ( record->m_flSimulationTime <= flTargetTime )
-			break; // hurra, stop
+//-----------------------------------------------------------------------------
+// Purpose: ...and are clipped against where their hitboxes were instead.
+//			Returns true if pTrace was shortened by a recorded hitbox.
+//-----------------------------------------------------------------------------
+bool CLagCompensationManager::ClipRayToHitboxHistory( const Ray_t &ray, unsigned int fMask, trace_t *pTrace )
+{
+	if ( !m_bCompensatingHitboxes )
+		return false;
 
-		prevOrg = record->m_vecOrigin;
+	VPROF_BUDGET( "ClipRayToHitboxHistory", "CLagCompensationManager" );
 
-		// go one step back
-		curr = track->Next( curr );
-	}
+	bool bHit = false;
+	for ( int i = m_HitboxTrack.FindNextSetBit( 0 ); i >= 0; i = m_HitboxTrack.FindNextSetBit( i + 1 ) )
+	{
+		CBaseEntity *pEntity = ( i < MAX_PLAYERS ) ? UTIL_PlayerByIndex( i + 1 ) : m_hTrackEntity[i].Get();
+		CBaseAnimating *pAnimating = pEntity ? pEntity->GetBaseAnimating() : NULL;
+		CStudioHdr *pStudioHdr = pAnimating ? pAnimating->GetModelPtr() : NULL;
+		if ( !pStudioHdr )
+			continue;
 
-	Assert( record );
+		const CLagRecordTrack *track = m_pTrack[i];
+		const LagHitboxRecord &record = track->m_pHitboxes[ m_nHitboxRecord[i] ];
 
-	if ( !record )
-	{
-		if ( sv_unlag_debug.GetBool() )
+		mstudiohitboxset_t *set = pStudioHdr->pHitboxSet( record.m_nHitboxSet );
+		if ( !set || set->numhitboxes != record.m_nHitboxes )
+			continue;
+
+		// Only blend towards the newer record if it has the same hitboxes, and
+		// the bones aren't scaled (the blend would lose the scale)
+		const LagHitboxRecord *pPrev = NULL;
+		float frac = m_flHitboxFrac[i];
+		if ( frac > 0.0f && m_nHitboxPrevRecord[i] >= 0 )
 		{
-			DevMsg( "No valid positions in history for BacktrackPlayer client ( %s )\n", pPlayer->GetPlayerName() );
+			pPrev = &track->m_pHitboxes[ m_nHitboxPrevRecord[i] ];
+			if ( pPrev->m_nModelIndex != record.m_nModelIndex || pPrev->m_nHitboxSet != record.m_nHitboxSet ||
+				 pPrev->m_nHitboxes != record.m_nHitboxes || record.m_flModelScale != 1.0f || pPrev->m_flModelScale != 1.0f )
+			{
+				pPrev = NULL;
+			}
 		}
 
-		return; // that should never happen
+		Vector vecWorldMins = record.m_vecWorldMins;
+		Vector vecWorldMaxs = record.m_vecWorldMaxs;
+		if ( pPrev )
+		{
+			VectorMin( vecWorldMins, pPrev->m_vecWorldMins, vecWorldMins );
+			VectorMax( vecWorldMaxs, pPrev->m_vecWorldMaxs, vecWorldMaxs );
+		}
+
+		if ( !IsBoxIntersectingRay( vecWorldMins - ray.m_Extents, vecWorldMaxs + ray.m_Extents, ray.m_Start, ray.m_Delta ) )
+			continue;
+
+		// TraceToStudio looks bones up by bone index
+		matrix3x4_t blended[ MAX_LAG_HITBOXES ];
+		matrix3x4_t *hitboxbones[ MAXSTUDIOBONES ];
+		for ( int j = 0; j < record.m_nHitboxes; j++ )
+		{
+			int bone = set->pHitbox( j )->bone;
+			if ( pPrev )
+			{
+				Quaternion q0, q1, q;
+				Vector p0, p1, p;
+				MatrixAngles( record.m_HitboxBoneToWorld[j], q0, p0 );
+				MatrixAngles( pPrev->m_HitboxBoneToWorld[j], q1, p1 );
+				QuaternionSlerp( q0, q1, frac, q );
+				VectorLerp( p0, p1, frac, p );
+				QuaternionMatrix( q, p, blended[j] );
+				hitboxbones[bone] = &blended[j];
+			}
+			else
+			{
+				hitboxbones[bone] = const_cast< matrix3x4_t * >( &record.m_HitboxBoneToWorld[j] );
+			}
+		}
+
+		trace_t tr;
+		if ( !TraceToStudio( physprops, ray, pStudioHdr, set, hitboxbones, fMask, record.m_vecAbsOrigin, record.m_flModelScale, tr ) )
+			continue;
+
+		if ( tr.fraction >= pTrace->fraction )
+			continue;
+
+		pTrace->fraction = tr.fraction;
+		pTrace->endpos = tr.endpos;
+		pTrace->plane = tr.plane;
+		pTrace->contents = tr.contents;
+		pTrace->hitgroup = tr.hitgroup;
+		pTrace->hitbox = tr.hitbox;
+		pTrace->physicsbone = tr.physicsbone;
+		pTrace->surface = tr.surface;
+		pTrace->startsolid = false;
+		pTrace->allsolid = false;
+		pTrace->m_pEnt = pEntity;
+		bHit = true;
 	}
 
-	float frac = 0.0f;
-	if ( prevRecord && 
-		 (record->m_flSimulationTime < flTargetTime) &&
-		 (record->m_flSimulationTime < prevRecord->m_flSimulationTime) )
-	{
-		// we didn't find the exact time but have a valid previous record
-		// so interpolate between these two records;
+	return bHit;
+}
 
-		Assert( prevRecord->m_flSimulationTime > record->m_flSimulationTime );
-		Assert( flTargetTime < prevRecord->m_flSimulationTime );
+void CLagCompensationManager::BacktrackPlayer( CBaseEntity *pPlayer, int pl_index, float flTargetTime )
+{
+	Vector org;
+	Vector minsPreScaled;
+	Vector maxsPreScaled;
+	QAngle ang;
 
-		// calc fraction between both records
-		frac = ( flTargetTime - record->m_flSimulationTime ) / 
-			( prevRecord->m_flSimulationTime - record->m_flSimulationTime );
+	VPROF_BUDGET( "BacktrackPlayer", "CLagCompensationManager" );
 
-		Assert( frac > 0 && frac < 1 ); // should never extrapolate
+	int record, prevRecord;
+	float frac;
+	if ( !FindBacktrackRecords( pPlayer, pl_index, flTargetTime, &record, &prevRecord, &frac ) )
+		return;
+
+	CLagRecordTrack *track = m_pTrack[ pl_index ];
+	bool bHasPrev = ( prevRecord >= 0 );
 
-		ang				= Lerp( frac, record->m_vecAngles, prevRecord->m_vecAngles );
-		org				= Lerp( frac, record->m_vecOrigin, prevRecord->m_vecOrigin );
-		minsPreScaled	= Lerp( frac, record->m_vecMinsPreScaled, prevRecord->m_vecMinsPreScaled );
-		maxsPreScaled	= Lerp( frac, record->m_vecMaxsPreScaled, prevRecord->m_vecMaxsPreScaled );
+	if ( frac > 0.0f )
+	{
+		ang				= Lerp( frac, track->m_vecAngles[record], track->m_vecAngles[prevRecord] );
+		org				= Lerp( frac, track->m_vecOrigin[record], track->m_vecOrigin[prevRecord] );
+		minsPreScaled	= Lerp( frac, track->m_vecMinsPreScaled[record], track->m_vecMinsPreScaled[prevRecord] );
+		maxsPreScaled	= Lerp( frac, track->m_vecMaxsPreScaled[record], track->m_vecMaxsPreScaled[prevRecord] );
 	}
 	else
 	{
 		// we found the exact record or no other record to interpolate with
 		// just copy these values since they are the best we have
-		org				= record->m_vecOrigin;
-		ang				= record->m_vecAngles;
-		minsPreScaled	= record->m_vecMinsPreScaled;
-		maxsPreScaled	= record->m_vecMaxsPreScaled;
+		org				= track->m_vecOrigin[record];
+		ang				= track->m_vecAngles[record];
+		minsPreScaled	= track->m_vecMinsPreScaled[record];
+		maxsPreScaled	= track->m_vecMaxsPreScaled[record];
 	}
 
 	// See if this is still a valid position for us to teleport to
-	if ( sv_unlag_fixstuck.GetBool() )
+	if ( sv_unlag_fixstuck.GetBool() && pPlayer->IsPlayer() )
 	{
 		// Try to move to the wanted position from our current position.
 		trace_t tr;
@@ -520,7 +1049,7 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 		if ( tr.startsolid || tr.allsolid )
 		{
 			if ( sv_unlag_debug.GetBool() )
-				DevMsg( "WARNING: BackupPlayer trying to back player into a bad position - client %s\n", pPlayer->GetPlayerName() );
+				DevMsg( "WARNING: BackupPlayer trying to back player into a bad position - client %s\n", GetLagCompensationName( pPlayer ) );
 
 			CBasePlayer *pHitPlayer = dynamic_cast<CBasePlayer *>( tr.m_pEnt );
 
@@ -533,12 +1062,11 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 				{
 					// prevent recursion - save a copy of m_RestorePlayer,
 					// pretend that this player is off-limits
-					int pl_index = pPlayer->entindex() - 1;
 
 					// Temp turn this flag on
 					m_RestorePlayer.Set( pl_index );
 
-					BacktrackPlayer( pHitPlayer, flTargetTime );
+					BacktrackPlayer( pHitPlayer, pHitPlayer->entindex() - 1, flTargetTime );
 
 					// Remove the temp flag
 					m_RestorePlayer.Clear( pl_index );
@@ -612,103 +1140,109 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 		change->m_vecOrigin = org;
 	}
 
-	// Sorry for the loss of the optimization for the case of people
-	// standing still, but you breathe even on the server.
-	// This is quicker than actually comparing all bazillion floats.
-	flags |= LC_ANIMATION_CHANGED;
-	restore->m_masterSequence = pPlayer->GetSequence();
-	restore->m_masterCycle = pPlayer->GetCycle();
-
-	bool interpolationAllowed = false;
-	if( prevRecord && (record->m_masterSequence == prevRecord->m_masterSequence) )
+	CBaseAnimating *pAnimating = pPlayer->GetBaseAnimating();
+	if ( pAnimating )
 	{
-		// If the master state changes, all layers will be invalid too, so don't interp (ya know, interp barely ever happens anyway)
-		interpolationAllowed = true;
-	}
-	
-	////////////////////////
-	// First do the master settings
-	bool interpolatedMasters = false;
-	if( frac > 0.0f && interpolationAllowed )
-	{
-		interpolatedMasters = true;
-		pPlayer->SetSequence( Lerp( frac, record->m_masterSequence, prevRecord->m_masterSequence ) );
-		pPlayer->SetCycle( Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle ) );
-
-		if( record->m_masterCycle > prevRecord->m_masterCycle )
+		// Sorry for the loss of the optimization for the case of people
+		// standing still, but you breathe even on the server.
+		// This is quicker than actually comparing all bazillion floats.
+		flags |= LC_ANIMATION_CHANGED;
+		restore->m_masterSequence = pAnimating->GetSequence();
+		restore->m_masterCycle = pAnimating->GetCycle();
+
+		bool interpolationAllowed = false;
+		if( bHasPrev && (track->m_masterSequence[record] == track->m_masterSequence[prevRecord]) )
 		{
-			// the older record is higher in frame than the newer, it must have wrapped around from 1 back to 0
-			// add one to the newer so it is lerping from .9 to 1.1 instead of .9 to .1, for example.
-			float newCycle = Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle + 1 );
-			pPlayer->SetCycle(newCycle < 1 ? newCycle : newCycle - 1 );// and make sure .9 to 1.2 does not end up 1.05
+			// If the master state changes, all layers will be invalid too, so don't interp (ya know, interp barely ever happens anyway)
+			interpolationAllowed = true;
 		}
-		else
+		
+		////////////////////////
+		// First do the master settings
+		bool interpolatedMasters = false;
+		if( frac > 0.0f && interpolationAllowed )
 		{
-			pPlayer->SetCycle( Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle ) );
-		}
-	}
-	if( !interpolatedMasters )
-	{
-		pPlayer->SetSequence(record->m_masterSequence);
-		pPlayer->SetCycle(record->m_masterCycle);
-	}
+			interpolatedMasters = true;
+			pAnimating->SetSequence( Lerp( frac, track->m_masterSequence[record], track->m_masterSequence[prevRecord] ) );
+			pAnimating->SetCycle( Lerp( frac, track->m_masterCycle[record], track->m_masterCycle[prevRecord] ) );
 
-	////////////////////////
-	// Now do all the layers
-	int layerCount = pPlayer->GetNumAnimOverlays();
-	for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
-	{
-		CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
-		if( currentLayer )
+			if( track->m_masterCycle[record] > track->m_masterCycle[prevRecord] )
+			{
+				// the older record is higher in frame than the newer, it must have wrapped around from 1 back to 0
+				// add one to the newer so it is lerping from .9 to 1.1 instead of .9 to .1, for example.
+				float newCycle = Lerp( frac, track->m_masterCycle[record], track->m_masterCycle[prevRecord] + 1 );
+				pAnimating->SetCycle(newCycle < 1 ? newCycle : newCycle - 1 );// and make sure .9 to 1.2 does not end up 1.05
+			}
+			else
+			{
+				pAnimating->SetCycle( Lerp( frac, track->m_masterCycle[record], track->m_masterCycle[prevRecord] ) );
+			}
+		}
+		if( !interpolatedMasters )
 		{
-			restore->m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
-			restore->m_layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
-			restore->m_layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
-			restore->m_layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
+			pAnimating->SetSequence(track->m_masterSequence[record]);
+			pAnimating->SetCycle(track->m_masterCycle[record]);
+		}
 
-			bool interpolated = false;
-			if( (frac > 0.0f)  &&  interpolationAllowed )
+		////////////////////////
+		// Now do all the layers
+		CBaseAnimatingOverlay *pOverlay = GetAnimOverlays( pPlayer );
+		int layerCount = pOverlay ? pOverlay->GetNumAnimOverlays() : 0;
+		for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
+		{
+			CAnimationLayer *currentLayer = pOverlay->GetAnimOverlay(layerIndex);
+			if( currentLayer )
 			{
-				LayerRecord &recordsLayerRecord = record->m_layerRecords[layerIndex];
-				LayerRecord &prevRecordsLayerRecord = prevRecord->m_layerRecords[layerIndex];
-				if( (recordsLayerRecord.m_order == prevRecordsLayerRecord.m_order)
-					&& (recordsLayerRecord.m_sequence == prevRecordsLayerRecord.m_sequence)
-					)
+				restore->m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
+				restore->m_layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
+				restore->m_layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
+				restore->m_layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
+
+				const LayerRecord &recordsLayerRecord = track->m_layerRecords[record][layerIndex];
+
+				bool interpolated = false;
+				if( (frac > 0.0f)  &&  interpolationAllowed )
 				{
-					// We can't interpolate across a sequence or order change
-					interpolated = true;
-					if( recordsLayerRecord.m_cycle > prevRecordsLayerRecord.m_cycle )
+					const LayerRecord &prevRecordsLayerRecord = track->m_layerRecords[prevRecord][layerIndex];
+					if( (recordsLayerRecord.m_order == prevRecordsLayerRecord.m_order)
+						&& (recordsLayerRecord.m_sequence == prevRecordsLayerRecord.m_sequence)
+						)
 					{
-						// the older record is higher in frame than the newer, it must have wrapped around from 1 back to 0
-						// add one to the newer so it is lerping from .9 to 1.1 instead of .9 to .1, for example.
-						float newCycle = Lerp( frac, recordsLayerRecord.m_cycle, prevRecordsLayerRecord.m_cycle + 1 );
-						currentLayer->m_flCycle = newCycle < 1 ? newCycle : newCycle - 1;// and make sure .9 to 1.2 does not end up 1.05
-					}
-					else
-					{
-						currentLayer->m_flCycle = Lerp( frac, recordsLayerRecord.m_cycle, prevRecordsLayerRecord.m_cycle  );
+						// We can't interpolate across a sequence or order change
+						interpolated = true;
+						if( recordsLayerRecord.m_cycle > prevRecordsLayerRecord.m_cycle )
+						{
+							// the older record is higher in frame than the newer, it must have wrapped around from 1 back to 0
+							// add one to the newer so it is lerping from .9 to 1.1 instead of .9 to .1, for example.
+							float newCycle = Lerp( frac, recordsLayerRecord.m_cycle, prevRecordsLayerRecord.m_cycle + 1 );
+							currentLayer->m_flCycle = newCycle < 1 ? newCycle : newCycle - 1;// and make sure .9 to 1.2 does not end up 1.05
+						}
+						else
+						{
+							currentLayer->m_flCycle = Lerp( frac, recordsLayerRecord.m_cycle, prevRecordsLayerRecord.m_cycle  );
+						}
+						currentLayer->m_nOrder = recordsLayerRecord.m_order;
+						currentLayer->m_nSequence = recordsLayerRecord.m_sequence;
+						currentLayer->m_flWeight = Lerp( frac, recordsLayerRecord.m_weight, prevRecordsLayerRecord.m_weight  );
 					}
+				}
+				if( !interpolated )
+				{
+					//Either no interp, or interp failed.  Just use record.
+					currentLayer->m_flCycle = recordsLayerRecord.m_cycle;
 					currentLayer->m_nOrder = recordsLayerRecord.m_order;
 					currentLayer->m_nSequence = recordsLayerRecord.m_sequence;
-					currentLayer->m_flWeight = Lerp( frac, recordsLayerRecord.m_weight, prevRecordsLayerRecord.m_weight  );
+					currentLayer->m_flWeight = recordsLayerRecord.m_weight;
 				}
 			}
-			if( !interpolated )
-			{
-				//Either no interp, or interp failed.  Just use record.
-				currentLayer->m_flCycle = record->m_layerRecords[layerIndex].m_cycle;
-				currentLayer->m_nOrder = record->m_layerRecords[layerIndex].m_order;
-				currentLayer->m_nSequence = record->m_layerRecords[layerIndex].m_sequence;
-				currentLayer->m_flWeight = record->m_layerRecords[layerIndex].m_weight;
-			}
 		}
 	}
 	
 	if ( !flags )
 		return; // we didn't change anything
 
-	if ( sv_lagflushbonecache.GetBool() )
-		pPlayer->InvalidateBoneCache();
+	if ( sv_lagflushbonecache.GetBool() && pAnimating )
+		pAnimating->InvalidateBoneCache();
 
 	/*char text[256]; Q_snprintf( text, sizeof(text), "time %.2f", flTargetTime );
 	pPlayer->DrawServerHitboxes( 10 );
@@ -720,9 +1254,9 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	restore->m_fFlags = flags; // we need to restore these flags
 	change->m_fFlags = flags; // we have changed these flags
 
-	if( sv_showlagcompensation.GetInt() == 1 )
+	if( sv_showlagcompensation.GetInt() == 1 && pAnimating )
 	{
-		pPlayer->DrawServerHitboxes(4, true);
+		pAnimating->DrawServerHitboxes(4, true);
 	}
 }
 
@@ -730,8 +1264,10 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 void CLagCompensationManager::FinishLagCompensation( CBasePlayer *player )
 {
 	VPROF_BUDGET_FLAGS( "FinishLagCompensation", VPROF_BUDGETGROUP_OTHER_NETWORKING, BUDGETFLAG_CLIENT|BUDGETFLAG_SERVER );
+	SERVER_BENCHMARK_SCOPE( SERVER_BENCHMARK_LAGCOMPENSATION );
 
 	m_pCurrentPlayer = NULL;
+	m_bCompensatingHitboxes = false;
 
 	if ( !m_bNeedToRestore )
 		return; // no player was changed at all
@@ -753,80 +1289,100 @@ void CLagCompensationManager::FinishLagCompensation( CBasePlayer *player )
 			continue;
 		}
 
-		LagRecord *restore = &m_RestoreData[ pl_index ];
-		LagRecord *change  = &m_ChangeData[ pl_index ];
+		RestoreEntity( pPlayer, pl_index );
+	}
+
+	// And the additional entities
+	for ( int i = MAX_PLAYERS; i < MAX_LAG_TRACKS; i++ )
+	{
+		if ( !m_RestorePlayer.Get( i ) )
+			continue;
+
+		CBaseEntity *pEntity = m_hTrackEntity[i];
+		if ( !pEntity )
+			continue;
+
+		RestoreEntity( pEntity, i );
+	}
+}
 
-		bool restoreSimulationTime = false;
+void CLagCompensationManager::RestoreEntity( CBaseEntity *pPlayer, int pl_index )
+{
+	LagRecord *restore = &m_RestoreData[ pl_index ];
+	LagRecord *change  = &m_ChangeData[ pl_index ];
 
-		if ( restore->m_fFlags & LC_SIZE_CHANGED )
+	bool restoreSimulationTime = false;
+
+	if ( restore->m_fFlags & LC_SIZE_CHANGED )
+	{
+		restoreSimulationTime = true;
+
+		// see if simulation made any changes, if no, then do the restore, otherwise,
+		//  leave new values in
+		if ( pPlayer->CollisionProp()->OBBMinsPreScaled() == change->m_vecMinsPreScaled &&
+			pPlayer->CollisionProp()->OBBMaxsPreScaled() == change->m_vecMaxsPreScaled )
 		{
-			restoreSimulationTime = true;
-	
-			// see if simulation made any changes, if no, then do the restore, otherwise,
-			//  leave new values in
-			if ( pPlayer->CollisionProp()->OBBMinsPreScaled() == change->m_vecMinsPreScaled &&
-				pPlayer->CollisionProp()->OBBMaxsPreScaled() == change->m_vecMaxsPreScaled )
-			{
-				// Restore it
-				pPlayer->SetSize( restore->m_vecMinsPreScaled, restore->m_vecMaxsPreScaled );
-			}
+			// Restore it
+			pPlayer->SetSize( restore->m_vecMinsPreScaled, restore->m_vecMaxsPreScaled );
+		}
 #ifdef STAGING_ONLY
-			else
-			{
-				Warning( "Should we really not restore the size?\n" );
-			}
-#endif
+		else
+		{
+			Warning( "Should we really not restore the size?\n" );
 		}
+#endif
+	}
 
-		if ( restore->m_fFlags & LC_ANGLES_CHANGED )
-		{		   
-			restoreSimulationTime = true;
+	if ( restore->m_fFlags & LC_ANGLES_CHANGED )
+	{		   
+		restoreSimulationTime = true;
 
-			if ( pPlayer->GetLocalAngles() == change->m_vecAngles )
-			{
-				pPlayer->SetLocalAngles( restore->m_vecAngles );
-			}
+		if ( pPlayer->GetLocalAngles() == change->m_vecAngles )
+		{
+			pPlayer->SetLocalAngles( restore->m_vecAngles );
 		}
+	}
 
-		if ( restore->m_fFlags & LC_ORIGIN_CHANGED )
-		{
-			restoreSimulationTime = true;
+	if ( restore->m_fFlags & LC_ORIGIN_CHANGED )
+	{
+		restoreSimulationTime = true;
 
-			// Okay, let's see if we can do something reasonable with the change
-			Vector delta = pPlayer->GetLocalOrigin() - change->m_vecOrigin;
-			
-			// If it moved really far, just leave the player in the new spot!!!
-			if ( delta.Length2DSqr() < m_flTeleportDistanceSqr )
-			{
-				RestorePlayerTo( pPlayer, restore->m_vecOrigin + delta );
-			}
+		// Okay, let's see if we can do something reasonable with the change
+		Vector delta = pPlayer->GetLocalOrigin() - change->m_vecOrigin;
+		
+		// If it moved really far, just leave the player in the new spot!!!
+		if ( delta.Length2DSqr() < m_flTeleportDistanceSqr )
+		{
+			RestorePlayerTo( pPlayer, restore->m_vecOrigin + delta );
 		}
+	}
 
-		if( restore->m_fFlags & LC_ANIMATION_CHANGED )
-		{
-			restoreSimulationTime = true;
+	if( restore->m_fFlags & LC_ANIMATION_CHANGED )
+	{
+		restoreSimulationTime = true;
 
-			pPlayer->SetSequence(restore->m_masterSequence);
-			pPlayer->SetCycle(restore->m_masterCycle);
+		CBaseAnimating *pAnimating = pPlayer->GetBaseAnimating();
+		pAnimating->SetSequence(restore->m_masterSequence);
+		pAnimating->SetCycle(restore->m_masterCycle);
 
-			int layerCount = pPlayer->GetNumAnimOverlays();
-			for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
+		CBaseAnimatingOverlay *pOverlay = GetAnimOverlays( pPlayer );
+		int layerCount = pOverlay ? pOverlay->GetNumAnimOverlays() : 0;
+		for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
+		{
+			CAnimationLayer *currentLayer = pOverlay->GetAnimOverlay(layerIndex);
+			if( currentLayer )
 			{
-				CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
-				if( currentLayer )
-				{
-					currentLayer->m_flCycle = restore->m_layerRecords[layerIndex].m_cycle;
-					currentLayer->m_nOrder = restore->m_layerRecords[layerIndex].m_order;
-					currentLayer->m_nSequence = restore->m_layerRecords[layerIndex].m_sequence;
-					currentLayer->m_flWeight = restore->m_layerRecords[layerIndex].m_weight;
-				}
+				currentLayer->m_flCycle = restore->m_layerRecords[layerIndex].m_cycle;
+				currentLayer->m_nOrder = restore->m_layerRecords[layerIndex].m_order;
+				currentLayer->m_nSequence = restore->m_layerRecords[layerIndex].m_sequence;
+				currentLayer->m_flWeight = restore->m_layerRecords[layerIndex].m_weight;
 			}
 		}
+	}
 
-		if ( restoreSimulationTime )
-		{
-			pPlayer->SetSimulationTime( restore->m_flSimulationTime );
-		}
+	if ( restoreSimulationTime )
+	{
+		pPlayer->SetSimulationTime( restore->m_flSimulationTime );
 	}
 }
 
@@ -9,6 +9,8 @@
 #include "props.h"
 #include "filesystem.h"
 #include "tier0/icommandline.h"
+#include "ai_network.h"
+#include "ai_node.h"
 
 
 // Server benchmark. Only works on specified maps.
@@ -17,8 +19,15 @@
 // Create 20 players and move them around and have them shoot.
 // At the end, report the # seconds it took to complete the test.
 // Don't start measuring for the first N ticks to account for HD load.
+//
+// Run with -sv_benchmark (and -sv_benchmark_exit to write the results and quit) on a dedicated
+// server for a headless, repeatable run. Per-subsystem timings go to sv_benchmark_results.json.
 
 static ConVar sv_benchmark_numticks( "sv_benchmark_numticks", "3300", 0, "If > 0, then it only runs the benchmark for this # of ticks." );
+static ConVar sv_benchmark_seed( "sv_benchmark_seed", "0", 0, "Random seed the benchmark uses for everything it spawns." );
+static ConVar sv_benchmark_numnpcs( "sv_benchmark_numnpcs", "20", 0, "Number of NPCs the benchmark spawns at random nodes of the AI network." );
+static ConVar sv_benchmark_npc_classes( "sv_benchmark_npc_classes", "npc_citizen npc_metropolice", 0, "Space separated NPC classes the benchmark spawns, in turn." );
+static ConVar sv_benchmark_npc_weapon( "sv_benchmark_npc_weapon", "weapon_smg1", 0, "Weapon given to the NPCs the benchmark spawns." );
 static ConVar sv_benchmark_autovprofrecord( "sv_benchmark_autovprofrecord", "0", 0, "If running a benchmark and this is set, it will record a vprof file over the duration of the benchmark with filename benchmark.vprof." );
 
 static float s_flBenchmarkStartWaitSeconds = 3;	// Wait this many seconds after level load before starting the benchmark.
@@ -28,6 +37,27 @@ static int s_nBenchmarkBotCreateInterval = 50;	// Create a bot every N ticks.
 
 static int s_nBenchmarkPhysicsObjects = 100;	// Create this many physics objects.
 
+static int s_nBenchmarkNPCCreateInterval = 10;	// Create an NPC every N ticks.
+
+// Used when there's no CServerBenchmarkHook to supply physics models.
+static const char *s_pszBenchmarkDefaultPhysicsModels[] =
+{
+	"models/props_c17/oildrum001.mdl",
+	"models/props_junk/wood_crate001a.mdl",
+	"models/props_borealis/bluebarrel001.mdl",
+	"models/props_junk/cardboard_box001a.mdl",
+};
+
+static const char *s_pszBenchmarkSubsystemNames[SERVER_BENCHMARK_SUBSYSTEM_COUNT] =
+{
+	"think",
+	"physics",
+	"gamemovement",
+	"transmit",
+	"lagcompensation",
+	"ai",
+};
+
 
 static double Benchmark_ValidTime()
 {
@@ -56,9 +86,13 @@ public:
 
 	virtual bool StartBenchmark()
 	{
-		bool bBenchmark = (CommandLine()->FindParm( "-sv_benchmark" ) != 0);
+		int nBenchmarkMode = 0;
+		if ( CommandLine()->FindParm( "-sv_benchmark" ) != 0 )
+		{
+			nBenchmarkMode = ( CommandLine()->FindParm( "-sv_benchmark_exit" ) != 0 ) ? 2 : 1;
+		}
 
-		return InternalStartBenchmark( bBenchmark, s_flBenchmarkStartWaitSeconds );
+		return InternalStartBenchmark( nBenchmarkMode, s_flBenchmarkStartWaitSeconds );
 	}
 
 	// nBenchmarkMode: 0 = no benchmark
@@ -78,22 +112,36 @@ public:
 
 		m_nBenchmarkMode = nBenchmarkMode;
 
-		if ( !CServerBenchmarkHook::s_pBenchmarkHook )
-			Error( "This game doesn't support server benchmarks (no CServerBenchmarkHook found)." );
-
 		m_BenchmarkState = BENCHMARKSTATE_START_WAIT;
 		m_flBenchmarkStartTime = Plat_FloatTime();
 		m_flBenchmarkStartWaitTime = flCountdown;
 
 		m_nBotsCreated = 0;
+		m_nNPCsCreated = 0;
 		m_nStartWaitCounter = -1;
+		m_PhysicsObjects.RemoveAll();
+		m_NPCs.RemoveAll();
+		m_PhysicsModelNames.RemoveAll();
 
 		// Setup the benchmark environment.
 		engine->SetDedicatedServerBenchmarkMode( true );	// Run 1 tick per frame and ignore all timing stuff.
 
 		// Tell the game-specific hook that we're starting.
-		CServerBenchmarkHook::s_pBenchmarkHook->StartBenchmark();
-		CServerBenchmarkHook::s_pBenchmarkHook->GetPhysicsModelNames( m_PhysicsModelNames );
+		if ( CServerBenchmarkHook::s_pBenchmarkHook )
+		{
+			CServerBenchmarkHook::s_pBenchmarkHook->StartBenchmark();
+			CServerBenchmarkHook::s_pBenchmarkHook->GetPhysicsModelNames( m_PhysicsModelNames );
+		}
+		else
+		{
+			DevMsg( "No CServerBenchmarkHook, running the benchmark without bots.\n" );
+			for ( int i = 0; i < ARRAYSIZE( s_pszBenchmarkDefaultPhysicsModels ); i++ )
+			{
+				m_PhysicsModelNames.AddToTail( const_cast<char *>( s_pszBenchmarkDefaultPhysicsModels[i] ) );
+			}
+		}
+
+		PrecachePopulation();
 
 		return true;
 	}
@@ -124,11 +172,16 @@ public:
 
 				StartVProfRecord();
 
-				RandomSeed( 0 );
-				m_RandomStream.SetSeed( 0 );
+				RandomSeed( sv_benchmark_seed.GetInt() );
+				m_RandomStream.SetSeed( sv_benchmark_seed.GetInt() );
+
+				ResetSubsystemTimes();
 			}
 		}
 
+		// Everything charged since the last call happened on the previous tick.
+		EndSubsystemTick();
+
 		int nTicksRunSoFar = gpGlobals->tickcount - m_nBenchmarkStartTick;
 		UpdateBenchmarkCounter();
 	
@@ -143,8 +196,66 @@ public:
 
 		// Ok, update whatever we're doing in the benchmark.
 		UpdatePlayerCreation();
+		UpdateNPCCreation();
 		UpdateVPhysicsObjects();
-		CServerBenchmarkHook::s_pBenchmarkHook->UpdateBenchmark();
+		if ( CServerBenchmarkHook::s_pBenchmarkHook )
+			CServerBenchmarkHook::s_pBenchmarkHook->UpdateBenchmark();
+	}
+
+	void PrecachePopulation()
+	{
+		bool bAllowPrecache = CBaseEntity::IsPrecacheAllowed();
+		CBaseEntity::SetAllowPrecache( true );
+
+		for ( int i = 0; i < m_PhysicsModelNames.Count(); i++ )
+		{
+			CBaseEntity::PrecacheModel( m_PhysicsModelNames[i] );
+		}
+
+		if ( sv_benchmark_numnpcs.GetInt() > 0 )
+		{
+			CUtlStringList npcClasses;
+			V_SplitString( sv_benchmark_npc_classes.GetString(), " ", npcClasses );
+			for ( int i = 0; i < npcClasses.Count(); i++ )
+			{
+				UTIL_PrecacheOther( npcClasses[i] );
+			}
+
+			if ( sv_benchmark_npc_weapon.GetString()[0] )
+			{
+				UTIL_PrecacheOther( sv_benchmark_npc_weapon.GetString() );
+			}
+		}
+
+		CBaseEntity::SetAllowPrecache( bAllowPrecache );
+	}
+
+	virtual void AddSubsystemTime( ServerBenchmarkSubsystem_t subsystem, const CCycleCount &duration )
+	{
+		m_SubsystemTick[subsystem] += duration;
+	}
+
+	void ResetSubsystemTimes()
+	{
+		for ( int i = 0; i < SERVER_BENCHMARK_SUBSYSTEM_COUNT; i++ )
+		{
+			m_SubsystemTotal[i].Init();
+			m_SubsystemPeak[i].Init();
+			m_SubsystemTick[i].Init();
+		}
+	}
+
+	void EndSubsystemTick()
+	{
+		for ( int i = 0; i < SERVER_BENCHMARK_SUBSYSTEM_COUNT; i++ )
+		{
+			m_SubsystemTotal[i] += m_SubsystemTick[i];
+			if ( m_SubsystemPeak[i].IsLessThan( m_SubsystemTick[i] ) )
+			{
+				m_SubsystemPeak[i] = m_SubsystemTick[i];
+			}
+			m_SubsystemTick[i].Init();
+		}
 	}
 
 	void StartVProfRecord()
@@ -199,9 +310,33 @@ public:
 		return false;
 	}
 
+	// Bots when there are any, otherwise the NPCs we've spawned.
+	void GetSpawnSources( CUtlVector<CBaseEntity*> &sources )
+	{
+		for ( int i = 1; i <= gpGlobals->maxClients; i++ )
+		{
+			CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
+			if ( pPlayer && (pPlayer->GetFlags() & FL_FAKECLIENT) )
+			{
+				sources.AddToTail( pPlayer );
+			}
+		}
+
+		if ( sources.Count() > 0 )
+			return;
+
+		for ( int i = 0; i < m_NPCs.Count(); i++ )
+		{
+			if ( m_NPCs[i] )
+			{
+				sources.AddToTail( m_NPCs[i] );
+			}
+		}
+	}
+
 	void UpdateVPhysicsObjects()
 	{
-		int nPhysicsObjectInterval = sv_benchmark_numticks.GetInt() / s_nBenchmarkPhysicsObjects;
+		int nPhysicsObjectInterval = MAX( sv_benchmark_numticks.GetInt() / s_nBenchmarkPhysicsObjects, 1 );
 
 		int nNextSpawnTick = m_nLastPhysicsObjectTick + nPhysicsObjectInterval;
 		if ( GetTickOffset() >= nNextSpawnTick )
@@ -211,15 +346,8 @@ public:
 			if ( m_PhysicsObjects.Count() < s_nBenchmarkPhysicsObjects )
 			{
 				// Find a bot to spawn it from.
-				CUtlVector<CBasePlayer*> curPlayers;
-				for ( int i = 1; i <= gpGlobals->maxClients; i++ )
-				{
-					CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
-					if ( pPlayer && (pPlayer->GetFlags() & FL_FAKECLIENT) )
-					{
-						curPlayers.AddToTail( pPlayer );
-					}
-				}
+				CUtlVector<CBaseEntity*> curPlayers;
+				GetSpawnSources( curPlayers );
 
 				if ( curPlayers.Count() > 0 && m_PhysicsModelNames.Count() > 0 )
 				{
@@ -247,7 +375,7 @@ public:
 		}
 
 		// Give them all a boost periodically.
-		int nPhysicsForceInterval = sv_benchmark_numticks.GetInt() / 20;
+		int nPhysicsForceInterval = MAX( sv_benchmark_numticks.GetInt() / 20, 1 );
 
 		int nNextForceTick = m_nLastPhysicsForceTick + nPhysicsForceInterval;
 		if ( GetTickOffset() >= nNextForceTick )
@@ -321,21 +449,115 @@ public:
 
 		if ( (nTicksRunSoFar % s_nBenchmarkBotCreateInterval) == 0 )
 		{
-			CServerBenchmarkHook::s_pBenchmarkHook->CreateBot();
-			++m_nBotsCreated;
+			// Only count bots that exist, so the results don't claim bots a mod
+			// without a hook never made
+			if ( CServerBenchmarkHook::s_pBenchmarkHook && CServerBenchmarkHook::s_pBenchmarkHook->CreateBot() )
+				++m_nBotsCreated;
+		}
+	}
+
+	// Spawns the NPCs at random ground nodes, cycling through sv_benchmark_npc_classes.
+	void UpdateNPCCreation()
+	{
+		if ( m_nNPCsCreated >= sv_benchmark_numnpcs.GetInt() )
+			return;
+
+		int nTicksRunSoFar = gpGlobals->tickcount - m_nBenchmarkStartTick;
+		if ( (nTicksRunSoFar % s_nBenchmarkNPCCreateInterval) != 0 )
+			return;
+
+		// Count it even if it fails so a map without nodes doesn't keep trying.
+		int iNPC = m_nNPCsCreated++;
+
+		if ( !g_pBigAINet || g_pBigAINet->NumNodes() == 0 )
+		{
+			if ( iNPC == 0 )
+				Warning( "Benchmark: map has no AI nodes, not spawning NPCs.\n" );
+			return;
+		}
+
+		CUtlStringList npcClasses;
+		V_SplitString( sv_benchmark_npc_classes.GetString(), " ", npcClasses );
+		if ( npcClasses.Count() == 0 )
+			return;
+
+		// Try a few nodes before giving up on this one.
+		for ( int i = 0; i < 10; i++ )
+		{
+			CAI_Node *pNode = g_pBigAINet->GetNode( this->RandomInt( 0, g_pBigAINet->NumNodes() - 1 ) );
+			if ( !pNode || pNode->GetType() != NODE_GROUND )
+				continue;
+
+			CBaseEntity *pEntity = CreateEntityByName( npcClasses[iNPC % npcClasses.Count()] );
+			if ( !pEntity )
+				return;
+
+			pEntity->SetAbsOrigin( pNode->GetOrigin() );
+			pEntity->SetAbsAngles( QAngle( 0, this->RandomFloat( -180, 180 ), 0 ) );
+			if ( sv_benchmark_npc_weapon.GetString()[0] )
+			{
+				pEntity->KeyValue( "additionalequipment", sv_benchmark_npc_weapon.GetString() );
+			}
+
+			DispatchSpawn( pEntity );
+			pEntity->Activate();
+
+			m_NPCs.AddToTail( pEntity );
+			return;
 		}
 	}
 
 	void OutputResults()
 	{
 		float flRunTime = Benchmark_ValidTime() - m_fl_ValidTime_BenchmarkStartTime;
+		int nTicks = sv_benchmark_numticks.GetInt();
 
 		Warning( "------------------ SERVER BENCHMARK RESULTS ------------------\n" );
 		Warning( "Total time          : %.2f seconds\n", flRunTime );
-		Warning( "Num ticks simulated : %d\n", sv_benchmark_numticks.GetInt() );
-		Warning( "Ticks per second    : %.2f\n", sv_benchmark_numticks.GetInt() / flRunTime );
+		Warning( "Num ticks simulated : %d\n", nTicks );
+		Warning( "Ticks per second    : %.2f\n", nTicks / flRunTime );
 		Warning( "Benchmark CRC       : %d\n", CalculateBenchmarkCRC() );
+		for ( int i = 0; i < SERVER_BENCHMARK_SUBSYSTEM_COUNT; i++ )
+		{
+			Warning( "%-20s: %.3f ms/tick (peak %.3f ms)\n", s_pszBenchmarkSubsystemNames[i],
+				m_SubsystemTotal[i].GetMillisecondsF() / MAX( nTicks, 1 ), m_SubsystemPeak[i].GetMillisecondsF() );
+		}
 		Warning( "--------------------------------------------------------------\n" );
+
+		WriteJSONResults( flRunTime );
+	}
+
+	void WriteJSONResults( float flRunTime )
+	{
+		FileHandle_t fh = filesystem->Open( "sv_benchmark_results.json", "wt", "DEFAULT_WRITE_PATH" );
+		if ( !fh )
+		{
+			Warning( "Unable to write sv_benchmark_results.json\n" );
+			return;
+		}
+
+		int nTicks = sv_benchmark_numticks.GetInt();
+
+		filesystem->FPrintf( fh, "{\n" );
+		filesystem->FPrintf( fh, "\t\"map\": \"%s\",\n", STRING( gpGlobals->mapname ) );
+		filesystem->FPrintf( fh, "\t\"seed\": %d,\n", sv_benchmark_seed.GetInt() );
+		filesystem->FPrintf( fh, "\t\"ticks\": %d,\n", nTicks );
+		filesystem->FPrintf( fh, "\t\"tick_interval\": %f,\n", TICK_INTERVAL );
+		filesystem->FPrintf( fh, "\t\"total_seconds\": %.4f,\n", flRunTime );
+		filesystem->FPrintf( fh, "\t\"ticks_per_second\": %.2f,\n", nTicks / flRunTime );
+		filesystem->FPrintf( fh, "\t\"crc\": %d,\n", CalculateBenchmarkCRC() );
+		filesystem->FPrintf( fh, "\t\"population\": { \"bots\": %d, \"npcs\": %d, \"physics_props\": %d },\n",
+			m_nBotsCreated, m_NPCs.Count(), m_PhysicsObjects.Count() );
+		filesystem->FPrintf( fh, "\t\"subsystems\": {" );
+		for ( int i = 0; i < SERVER_BENCHMARK_SUBSYSTEM_COUNT; i++ )
+		{
+			filesystem->FPrintf( fh, "%s\n\t\t\"%s\": { \"total_ms\": %.4f, \"ms_per_tick\": %.4f, \"peak_ms\": %.4f }",
+				( i > 0 ) ? "," : "", s_pszBenchmarkSubsystemNames[i], m_SubsystemTotal[i].GetMillisecondsF(),
+				m_SubsystemTotal[i].GetMillisecondsF() / MAX( nTicks, 1 ), m_SubsystemPeak[i].GetMillisecondsF() );
+		}
+		filesystem->FPrintf( fh, "\n\t}\n}\n" );
+
+		filesystem->Close( fh );
 	}
 
 	int CalculateBenchmarkCRC()
@@ -353,6 +575,15 @@ public:
 			}
 		}
 
+		for ( int i = 0; i < m_NPCs.Count(); i++ )
+		{
+			if ( m_NPCs[i] )
+			{
+				crc += (int)m_NPCs[i]->GetAbsOrigin().x;
+				crc += (int)m_NPCs[i]->GetAbsOrigin().y;
+			}
+		}
+
 		return crc;
 	}
 
@@ -363,7 +594,7 @@ public:
 
 	virtual float RandomFloat( float nMin, float nMax )
 	{
-		return m_RandomStream.RandomInt( nMin, nMax );
+		return m_RandomStream.RandomFloat( nMin, nMax );
 	}
 
 
@@ -389,7 +620,13 @@ private:
 	int m_nLastPhysicsForceTick;
 
 	int m_nBotsCreated;
+	int m_nNPCsCreated;
 	CUtlVector< EHANDLE > m_PhysicsObjects;
+	CUtlVector< EHANDLE > m_NPCs;
+
+	CCycleCount m_SubsystemTotal[SERVER_BENCHMARK_SUBSYSTEM_COUNT];
+	CCycleCount m_SubsystemPeak[SERVER_BENCHMARK_SUBSYSTEM_COUNT];
+	CCycleCount m_SubsystemTick[SERVER_BENCHMARK_SUBSYSTEM_COUNT];
 
 	CUtlVector<char*> m_PhysicsModelNames;
 	int m_nBenchmarkMode;
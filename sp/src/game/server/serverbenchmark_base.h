@@ -10,6 +10,21 @@
 #pragma once
 #endif
 
+#include "tier0/fasttimer.h"
+
+// Parts of the tick timed separately by the benchmark. The timings nest: think includes
+// the AI, and the player's gamemovement when it's simulated from the think loop.
+enum ServerBenchmarkSubsystem_t
+{
+	SERVER_BENCHMARK_THINK = 0,
+	SERVER_BENCHMARK_PHYSICS,
+	SERVER_BENCHMARK_GAMEMOVEMENT,
+	SERVER_BENCHMARK_TRANSMIT,
+	SERVER_BENCHMARK_LAGCOMPENSATION,
+	SERVER_BENCHMARK_AI,
+
+	SERVER_BENCHMARK_SUBSYSTEM_COUNT
+};
 
 // The base server code calls into this.
 class IServerBenchmark
@@ -26,13 +41,49 @@ public:
 	virtual int RandomInt( int nMin, int nMax ) = 0;
 	virtual float RandomFloat( float flMin, float flMax ) = 0;
 	virtual int GetTickOffset() = 0;
+
+	// Use SERVER_BENCHMARK_SCOPE rather than calling this directly.
+	virtual void AddSubsystemTime( ServerBenchmarkSubsystem_t subsystem, const CCycleCount &duration ) = 0;
 };
 
 extern IServerBenchmark *g_pServerBenchmark;
 
 
+//
+// Charges the time spent in the enclosing block to a subsystem while the benchmark is running.
+//
+class CServerBenchmarkScope
+{
+public:
+	CServerBenchmarkScope( ServerBenchmarkSubsystem_t subsystem )
+	{
+		m_Subsystem = subsystem;
+		m_bRunning = g_pServerBenchmark->IsBenchmarkRunning();
+		if ( m_bRunning )
+			m_Timer.Start();
+	}
+
+	~CServerBenchmarkScope()
+	{
+		if ( m_bRunning )
+		{
+			m_Timer.End();
+			g_pServerBenchmark->AddSubsystemTime( m_Subsystem, m_Timer.GetDuration() );
+		}
+	}
+
+private:
+	ServerBenchmarkSubsystem_t m_Subsystem;
+	bool m_bRunning;
+	CFastTimer m_Timer;
+};
+
+#define SERVER_BENCHMARK_SCOPE( subsystem ) CServerBenchmarkScope serverBenchmarkScope_##subsystem( subsystem )
+
+
 //
 // Each game can derive from this to hook into the server benchmark.
+// Without a hook the benchmark runs with NPCs and physics props only.
 //
 // Hooks should always use g_pServerBenchmark->RandomInt/Float to get random numbers
 // so the benchmark is deterministic.
@@ -0,0 +1,159 @@
+//=============================================================================//
+//
+// Purpose: Keeps the entity think loop within a time budget by putting off
+//			the thinks of low priority entities to a later tick.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "thinkbudget.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+static ConVar sv_think_budget_ms( "sv_think_budget_ms", "0", 0, "If > 0, once the entity think loop has taken this many milliseconds in a tick, the thinks of entities that allow it (distant NPCs, gibs) are put off to the next tick. They still move." );
+static ConVar sv_think_budget_max_defer( "sv_think_budget_max_defer", "3", 0, "The most consecutive ticks an entity can be put off for by sv_think_budget_ms before it's run regardless.", true, 1, true, 255 );
+static ConVar sv_think_budget_debug( "sv_think_budget_debug", "0", 0, "Report every tick that goes over sv_think_budget_ms." );
+
+CThinkBudget g_ThinkBudget( "CThinkBudget" );
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+CThinkBudget::CThinkBudget( char const *name ) : CAutoGameSystemPerFrame( name )
+{
+	m_bActive = false;
+	m_bOverBudget = false;
+	m_nMaxDeferTicks = 0;
+	m_nDeferredThisTick = 0;
+	m_pDeferredEntity = NULL;
+	memset( m_nDeferredTicks, 0, sizeof( m_nDeferredTicks ) );
+	ResetStats();
+}
+
+void CThinkBudget::LevelInitPreEntity()
+{
+	memset( m_nDeferredTicks, 0, sizeof( m_nDeferredTicks ) );
+	ResetStats();
+}
+
+void CThinkBudget::ResetStats()
+{
+	m_nTicks = 0;
+	m_nTicksOverBudget = 0;
+	m_nTotalDeferred = 0;
+	m_nMaxDeferred = 0;
+	m_nForced = 0;
+	m_nLastDeferred = 0;
+	m_flOverBudgetMS = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+void CThinkBudget::BeginThinks()
+{
+	m_bActive = ( sv_think_budget_ms.GetFloat() > 0 );
+	m_bOverBudget = false;
+	m_nDeferredThisTick = 0;
+
+	if ( !m_bActive )
+		return;
+
+	m_Budget.Init( sv_think_budget_ms.GetFloat() );
+	m_nMaxDeferTicks = sv_think_budget_max_defer.GetInt();
+	m_Timer.Start();
+}
+
+void CThinkBudget::EndThinks()
+{
+	m_pDeferredEntity = NULL;
+
+	if ( !m_bActive )
+		return;
+
+	m_Timer.End();
+	m_bActive = false;
+
+	m_nTicks++;
+	m_nLastDeferred = m_nDeferredThisTick;
+
+	if ( !m_bOverBudget )
+		return;
+
+	double flOverMS = m_Timer.GetDuration().GetMillisecondsF() - sv_think_budget_ms.GetFloat();
+
+	m_nTicksOverBudget++;
+	m_nTotalDeferred += m_nDeferredThisTick;
+	m_nMaxDeferred = MAX( m_nMaxDeferred, m_nDeferredThisTick );
+	m_flOverBudgetMS += MAX( flOverMS, 0.0 );
+
+	if ( sv_think_budget_debug.GetBool() )
+	{
+		Msg( "Think budget: tick %d took %.2fms, deferred %d entities\n", gpGlobals->tickcount, m_Timer.GetDuration().GetMillisecondsF(), m_nDeferredThisTick );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Entities are never put off for longer than sv_think_budget_max_defer
+//			ticks in a row, so nothing starves even if the server stays behind.
+//-----------------------------------------------------------------------------
+bool CThinkBudget::ShouldDefer( CBaseEntity *pEntity )
+{
+	if ( !m_bActive || !pEntity->edict() )
+		return false;
+
+	int iIndex = pEntity->entindex();
+
+	if ( !m_bOverBudget )
+	{
+		if ( m_Timer.GetDurationInProgress().IsLessThan( m_Budget ) )
+		{
+			m_nDeferredTicks[iIndex] = 0;
+			return false;
+		}
+
+		m_bOverBudget = true;
+	}
+
+	if ( !pEntity->CanDeferThink() )
+		return false;
+
+	if ( m_nDeferredTicks[iIndex] >= m_nMaxDeferTicks )
+	{
+		m_nDeferredTicks[iIndex] = 0;
+		m_nForced++;
+		return false;
+	}
+
+	m_nDeferredTicks[iIndex]++;
+	m_nDeferredThisTick++;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+void CThinkBudget::ReportStats()
+{
+	Msg( "Think budget: %.2fms, max %d ticks deferred\n", sv_think_budget_ms.GetFloat(), sv_think_budget_max_defer.GetInt() );
+	Msg( "  %d ticks, %d over budget (avg %.2fms over)\n", m_nTicks, m_nTicksOverBudget,
+		m_nTicksOverBudget ? m_flOverBudgetMS / m_nTicksOverBudget : 0.0 );
+	Msg( "  %d deferrals, avg %.1f / max %d per tick over budget, %d last tick\n", m_nTotalDeferred,
+		m_nTicksOverBudget ? (float)m_nTotalDeferred / m_nTicksOverBudget : 0.0f, m_nMaxDeferred, m_nLastDeferred );
+	Msg( "  %d entities run regardless after reaching the deferral limit\n", m_nForced );
+}
+
+CON_COMMAND( sv_think_budget_stats, "Show how often sv_think_budget_ms has deferred thinkers. Pass 'reset' to clear." )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( args.ArgC() > 1 && !Q_stricmp( args[1], "reset" ) )
+	{
+		g_ThinkBudget.ResetStats();
+		return;
+	}
+
+	g_ThinkBudget.ReportStats();
+}
@@ -0,0 +1,69 @@
+//=============================================================================//
+//
+// Purpose: Keeps the entity think loop within a time budget by putting off
+//			the thinks of low priority entities (see CBaseEntity::CanDeferThink)
+//			to a later tick once the budget has been spent. They're still
+//			simulated every tick, so movement isn't held back.
+//
+//=============================================================================//
+
+#ifndef THINKBUDGET_H
+#define THINKBUDGET_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "igamesystem.h"
+#include "tier0/fasttimer.h"
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+class CThinkBudget : public CAutoGameSystemPerFrame
+{
+public:
+	CThinkBudget( char const *name );
+
+	// game system
+	virtual void LevelInitPreEntity();
+
+	// Brackets the think loop in Physics_RunThinkFunctions
+	void	BeginThinks();
+	void	EndThinks();
+
+	// Returns true if the entity's thinks should wait for a later tick
+	bool	ShouldDefer( CBaseEntity *pEntity );
+
+	// PhysicsRunThink skips the thinks of the entity set here while it's
+	// being simulated
+	void	SetDeferredEntity( CBaseEntity *pEntity )			{ m_pDeferredEntity = pEntity; }
+	bool	IsThinkDeferred( const CBaseEntity *pEntity ) const	{ return pEntity == m_pDeferredEntity; }
+
+	void	ReportStats();
+	void	ResetStats();
+
+private:
+	bool			m_bActive;
+	bool			m_bOverBudget;
+	CCycleCount		m_Budget;
+	CFastTimer		m_Timer;
+	int				m_nMaxDeferTicks;
+	int				m_nDeferredThisTick;
+	CBaseEntity		*m_pDeferredEntity;
+
+	// Consecutive ticks each entity has been put off for
+	unsigned char	m_nDeferredTicks[MAX_EDICTS];
+
+	// Stats since the last reset
+	int				m_nTicks;
+	int				m_nTicksOverBudget;
+	int				m_nTotalDeferred;
+	int				m_nMaxDeferred;
+	int				m_nForced;
+	int				m_nLastDeferred;
+	double			m_flOverBudgetMS;
+};
+
+extern CThinkBudget g_ThinkBudget;
+
+#endif // THINKBUDGET_H
@@ -18,6 +18,7 @@
 #include "func_break.h"
 #include "physics_impact_damage.h"
 #include "entityblocker.h"
+#include "ilagcompensationmanager.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -509,6 +510,8 @@ void CPropVehicleDriveable::Spawn( void )
 	m_flMinimumSpeedToEnterExit = 0;
 	m_takedamage = DAMAGE_EVENTS_ONLY;
 	m_bEngineLocked = false;
+
+	lagcompensation->AddAdditionalEntity( this );
 }
 
 
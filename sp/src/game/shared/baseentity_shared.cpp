@@ -29,6 +29,7 @@
 	#include "player_pickup.h"
 	#include "waterbullet.h"
 	#include "func_break.h"
+	#include "ilagcompensationmanager.h"
 
 #ifdef HL2MP
 	#include "te_hl2mp_shotgun_shot.h"
@@ -1438,6 +1439,15 @@ void CBaseEntity::InvalidatePhysicsRecursive( int nChangeFlags )
 	
 	int nDirtyFlags = 0;
 
+#ifndef CLIENT_DLL
+	if ( ( nChangeFlags & (POSITION_CHANGED | ANGLES_CHANGED | ANIMATION_CHANGED) ) && CBaseAnimating::HasPrewarmedBoneCaches() )
+	{
+		CBaseAnimating *pAnim = GetBaseAnimating();
+		if ( pAnim )
+			pAnim->InvalidateBoneCacheIfPrewarmed();
+	}
+#endif
+
 	if ( nChangeFlags & VELOCITY_CHANGED )
 	{
 		nDirtyFlags |= EFL_DIRTY_ABSVELOCITY;
@@ -1715,6 +1725,16 @@ void CBaseEntity::FireBullets( const FireBulletsInfo_t &info )
 	}
 #endif
 
+#ifdef GAME_DLL
+	// With hitbox-only lag compensation the compensated entities haven't been moved back,
+	// so skip where they are now and clip each shot against their recorded hitboxes.
+	bool bLagCompensatedHitboxes = lagcompensation->IsCompensatingHitboxes();
+	if ( bLagCompensatedHitboxes )
+	{
+		lagcompensation->IgnoreHitboxCompensatedEntities( &traceFilter );
+	}
+#endif
+
 	bool bUnderwaterBullets = ShouldDrawUnderwaterBulletBubbles();
 	bool bStartedInWater = false;
 	if ( bUnderwaterBullets )
@@ -1786,6 +1806,14 @@ void CBaseEntity::FireBullets( const FireBulletsInfo_t &info )
 			}
 #else
 			AI_TraceHull( info.m_vecSrc, vecEnd, Vector( -3, -3, -3 ), Vector( 3, 3, 3 ), MASK_SHOT, &traceFilter, &tr );
+#ifdef GAME_DLL
+			if ( bLagCompensatedHitboxes )
+			{
+				Ray_t rayBullet;
+				rayBullet.Init( info.m_vecSrc, vecEnd, Vector( -3, -3, -3 ), Vector( 3, 3, 3 ) );
+				lagcompensation->ClipRayToHitboxHistory( rayBullet, MASK_SHOT, &tr );
+			}
+#endif
 #endif //#ifdef PORTAL
 		}
 		else
@@ -1811,6 +1839,14 @@ void CBaseEntity::FireBullets( const FireBulletsInfo_t &info )
 			}
 #else
 			AI_TraceLine(info.m_vecSrc, vecEnd, MASK_SHOT, &traceFilter, &tr);
+#ifdef GAME_DLL
+			if ( bLagCompensatedHitboxes )
+			{
+				Ray_t rayBullet;
+				rayBullet.Init( info.m_vecSrc, vecEnd );
+				lagcompensation->ClipRayToHitboxHistory( rayBullet, MASK_SHOT, &tr );
+			}
+#endif
 #endif //#ifdef PORTAL
 		}
 
@@ -0,0 +1,168 @@
+//=============================================================================//
+//
+// Purpose: Times bone setup for a set of models with and without the SIMD
+//			bone blending paths, and checks that both give the same bones.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "bone_setup.h"
+#include "datacache/imdlcache.h"
+#include "tier0/fasttimer.h"
+#include "vstdlib/random.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define BONE_BENCHMARK_POSES 16
+
+struct BoneBenchmarkPose_t
+{
+	int		m_nSequence[2];
+	float	m_flCycle[2];
+	float	m_flWeight;
+	float	m_flPoseParameter[MAXSTUDIOPOSEPARAM];
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: A two layer blend, which goes through CalcPose, SlerpBones and
+//			Studio_BuildMatrices
+//-----------------------------------------------------------------------------
+static void BoneBenchmark_SetupPose( const CStudioHdr *pStudioHdr, const BoneBenchmarkPose_t &pose, matrix3x4_t *pBoneToWorld )
+{
+	Vector pos[MAXSTUDIOBONES];
+	Quaternion q[MAXSTUDIOBONES];
+
+	IBoneSetup boneSetup( pStudioHdr, BONE_USED_BY_ANYTHING, pose.m_flPoseParameter );
+	boneSetup.InitPose( pos, q );
+	boneSetup.AccumulatePose( pos, q, pose.m_nSequence[0], pose.m_flCycle[0], 1.0f, 0.0f, NULL );
+	boneSetup.AccumulatePose( pos, q, pose.m_nSequence[1], pose.m_flCycle[1], pose.m_flWeight, 0.0f, NULL );
+
+	Studio_BuildMatrices( pStudioHdr, vec3_angle, vec3_origin, pos, q, -1, 1.0f, pBoneToWorld, BONE_USED_BY_ANYTHING );
+}
+
+static CCycleCount BoneBenchmark_Time( const CStudioHdr *pStudioHdr, const BoneBenchmarkPose_t *pPoses, int nIterations, matrix3x4_t *pBoneToWorld )
+{
+	CFastTimer timer;
+	timer.Start();
+	for ( int i = 0; i < nIterations; i++ )
+	{
+		for ( int j = 0; j < BONE_BENCHMARK_POSES; j++ )
+		{
+			BoneBenchmark_SetupPose( pStudioHdr, pPoses[j], pBoneToWorld );
+		}
+	}
+	timer.End();
+	return timer.GetDuration();
+}
+
+static void BoneBenchmark_RunModel( const char *pszModel, int nIterations )
+{
+	MDLCACHE_CRITICAL_SECTION();
+
+	MDLHandle_t hMDL = mdlcache->FindMDL( pszModel );
+	if ( hMDL == MDLHANDLE_INVALID )
+	{
+		Warning( "%s: couldn't load model\n", pszModel );
+		return;
+	}
+
+	studiohdr_t *pStudioHdr = mdlcache->GetStudioHdr( hMDL );
+	if ( !pStudioHdr || mdlcache->IsErrorModel( hMDL ) )
+	{
+		Warning( "%s: couldn't load model\n", pszModel );
+		mdlcache->Release( hMDL );
+		return;
+	}
+
+	CStudioHdr studioHdr( pStudioHdr, mdlcache );
+	if ( studioHdr.GetNumSeq() == 0 )
+	{
+		Warning( "%s: no sequences\n", pszModel );
+		mdlcache->Release( hMDL );
+		return;
+	}
+
+	// Same poses every run so results can be compared between builds
+	CUniformRandomStream random;
+	random.SetSeed( 0 );
+
+	BoneBenchmarkPose_t poses[BONE_BENCHMARK_POSES];
+	for ( int i = 0; i < BONE_BENCHMARK_POSES; i++ )
+	{
+		for ( int j = 0; j < 2; j++ )
+		{
+			poses[i].m_nSequence[j] = random.RandomInt( 0, studioHdr.GetNumSeq() - 1 );
+			poses[i].m_flCycle[j] = random.RandomFloat( 0.0f, 1.0f );
+		}
+		poses[i].m_flWeight = random.RandomFloat( 0.1f, 0.9f );
+		for ( int j = 0; j < MAXSTUDIOPOSEPARAM; j++ )
+		{
+			poses[i].m_flPoseParameter[j] = random.RandomFloat( 0.0f, 1.0f );
+		}
+	}
+
+	matrix3x4_t *pScalar = new matrix3x4_t[MAXSTUDIOBONES];
+	matrix3x4_t *pSIMD = new matrix3x4_t[MAXSTUDIOBONES];
+
+	// Check first
+	float flMaxError = 0.0f;
+	for ( int i = 0; i < BONE_BENCHMARK_POSES; i++ )
+	{
+		Studio_ForceScalarBoneSetup( true );
+		BoneBenchmark_SetupPose( &studioHdr, poses[i], pScalar );
+		Studio_ForceScalarBoneSetup( false );
+		BoneBenchmark_SetupPose( &studioHdr, poses[i], pSIMD );
+
+		for ( int iBone = 0; iBone < studioHdr.numbones(); iBone++ )
+		{
+			for ( int j = 0; j < 3; j++ )
+			{
+				for ( int k = 0; k < 4; k++ )
+				{
+					// Translations are in inches, so compare relative to the distance from the root
+					float flScale = ( k == 3 ) ? MAX( 1.0f, fabs( pScalar[iBone][j][k] ) ) : 1.0f;
+					flMaxError = MAX( flMaxError, fabs( pScalar[iBone][j][k] - pSIMD[iBone][j][k] ) / flScale );
+				}
+			}
+		}
+	}
+
+	Studio_ForceScalarBoneSetup( true );
+	CCycleCount scalarTime = BoneBenchmark_Time( &studioHdr, poses, nIterations, pScalar );
+	Studio_ForceScalarBoneSetup( false );
+	CCycleCount simdTime = BoneBenchmark_Time( &studioHdr, poses, nIterations, pSIMD );
+
+	int nSetups = nIterations * BONE_BENCHMARK_POSES;
+	double flScalarUS = scalarTime.GetMicrosecondsF() / nSetups;
+	double flSIMDUS = simdTime.GetMicrosecondsF() / nSetups;
+
+	Msg( "%s: %d bones, scalar %.2fus, simd %.2fus per setup (%.2fx), max error %g%s\n",
+		pszModel, studioHdr.numbones(), flScalarUS, flSIMDUS, flSIMDUS > 0.0 ? flScalarUS / flSIMDUS : 0.0,
+		flMaxError, ( flMaxError > 1e-3f ) ? " MISMATCH" : "" );
+
+	delete [] pScalar;
+	delete [] pSIMD;
+
+	mdlcache->Release( hMDL );
+}
+
+CON_COMMAND_SHARED( anim_bonesetup_benchmark, "Compare scalar and SIMD bone setup. Usage: anim_bonesetup_benchmark <iterations> <model> [model...]" )
+{
+#ifdef GAME_DLL
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+#endif
+
+	if ( args.ArgC() < 3 )
+	{
+		Msg( "Usage: %s <iterations> <model> [model...]\n", args[0] );
+		return;
+	}
+
+	int nIterations = MAX( atoi( args[1] ), 1 );
+	for ( int i = 2; i < args.ArgC(); i++ )
+	{
+		BoneBenchmark_RunModel( args[i], nIterations );
+	}
+}
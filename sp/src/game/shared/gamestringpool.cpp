@@ -8,6 +8,7 @@
 #include "cbase.h"
 
 #include "utlhashtable.h"
+#include "tier1/utlhashsymboltable.h"
 #ifndef GC
 #include "igamesystem.h"
 #endif
@@ -40,11 +41,12 @@ class CGameStringPool : public CBaseGameSystem
 		m_Strings.DbgCheckIntegrity();
 		m_KeyLookupCache.DbgCheckIntegrity();
 #endif
-		m_Strings.Purge();
+		m_Strings.RemoveAll();
 		m_KeyLookupCache.Purge();
 	}
 
-	CUtlHashtable<CUtlConstString> m_Strings;
+	// Strings are packed into blocks that are only freed at level shutdown
+	CUtlHashSymbolTable m_Strings;
 	CUtlHashtable<const void*, const char*> m_KeyLookupCache;
 
 public:
@@ -55,10 +57,10 @@ public:
 
 	void Dump( void )
 	{
-		CUtlVector<const char*> strings( 0, m_Strings.Count() );
-		for ( UtlHashHandle_t i = m_Strings.FirstHandle(); i != m_Strings.InvalidHandle(); i = m_Strings.NextHandle(i) )
+		CUtlVector<const char*> strings( 0, m_Strings.GetNumStrings() );
+		for ( int i = 0; i < m_Strings.GetNumStrings(); ++i )
 		{
-			strings.AddToTail( m_Strings[i] );
+			strings.AddToTail( m_Strings.String( i ) );
 		}
 
 		struct _Local {
@@ -76,13 +78,13 @@ public:
 
 	const char *Find(const char *string)
 	{
-		UtlHashHandle_t i = m_Strings.Find( string );
-		return i == m_Strings.InvalidHandle() ? NULL : m_Strings[ i ].Get();
+		UtlHashSymId_t i = m_Strings.Find( string );
+		return i == UTL_INVAL_HASH_SYMBOL ? NULL : m_Strings.String( i );
 	}
 
 	const char *Allocate(const char *string)
 	{
-		return m_Strings[ m_Strings.Insert( string ) ].Get();
+		return m_Strings.String( m_Strings.AddString( string ) );
 	}
 
 	const char *AllocateWithKey(const char *string, const void* key)
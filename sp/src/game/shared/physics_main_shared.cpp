@@ -19,6 +19,11 @@
 #include "utlmultilist.h"
 #include "tier1/callqueue.h"
 
+#if !defined( CLIENT_DLL )
+	#include "entitythinkprofiler.h"
+	#include "thinkbudget.h"
+#endif
+
 #ifdef PORTAL
 	#include "portal_util_shared.h"
 #endif
@@ -1905,6 +1910,12 @@ bool CBaseEntity::PhysicsRunThink( thinkmethods_t thinkMethod )
 {
 	if ( IsEFlagSet( EFL_NO_THINK_FUNCTION ) )
 		return true;
+
+#if !defined( CLIENT_DLL )
+	// Over the think budget; try again next tick
+	if ( g_ThinkBudget.IsThinkDeferred( this ) )
+		return true;
+#endif
 	
 	bool bAlive = true;
 
@@ -2114,7 +2125,14 @@ bool CBaseEntity::PhysicsRunSpecificThink( int nContextIndex, BASEPTR thinkFunc
 
 	SetNextThink( nContextIndex, TICK_NEVER_THINK );
 
+#if !defined( CLIENT_DLL )
+	{
+		CEntityThinkProfileScope profileThink( this, ( nContextIndex == -1 ) ? NULL : STRING( m_aThinkFunctions[nContextIndex].m_iszContext ) );
+		PhysicsDispatchThink( thinkFunc );
+	}
+#else
 	PhysicsDispatchThink( thinkFunc );
+#endif
 
 	SetLastThink( nContextIndex, gpGlobals->curtime );
 
@@ -21,6 +21,7 @@
 #include "predictioncopy.h"
 #include "engine/ivmodelinfo.h"
 #include "tier1/fmtstr.h"
+#include "tier1/utlmap.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -988,6 +989,45 @@ CPredictionCopy::difftype_t CPredictionCopy::CompareEHandle( EHANDLE *outvalue,
 	return IDENTICAL;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Marks the field this one overrides, then returns true if this field
+//			is overridden itself or isn't part of this kind of copy
+//-----------------------------------------------------------------------------
+bool CPredictionCopy::ShouldSkipField( int chain_count, typedescription_t *pField )
+{
+	// Mark any subchains first
+	if ( pField->override_field != NULL )
+	{
+		pField->override_field->override_count = chain_count;
+	}
+
+	// Skip this field?
+	if ( pField->override_count == chain_count )
+	{
+		return true;
+	}
+
+	// Always recurse into embeddeds
+	if ( pField->fieldType != FIELD_EMBEDDED )
+	{
+		int flags = pField->flags;
+
+		// Don't copy fields that are private to server or client
+		if ( flags & FTYPEDESC_PRIVATE )
+			return true;
+
+		// For PC_NON_NETWORKED_ONLYs skip any fields that are present in the network send tables
+		if ( m_nType == PC_NON_NETWORKED_ONLY && ( flags & FTYPEDESC_INSENDTABLE ) )
+			return true;
+
+		// For PC_NETWORKED_ONLYs skip any fields that are not present in the network send tables
+		if ( m_nType == PC_NETWORKED_ONLY && !( flags & FTYPEDESC_INSENDTABLE ) )
+			return true;
+	}
+
+	return false;
+}
+
 void CPredictionCopy::CopyFields( int chain_count, datamap_t *pRootMap, typedescription_t *pFields, int fieldCount )
 {
 	int				i;
@@ -1007,33 +1047,8 @@ void CPredictionCopy::CopyFields( int chain_count, datamap_t *pRootMap, typedesc
 		m_pCurrentField = &pFields[ i ];
 		flags = m_pCurrentField->flags;
 
-		// Mark any subchains first
-		if ( m_pCurrentField->override_field != NULL )
-		{
-			m_pCurrentField->override_field->override_count = chain_count;
-		}
-
-		// Skip this field?
-		if ( m_pCurrentField->override_count == chain_count )
-		{
+		if ( ShouldSkipField( chain_count, m_pCurrentField ) )
 			continue;
-		}
-
-		// Always recurse into embeddeds
-		if ( m_pCurrentField->fieldType != FIELD_EMBEDDED )
-		{
-			// Don't copy fields that are private to server or client
-			if ( flags & FTYPEDESC_PRIVATE )
-				continue;
-
-			// For PC_NON_NETWORKED_ONLYs skip any fields that are present in the network send tables
-			if ( m_nType == PC_NON_NETWORKED_ONLY && ( flags & FTYPEDESC_INSENDTABLE ) )
-				continue;
-
-			// For PC_NETWORKED_ONLYs skip any fields that are not present in the network send tables
-			if ( m_nType == PC_NETWORKED_ONLY && !( flags & FTYPEDESC_INSENDTABLE ) )
-				continue;
-		}
 
 		void *pOutputData;
 		void const *pInputData;
@@ -1373,6 +1388,402 @@ void CPredictionCopy::DetermineWatchField( const char *operation, int entindex,
 	m_pWatchField = FindFieldByName( pwatchvar.GetString(), dmap );
 }
 
+static ConVar cl_pred_compiled_copy( "cl_pred_compiled_copy", "1", 0, "Save, restore and error check predicted fields with copy programs built from the prediction datamaps instead of walking the fields each time." );
+static ConVar cl_pred_delta_restore( "cl_pred_delta_restore", "1", 0, "When restoring predicted entities, only write the fields that differ from the saved state (needs cl_pred_compiled_copy)." );
+
+PredictionRestoreStats_t g_PredictionRestoreStats;
+
+//-----------------------------------------------------------------------------
+// Purpose: A prediction datamap flattened into runs of bytes for one kind of
+//			copy (PC_ type and packed or normal data on each side). Fields next
+//			to each other on both sides are merged, so restoring from a packed
+//			frame is a handful of memcpys rather than a walk of the fields.
+//-----------------------------------------------------------------------------
+class CPredictionCopyProgram
+{
+public:
+	enum
+	{
+		RUN_DATA = 0,
+		RUN_STRING,		// null terminated, copied up to the terminator
+	};
+
+	struct Run_t
+	{
+		int		m_nDestOffset;
+		int		m_nSrcOffset;
+		int		m_nSize;
+		int		m_nType;
+		bool	m_bErrorCheck;
+	};
+
+	CPredictionCopyProgram( const char *pszClassName );
+
+	void	AddField( int destOffset, int srcOffset, int size, int type, bool bErrorCheck );
+	void	Finish();
+
+	void	Copy( void *pDest, const void *pSrc ) const;
+	void	CopyChanged( void *pDest, const void *pSrc ) const;
+	bool	IsEqual( const void *pDest, const void *pSrc ) const;
+
+	static void MergeRuns( CUtlVector< Run_t > &runs );
+	static int __cdecl RunCompare( const Run_t *lhs, const Run_t *rhs );
+
+	const char			*m_pszClassName;
+	bool				m_bValid;
+	int					m_nFields;
+	int					m_nBytes;
+	CUtlVector< Run_t >	m_CopyRuns;
+	CUtlVector< Run_t >	m_CompareRuns;	// Without the FTYPEDESC_NOERRORCHECK fields
+};
+
+CPredictionCopyProgram::CPredictionCopyProgram( const char *pszClassName )
+{
+	m_pszClassName = pszClassName;
+	m_bValid = true;
+	m_nFields = 0;
+	m_nBytes = 0;
+}
+
+void CPredictionCopyProgram::AddField( int destOffset, int srcOffset, int size, int type, bool bErrorCheck )
+{
+	Run_t &run = m_CopyRuns[ m_CopyRuns.AddToTail() ];
+	run.m_nDestOffset = destOffset;
+	run.m_nSrcOffset = srcOffset;
+	run.m_nSize = size;
+	run.m_nType = type;
+	run.m_bErrorCheck = bErrorCheck;
+	++m_nFields;
+}
+
+int __cdecl CPredictionCopyProgram::RunCompare( const Run_t *lhs, const Run_t *rhs )
+{
+	return lhs->m_nDestOffset - rhs->m_nDestOffset;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Runs are sorted by destination, so any that follow on from the
+//			previous one on both sides can be folded into it
+//-----------------------------------------------------------------------------
+void CPredictionCopyProgram::MergeRuns( CUtlVector< Run_t > &runs )
+{
+	int nOut = 0;
+	for ( int i = 0; i < runs.Count(); i++ )
+	{
+		if ( nOut > 0 )
+		{
+			Run_t &prev = runs[ nOut - 1 ];
+			const Run_t &run = runs[ i ];
+			if ( prev.m_nType == RUN_DATA && run.m_nType == RUN_DATA &&
+				prev.m_nDestOffset + prev.m_nSize == run.m_nDestOffset &&
+				prev.m_nSrcOffset + prev.m_nSize == run.m_nSrcOffset )
+			{
+				prev.m_nSize += run.m_nSize;
+				continue;
+			}
+		}
+
+		runs[ nOut++ ] = runs[ i ];
+	}
+
+	runs.SetCountNonDestructively( nOut );
+}
+
+void CPredictionCopyProgram::Finish()
+{
+	if ( !m_bValid )
+		return;
+
+	// The copy order doesn't matter as long as nothing is written twice
+	m_CopyRuns.Sort( RunCompare );
+	for ( int i = 1; i < m_CopyRuns.Count(); i++ )
+	{
+		const Run_t &prev = m_CopyRuns[ i - 1 ];
+		if ( prev.m_nDestOffset + MAX( prev.m_nSize, 1 ) > m_CopyRuns[ i ].m_nDestOffset )
+		{
+			DevMsg( "%s: overlapping prediction fields, not using a copy program\n", m_pszClassName );
+			m_bValid = false;
+			return;
+		}
+	}
+
+	for ( int i = 0; i < m_CopyRuns.Count(); i++ )
+	{
+		m_nBytes += m_CopyRuns[ i ].m_nSize;
+		if ( m_CopyRuns[ i ].m_bErrorCheck )
+		{
+			m_CompareRuns.AddToTail( m_CopyRuns[ i ] );
+		}
+	}
+
+	MergeRuns( m_CopyRuns );
+	MergeRuns( m_CompareRuns );
+}
+
+void CPredictionCopyProgram::Copy( void *pDest, const void *pSrc ) const
+{
+	for ( int i = 0; i < m_CopyRuns.Count(); i++ )
+	{
+		const Run_t &run = m_CopyRuns[ i ];
+		char *pOut = (char *)pDest + run.m_nDestOffset;
+		const char *pIn = (const char *)pSrc + run.m_nSrcOffset;
+
+		if ( run.m_nType == RUN_STRING )
+		{
+			memcpy( pOut, pIn, Q_strlen( pIn ) + 1 );
+		}
+		else
+		{
+			memcpy( pOut, pIn, run.m_nSize );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Compares a word at a time and ORs the differences together, so
+//			there's no branch per word and the compiler can vectorize it
+//-----------------------------------------------------------------------------
+static inline bool PredictionCopy_BlocksEqual( const char *a, const char *b, int size )
+{
+	uint64 diff = 0;
+
+	int i = 0;
+	for ( ; i + (int)sizeof( uint64 ) <= size; i += sizeof( uint64 ) )
+	{
+		uint64 wa, wb;
+		memcpy( &wa, a + i, sizeof( wa ) );
+		memcpy( &wb, b + i, sizeof( wb ) );
+		diff |= wa ^ wb;
+	}
+
+	for ( ; i < size; i++ )
+	{
+		diff |= (uint64)( a[i] ^ b[i] );
+	}
+
+	return diff == 0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Restores into an entity, writing only the runs that differ. Most
+//			predicted state doesn't change from one command to the next, so
+//			this leaves the entity's unchanged cache lines clean.
+//-----------------------------------------------------------------------------
+void CPredictionCopyProgram::CopyChanged( void *pDest, const void *pSrc ) const
+{
+	int nRestored = 0;
+	int nCopied = 0;
+
+	for ( int i = 0; i < m_CopyRuns.Count(); i++ )
+	{
+		const Run_t &run = m_CopyRuns[ i ];
+		char *pOut = (char *)pDest + run.m_nDestOffset;
+		const char *pIn = (const char *)pSrc + run.m_nSrcOffset;
+
+		if ( run.m_nType == RUN_STRING )
+		{
+			int nLength = Q_strlen( pIn ) + 1;
+			nRestored += nLength;
+			if ( Q_strcmp( pOut, pIn ) )
+			{
+				memcpy( pOut, pIn, nLength );
+				nCopied += nLength;
+			}
+			continue;
+		}
+
+		nRestored += run.m_nSize;
+		if ( !PredictionCopy_BlocksEqual( pOut, pIn, run.m_nSize ) )
+		{
+			memcpy( pOut, pIn, run.m_nSize );
+			nCopied += run.m_nSize;
+		}
+	}
+
+	++g_PredictionRestoreStats.m_nRestores;
+	g_PredictionRestoreStats.m_nBytesRestored += nRestored;
+	g_PredictionRestoreStats.m_nBytesCopied += nCopied;
+	g_PredictionRestoreStats.m_nFrameBytesRestored += nRestored;
+	g_PredictionRestoreStats.m_nFrameBytesCopied += nCopied;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Identical bytes mean no field could differ, so the field by field
+//			compare (with its tolerances and reporting) only runs if this fails
+//-----------------------------------------------------------------------------
+bool CPredictionCopyProgram::IsEqual( const void *pDest, const void *pSrc ) const
+{
+	for ( int i = 0; i < m_CompareRuns.Count(); i++ )
+	{
+		const Run_t &run = m_CompareRuns[ i ];
+		const char *pOut = (const char *)pDest + run.m_nDestOffset;
+		const char *pIn = (const char *)pSrc + run.m_nSrcOffset;
+
+		if ( run.m_nType == RUN_STRING )
+		{
+			if ( Q_strcmp( pOut, pIn ) )
+				return false;
+		}
+		else if ( !PredictionCopy_BlocksEqual( pOut, pIn, run.m_nSize ) )
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+struct PredictionCopyProgramKey_t
+{
+	datamap_t	*m_pMap;
+	int			m_nType;
+	int			m_nDestOffsetIndex;
+	int			m_nSrcOffsetIndex;
+};
+
+static bool PredictionCopyProgramKeyLessFunc( const PredictionCopyProgramKey_t &lhs, const PredictionCopyProgramKey_t &rhs )
+{
+	if ( lhs.m_pMap != rhs.m_pMap )
+		return lhs.m_pMap < rhs.m_pMap;
+	if ( lhs.m_nType != rhs.m_nType )
+		return lhs.m_nType < rhs.m_nType;
+	if ( lhs.m_nDestOffsetIndex != rhs.m_nDestOffsetIndex )
+		return lhs.m_nDestOffsetIndex < rhs.m_nDestOffsetIndex;
+	return lhs.m_nSrcOffsetIndex < rhs.m_nSrcOffsetIndex;
+}
+
+// Datamaps are static, so programs are built the first time they're needed and kept
+static CUtlMap< PredictionCopyProgramKey_t, CPredictionCopyProgram * > g_PredictionCopyPrograms( 0, 0, PredictionCopyProgramKeyLessFunc );
+
+//-----------------------------------------------------------------------------
+// Purpose: The describe, watch and report modes need to see each field, so
+//			they always walk the datamap
+//-----------------------------------------------------------------------------
+bool CPredictionCopy::CanUseProgram( void ) const
+{
+	if ( !cl_pred_compiled_copy.GetBool() )
+		return false;
+
+	if ( m_bDescribeFields || m_pWatchField )
+		return false;
+
+	// Either a plain copy or a plain error check
+	return m_bPerformCopy != m_bErrorCheck;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Records where each field CopyFields would touch lives, relative to
+//			the start of the source and destination
+//-----------------------------------------------------------------------------
+void CPredictionCopy::RecordFields( int chain_count, typedescription_t *pFields, int fieldCount, int destOffset, int srcOffset, CPredictionCopyProgram *pProgram )
+{
+	for ( int i = 0; i < fieldCount && pProgram->m_bValid; i++ )
+	{
+		typedescription_t *pField = &pFields[ i ];
+
+		if ( ShouldSkipField( chain_count, pField ) )
+			continue;
+
+		int fieldOffsetDest = destOffset + pField->fieldOffset[ m_nDestOffsetIndex ];
+		int fieldOffsetSrc = srcOffset + pField->fieldOffset[ m_nSrcOffsetIndex ];
+		int fieldSize = pField->fieldSize;
+		bool bErrorCheck = !( pField->flags & FTYPEDESC_NOERRORCHECK );
+
+		switch ( pField->fieldType )
+		{
+		case FIELD_EMBEDDED:
+			// Can't follow a pointer with fixed offsets
+			if ( ( pField->flags & FTYPEDESC_PTR ) &&
+				( m_nSrcOffsetIndex == PC_DATA_NORMAL || m_nDestOffsetIndex == PC_DATA_NORMAL ) )
+			{
+				pProgram->m_bValid = false;
+				break;
+			}
+
+			RecordFields( chain_count, pField->td->dataDesc, pField->td->dataNumFields, fieldOffsetDest, fieldOffsetSrc, pProgram );
+			break;
+
+		case FIELD_FLOAT:
+			pProgram->AddField( fieldOffsetDest, fieldOffsetSrc, sizeof( float ) * fieldSize, CPredictionCopyProgram::RUN_DATA, bErrorCheck );
+			break;
+
+		case FIELD_STRING:
+			pProgram->AddField( fieldOffsetDest, fieldOffsetSrc, 0, CPredictionCopyProgram::RUN_STRING, bErrorCheck );
+			break;
+
+		case FIELD_VECTOR:
+			pProgram->AddField( fieldOffsetDest, fieldOffsetSrc, sizeof( Vector ) * fieldSize, CPredictionCopyProgram::RUN_DATA, bErrorCheck );
+			break;
+
+		case FIELD_QUATERNION:
+			pProgram->AddField( fieldOffsetDest, fieldOffsetSrc, sizeof( Quaternion ) * fieldSize, CPredictionCopyProgram::RUN_DATA, bErrorCheck );
+			break;
+
+		case FIELD_COLOR32:
+			pProgram->AddField( fieldOffsetDest, fieldOffsetSrc, 4 * fieldSize, CPredictionCopyProgram::RUN_DATA, bErrorCheck );
+			break;
+
+		case FIELD_BOOLEAN:
+			pProgram->AddField( fieldOffsetDest, fieldOffsetSrc, sizeof( bool ) * fieldSize, CPredictionCopyProgram::RUN_DATA, bErrorCheck );
+			break;
+
+		case FIELD_INTEGER:
+			pProgram->AddField( fieldOffsetDest, fieldOffsetSrc, sizeof( int ) * fieldSize, CPredictionCopyProgram::RUN_DATA, bErrorCheck );
+			break;
+
+		case FIELD_SHORT:
+			pProgram->AddField( fieldOffsetDest, fieldOffsetSrc, sizeof( short ) * fieldSize, CPredictionCopyProgram::RUN_DATA, bErrorCheck );
+			break;
+
+		case FIELD_CHARACTER:
+			pProgram->AddField( fieldOffsetDest, fieldOffsetSrc, fieldSize, CPredictionCopyProgram::RUN_DATA, bErrorCheck );
+			break;
+
+		case FIELD_EHANDLE:
+			pProgram->AddField( fieldOffsetDest, fieldOffsetSrc, sizeof( EHANDLE ) * fieldSize, CPredictionCopyProgram::RUN_DATA, bErrorCheck );
+			break;
+
+		case FIELD_VOID:
+			break;
+
+		default:
+			// Types CopyFields asserts on; leave them to it
+			pProgram->m_bValid = false;
+			break;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns NULL if this datamap can't be turned into a program
+//-----------------------------------------------------------------------------
+const CPredictionCopyProgram *CPredictionCopy::GetProgram( datamap_t *dmap )
+{
+	PredictionCopyProgramKey_t key;
+	key.m_pMap = dmap;
+	key.m_nType = m_nType;
+	key.m_nDestOffsetIndex = m_nDestOffsetIndex;
+	key.m_nSrcOffsetIndex = m_nSrcOffsetIndex;
+
+	unsigned short i = g_PredictionCopyPrograms.Find( key );
+	if ( i == g_PredictionCopyPrograms.InvalidIndex() )
+	{
+		CPredictionCopyProgram *pProgram = new CPredictionCopyProgram( dmap->dataClassName );
+
+		// Same order as TransferData_R, so overrides are skipped the same way
+		for ( datamap_t *pMap = dmap; pMap && pProgram->m_bValid; pMap = pMap->baseMap )
+		{
+			RecordFields( g_nChainCount, pMap->dataDesc, pMap->dataNumFields, 0, 0, pProgram );
+		}
+
+		pProgram->Finish();
+		i = g_PredictionCopyPrograms.Insert( key, pProgram );
+	}
+
+	CPredictionCopyProgram *pProgram = g_PredictionCopyPrograms[ i ];
+	return pProgram->m_bValid ? pProgram : NULL;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 // Input  : *operation - 
@@ -1391,11 +1802,64 @@ int CPredictionCopy::TransferData( const char *operation, int entindex, datamap_
 	
 	DetermineWatchField( operation, entindex, dmap );
 
+	if ( CanUseProgram() )
+	{
+		const CPredictionCopyProgram *pProgram = GetProgram( dmap );
+		if ( pProgram )
+		{
+			if ( !m_bErrorCheck )
+			{
+				if ( m_nDestOffsetIndex == TD_OFFSET_NORMAL && cl_pred_delta_restore.GetBool() )
+				{
+					pProgram->CopyChanged( m_pDest, m_pSrc );
+				}
+				else
+				{
+					pProgram->Copy( m_pDest, m_pSrc );
+				}
+				return 0;
+			}
+
+			// Walk the fields to count and report the errors only if there are any
+			if ( pProgram->IsEqual( m_pDest, m_pSrc ) )
+				return 0;
+		}
+	}
+
 	TransferData_R( g_nChainCount, dmap );
 
 	return m_nErrorCount;
 }
 
+CON_COMMAND( cl_pred_compiled_copy_report, "List the prediction copy programs built so far." )
+{
+	static const char *s_pszTypes[] = { "everything", "non-networked", "networked" };
+
+	int nPrograms = 0, nFields = 0, nRuns = 0;
+	FOR_EACH_MAP_FAST( g_PredictionCopyPrograms, i )
+	{
+		const PredictionCopyProgramKey_t &key = g_PredictionCopyPrograms.Key( i );
+		const CPredictionCopyProgram *pProgram = g_PredictionCopyPrograms[ i ];
+
+		if ( !pProgram->m_bValid )
+		{
+			Msg( "%-32s %-14s %s -> %s: not compiled\n", pProgram->m_pszClassName, s_pszTypes[ key.m_nType ],
+				key.m_nSrcOffsetIndex ? "packed" : "normal", key.m_nDestOffsetIndex ? "packed" : "normal" );
+			continue;
+		}
+
+		Msg( "%-32s %-14s %s -> %s: %d fields, %d bytes in %d runs (%d compared)\n", pProgram->m_pszClassName, s_pszTypes[ key.m_nType ],
+			key.m_nSrcOffsetIndex ? "packed" : "normal", key.m_nDestOffsetIndex ? "packed" : "normal",
+			pProgram->m_nFields, pProgram->m_nBytes, pProgram->m_CopyRuns.Count(), pProgram->m_CompareRuns.Count() );
+
+		++nPrograms;
+		nFields += pProgram->m_nFields;
+		nRuns += pProgram->m_CopyRuns.Count();
+	}
+
+	Msg( "%d programs, %d fields in %d runs\n", nPrograms, nFields, nRuns );
+}
+
 /*
 //-----------------------------------------------------------------------------
 // Purpose: Simply dumps all data fields in object
@@ -44,6 +44,8 @@ enum
 typedef void ( *FN_FIELD_COMPARE )( const char *classname, const char *fieldname, const char *fieldtype,
 	bool networked, bool noterrorchecked, bool differs, bool withintolerance, const char *value );
 
+class CPredictionCopyProgram;
+
 class CPredictionCopy
 {
 public:
@@ -131,8 +133,14 @@ private:
 	
 	bool	CanCheck( void );
 
+	bool	ShouldSkipField( int chain_count, typedescription_t *pField );
 	void	CopyFields( int chaincount, datamap_t *pMap, typedescription_t *pFields, int fieldCount );
 
+	// Plain copies and error checks run from a flattened copy of the datamap
+	bool	CanUseProgram( void ) const;
+	const CPredictionCopyProgram *GetProgram( datamap_t *dmap );
+	void	RecordFields( int chain_count, typedescription_t *pFields, int fieldCount, int destOffset, int srcOffset, CPredictionCopyProgram *pProgram );
+
 private:
 
 	int				m_nType;
@@ -159,6 +167,50 @@ private:
 	char const			*m_pOperation;
 };
 
+//-----------------------------------------------------------------------------
+// Purpose: How much of the state restored into entities actually changed.
+//			With cl_pred_delta_restore, only the fields that differ are written.
+//-----------------------------------------------------------------------------
+struct PredictionRestoreStats_t
+{
+	PredictionRestoreStats_t()
+	{
+		Reset();
+	}
+
+	void Reset()
+	{
+		m_nFrames = 0;
+		m_nRestores = 0;
+		m_nBytesRestored = 0;
+		m_nBytesCopied = 0;
+		m_nLastFrameBytesRestored = 0;
+		m_nLastFrameBytesCopied = 0;
+		m_nFrameBytesRestored = 0;
+		m_nFrameBytesCopied = 0;
+	}
+
+	void EndFrame()
+	{
+		++m_nFrames;
+		m_nLastFrameBytesRestored = m_nFrameBytesRestored;
+		m_nLastFrameBytesCopied = m_nFrameBytesCopied;
+		m_nFrameBytesRestored = 0;
+		m_nFrameBytesCopied = 0;
+	}
+
+	int		m_nFrames;
+	int		m_nRestores;
+	int64	m_nBytesRestored;	// Size of the fields restored
+	int64	m_nBytesCopied;		// Size of the ones that had changed
+	int		m_nLastFrameBytesRestored;
+	int		m_nLastFrameBytesCopied;
+	int		m_nFrameBytesRestored;
+	int		m_nFrameBytesCopied;
+};
+
+extern PredictionRestoreStats_t g_PredictionRestoreStats;
+
 typedef void (*FN_FIELD_DESCRIPTION)( const char *classname, const char *fieldname, const char *fieldtype,
 	bool networked, const char *value );
 
@@ -10,7 +10,7 @@
 #include "tier0/vprof.h"
 #include "tier1/utlintrusivelist.h"
 #include "datacache/imdlcache.h"
-#include "vstdlib/jobthread.h"
+#include "vstdlib/jobtasks.h"
 
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -164,23 +164,26 @@ static void CalculateOffsettedPosition( CBaseEntity *pEntity, EEntityOffsetMode_
 
 
 
-struct QueryCacheUpdateRecord_t
-{
-	int m_nStartHashChain;
-	int m_nNumHashChainsToUpdate;
-	CUtlIntrusiveDListWithTailPtr<QueryCacheEntry_t> m_KilledList;
-};
+// Hash chains are handed out to the threads this many at a time
+#define QUERYCACHE_UPDATE_GRAIN 64
 
+// Entries each thread took out of the hash chains, for the victim list
+static CJobPerThread< CUtlIntrusiveDListWithTailPtr<QueryCacheEntry_t> > s_KilledLists;
 
 
-void ProcessQueryCacheUpdate( QueryCacheUpdateRecord_t &workItem )
+static void ProcessQueryCacheUpdate( int iFirstHashChain, int iLastHashChain )
 {
+	CUtlIntrusiveDListWithTailPtr<QueryCacheEntry_t> &killedList = s_KilledLists.Local();
+
+	//mdlcache->BeginCoarseLock();			// x360 only - will need to port for this in the future
+	mdlcache->BeginLock();
+
 	float flCurTime = gpGlobals->curtime;
 	// run through all of the cache.
-	for( int i = 0; i < workItem.m_nNumHashChainsToUpdate; i++ )
+	for( int i = iFirstHashChain; i < iLastHashChain; i++ )
 	{
 		QueryCacheEntry_t *pNext;
-		for( QueryCacheEntry_t *pEntry = s_HashChains[i + workItem.m_nStartHashChain].m_pHead ; pEntry; pEntry = pNext )
+		for( QueryCacheEntry_t *pEntry = s_HashChains[i].m_pHead ; pEntry; pEntry = pNext )
 		{
 			pNext = pEntry->m_pNext;
 			if ( pEntry->m_bUsedSinceUpdated )
@@ -204,24 +207,12 @@ void ProcessQueryCacheUpdate( QueryCacheUpdateRecord_t &workItem )
 					}
 					pEntry->m_QueryParams.m_Type = EQUERY_INVALID;
 					s_HashChains[pEntry->m_QueryParams.m_nHashIdx].RemoveNode( pEntry );
-					workItem.m_KilledList.AddToHead( pEntry );
+					killedList.AddToHead( pEntry );
 				}
 			}
 		}
 	}
-}
-
-
-#define N_WAYS_TO_SPLIT_CACHE_UPDATE 8
-
-static void PreUpdateQueryCache()
-{
-	//mdlcache->BeginCoarseLock();			// x360 only - will need to port for this in the future
-	mdlcache->BeginLock();
-}
 
-static void PostUpdateQueryCache()
-{
 	mdlcache->EndLock();
 	//mdlcache->EndCoarseLock();			// x360 only - will need to port for this in the future
 }
@@ -230,23 +221,17 @@ static void PostUpdateQueryCache()
 void UpdateQueryCache( void )
 {
 	// parallel process all hash chains
-	QueryCacheUpdateRecord_t workList[N_WAYS_TO_SPLIT_CACHE_UPDATE];
-	int nCurEntry = 0;
-	for( int i =0 ; i < N_WAYS_TO_SPLIT_CACHE_UPDATE; i++ )
-	{
-		workList[i].m_nStartHashChain = nCurEntry;
-		if ( i != N_WAYS_TO_SPLIT_CACHE_UPDATE -1 )
-			workList[i].m_nNumHashChainsToUpdate = ARRAYSIZE( s_HashChains ) / N_WAYS_TO_SPLIT_CACHE_UPDATE;
-		else
-			workList[i].m_nNumHashChainsToUpdate = ARRAYSIZE( s_HashChains ) - nCurEntry;
-		nCurEntry += ARRAYSIZE( s_HashChains ) / N_WAYS_TO_SPLIT_CACHE_UPDATE;
-	}
-	ParallelProcess( "ProcessQueryCacheUpdate", workList, N_WAYS_TO_SPLIT_CACHE_UPDATE, ProcessQueryCacheUpdate, PreUpdateQueryCache, PostUpdateQueryCache, ( sv_disable_querycache.GetBool() ) ? 0 : INT_MAX );
+	ParallelFor( "ProcessQueryCacheUpdate", 0, ARRAYSIZE( s_HashChains ), QUERYCACHE_UPDATE_GRAIN, ProcessQueryCacheUpdate, ( sv_disable_querycache.GetBool() ) ? 0 : INT_MAX );
 	// now, we need to take all of the obsolete cache entries each thread generated and add them to
 	// the victim cache
-	for( int i = 0 ; i < N_WAYS_TO_SPLIT_CACHE_UPDATE; i++ )
+	for( int i = 0 ; i < s_KilledLists.Count(); i++ )
 	{
-		PrependDListWithTailToDList( workList[i].m_KilledList, s_VictimList );
+		CUtlIntrusiveDListWithTailPtr<QueryCacheEntry_t> &killedList = s_KilledLists[i];
+		PrependDListWithTailToDList( killedList, s_VictimList );
+
+		// The entries belong to the victim list now
+		killedList.RemoveAll();
+		killedList.m_pTailPtr = NULL;
 	}
 }
 
@@ -0,0 +1,375 @@
+//=============================================================================//
+//
+// Purpose: Times interning and looking up strings in CUtlHashSymbolTable
+//			against the sorted tree CStringPool and CUtlSymbolTable used to
+//			be built on, and CUtlConcurrentSymbolTable against
+//			CUtlSymbolTableMT with many threads interning at once.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "tier1/utlhashsymboltable.h"
+#include "tier1/utlconcurrentsymboltable.h"
+#include "tier1/utlsymbol.h"
+#include "tier0/fasttimer.h"
+#include "vstdlib/random.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+//-----------------------------------------------------------------------------
+// Purpose: The old CStringPool, for comparison
+//-----------------------------------------------------------------------------
+class CSymbolBenchmarkTreePool
+{
+public:
+	CSymbolBenchmarkTreePool() : m_Strings( 32, 256, CaselessStringLessThan ) {}
+	~CSymbolBenchmarkTreePool()
+	{
+		for ( int i = m_Strings.FirstInorder(); i != m_Strings.InvalidIndex(); i = m_Strings.NextInorder( i ) )
+		{
+			free( (void *)m_Strings[i] );
+		}
+	}
+
+	const char *Allocate( const char *pszValue )
+	{
+		int i = m_Strings.Find( pszValue );
+		if ( i != m_Strings.InvalidIndex() )
+			return m_Strings[i];
+
+		char *pszNew = strdup( pszValue );
+		m_Strings.Insert( pszNew );
+		return pszNew;
+	}
+
+	const char *Find( const char *pszValue )
+	{
+		int i = m_Strings.Find( pszValue );
+		return ( i != m_Strings.InvalidIndex() ) ? m_Strings[i] : NULL;
+	}
+
+	int Count() const { return m_Strings.Count(); }
+
+private:
+	CUtlRBTree<const char *, int> m_Strings;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Names that look like the ones entities and keyvalues intern, with
+//			some repeats in a different case
+//-----------------------------------------------------------------------------
+static void SymbolBenchmark_MakeStrings( int nStrings, CUtlVector<CUtlString> &strings, CUniformRandomStream &random )
+{
+	static const char *s_pszPrefixes[] =
+	{
+		"models/props_c17/", "models/humans/group01/", "npc_", "weapon_", "ambient.", "info_", "trigger_", "env_", "func_", "prop_",
+	};
+
+	strings.SetCount( nStrings );
+	for ( int i = 0; i < nStrings; i++ )
+	{
+		if ( i > 0 && random.RandomInt( 0, 3 ) == 0 )
+		{
+			// A repeat, maybe in another case
+			CUtlString &repeat = strings[random.RandomInt( 0, i - 1 )];
+			strings[i] = repeat;
+			if ( random.RandomInt( 0, 1 ) )
+			{
+				char *pszUpper = strings[i].Get();
+				V_strupr( pszUpper );
+			}
+			continue;
+		}
+
+		char szName[MAX_PATH];
+		V_snprintf( szName, sizeof( szName ), "%s%s_%d", s_pszPrefixes[random.RandomInt( 0, ARRAYSIZE( s_pszPrefixes ) - 1 )],
+			( i & 1 ) ? "oildrum" : "citizen_male", random.RandomInt( 0, 1000000 ) );
+		strings[i] = szName;
+	}
+}
+
+static void SymbolBenchmark_Run( int nStrings, int nLookups )
+{
+	// Same strings every run so results can be compared between builds
+	CUniformRandomStream random;
+	random.SetSeed( 0 );
+
+	CUtlVector<CUtlString> strings;
+	SymbolBenchmark_MakeStrings( nStrings, strings, random );
+
+	CUtlVector<CUtlString> misses;
+	SymbolBenchmark_MakeStrings( MIN( nStrings, 4096 ), misses, random );
+	for ( int i = 0; i < misses.Count(); i++ )
+	{
+		misses[i] += "_missing";
+	}
+
+	CSymbolBenchmarkTreePool *pTree = new CSymbolBenchmarkTreePool;
+	CUtlHashSymbolTable *pHash = new CUtlHashSymbolTable( 0, true );
+
+	CFastTimer timer;
+	CCycleCount treeIntern, hashIntern, treeHit, hashHit, treeMiss, hashMiss;
+
+	timer.Start();
+	for ( int i = 0; i < nStrings; i++ )
+	{
+		pTree->Allocate( strings[i] );
+	}
+	timer.End();
+	treeIntern = timer.GetDuration();
+
+	timer.Start();
+	for ( int i = 0; i < nStrings; i++ )
+	{
+		pHash->AddString( strings[i] );
+	}
+	timer.End();
+	hashIntern = timer.GetDuration();
+
+	int nTreeFound = 0, nHashFound = 0;
+
+	timer.Start();
+	for ( int i = 0; i < nLookups; i++ )
+	{
+		nTreeFound += ( pTree->Find( strings[i % nStrings] ) != NULL );
+	}
+	timer.End();
+	treeHit = timer.GetDuration();
+
+	timer.Start();
+	for ( int i = 0; i < nLookups; i++ )
+	{
+		nHashFound += ( pHash->Find( strings[i % nStrings] ) != UTL_INVAL_HASH_SYMBOL );
+	}
+	timer.End();
+	hashHit = timer.GetDuration();
+
+	timer.Start();
+	for ( int i = 0; i < nLookups; i++ )
+	{
+		nTreeFound += ( pTree->Find( misses[i % misses.Count()] ) != NULL );
+	}
+	timer.End();
+	treeMiss = timer.GetDuration();
+
+	timer.Start();
+	for ( int i = 0; i < nLookups; i++ )
+	{
+		nHashFound += ( pHash->Find( misses[i % misses.Count()] ) != UTL_INVAL_HASH_SYMBOL );
+	}
+	timer.End();
+	hashMiss = timer.GetDuration();
+
+	bool bMismatch = ( pTree->Count() != pHash->GetNumStrings() || nTreeFound != nHashFound );
+
+	Msg( "%d strings (%d unique), %d lookups%s\n", nStrings, pHash->GetNumStrings(), nLookups, bMismatch ? " MISMATCH" : "" );
+	Msg( "  intern: tree %.3fms, hash %.3fms (%.2fx)\n", treeIntern.GetMillisecondsF(), hashIntern.GetMillisecondsF(),
+		hashIntern.GetMillisecondsF() > 0.0 ? treeIntern.GetMillisecondsF() / hashIntern.GetMillisecondsF() : 0.0 );
+	Msg( "  hit:    tree %.3fms, hash %.3fms (%.2fx)\n", treeHit.GetMillisecondsF(), hashHit.GetMillisecondsF(),
+		hashHit.GetMillisecondsF() > 0.0 ? treeHit.GetMillisecondsF() / hashHit.GetMillisecondsF() : 0.0 );
+	Msg( "  miss:   tree %.3fms, hash %.3fms (%.2fx)\n", treeMiss.GetMillisecondsF(), hashMiss.GetMillisecondsF(),
+		hashMiss.GetMillisecondsF() > 0.0 ? treeMiss.GetMillisecondsF() / hashMiss.GetMillisecondsF() : 0.0 );
+	Msg( "  hash table memory: %d bytes\n", pHash->GetMemoryUsage() );
+
+	delete pTree;
+	delete pHash;
+}
+
+CON_COMMAND_SHARED( symboltable_benchmark, "Compare interning strings in a sorted tree and in CUtlHashSymbolTable. Usage: symboltable_benchmark [strings] [lookups]" )
+{
+#ifdef GAME_DLL
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+#endif
+
+	int nStrings = ( args.ArgC() > 1 ) ? MAX( atoi( args[1] ), 1 ) : 20000;
+	int nLookups = ( args.ArgC() > 2 ) ? MAX( atoi( args[2] ), 1 ) : 200000;
+
+	SymbolBenchmark_Run( nStrings, nLookups );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Contention benchmark. Every thread interns names the way entity
+//			spawning and response lookups do: mostly names that are already
+//			in, with the odd new one, several threads often racing on the
+//			same new name.
+//-----------------------------------------------------------------------------
+#define SYMBOL_CONTENTION_HOT_STRINGS	4096
+#define SYMBOL_CONTENTION_NEW_STRINGS	16384	// Keeps CUtlSymbolTableMT under its 64k limit
+
+struct SymbolContentionThread_t
+{
+	CUtlSymbolTableMT			*m_pLockedTable;
+	CUtlConcurrentSymbolTable	*m_pConcurrentTable;
+	const CUtlVector<CUtlString> *m_pHot;
+	const CUtlVector<CUtlString> *m_pNew;
+	volatile bool				*m_pGo;
+	int							m_nOps;
+	int							m_nSeed;
+	int							m_nBadStrings;
+};
+
+static unsigned SymbolContention_ThreadFunc( void *pParam )
+{
+	SymbolContentionThread_t *pThread = (SymbolContentionThread_t *)pParam;
+	const CUtlVector<CUtlString> &hot = *pThread->m_pHot;
+	const CUtlVector<CUtlString> &newStrings = *pThread->m_pNew;
+
+	CUniformRandomStream random;
+	random.SetSeed( pThread->m_nSeed );
+
+	while ( !*pThread->m_pGo )
+	{
+		ThreadPause();
+	}
+
+	for ( int i = 0; i < pThread->m_nOps; i++ )
+	{
+		const char *pszName = ( i & 7 ) ? hot[random.RandomInt( 0, hot.Count() - 1 )].Get() : newStrings[random.RandomInt( 0, newStrings.Count() - 1 )].Get();
+
+		const char *pszResult;
+		if ( pThread->m_pLockedTable )
+		{
+			pszResult = pThread->m_pLockedTable->String( pThread->m_pLockedTable->AddString( pszName ) );
+		}
+		else
+		{
+			pszResult = pThread->m_pConcurrentTable->String( pThread->m_pConcurrentTable->AddString( pszName ) );
+		}
+
+		if ( V_stricmp( pszResult, pszName ) )
+		{
+			pThread->m_nBadStrings++;
+		}
+	}
+
+	return 0;
+}
+
+// Returns the seconds taken, or a negative number if a thread couldn't start
+static double SymbolContention_Run( CUtlSymbolTableMT *pLockedTable, CUtlConcurrentSymbolTable *pConcurrentTable, int nThreads, int nOps,
+	const CUtlVector<CUtlString> &hot, const CUtlVector<CUtlString> &newStrings, int &nBadStrings )
+{
+	volatile bool bGo = false;
+
+	CUtlVector<SymbolContentionThread_t> threads;
+	CUtlVector<ThreadHandle_t> handles;
+	threads.SetCount( nThreads );
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		SymbolContentionThread_t &thread = threads[i];
+		thread.m_pLockedTable = pLockedTable;
+		thread.m_pConcurrentTable = pConcurrentTable;
+		thread.m_pHot = &hot;
+		thread.m_pNew = &newStrings;
+		thread.m_pGo = &bGo;
+		thread.m_nOps = nOps;
+		thread.m_nSeed = i + 1;
+		thread.m_nBadStrings = 0;
+	}
+
+	bool bFailed = false;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		ThreadHandle_t hThread = CreateSimpleThread( SymbolContention_ThreadFunc, &threads[i] );
+		if ( !hThread )
+		{
+			bFailed = true;
+			break;
+		}
+		handles.AddToTail( hThread );
+	}
+
+	CFastTimer timer;
+	timer.Start();
+	bGo = true;
+	for ( int i = 0; i < handles.Count(); i++ )
+	{
+		ThreadJoin( handles[i] );
+		ReleaseThreadHandle( handles[i] );
+	}
+	timer.End();
+
+	nBadStrings = 0;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		nBadStrings += threads[i].m_nBadStrings;
+	}
+
+	return bFailed ? -1.0 : timer.GetDuration().GetSeconds();
+}
+
+CON_COMMAND_SHARED( symboltable_contention_benchmark, "Compare CUtlSymbolTableMT and CUtlConcurrentSymbolTable with 1 to N threads interning at once. Usage: symboltable_contention_benchmark [max threads] [ops per thread]" )
+{
+#ifdef GAME_DLL
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+#endif
+
+	int nMaxThreads = ( args.ArgC() > 1 ) ? clamp( atoi( args[1] ), 1, 64 ) : 32;
+	int nOps = ( args.ArgC() > 2 ) ? MAX( atoi( args[2] ), 1 ) : 200000;
+
+	CUniformRandomStream random;
+	random.SetSeed( 0 );
+
+	CUtlVector<CUtlString> hot, newStrings;
+	SymbolBenchmark_MakeStrings( SYMBOL_CONTENTION_HOT_STRINGS, hot, random );
+	SymbolBenchmark_MakeStrings( SYMBOL_CONTENTION_NEW_STRINGS, newStrings, random );
+	for ( int i = 0; i < newStrings.Count(); i++ )
+	{
+		newStrings[i] += "_new";
+	}
+
+	Msg( "%d ops per thread, 1 in 8 on a new name\n", nOps );
+	for ( int nThreads = 1; nThreads <= nMaxThreads; nThreads *= 2 )
+	{
+		// Fresh tables every run, with the hot names already in
+		CUtlSymbolTableMT *pLockedTable = new CUtlSymbolTableMT( 0, 32, true );
+		CUtlConcurrentSymbolTable *pConcurrentTable = new CUtlConcurrentSymbolTable( true );
+		for ( int i = 0; i < hot.Count(); i++ )
+		{
+			pLockedTable->AddString( hot[i] );
+			pConcurrentTable->AddString( hot[i] );
+		}
+
+		int nLockedBad, nConcurrentBad;
+		double flLocked = SymbolContention_Run( pLockedTable, NULL, nThreads, nOps, hot, newStrings, nLockedBad );
+		double flConcurrent = SymbolContention_Run( NULL, pConcurrentTable, nThreads, nOps, hot, newStrings, nConcurrentBad );
+
+		if ( flLocked < 0.0 || flConcurrent < 0.0 )
+		{
+			Warning( "Couldn't start %d threads.\n", nThreads );
+			delete pLockedTable;
+			delete pConcurrentTable;
+			break;
+		}
+
+		// Both tables must have interned the same names
+		int nMissing = 0;
+		for ( int i = 0; i < hot.Count() + newStrings.Count(); i++ )
+		{
+			const char *pszName = ( i < hot.Count() ) ? hot[i].Get() : newStrings[i - hot.Count()].Get();
+			UtlHashSymId_t id = pConcurrentTable->Find( pszName );
+			if ( id != UTL_INVAL_HASH_SYMBOL && V_stricmp( pConcurrentTable->String( id ), pszName ) )
+			{
+				nConcurrentBad++;
+			}
+			if ( ( id != UTL_INVAL_HASH_SYMBOL ) != pLockedTable->Find( pszName ).IsValid() )
+			{
+				nMissing++;
+			}
+		}
+
+		int nConcurrentStrings = pConcurrentTable->GetNumStrings();
+		bool bMismatch = ( nLockedBad || nConcurrentBad || nMissing || pLockedTable->GetNumStrings() != nConcurrentStrings );
+
+		double flTotalOps = (double)nThreads * nOps;
+		Msg( "  %2d threads: locked %.2fM ops/s, concurrent %.2fM ops/s (%.2fx), %d strings%s\n", nThreads,
+			flLocked > 0.0 ? flTotalOps / flLocked / 1000000.0 : 0.0, flConcurrent > 0.0 ? flTotalOps / flConcurrent / 1000000.0 : 0.0,
+			flConcurrent > 0.0 ? flLocked / flConcurrent : 0.0, nConcurrentStrings, bMismatch ? " MISMATCH" : "" );
+
+		delete pLockedTable;
+		delete pConcurrentTable;
+	}
+}
@@ -18,8 +18,10 @@
 #include "mathlib/ssequaternion.h"
 #include "bitvec.h"
 #include "datamanager.h"
+#include "tier1/generichash.h"
 #include "convar.h"
 #include "tier0/tslist.h"
+#include "vstdlib/jobtasks.h"
 #include "vphysics_interface.h"
 #ifdef CLIENT_DLL
 	#include "posedebugger.h"
@@ -188,6 +190,18 @@ void CBoneCache::ReadCachedBonePointers( matrix3x4_t **bones, int numbones )
 	}
 }
 
+// Moves all the cached bones by a transform, for when the entity has moved but its pose hasn't changed
+void CBoneCache::TransformBones( const matrix3x4_t &transform )
+{
+	matrix3x4_t *pBones = BoneArray();
+	for ( int i = 0; i < m_cachedBoneCount; i++ )
+	{
+		matrix3x4_t bone;
+		MatrixCopy( pBones[i], bone );
+		ConcatTransforms( transform, bone, pBones[i] );
+	}
+}
+
 bool CBoneCache::IsValid( float curtime, float dt )
 {
 	if ( curtime - m_timeValid <= dt )
@@ -212,35 +226,204 @@ short *CBoneCache::CachedToStudio()
 	return (short *)( (char *)(this+1) + m_cachedToStudioOffset );
 }
 
-// Construct a singleton
-static CDataManager<CBoneCache, bonecacheparams_t, CBoneCache *, CThreadFastMutex> g_StudioBoneCache( 128 * 1024L );
+//-----------------------------------------------------------------------------
+// The bone caches are split into shards, each an LRU with its own lock, so
+// entities setting up bones on different threads rarely wait on each other.
+// New caches go to the shards in turn. The shard is kept in the top bits of
+// the 16 bit index half of the handle, which limits each shard to
+// BONECACHE_SHARD_MAX_ENTRIES caches; past that the least recently used one
+// is evicted, same as when the shard runs out of memory.
+//-----------------------------------------------------------------------------
+#define BONECACHE_SHARD_BITS		3
+#define BONECACHE_SHARDS			( 1 << BONECACHE_SHARD_BITS )
+#define BONECACHE_SHARD_SHIFT		( 16 - BONECACHE_SHARD_BITS )
+#define BONECACHE_SHARD_MASK		( ( BONECACHE_SHARDS - 1 ) << BONECACHE_SHARD_SHIFT )
+#define BONECACHE_SHARD_MAX_ENTRIES	( ( 1 << BONECACHE_SHARD_SHIFT ) - 2 )
+
+static void BoneCacheSizeChanged( IConVar *var, const char *pOldValue, float flOldValue );
+static ConVar anim_bonecache_size( "anim_bonecache_size", "512", 0, "Memory for cached bone matrices, in KB, split across all the bone cache shards.", true, 64, true, 65536, BoneCacheSizeChanged );
+
+class CBoneCacheShard : public CDataManager<CBoneCache, bonecacheparams_t, CBoneCache *, CThreadFastMutex>
+{
+	typedef CDataManager<CBoneCache, bonecacheparams_t, CBoneCache *, CThreadFastMutex> BaseClass;
+public:
+	CBoneCacheShard() : BaseClass( 512 * 1024L / BONECACHE_SHARDS )
+	{
+		ResetStats();
+	}
+
+	// Counts the times another thread already held the lock
+	void Lock()
+	{
+		if ( !AccessMutex().TryLock() )
+		{
+			++m_nContended;
+			AccessMutex().Lock();
+		}
+	}
+
+	void Unlock()
+	{
+		AccessMutex().Unlock();
+	}
+
+	memhandle_t CreateBoneCache( const bonecacheparams_t &params )
+	{
+		if ( EntryCount() >= BONECACHE_SHARD_MAX_ENTRIES )
+		{
+			DestroyResource( GetFirstUnlocked() );
+			m_nEvicted++;
+		}
+
+		int nCount = EntryCount();
+		memhandle_t hCache = CreateResource( params );
+
+		// Anything that had to go to make room
+		m_nEvicted += nCount + 1 - EntryCount();
+		m_nCreated++;
+
+		if ( hCache == INVALID_MEMHANDLE || ( (unsigned int)hCache & BONECACHE_SHARD_MASK ) )
+		{
+			Assert( hCache == INVALID_MEMHANDLE );
+			DestroyResource( hCache );
+			return INVALID_MEMHANDLE;
+		}
+		return hCache;
+	}
+
+	int EntryCount() const
+	{
+		// Destroyed entries stay in m_freeList so their serials can be reused
+		return m_memoryLists.Count( m_lruList ) + m_memoryLists.Count( m_lockList );
+	}
+
+	void ResetStats()
+	{
+		m_nGets = 0;
+		m_nMisses = 0;
+		m_nCreated = 0;
+		m_nEvicted = 0;
+		m_nContended = 0;
+	}
+
+	int				m_nGets;
+	int				m_nMisses;		// handle had been evicted
+	int				m_nCreated;
+	int				m_nEvicted;
+	CInterlockedInt	m_nContended;
+};
+
+static CBoneCacheShard g_StudioBoneCache[BONECACHE_SHARDS];
+static CInterlockedInt g_nNextBoneCacheShard;
+
+static void BoneCacheSizeChanged( IConVar *var, const char *pOldValue, float flOldValue )
+{
+	for ( int i = 0; i < BONECACHE_SHARDS; i++ )
+	{
+		g_StudioBoneCache[i].Lock();
+		g_StudioBoneCache[i].SetTargetSize( anim_bonecache_size.GetInt() * 1024 / BONECACHE_SHARDS );
+		g_StudioBoneCache[i].FlushToTargetSize();
+		g_StudioBoneCache[i].Unlock();
+	}
+}
+
+inline CBoneCacheShard &BoneCacheShard( memhandle_t cacheHandle )
+{
+	return g_StudioBoneCache[ ( (unsigned int)cacheHandle & BONECACHE_SHARD_MASK ) >> BONECACHE_SHARD_SHIFT ];
+}
+
+inline memhandle_t BoneCacheShardHandle( memhandle_t cacheHandle )
+{
+	return (memhandle_t)( (unsigned int)cacheHandle & ~BONECACHE_SHARD_MASK );
+}
 
 CBoneCache *Studio_GetBoneCache( memhandle_t cacheHandle )
 {
-	AUTO_LOCK( g_StudioBoneCache.AccessMutex() );
-	return g_StudioBoneCache.GetResource_NoLock( cacheHandle );
+	if ( cacheHandle == INVALID_MEMHANDLE )
+		return NULL;
+
+	CBoneCacheShard &shard = BoneCacheShard( cacheHandle );
+	shard.Lock();
+	CBoneCache *pCache = shard.GetResource_NoLock( BoneCacheShardHandle( cacheHandle ) );
+	shard.m_nGets++;
+	if ( !pCache )
+	{
+		shard.m_nMisses++;
+	}
+	shard.Unlock();
+	return pCache;
 }
 
 memhandle_t Studio_CreateBoneCache( bonecacheparams_t &params )
 {
-	AUTO_LOCK( g_StudioBoneCache.AccessMutex() );
-	return g_StudioBoneCache.CreateResource( params );
+	int iShard = ( ++g_nNextBoneCacheShard ) & ( BONECACHE_SHARDS - 1 );
+
+	CBoneCacheShard &shard = g_StudioBoneCache[iShard];
+	shard.Lock();
+	memhandle_t hCache = shard.CreateBoneCache( params );
+	shard.Unlock();
+
+	if ( hCache == INVALID_MEMHANDLE )
+		return INVALID_MEMHANDLE;
+
+	return (memhandle_t)( (unsigned int)hCache | ( iShard << BONECACHE_SHARD_SHIFT ) );
 }
 
 void Studio_DestroyBoneCache( memhandle_t cacheHandle )
 {
-	AUTO_LOCK( g_StudioBoneCache.AccessMutex() );
-	g_StudioBoneCache.DestroyResource( cacheHandle );
+	if ( cacheHandle == INVALID_MEMHANDLE )
+		return;
+
+	CBoneCacheShard &shard = BoneCacheShard( cacheHandle );
+	shard.Lock();
+	shard.DestroyResource( BoneCacheShardHandle( cacheHandle ) );
+	shard.Unlock();
 }
 
 void Studio_InvalidateBoneCache( memhandle_t cacheHandle )
 {
-	AUTO_LOCK( g_StudioBoneCache.AccessMutex() );
-	CBoneCache *pCache = g_StudioBoneCache.GetResource_NoLock( cacheHandle );
+	if ( cacheHandle == INVALID_MEMHANDLE )
+		return;
+
+	CBoneCacheShard &shard = BoneCacheShard( cacheHandle );
+	shard.Lock();
+	CBoneCache *pCache = shard.GetResource_NoLock( BoneCacheShardHandle( cacheHandle ) );
 	if ( pCache )
 	{
 		pCache->m_timeValid = -1.0f;
 	}
+	shard.Unlock();
+}
+
+#ifdef CLIENT_DLL
+CON_COMMAND( cl_bonecache_stats, "Show bone cache use and evictions per shard. Pass 'reset' to clear." )
+#else
+CON_COMMAND( sv_bonecache_stats, "Show bone cache use and evictions per shard. Pass 'reset' to clear." )
+#endif
+{
+	bool bReset = ( args.ArgC() > 1 && !Q_stricmp( args[1], "reset" ) );
+
+	if ( !bReset )
+	{
+		Msg( "Bone cache: %d shards, %dKB\n", BONECACHE_SHARDS, anim_bonecache_size.GetInt() );
+		Msg( "shard  caches   used KB       gets  misses  created  evicted  contended\n" );
+	}
+
+	for ( int i = 0; i < BONECACHE_SHARDS; i++ )
+	{
+		CBoneCacheShard &shard = g_StudioBoneCache[i];
+		shard.Lock();
+		if ( bReset )
+		{
+			shard.ResetStats();
+		}
+		else
+		{
+			Msg( "%5d  %6d  %8.1f  %9d  %6d  %7d  %7d  %9d\n", i, shard.EntryCount(), shard.UsedSize() / 1024.0f,
+				shard.m_nGets, shard.m_nMisses, shard.m_nCreated, shard.m_nEvicted, (int)shard.m_nContended );
+		}
+		shard.Unlock();
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -261,6 +444,271 @@ void BuildBoneChain(
 }
 
 
+//-----------------------------------------------------------------------------
+// Seek index for long animation tracks. Finding a frame in a run length
+// encoded mstudioanimvalue_t track means walking every run before it, which
+// gets slower the further a long sequence plays. Tracks sampled past
+// ANIMVALUE_CHECKPOINT_FRAMES remember the run holding every
+// ANIMVALUE_CHECKPOINT_FRAMES'th frame, so a lookup only walks the runs after
+// the nearest checkpoint. Indices are only built out as far as the frames
+// asked for.
+//
+// Bone setup runs on several threads at once, so every thread keeps its own
+// table of indices and a lookup never takes a lock. Tables are
+// ANIMVALUE_INDEX_WAYS-way set associative so tracks that hash to the same
+// set don't keep throwing each other out.
+//-----------------------------------------------------------------------------
+static ConVar anim_animvalue_index( "anim_animvalue_index", "1", FCVAR_REPLICATED, "Use checkpoint indices to find frames in long animation tracks" );
+
+#define ANIMVALUE_CHECKPOINT_FRAMES	64
+#define ANIMVALUE_INDEX_SETS		512		// must be a power of two
+#define ANIMVALUE_INDEX_WAYS		4
+#define ANIMVALUE_INDEX_BUDGET		( 256 * 1024 )	// bytes of indices per thread
+
+class CAnimValueIndex
+{
+public:
+	CAnimValueIndex( mstudioanimvalue_t *pTrack );
+
+	unsigned int		Size() const { return sizeof( CAnimValueIndex ) + m_Checkpoints.NumAllocated() * sizeof( Checkpoint_t ); }
+
+	bool				IsIndexOf( const mstudioanimvalue_t *pTrack ) const { return m_pTrack == pTrack; }
+
+	// Finds the run holding the frame, and the frame's offset into it. Returns
+	// false if the track ends first or no longer matches the index.
+	bool				Seek( int frame, mstudioanimvalue_t *&panimvalue, int &k );
+
+private:
+	struct Checkpoint_t
+	{
+		int		m_nOffset;		// in mstudioanimvalue_t's from the start of the track
+		int		m_nFrame;		// first frame of the run
+		short	m_nHeader;		// the run's valid/total, to catch data that's been reloaded
+	};
+
+	mstudioanimvalue_t			*m_pTrack;
+	CUtlVector< Checkpoint_t >	m_Checkpoints;
+};
+
+CAnimValueIndex::CAnimValueIndex( mstudioanimvalue_t *pTrack )
+{
+	m_pTrack = pTrack;
+
+	Checkpoint_t &first = m_Checkpoints[ m_Checkpoints.AddToTail() ];
+	first.m_nOffset = 0;
+	first.m_nFrame = 0;
+	first.m_nHeader = pTrack->value;
+}
+
+bool CAnimValueIndex::Seek( int frame, mstudioanimvalue_t *&panimvalue, int &k )
+{
+	if ( m_pTrack->value != m_Checkpoints[0].m_nHeader )
+		return false;
+
+	int iCheckpoint = frame / ANIMVALUE_CHECKPOINT_FRAMES;
+
+	// Build out checkpoints up to the one we need
+	while ( m_Checkpoints.Count() <= iCheckpoint )
+	{
+		const Checkpoint_t &last = m_Checkpoints.Tail();
+		mstudioanimvalue_t *pRun = m_pTrack + last.m_nOffset;
+		int nRunFrame = last.m_nFrame;
+		int nTarget = m_Checkpoints.Count() * ANIMVALUE_CHECKPOINT_FRAMES;
+
+		while ( nRunFrame + pRun->num.total <= nTarget )
+		{
+			nRunFrame += pRun->num.total;
+			pRun += pRun->num.valid + 1;
+			if ( pRun->num.total == 0 )
+				return false;
+		}
+
+		Checkpoint_t &next = m_Checkpoints[ m_Checkpoints.AddToTail() ];
+		next.m_nOffset = pRun - m_pTrack;
+		next.m_nFrame = nRunFrame;
+		next.m_nHeader = pRun->value;
+	}
+
+	const Checkpoint_t &checkpoint = m_Checkpoints[iCheckpoint];
+	mstudioanimvalue_t *pRun = m_pTrack + checkpoint.m_nOffset;
+	if ( pRun->value != checkpoint.m_nHeader )
+		return false;
+
+	panimvalue = pRun;
+	k = frame - checkpoint.m_nFrame;
+	return true;
+}
+
+// Bumped by Studio_FlushAnimValueIndex; each thread drops its table the next
+// time it looks something up, so nothing has to reach into another thread's
+static CInterlockedInt g_nAnimValueIndexGeneration;
+
+//-----------------------------------------------------------------------------
+// One thread's indices. Each set keeps its ways in most recently used order.
+//-----------------------------------------------------------------------------
+class CAnimValueIndexTable
+{
+public:
+	CAnimValueIndexTable()
+	{
+		memset( m_pIndex, 0, sizeof( m_pIndex ) );
+		m_nSize = 0;
+		m_nGeneration = g_nAnimValueIndexGeneration;
+	}
+
+	~CAnimValueIndexTable()
+	{
+		Purge();
+	}
+
+	void Purge()
+	{
+		for ( int i = 0; i < ANIMVALUE_INDEX_SETS; i++ )
+		{
+			for ( int j = 0; j < ANIMVALUE_INDEX_WAYS; j++ )
+			{
+				delete m_pIndex[i][j];
+				m_pIndex[i][j] = NULL;
+			}
+		}
+		m_nSize = 0;
+	}
+
+	bool Seek( int frame, mstudioanimvalue_t *&panimvalue, int &k );
+
+private:
+	void Remove( CAnimValueIndex **pSet, int iWay );
+
+	CAnimValueIndex		*m_pIndex[ANIMVALUE_INDEX_SETS][ANIMVALUE_INDEX_WAYS];
+	unsigned int		m_nSize;
+	int					m_nGeneration;
+};
+
+void CAnimValueIndexTable::Remove( CAnimValueIndex **pSet, int iWay )
+{
+	m_nSize -= pSet[iWay]->Size();
+	delete pSet[iWay];
+	for ( ; iWay < ANIMVALUE_INDEX_WAYS - 1; iWay++ )
+	{
+		pSet[iWay] = pSet[iWay + 1];
+	}
+	pSet[ANIMVALUE_INDEX_WAYS - 1] = NULL;
+}
+
+bool CAnimValueIndexTable::Seek( int frame, mstudioanimvalue_t *&panimvalue, int &k )
+{
+	if ( m_nGeneration != g_nAnimValueIndexGeneration )
+	{
+		Purge();
+		m_nGeneration = g_nAnimValueIndexGeneration;
+	}
+
+	CAnimValueIndex **pSet = m_pIndex[ HashIntConventional( (int)(intp)panimvalue ) & ( ANIMVALUE_INDEX_SETS - 1 ) ];
+
+	int iWay;
+	for ( iWay = 0; iWay < ANIMVALUE_INDEX_WAYS && pSet[iWay]; iWay++ )
+	{
+		if ( pSet[iWay]->IsIndexOf( panimvalue ) )
+			break;
+	}
+
+	CAnimValueIndex *pIndex;
+	if ( iWay < ANIMVALUE_INDEX_WAYS && pSet[iWay] )
+	{
+		pIndex = pSet[iWay];
+	}
+	else
+	{
+		// Make room in the set, then in the budget, least recently used first
+		if ( pSet[ANIMVALUE_INDEX_WAYS - 1] )
+		{
+			Remove( pSet, ANIMVALUE_INDEX_WAYS - 1 );
+		}
+		while ( m_nSize > ANIMVALUE_INDEX_BUDGET && pSet[0] )
+		{
+			int iLast = 0;
+			while ( iLast < ANIMVALUE_INDEX_WAYS - 1 && pSet[iLast + 1] )
+			{
+				iLast++;
+			}
+			Remove( pSet, iLast );
+		}
+		if ( m_nSize > ANIMVALUE_INDEX_BUDGET )
+			return false;
+
+		pIndex = new CAnimValueIndex( panimvalue );
+		m_nSize += pIndex->Size();
+		iWay = ANIMVALUE_INDEX_WAYS - 1;
+	}
+
+	// Move to the front of the set. Ways are kept packed, so this also takes
+	// a new index's place at the end
+	for ( ; iWay > 0; iWay-- )
+	{
+		pSet[iWay] = pSet[iWay - 1];
+	}
+	pSet[0] = pIndex;
+
+	unsigned int nOldSize = pIndex->Size();
+	bool bFound = pIndex->Seek( frame, panimvalue, k );
+	m_nSize += pIndex->Size() - nOldSize;
+
+	if ( !bFound )
+	{
+		// Stale, or the frame is off the end of the track; either way let the caller walk it
+		Remove( pSet, 0 );
+	}
+
+	return bFound;
+}
+
+static CJobPerThread<CAnimValueIndexTable> g_AnimValueIndexTables;
+
+static bool SeekAnimValueIndex( int frame, mstudioanimvalue_t *&panimvalue, int &k )
+{
+	return g_AnimValueIndexTables.Local().Seek( frame, panimvalue, k );
+}
+
+void Studio_FlushAnimValueIndex()
+{
+	++g_nAnimValueIndexGeneration;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: find the run in an animation track that holds a frame, and the
+//			frame's offset into it
+//-----------------------------------------------------------------------------
+static mstudioanimvalue_t *FindAnimValueRun( int frame, mstudioanimvalue_t *panimvalue, int &k )
+{
+	k = frame;
+
+	if ( frame >= ANIMVALUE_CHECKPOINT_FRAMES && anim_animvalue_index.GetBool() )
+	{
+		mstudioanimvalue_t *pRun = panimvalue;
+		if ( SeekAnimValueIndex( frame, pRun, k ) )
+		{
+			panimvalue = pRun;
+		}
+		else
+		{
+			k = frame;
+		}
+	}
+
+	while (panimvalue->num.total <= k)
+	{
+		k -= panimvalue->num.total;
+		panimvalue += panimvalue->num.valid + 1;
+		if ( panimvalue->num.total == 0 )
+		{
+			Assert( 0 ); // running off the end of the animation stream is bad
+			return NULL;
+		}
+	}
+
+	return panimvalue;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: return a sub frame rotation for a single bone
 //-----------------------------------------------------------------------------
@@ -280,19 +728,14 @@ void ExtractAnimValue( int frame, mstudioanimvalue_t *panimvalue, float scale, f
 		return;
 	}
 
-	int k = frame;
+	int k;
 
 	// find the data list that has the frame
-	while (panimvalue->num.total <= k)
+	panimvalue = FindAnimValueRun( frame, panimvalue, k );
+	if ( !panimvalue )
 	{
-		k -= panimvalue->num.total;
-		panimvalue += panimvalue->num.valid + 1;
-		if ( panimvalue->num.total == 0 )
-		{
-			Assert( 0 ); // running off the end of the animation stream is bad
-			v1 = v2 = 0;
-			return;
-		}
+		v1 = v2 = 0;
+		return;
 	}
 	if (panimvalue->num.valid > k)
 	{
@@ -344,18 +787,13 @@ void ExtractAnimValue( int frame, mstudioanimvalue_t *panimvalue, float scale, f
 		return;
 	}
 
-	int k = frame;
+	int k;
 
-	while (panimvalue->num.total <= k)
+	panimvalue = FindAnimValueRun( frame, panimvalue, k );
+	if ( !panimvalue )
 	{
-		k -= panimvalue->num.total;
-		panimvalue += panimvalue->num.valid + 1;
-		if ( panimvalue->num.total == 0 )
-		{
-			Assert( 0 ); // running off the end of the animation stream is bad
-			v1 = 0;
-			return;
-		}
+		v1 = 0;
+		return;
 	}
 	if (panimvalue->num.valid > k)
 	{
@@ -1243,6 +1681,329 @@ FORCEINLINE fltx4 QuaternionAccumulateSIMD( const fltx4 &p, float s, const fltx4
 #endif
 
 
+//-----------------------------------------------------------------------------
+// SoA bone blending. Bones are processed four at a time with one quaternion or
+// vector component per register (x x x x, y y y y, ...), which keeps all four
+// lanes busy instead of the one-quaternion-per-register helpers above.
+//-----------------------------------------------------------------------------
+static ConVar anim_simd_bones( "anim_simd_bones", "1", FCVAR_REPLICATED, "Blend bones and build bone matrices four at a time with SIMD." );
+static bool s_bForceScalarBones = false;
+
+void Studio_ForceScalarBoneSetup( bool bForce )
+{
+	s_bForceScalarBones = bForce;
+}
+
+static inline bool UseSIMDBones()
+{
+	return !s_bForceScalarBones && anim_simd_bones.GetBool();
+}
+
+// LoadAndSwizzle reads 16 bytes per Vector, so a group never ends on the last bone
+// of a list. Those bones are left to the scalar code.
+#define SIMD_BONE_GROUP_FITS( i, nBoneCount ) ( (i) + 4 < (nBoneCount) )
+
+COMPILE_TIME_ASSERT( sizeof( QuaternionAligned ) == sizeof( Quaternion ) );
+
+struct FourBoneQuaternions_t
+{
+	fltx4 x, y, z, w;
+
+	FORCEINLINE void Load( const Quaternion *q )
+	{
+		x = LoadUnalignedSIMD( q[0].Base() );
+		y = LoadUnalignedSIMD( q[1].Base() );
+		z = LoadUnalignedSIMD( q[2].Base() );
+		w = LoadUnalignedSIMD( q[3].Base() );
+		TransposeSIMD( x, y, z, w );
+	}
+
+	FORCEINLINE void Store( Quaternion *q ) const
+	{
+		fltx4 r0 = x, r1 = y, r2 = z, r3 = w;
+		TransposeSIMD( r0, r1, r2, r3 );
+		StoreUnalignedSIMD( q[0].Base(), r0 );
+		StoreUnalignedSIMD( q[1].Base(), r1 );
+		StoreUnalignedSIMD( q[2].Base(), r2 );
+		StoreUnalignedSIMD( q[3].Base(), r3 );
+	}
+
+	FORCEINLINE fltx4 Dot( const FourBoneQuaternions_t &q ) const
+	{
+		return MaddSIMD( x, q.x, MaddSIMD( y, q.y, MaddSIMD( z, q.z, MulSIMD( w, q.w ) ) ) );
+	}
+
+	// Per lane: where mask is set, take q
+	FORCEINLINE void MaskedAssign( const fltx4 &mask, const FourBoneQuaternions_t &q )
+	{
+		x = ::MaskedAssign( mask, q.x, x );
+		y = ::MaskedAssign( mask, q.y, y );
+		z = ::MaskedAssign( mask, q.z, z );
+		w = ::MaskedAssign( mask, q.w, w );
+	}
+
+	// Same as QuaternionNormalize, zero length quaternions are left alone
+	FORCEINLINE void Normalize()
+	{
+		fltx4 radius = Dot( *this );
+		fltx4 nonZero = CmpGtSIMD( radius, Four_Zeros );
+		fltx4 iradius = ::MaskedAssign( nonZero, DivSIMD( Four_Ones, SqrtSIMD( radius ) ), Four_Ones );
+		x = MulSIMD( x, iradius );
+		y = MulSIMD( y, iradius );
+		z = MulSIMD( z, iradius );
+		w = MulSIMD( w, iradius );
+	}
+
+	// Same as QuaternionAlign against p, but only in lanes where alignMask is set
+	FORCEINLINE void Align( const FourBoneQuaternions_t &p, const fltx4 &alignMask )
+	{
+		fltx4 flip = AndSIMD( alignMask, CmpLtSIMD( p.Dot( *this ), Four_Zeros ) );
+		x = ::MaskedAssign( flip, NegSIMD( x ), x );
+		y = ::MaskedAssign( flip, NegSIMD( y ), y );
+		z = ::MaskedAssign( flip, NegSIMD( z ), z );
+		w = ::MaskedAssign( flip, NegSIMD( w ), w );
+	}
+};
+
+// Lanes for bones without BONE_FIXED_ALIGNMENT, which get QuaternionAlign'ed
+static FORCEINLINE fltx4 BoneAlignMask( const CStudioHdr *pStudioHdr, int iBone )
+{
+	fltx4 mask;
+	for ( int k = 0; k < 4; k++ )
+	{
+		SubInt( mask, k ) = ( pStudioHdr->boneFlags( iBone + k ) & BONE_FIXED_ALIGNMENT ) ? 0 : 0xFFFFFFFF;
+	}
+	return mask;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: QuaternionSlerp / QuaternionSlerpNoAlign for four bones. q is aligned
+//			in place. Returns false, without writing qt, if any lane has
+//			quaternions pointing in opposite directions; the caller has to use
+//			the scalar code for those.
+//-----------------------------------------------------------------------------
+static FORCEINLINE bool QuaternionSlerpSoA( const FourBoneQuaternions_t &p, FourBoneQuaternions_t &q, const fltx4 &t, const fltx4 &alignMask, FourBoneQuaternions_t &qt )
+{
+	q.Align( p, alignMask );
+
+	fltx4 cosom = p.Dot( q );
+	fltx4 epsilon = ReplicateX4( 0.000001f );
+
+	if ( IsAnyNegative( CmpLeSIMD( AddSIMD( Four_Ones, cosom ), epsilon ) ) )
+		return false;
+
+	fltx4 oneMinusT = SubSIMD( Four_Ones, t );
+	fltx4 omega = ArcCosSIMD( MinSIMD( cosom, Four_Ones ) );
+	fltx4 sinom = SinSIMD( omega );
+	fltx4 sclp = DivSIMD( SinSIMD( MulSIMD( oneMinusT, omega ) ), sinom );
+	fltx4 sclq = DivSIMD( SinSIMD( MulSIMD( t, omega ) ), sinom );
+
+	// Nearly identical, plain lerp
+	fltx4 nearlyEqual = CmpLeSIMD( SubSIMD( Four_Ones, cosom ), epsilon );
+	sclp = MaskedAssign( nearlyEqual, oneMinusT, sclp );
+	sclq = MaskedAssign( nearlyEqual, t, sclq );
+
+	qt.x = MaddSIMD( sclp, p.x, MulSIMD( sclq, q.x ) );
+	qt.y = MaddSIMD( sclp, p.y, MulSIMD( sclq, q.y ) );
+	qt.z = MaddSIMD( sclp, p.z, MulSIMD( sclq, q.z ) );
+	qt.w = MaddSIMD( sclp, p.w, MulSIMD( sclq, q.w ) );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: pos1 = pos1 * s1 + pos2 * s2 for four bones, only in lanes where
+//			mask is set
+//-----------------------------------------------------------------------------
+static FORCEINLINE void BlendPositionsSoA( Vector *pos1, const Vector *pos2, const fltx4 &s1, const fltx4 &s2, const fltx4 &mask )
+{
+	FourVectors p1, p2, result;
+	p1.LoadAndSwizzle( pos1[0], pos1[1], pos1[2], pos1[3] );
+	p2.LoadAndSwizzle( pos2[0], pos2[1], pos2[2], pos2[3] );
+
+	result.x = MaskedAssign( mask, MaddSIMD( p1.x, s1, MulSIMD( p2.x, s2 ) ), p1.x );
+	result.y = MaskedAssign( mask, MaddSIMD( p1.y, s1, MulSIMD( p2.y, s2 ) ), p1.y );
+	result.z = MaskedAssign( mask, MaddSIMD( p1.z, s1, MulSIMD( p2.z, s2 ) ), p1.z );
+
+	for ( int k = 0; k < 4; k++ )
+	{
+		pos1[k] = result.Vec( k );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The non-delta part of SlerpBones for as many groups of four bones as
+//			possible. pS2 is the per bone weight, <= 0 for bones to leave alone.
+//			Returns the first bone that still needs to be done, which is early
+//			if a group needs the scalar special case for opposite quaternions.
+//-----------------------------------------------------------------------------
+static int SlerpBonesSIMD( const CStudioHdr *pStudioHdr, Quaternion *q1, Vector *pos1, const QuaternionAligned *q2, const Vector *pos2, const float *pS2, int nBoneCount )
+{
+	int i;
+	for ( i = 0; SIMD_BONE_GROUP_FITS( i, nBoneCount ); i += 4 )
+	{
+		fltx4 s2 = LoadUnalignedSIMD( &pS2[i] );
+		fltx4 active = CmpGtSIMD( s2, Four_Zeros );
+		if ( !IsAnyNegative( active ) )
+			continue;
+
+		fltx4 s1 = SubSIMD( Four_Ones, s2 );
+
+		// q1 = slerp( q2, q1, s1 ), so the result is q2 weighted by s2
+		FourBoneQuaternions_t p, q, qt;
+		p.Load( &q2[i] );
+		q.Load( &q1[i] );
+		if ( !QuaternionSlerpSoA( p, q, s1, BoneAlignMask( pStudioHdr, i ), qt ) )
+			break;
+
+		FourBoneQuaternions_t result;
+		result.Load( &q1[i] );
+		result.MaskedAssign( active, qt );
+		result.Store( &q1[i] );
+
+		BlendPositionsSoA( &pos1[i], &pos2[i], s1, s2, active );
+	}
+	return i;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The blend part of BlendBones four bones at a time. pActive is 1 for
+//			bones to blend. Returns the first bone that still needs to be done.
+//-----------------------------------------------------------------------------
+static int BlendBonesSIMD( const CStudioHdr *pStudioHdr, Quaternion *q1, Vector *pos1, const Quaternion *q2, const Vector *pos2, const float *pActive, float s, int nBoneCount )
+{
+	fltx4 s2 = ReplicateX4( s );
+	fltx4 s1 = ReplicateX4( 1.0f - s );
+
+	int i;
+	for ( i = 0; SIMD_BONE_GROUP_FITS( i, nBoneCount ); i += 4 )
+	{
+		fltx4 active = CmpGtSIMD( LoadUnalignedSIMD( &pActive[i] ), Four_Zeros );
+		if ( !IsAnyNegative( active ) )
+			continue;
+
+		// q1 = QuaternionBlend( q2, q1, s1 )
+		FourBoneQuaternions_t p, q, qt;
+		p.Load( &q2[i] );
+		q.Load( &q1[i] );
+		q.Align( p, BoneAlignMask( pStudioHdr, i ) );
+
+		qt.x = MaddSIMD( s2, p.x, MulSIMD( s1, q.x ) );
+		qt.y = MaddSIMD( s2, p.y, MulSIMD( s1, q.y ) );
+		qt.z = MaddSIMD( s2, p.z, MulSIMD( s1, q.z ) );
+		qt.w = MaddSIMD( s2, p.w, MulSIMD( s1, q.w ) );
+		qt.Normalize();
+
+		FourBoneQuaternions_t result;
+		result.Load( &q1[i] );
+		result.MaskedAssign( active, qt );
+		result.Store( &q1[i] );
+
+		BlendPositionsSoA( &pos1[i], &pos2[i], s1, s2, active );
+	}
+	return i;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: QuaternionIdentityBlend and position scale for ScaleBones, four bones
+//			at a time. Returns the first bone that still needs to be done.
+//-----------------------------------------------------------------------------
+static int ScaleBonesSIMD( Quaternion *q1, Vector *pos1, const float *pActive, float s, int nBoneCount )
+{
+	fltx4 t = ReplicateX4( 1.0f - s );
+	fltx4 sclp = ReplicateX4( s );
+
+	int i;
+	for ( i = 0; SIMD_BONE_GROUP_FITS( i, nBoneCount ); i += 4 )
+	{
+		fltx4 active = CmpGtSIMD( LoadUnalignedSIMD( &pActive[i] ), Four_Zeros );
+		if ( !IsAnyNegative( active ) )
+			continue;
+
+		FourBoneQuaternions_t q, qt;
+		q.Load( &q1[i] );
+
+		// Blend towards identity keeping the sign of w
+		fltx4 negativeW = CmpLtSIMD( q.w, Four_Zeros );
+		qt.x = MulSIMD( q.x, sclp );
+		qt.y = MulSIMD( q.y, sclp );
+		qt.z = MulSIMD( q.z, sclp );
+		qt.w = MaddSIMD( q.w, sclp, MaskedAssign( negativeW, NegSIMD( t ), t ) );
+		qt.Normalize();
+
+		q.MaskedAssign( active, qt );
+		q.Store( &q1[i] );
+
+		BlendPositionsSoA( &pos1[i], &pos1[i], sclp, Four_Zeros, active );
+	}
+	return i;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: QuaternionMatrix( q[i], pos[i], out[i] ) for four bones at a time.
+//			Returns the first bone that still needs to be done.
+//-----------------------------------------------------------------------------
+static int QuaternionMatricesSIMD( const Quaternion *q, const Vector *pos, matrix3x4_t *out, int nBoneCount )
+{
+	fltx4 two = ReplicateX4( 2.0f );
+
+	int i;
+	for ( i = 0; SIMD_BONE_GROUP_FITS( i, nBoneCount ); i += 4 )
+	{
+		FourBoneQuaternions_t quat;
+		quat.Load( &q[i] );
+
+		FourVectors origin;
+		origin.LoadAndSwizzle( pos[i], pos[i+1], pos[i+2], pos[i+3] );
+
+		fltx4 x2 = MulSIMD( two, quat.x );
+		fltx4 y2 = MulSIMD( two, quat.y );
+		fltx4 z2 = MulSIMD( two, quat.z );
+		fltx4 xx = MulSIMD( x2, quat.x );
+		fltx4 yy = MulSIMD( y2, quat.y );
+		fltx4 zz = MulSIMD( z2, quat.z );
+		fltx4 xy = MulSIMD( x2, quat.y );
+		fltx4 xz = MulSIMD( x2, quat.z );
+		fltx4 yz = MulSIMD( y2, quat.z );
+		fltx4 wx = MulSIMD( x2, quat.w );
+		fltx4 wy = MulSIMD( y2, quat.w );
+		fltx4 wz = MulSIMD( z2, quat.w );
+
+		// One matrix element of each of the four bones per register, then transpose
+		// each row back into the four matrices
+		fltx4 m00 = SubSIMD( Four_Ones, AddSIMD( yy, zz ) );
+		fltx4 m01 = SubSIMD( xy, wz );
+		fltx4 m02 = AddSIMD( xz, wy );
+		fltx4 m03 = origin.x;
+		fltx4 m10 = AddSIMD( xy, wz );
+		fltx4 m11 = SubSIMD( Four_Ones, AddSIMD( xx, zz ) );
+		fltx4 m12 = SubSIMD( yz, wx );
+		fltx4 m13 = origin.y;
+		fltx4 m20 = SubSIMD( xz, wy );
+		fltx4 m21 = AddSIMD( yz, wx );
+		fltx4 m22 = SubSIMD( Four_Ones, AddSIMD( xx, yy ) );
+		fltx4 m23 = origin.z;
+
+		TransposeSIMD( m00, m01, m02, m03 );
+		TransposeSIMD( m10, m11, m12, m13 );
+		TransposeSIMD( m20, m21, m22, m23 );
+
+		StoreUnalignedSIMD( out[i].m_flMatVal[0], m00 );
+		StoreUnalignedSIMD( out[i].m_flMatVal[1], m10 );
+		StoreUnalignedSIMD( out[i].m_flMatVal[2], m20 );
+		StoreUnalignedSIMD( out[i+1].m_flMatVal[0], m01 );
+		StoreUnalignedSIMD( out[i+1].m_flMatVal[1], m11 );
+		StoreUnalignedSIMD( out[i+1].m_flMatVal[2], m21 );
+		StoreUnalignedSIMD( out[i+2].m_flMatVal[0], m02 );
+		StoreUnalignedSIMD( out[i+2].m_flMatVal[1], m12 );
+		StoreUnalignedSIMD( out[i+2].m_flMatVal[2], m22 );
+		StoreUnalignedSIMD( out[i+3].m_flMatVal[0], m03 );
+		StoreUnalignedSIMD( out[i+3].m_flMatVal[1], m13 );
+		StoreUnalignedSIMD( out[i+3].m_flMatVal[2], m23 );
+	}
+	return i;
+}
+
+
 
 //-----------------------------------------------------------------------------
 // Purpose: blend together in world space q1,pos1 with q2,pos2.  Return result in q1,pos1.  
@@ -1479,8 +2240,14 @@ void SlerpBones(
 		return;
 	}
 
+	i = 0;
+	if ( UseSIMDBones() )
+	{
+		i = SlerpBonesSIMD( pStudioHdr, q1, pos1, q2, pos2, pS2, nBoneCount );
+	}
+
 	QuaternionAligned q3;
-	for (i = 0; i < nBoneCount; i++)
+	for ( ; i < nBoneCount; i++)
 	{
 		s2 = pS2[i];
 		if ( s2 <= 0.0f )
@@ -1590,7 +2357,21 @@ void BlendBones(
 	float s2 = s;
 	float s1 = 1.0 - s2;
 
-	for (i = 0; i < pStudioHdr->numbones(); i++)
+	i = 0;
+	if ( UseSIMDBones() )
+	{
+		int nBoneCount = pStudioHdr->numbones();
+		float *pActive = (float*)stackalloc( nBoneCount * sizeof(float) );
+		for ( i = 0; i < nBoneCount; i++ )
+		{
+			j = pSeqGroup ? pSeqGroup->boneMap[i] : i;
+			pActive[i] = ( ( pStudioHdr->boneFlags(i) & boneMask ) && j >= 0 && seqdesc.weight( j ) > 0.0 ) ? 1.0f : 0.0f;
+		}
+
+		i = BlendBonesSIMD( pStudioHdr, q1, pos1, q2, pos2, pActive, s, nBoneCount );
+	}
+
+	for ( ; i < pStudioHdr->numbones(); i++)
 	{
 		// skip unused bones
 		if (!(pStudioHdr->boneFlags(i) & boneMask))
@@ -1656,7 +2437,21 @@ void ScaleBones(
 	float s2 = s;
 	float s1 = 1.0 - s2;
 
-	for (i = 0; i < pStudioHdr->numbones(); i++)
+	i = 0;
+	if ( UseSIMDBones() )
+	{
+		int nBoneCount = pStudioHdr->numbones();
+		float *pActive = (float*)stackalloc( nBoneCount * sizeof(float) );
+		for ( i = 0; i < nBoneCount; i++ )
+		{
+			j = pSeqGroup ? pSeqGroup->boneMap[i] : i;
+			pActive[i] = ( ( pStudioHdr->boneFlags(i) & boneMask ) && j >= 0 && seqdesc.weight( j ) > 0.0 ) ? 1.0f : 0.0f;
+		}
+
+		i = ScaleBonesSIMD( q1, pos1, pActive, s, nBoneCount );
+	}
+
+	for ( ; i < pStudioHdr->numbones(); i++)
 	{
 		// skip unused bones
 		if (!(pStudioHdr->boneFlags(i) & boneMask))
@@ -4558,23 +5353,46 @@ void Studio_BuildMatrices(
 		VectorScale( rotationmatrix[2], flScale, rotationmatrix[2] );
 	}
 
+	// When building every bone, convert the local transforms four at a time up front;
+	// the concatenation has to follow the hierarchy so it stays one bone at a time.
+	matrix3x4_t *pLocalMatrices = NULL;
+	int nLocalMatrices = 0;
+	if ( iBone == -1 && UseSIMDBones() )
+	{
+		pLocalMatrices = g_MatrixPool.Alloc();
+		nLocalMatrices = QuaternionMatricesSIMD( q, pos, pLocalMatrices, chainlength );
+	}
+
 	for (j = chainlength - 1; j >= 0; j--)
 	{
 		i = chain[j];
 		if (pStudioHdr->boneFlags(i) & boneMask)
 		{
-			QuaternionMatrix( q[i], pos[i], bonematrix );
+			const matrix3x4_t *pBoneMatrix = &bonematrix;
+			if ( i < nLocalMatrices )
+			{
+				pBoneMatrix = &pLocalMatrices[i];
+			}
+			else
+			{
+				QuaternionMatrix( q[i], pos[i], bonematrix );
+			}
 
 			if (pStudioHdr->boneParent(i) == -1) 
 			{
-				ConcatTransforms (rotationmatrix, bonematrix, bonetoworld[i]);
+				ConcatTransforms (rotationmatrix, *pBoneMatrix, bonetoworld[i]);
 			} 
 			else 
 			{
-				ConcatTransforms (bonetoworld[pStudioHdr->boneParent(i)], bonematrix, bonetoworld[i]);
+				ConcatTransforms (bonetoworld[pStudioHdr->boneParent(i)], *pBoneMatrix, bonetoworld[i]);
 			}
 		}
 	}
+
+	if ( pLocalMatrices )
+	{
+		g_MatrixPool.Free( pLocalMatrices );
+	}
 }
 
 
@@ -331,6 +331,12 @@ void Studio_BuildMatrices(
 	int boneMask
 	);
 
+// Makes bone blending and Studio_BuildMatrices skip their SIMD paths, so the two can be compared
+void Studio_ForceScalarBoneSetup( bool bForce );
+
+// Drops the seek indices kept for long animation tracks
+void Studio_FlushAnimValueIndex();
+
 
 // Get a bone->bone relative transform
 void Studio_CalcBoneToBoneTransform( const CStudioHdr *pStudioHdr, int inputBoneIndex, int outputBoneIndex, matrix3x4_t &matrixOut );
@@ -412,6 +418,8 @@ public:
 	matrix3x4_t		*GetCachedBone( int studioIndex );
 	void			ReadCachedBones( matrix3x4_t *pBoneToWorld );
 	void			ReadCachedBonePointers( matrix3x4_t **bones, int numbones );
+	void			TransformBones( const matrix3x4_t &transform );
+	int				CachedBoneCount() const { return m_cachedBoneCount; }
 
 	bool			IsValid( float curtime, float dt = 0.1f );
 
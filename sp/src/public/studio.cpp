@@ -732,6 +732,8 @@ void CStudioHdr::Init( const studiohdr_t *pStudioHdr, IMDLCache *mdlcache )
 
 	m_pVModel = NULL;
 	m_pStudioHdrCache.RemoveAll();
+	m_pSeqdescCache.RemoveAll();
+	m_pAnimdescCache.RemoveAll();
 
 	if (m_pStudioHdr == NULL)
 	{
@@ -807,6 +809,11 @@ const virtualmodel_t * CStudioHdr::ResetVModel( const virtualmodel_t *pVModel )
 		{
 			m_pStudioHdrCache[ i ] = NULL;
 		}
+
+		m_pSeqdescCache.SetCount( m_pVModel->m_seq.Count() );
+		memset( m_pSeqdescCache.Base(), 0, m_pSeqdescCache.Count() * sizeof(mstudioseqdesc_t *) );
+		m_pAnimdescCache.SetCount( m_pVModel->m_anim.Count() );
+		memset( m_pAnimdescCache.Base(), 0, m_pAnimdescCache.Count() * sizeof(mstudioanimdesc_t *) );
 		
 		return const_cast<virtualmodel_t *>(pVModel);
 	}
@@ -817,23 +824,34 @@ const virtualmodel_t * CStudioHdr::ResetVModel( const virtualmodel_t *pVModel )
 	}
 }
 
-const studiohdr_t *CStudioHdr::GroupStudioHdr( int i )
+//-----------------------------------------------------------------------------
+// Purpose: The include models may have moved if the mdl cache was unlocked
+//			since we last looked, so forget where they were
+//-----------------------------------------------------------------------------
+void CStudioHdr::CheckFrameUnlockCounter()
 {
-	if ( !this )
-	{
-		ExecuteNTimes( 5, Warning( "Call to NULL CStudioHdr::GroupStudioHdr()\n" ) );
-	}
-
 	if ( m_nFrameUnlockCounter != *m_pFrameUnlockCounter )
 	{
 		m_FrameUnlockCounterMutex.Lock();
 		if ( *m_pFrameUnlockCounter != m_nFrameUnlockCounter ) // i.e., this thread got the mutex
 		{
 			memset( m_pStudioHdrCache.Base(), 0, m_pStudioHdrCache.Count() * sizeof(studiohdr_t *) );
+			memset( m_pSeqdescCache.Base(), 0, m_pSeqdescCache.Count() * sizeof(mstudioseqdesc_t *) );
+			memset( m_pAnimdescCache.Base(), 0, m_pAnimdescCache.Count() * sizeof(mstudioanimdesc_t *) );
 			m_nFrameUnlockCounter = *m_pFrameUnlockCounter;
 		}
 		m_FrameUnlockCounterMutex.Unlock();
 	}
+}
+
+const studiohdr_t *CStudioHdr::GroupStudioHdr( int i )
+{
+	if ( !this )
+	{
+		ExecuteNTimes( 5, Warning( "Call to NULL CStudioHdr::GroupStudioHdr()\n" ) );
+	}
+
+	CheckFrameUnlockCounter();
 
 	if ( !m_pStudioHdrCache.IsValidIndex( i ) )
 	{
@@ -892,9 +910,20 @@ mstudioanimdesc_t &CStudioHdr::pAnimdesc( int i )
 		return *m_pStudioHdr->pLocalAnimdesc( i );
 	}
 
-	const studiohdr_t *pStudioHdr = GroupStudioHdr( m_pVModel->m_anim[i].group );
+	CheckFrameUnlockCounter();
+
+	mstudioanimdesc_t *pAnimdesc = m_pAnimdescCache.IsValidIndex( i ) ? m_pAnimdescCache[i] : NULL;
+	if ( !pAnimdesc )
+	{
+		const studiohdr_t *pStudioHdr = GroupStudioHdr( m_pVModel->m_anim[i].group );
+		pAnimdesc = pStudioHdr->pLocalAnimdesc( m_pVModel->m_anim[i].index );
+		if ( m_pAnimdescCache.IsValidIndex( i ) )
+		{
+			m_pAnimdescCache[i] = pAnimdesc;
+		}
+	}
 
-	return *pStudioHdr->pLocalAnimdesc( m_pVModel->m_anim[i].index );
+	return *pAnimdesc;
 }
 
 //-----------------------------------------------------------------------------
@@ -929,9 +958,20 @@ mstudioseqdesc_t &CStudioHdr::pSeqdesc( int i )
 		return *m_pStudioHdr->pLocalSeqdesc( i );
 	}
 
-	const studiohdr_t *pStudioHdr = GroupStudioHdr( m_pVModel->m_seq[i].group );
+	CheckFrameUnlockCounter();
+
+	mstudioseqdesc_t *pSeqdesc = m_pSeqdescCache.IsValidIndex( i ) ? m_pSeqdescCache[i] : NULL;
+	if ( !pSeqdesc )
+	{
+		const studiohdr_t *pStudioHdr = GroupStudioHdr( m_pVModel->m_seq[i].group );
+		pSeqdesc = pStudioHdr->pLocalSeqdesc( m_pVModel->m_seq[i].index );
+		if ( m_pSeqdescCache.IsValidIndex( i ) )
+		{
+			m_pSeqdescCache[i] = pSeqdesc;
+		}
+	}
 
-	return *pStudioHdr->pLocalSeqdesc( m_pVModel->m_seq[i].index );
+	return *pSeqdesc;
 }
 
 //-----------------------------------------------------------------------------
@@ -2361,6 +2361,7 @@ private:
 
 	const virtualmodel_t * ResetVModel( const virtualmodel_t *pVModel ) const;
 	const studiohdr_t *GroupStudioHdr( int group );
+	void CheckFrameUnlockCounter();
 	mutable CUtlVector< const studiohdr_t * > m_pStudioHdrCache;
 
 	mutable int			m_nFrameUnlockCounter;
@@ -2689,6 +2690,12 @@ public:
 	mutable	int			m_nPerfAnimationLayers;
 #endif
 
+private:
+	// Sequences and animations of a virtual model, resolved through their
+	// include model. Cleared along with m_pStudioHdrCache. These are last so
+	// the layout before them matches what the engine was built with.
+	mutable CUtlVector< mstudioseqdesc_t * > m_pSeqdescCache;
+	mutable CUtlVector< mstudioanimdesc_t * > m_pAnimdescCache;
 
 };
 
@@ -14,10 +14,12 @@
 
 #include "utlrbtree.h"
 #include "utlvector.h"
+#include "utlhashsymboltable.h"
 
 //-----------------------------------------------------------------------------
 // Purpose: Allocates memory for strings, checking for duplicates first,
-//			reusing exising strings if duplicate found.
+//			reusing exising strings if duplicate found. Duplicates are
+//			found case-insensitively.
 //-----------------------------------------------------------------------------
 
 class CStringPool
@@ -35,9 +37,7 @@ public:
 	const char * Find( const char *pszValue );
 
 protected:
-	typedef CUtlRBTree<const char *, unsigned short> CStrSet;
-
-	CStrSet m_Strings;
+	CUtlHashSymbolTable m_Strings;
 };
 
 //-----------------------------------------------------------------------------
@@ -0,0 +1,120 @@
+//=============================================================================//
+//
+// Purpose: A string interning table that can be used from many threads at once
+//
+//=============================================================================//
+
+#ifndef UTLCONCURRENTSYMBOLTABLE_H
+#define UTLCONCURRENTSYMBOLTABLE_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/threadtools.h"
+#include "tier1/utlhashsymboltable.h"
+
+
+//-----------------------------------------------------------------------------
+// CUtlConcurrentSymbolTable:
+// description:
+//    Maps strings to 32-bit handles and back, like CUtlHashSymbolTable, but
+//    AddString, Find and String can be called from any number of threads
+//    (job threads included) without a table-wide lock.
+//
+//    The table is split into shards picked by the top bits of the hash, each
+//    an open addressing table like CUtlHashSymbolTable. Slots only ever go
+//    from empty to filled and a grown slot array is published with a single
+//    pointer store, so Find and String never lock or wait. AddString looks
+//    the string up the same way first and only takes its shard's lock to
+//    insert a string that isn't there yet.
+//
+//    Handles are not dense: the low bits are the shard. Replaced slot arrays
+//    are kept until RemoveAll, which (like the destructor) must not run while
+//    other threads are using the table.
+//-----------------------------------------------------------------------------
+class CUtlConcurrentSymbolTable
+{
+public:
+	// constructor, destructor
+	CUtlConcurrentSymbolTable( bool bCaseInsensitive = false );
+	~CUtlConcurrentSymbolTable();
+
+	// Finds and/or creates a symbol based on the string
+	UtlHashSymId_t AddString( const char *pString );
+
+	// Finds the symbol for pString. Wait-free.
+	UtlHashSymId_t Find( const char *pString ) const;
+
+	// Look up the string associated with a particular symbol. Wait-free.
+	const char *String( UtlHashSymId_t id ) const;
+
+	// Remove all symbols in the table. Not thread-safe.
+	void RemoveAll();
+
+	int GetNumStrings() const
+	{
+		return m_nStrings;
+	}
+
+	bool IsCaseInsensitive() const
+	{
+		return m_bInsensitive;
+	}
+
+private:
+	enum
+	{
+		SHARD_BITS = 5,
+		SHARD_COUNT = ( 1 << SHARD_BITS ),
+
+		// Each shard's strings are kept in chunks that double in size, so
+		// they never move while another thread is reading them
+		FIRST_CHUNK_SIZE = 256,
+		MAX_CHUNKS = 20,
+	};
+
+	struct Slot_t
+	{
+		unsigned int			m_nHash;
+		volatile unsigned int	m_nIndex;	// Index in the shard + 1, 0 if the slot is empty
+	};
+
+	struct SlotArray_t
+	{
+		SlotArray_t		*m_pRetired;	// The array this one replaced
+		int				m_nMask;
+		Slot_t			m_Slots[1];
+	};
+
+	struct Shard_t
+	{
+		CThreadFastMutex		m_Lock;
+		SlotArray_t * volatile	m_pSlots;
+		const char ** volatile	m_ppChunks[MAX_CHUNKS];
+		int						m_nCount;
+
+		// String storage, only touched under m_Lock
+		CUtlVector<char*>		m_Blocks;
+		char					*m_pBlockCur;
+		int						m_nBlockFree;
+		int						m_nBlockBytes;
+
+		// Pad so shards being written on different threads don't share a cache line
+		char					m_Pad[64];
+	};
+
+	static int GetShard( unsigned int nHash ) { return nHash >> ( 32 - SHARD_BITS ); }
+	static void ChunkFromIndex( int nIndex, int *pChunk, int *pOffset );
+
+	int FindIndex( const SlotArray_t *pSlots, const char *pString, unsigned int nHash, const Shard_t &shard ) const;
+	const char *ShardString( const Shard_t &shard, int nIndex ) const;
+	void GrowSlots( Shard_t &shard );
+	const char *CopyString( Shard_t &shard, const char *pString, int nLen );
+
+	Shard_t			m_Shards[SHARD_COUNT];
+	CInterlockedInt	m_nStrings;
+	bool			m_bInsensitive;
+};
+
+#endif // UTLCONCURRENTSYMBOLTABLE_H
@@ -0,0 +1,95 @@
+//=============================================================================//
+//
+// Purpose: A string interning table using open addressing and arena storage
+//
+//=============================================================================//
+
+#ifndef UTLHASHSYMBOLTABLE_H
+#define UTLHASHSYMBOLTABLE_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier1/utlvector.h"
+
+
+//-----------------------------------------------------------------------------
+// A 32-bit handle to a string in a CUtlHashSymbolTable. Handles are handed
+// out in order starting at 0, so they can be used to index side arrays.
+//-----------------------------------------------------------------------------
+typedef unsigned int UtlHashSymId_t;
+
+#define UTL_INVAL_HASH_SYMBOL  ((UtlHashSymId_t)~0)
+
+// The hash the symbol tables use. Returns the length including the terminator in *pLen.
+unsigned int UtlHashSymbol_HashString( const char *pString, bool bCaseInsensitive, int *pLen );
+
+
+//-----------------------------------------------------------------------------
+// CUtlHashSymbolTable:
+// description:
+//    Maps strings to handles and back, like CUtlSymbolTable. Lookups hash the
+//    string once and probe a flat open addressing table; each slot keeps the
+//    full 32-bit hash, so almost every mismatch is rejected without a string
+//    compare and growing never rehashes a string.
+//
+//    Strings are copied into large blocks that are only freed by RemoveAll,
+//    so the pointers returned by String() stay valid until then.
+//-----------------------------------------------------------------------------
+class CUtlHashSymbolTable
+{
+public:
+	// constructor, destructor
+	CUtlHashSymbolTable( int nInitSize = 0, bool bCaseInsensitive = false );
+	~CUtlHashSymbolTable();
+
+	// Finds and/or creates a symbol based on the string
+	UtlHashSymId_t AddString( const char *pString );
+
+	// Finds the symbol for pString
+	UtlHashSymId_t Find( const char *pString ) const;
+
+	// Look up the string associated with a particular symbol
+	const char *String( UtlHashSymId_t id ) const;
+
+	// Remove all symbols in the table and free the string storage
+	void RemoveAll();
+
+	int GetNumStrings() const
+	{
+		return m_Strings.Count();
+	}
+
+	bool IsCaseInsensitive() const
+	{
+		return m_bInsensitive;
+	}
+
+	// Bytes used by the table and the strings
+	int GetMemoryUsage() const;
+
+private:
+	struct Slot_t
+	{
+		unsigned int	m_nHash;
+		UtlHashSymId_t	m_Id;	// UTL_INVAL_HASH_SYMBOL if the slot is empty
+	};
+
+	// Returns the slot holding pString, or the empty slot it should go in
+	int FindSlot( const char *pString, unsigned int nHash ) const;
+
+	void Rehash( int nSlots );
+	const char *CopyString( const char *pString, int nLen );
+
+	CUtlVector<Slot_t>		m_Slots;		// Always a power of two long
+	CUtlVector<const char*>	m_Strings;		// Indexed by UtlHashSymId_t
+	CUtlVector<char*>		m_Blocks;		// String storage
+
+	char	*m_pBlockCur;
+	int		m_nBlockFree;
+	int		m_nBlockBytes;
+	bool	m_bInsensitive;
+};
+
+#endif // UTLHASHSYMBOLTABLE_H
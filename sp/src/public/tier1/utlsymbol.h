@@ -19,6 +19,7 @@
 #include "tier1/utlbuffer.h"
 #include "tier1/utllinkedlist.h"
 #include "tier1/stringpool.h"
+#include "tier1/utlhashsymboltable.h"
 
 
 //-----------------------------------------------------------------------------
@@ -89,9 +90,8 @@ protected:
 //    a static version of this class for creating global strings, but this
 //    class can also be instanced to create local symbol tables.
 // 
-//    This class stores the strings in a series of string pools. The first
-//    two bytes of each string are decorated with a hash to speed up
-//	  comparisons.
+//    This class is a CUtlHashSymbolTable limited to the 16-bit CUtlSymbol
+//    handles. Symbols are numbered in the order they were added.
 //-----------------------------------------------------------------------------
 
 class CUtlSymbolTable
@@ -115,74 +115,11 @@ public:
 
 	int GetNumStrings( void ) const
 	{
-		return m_Lookup.Count();
+		return m_Table.GetNumStrings();
 	}
 
-	// We store one of these at the beginning of every string to speed
-	// up comparisons.
-	typedef unsigned short hashDecoration_t; 
-
 protected:
-	class CStringPoolIndex
-	{
-	public:
-		inline CStringPoolIndex()
-		{
-		}
-
-		inline CStringPoolIndex( unsigned short iPool, unsigned short iOffset )
-			: 	m_iPool(iPool), m_iOffset(iOffset)
-		{}
-
-		inline bool operator==( const CStringPoolIndex &other )	const
-		{
-			return m_iPool == other.m_iPool && m_iOffset == other.m_iOffset;
-		}
-
-		unsigned short m_iPool;		// Index into m_StringPools.
-		unsigned short m_iOffset;	// Index into the string pool.
-	};
-
-	class CLess
-	{
-	public:
-		CLess( int ignored = 0 ) {} // permits default initialization to NULL in CUtlRBTree
-		bool operator!() const { return false; }
-		bool operator()( const CStringPoolIndex &left, const CStringPoolIndex &right ) const;
-	};
-
-	// Stores the symbol lookup
-	class CTree : public CUtlRBTree<CStringPoolIndex, unsigned short, CLess>
-	{
-	public:
-		CTree(  int growSize, int initSize ) : CUtlRBTree<CStringPoolIndex, unsigned short, CLess>( growSize, initSize ) {}
-		friend class CUtlSymbolTable::CLess; // Needed to allow CLess to calculate pointer to symbol table
-	};
-
-	struct StringPool_t
-	{	
-		int m_TotalLen;		// How large is 
-		int m_SpaceUsed;
-		char m_Data[1];
-	};
-
-	CTree m_Lookup;
-
-	bool m_bInsensitive;
-	mutable unsigned short m_nUserSearchStringHash;
-	mutable const char* m_pUserSearchString;
-
-	// stores the string data
-	CUtlVector<StringPool_t*> m_StringPools;
-
-private:
-	int FindPoolWithSpace( int len ) const;
-	const char* StringFromIndex( const CStringPoolIndex &index ) const;
-	const char* DecoratedStringFromIndex( const CStringPoolIndex &index ) const;
-
-	friend class CLess;
-	friend class CSymbolHash;
-
+	CUtlHashSymbolTable m_Table;
 };
 
 class CUtlSymbolTableMT :  public CUtlSymbolTable
@@ -203,9 +140,9 @@ public:
 
 	CUtlSymbol Find( const char* pString ) const
 	{
-		m_lock.LockForWrite();
+		m_lock.LockForRead();
 		CUtlSymbol result = CUtlSymbolTable::Find( pString );
-		m_lock.UnlockWrite();
+		m_lock.UnlockRead();
 		return result;
 	}
 
@@ -0,0 +1,358 @@
+//=============================================================================//
+//
+// Purpose: Fork-join scheduling over an IThreadPool. Every worker gets its own
+//			deque of tasks: it pushes and pops at one end without contending
+//			with anyone, and idle workers steal from the other end. Tasks from
+//			outside the workers go through a lock-free injection queue.
+//
+//=============================================================================//
+
+#ifndef JOBSTEALING_H
+#define JOBSTEALING_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/threadtools.h"
+#include "tier0/tslist.h"
+#include "vstdlib/jobthread.h"
+
+class CJobStealingScheduler;
+class CJobStealingWorker;
+
+// Failed rounds of looking for work before an idle worker starts yielding
+#define JOB_STEALING_SPIN_ROUNDS	64
+
+
+//-----------------------------------------------------------------------------
+// A unit of work. The scheduler never owns tasks; whoever spawns one keeps it
+// alive until it has run.
+//-----------------------------------------------------------------------------
+abstract_class CJobStealingTask
+{
+public:
+	virtual ~CJobStealingTask() {}
+	virtual void Execute( CJobStealingWorker *pWorker ) = 0;
+};
+
+
+//-----------------------------------------------------------------------------
+// Fixed size Chase-Lev deque. Push and Pop are for the owning worker only,
+// Steal can be called from any thread.
+//-----------------------------------------------------------------------------
+class CJobStealingDeque
+{
+public:
+	enum
+	{
+		CAPACITY = 1024,	// must be a power of two
+	};
+
+	CJobStealingDeque()
+	{
+		m_nTop = 0;
+		m_nBottom = 0;
+	}
+
+	// Returns false when full; the caller should just run the task itself
+	bool Push( CJobStealingTask *pTask )
+	{
+		int nBottom = m_nBottom;
+		if ( nBottom - m_nTop >= CAPACITY )
+			return false;
+
+		m_pTasks[nBottom & ( CAPACITY - 1 )] = pTask;
+
+		// The task has to be in place before a thief can see it
+		ThreadMemoryBarrier();
+		m_nBottom = nBottom + 1;
+		return true;
+	}
+
+	CJobStealingTask *Pop()
+	{
+		int nBottom = m_nBottom - 1;
+
+		// Thieves have to see the smaller bottom before top is read, which
+		// needs a full fence; the exchange is one on every platform
+		ThreadInterlockedExchange( &m_nBottom, nBottom );
+		int nTop = m_nTop;
+
+		if ( nTop > nBottom )
+		{
+			m_nBottom = nBottom + 1;
+			return NULL;
+		}
+
+		CJobStealingTask *pTask = m_pTasks[nBottom & ( CAPACITY - 1 )];
+		if ( nTop == nBottom )
+		{
+			// Last one, a thief may be going for it too
+			if ( !ThreadInterlockedAssignIf( &m_nTop, nTop + 1, nTop ) )
+			{
+				pTask = NULL;
+			}
+			m_nBottom = nBottom + 1;
+		}
+		return pTask;
+	}
+
+	CJobStealingTask *Steal()
+	{
+		int nTop = m_nTop;
+		ThreadMemoryBarrier();
+		int nBottom = m_nBottom;
+		if ( nTop >= nBottom )
+			return NULL;
+
+		// If the owner has wrapped around onto this slot, top has moved on
+		// and the compare fails
+		CJobStealingTask *pTask = m_pTasks[nTop & ( CAPACITY - 1 )];
+		if ( !ThreadInterlockedAssignIf( &m_nTop, nTop + 1, nTop ) )
+			return NULL;
+
+		return pTask;
+	}
+
+	bool IsEmpty() const { return m_nTop >= m_nBottom; }
+
+	// Top and bottom only ever count up, so rewind them between runs while
+	// nobody else can be looking
+	void Reset()
+	{
+		Assert( IsEmpty() );
+		m_nTop = 0;
+		m_nBottom = 0;
+	}
+
+private:
+	// Thieves hammer top and the owner hammers bottom; keep them apart
+	volatile int		m_nTop;
+	unsigned char		m_Pad[128 - sizeof( int )];
+	volatile int		m_nBottom;
+	CJobStealingTask	*m_pTasks[CAPACITY];
+};
+
+
+//-----------------------------------------------------------------------------
+// One participant in a CJobStealingScheduler::Run. Tasks get the worker
+// they're running on so they can spawn children onto its deque.
+//-----------------------------------------------------------------------------
+class CJobStealingWorker
+{
+public:
+	CJobStealingWorker( CJobStealingScheduler *pScheduler, int iIndex ) : m_pScheduler( pScheduler ), m_iIndex( iIndex ), m_iNextVictim( iIndex ) {}
+
+	CJobStealingScheduler *GetScheduler()	{ return m_pScheduler; }
+	int GetIndex() const					{ return m_iIndex; }
+
+	// Queues a task to run on this or any other worker
+	void Spawn( CJobStealingTask *pTask );
+
+	// Runs tasks until *pnRemaining reaches zero, for waiting on children
+	// without leaving a thread idle
+	void HelpUntilZero( volatile int *pnRemaining );
+
+private:
+	friend class CJobStealingScheduler;
+
+	// Own deque first, then the injection queue, then everyone else's
+	CJobStealingTask *FindTask();
+	void RunTask( CJobStealingTask *pTask );
+
+	CJobStealingScheduler	*m_pScheduler;
+	int						m_iIndex;
+	int						m_iNextVictim;
+	CJobStealingDeque		m_Deque;
+};
+
+
+//-----------------------------------------------------------------------------
+// Runs a root task and everything it spawns on the calling thread and up to
+// a pool's worth of jobs, and returns once all of it has run. One Run at a
+// time per scheduler; nest by spawning from tasks instead.
+//-----------------------------------------------------------------------------
+class CJobStealingScheduler
+{
+public:
+	CJobStealingScheduler( IThreadPool *pThreadPool = NULL, const char *pszDescription = "CJobStealingScheduler" )
+	{
+		m_pThreadPool = pThreadPool;
+		m_szDescription = pszDescription;
+		m_nWorkers = 0;
+		m_nNextWorker = 0;
+		m_nPending = 0;
+		memset( m_pWorkers, 0, sizeof( m_pWorkers ) );
+	}
+
+	~CJobStealingScheduler()
+	{
+		for ( int i = 0; i < TP_MAX_POOL_THREADS + 1; i++ )
+		{
+			delete m_pWorkers[i];
+		}
+	}
+
+	void Run( CJobStealingTask *pRoot, int nMaxParallel = INT_MAX )
+	{
+		tmZone( TELEMETRY_LEVEL0, TMZF_NONE, "Run %s", m_szDescription );
+
+		Assert( m_nPending == 0 && m_nWorkers == 0 );
+
+		IThreadPool *pThreadPool = m_pThreadPool ? m_pThreadPool : g_pThreadPool;
+
+		int nJobs = pThreadPool ? pThreadPool->NumThreads() : 0;
+		nJobs = MIN( nJobs, nMaxParallel );
+		nJobs = clamp( nJobs, 0, TP_MAX_POOL_THREADS );
+
+		m_nWorkers = nJobs + 1;
+		for ( int i = 0; i < m_nWorkers; i++ )
+		{
+			if ( !m_pWorkers[i] )
+			{
+				m_pWorkers[i] = new CJobStealingWorker( this, i );
+			}
+			m_pWorkers[i]->m_Deque.Reset();
+		}
+
+		// The calling thread is always worker 0
+		m_nNextWorker = 1;
+		ThreadInterlockedIncrement( &m_nPending );
+		m_pWorkers[0]->m_Deque.Push( pRoot );
+
+		CJob **jobs = (CJob **)stackalloc( MAX( nJobs, 1 ) * sizeof( CJob * ) );
+		for ( int i = 0; i < nJobs; i++ )
+		{
+			jobs[i] = pThreadPool->QueueCall( this, &CJobStealingScheduler::DoExecute );
+			jobs[i]->SetDescription( m_szDescription );
+		}
+
+		WorkerLoop( m_pWorkers[0] );
+
+		for ( int i = 0; i < nJobs; i++ )
+		{
+			jobs[i]->Abort(); // will either abort ones that never got a thread, or wait for ones that did
+			jobs[i]->Release();
+		}
+
+		Assert( m_nPending == 0 );
+		m_nWorkers = 0;
+	}
+
+	// For threads that aren't workers, while Run is going
+	void Inject( CJobStealingTask *pTask )
+	{
+		ThreadInterlockedIncrement( &m_nPending );
+		m_InjectionQueue.PushItem( pTask );
+	}
+
+	int NumWorkers() const { return m_nWorkers; }
+
+private:
+	friend class CJobStealingWorker;
+
+	void DoExecute()
+	{
+		tmZone( TELEMETRY_LEVEL0, TMZF_NONE, "DoExecute %s", m_szDescription );
+
+		int iWorker = ++m_nNextWorker - 1;
+		if ( iWorker >= m_nWorkers )
+		{
+			Assert( 0 );
+			return;
+		}
+
+		WorkerLoop( m_pWorkers[iWorker] );
+	}
+
+	void WorkerLoop( CJobStealingWorker *pWorker )
+	{
+		pWorker->HelpUntilZero( &m_nPending );
+	}
+
+	IThreadPool					*m_pThreadPool;
+	const char					*m_szDescription;
+	CJobStealingWorker			*m_pWorkers[TP_MAX_POOL_THREADS + 1];
+	int							m_nWorkers;
+	CInterlockedInt				m_nNextWorker;
+	volatile int				m_nPending;
+	CTSQueue<CJobStealingTask *>	m_InjectionQueue;
+};
+
+
+//-----------------------------------------------------------------------------
+// CJobStealingWorker
+//-----------------------------------------------------------------------------
+inline void CJobStealingWorker::Spawn( CJobStealingTask *pTask )
+{
+	ThreadInterlockedIncrement( &m_pScheduler->m_nPending );
+	if ( !m_Deque.Push( pTask ) )
+	{
+		RunTask( pTask );
+	}
+}
+
+inline void CJobStealingWorker::RunTask( CJobStealingTask *pTask )
+{
+	pTask->Execute( this );
+	ThreadInterlockedDecrement( &m_pScheduler->m_nPending );
+}
+
+inline CJobStealingTask *CJobStealingWorker::FindTask()
+{
+	CJobStealingTask *pTask = m_Deque.Pop();
+	if ( pTask )
+		return pTask;
+
+	if ( m_pScheduler->m_InjectionQueue.PopItem( &pTask ) )
+		return pTask;
+
+	// Every other worker once, starting from where the last search left off
+	// so thieves spread out. m_iNextVictim counts the others, skipping us.
+	int nWorkers = m_pScheduler->m_nWorkers;
+	int nOthers = nWorkers - 1;
+	for ( int i = 0; i < nOthers; i++ )
+	{
+		int iOther = ( m_iNextVictim + i ) % nOthers;
+		int iVictim = ( m_iIndex + 1 + iOther ) % nWorkers;
+
+		pTask = m_pScheduler->m_pWorkers[iVictim]->m_Deque.Steal();
+		if ( pTask )
+		{
+			// Go back to the same one next time, it may have more
+			m_iNextVictim = iOther;
+			return pTask;
+		}
+	}
+
+	if ( nOthers > 0 )
+	{
+		m_iNextVictim = ( m_iNextVictim + 1 ) % nOthers;
+	}
+	return NULL;
+}
+
+inline void CJobStealingWorker::HelpUntilZero( volatile int *pnRemaining )
+{
+	int nIdleRounds = 0;
+	while ( *pnRemaining != 0 )
+	{
+		CJobStealingTask *pTask = FindTask();
+		if ( pTask )
+		{
+			RunTask( pTask );
+			nIdleRounds = 0;
+		}
+		else if ( ++nIdleRounds < JOB_STEALING_SPIN_ROUNDS )
+		{
+			ThreadPause();
+		}
+		else
+		{
+			ThreadSleep( 0 );
+		}
+	}
+}
+
+#endif // JOBSTEALING_H
@@ -0,0 +1,457 @@
+//=============================================================================//
+//
+// Purpose: Task level parallelism over the thread pool. ParallelFor runs a
+//			functor over index ranges; task groups and graphs run tasks with
+//			dependencies on a CJobStealingScheduler; per-thread storage and
+//			scratch memory let jobs gather results without taking locks.
+//
+//=============================================================================//
+
+#ifndef JOBTASKS_H
+#define JOBTASKS_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/threadtools.h"
+#include "tier1/utlvector.h"
+#include "vstdlib/jobthread.h"
+#include "vstdlib/jobstealing.h"
+
+#define JOB_SCRATCH_BLOCK_SIZE	( 64 * 1024 )
+
+
+//-----------------------------------------------------------------------------
+// One T for every thread that asks for one. Local() can be called from any
+// thread; Count() and operator[] are for when no jobs are using it, to merge
+// what each thread gathered. Each one takes up a thread local slot, so keep
+// them around rather than making one per call.
+//-----------------------------------------------------------------------------
+template <typename T>
+class CJobPerThread
+{
+public:
+	~CJobPerThread()
+	{
+		m_All.PurgeAndDeleteElements();
+	}
+
+	T &Local()
+	{
+		T *pLocal = m_pLocal;
+		if ( !pLocal )
+		{
+			pLocal = new T;
+			m_pLocal = pLocal;
+
+			AUTO_LOCK( m_Lock );
+			m_All.AddToTail( pLocal );
+		}
+		return *pLocal;
+	}
+
+	int Count() const			{ return m_All.Count(); }
+	T &operator[]( int i )		{ return *m_All[i]; }
+
+private:
+	CThreadLocalPtr<T>	m_pLocal;
+	CUtlVector<T *>		m_All;
+	CThreadFastMutex	m_Lock;
+};
+
+
+//-----------------------------------------------------------------------------
+// Per thread bump allocator for temporary memory in jobs. Nothing is freed
+// until Reset(), which rewinds every thread's blocks for reuse and has to be
+// called when no jobs are using it.
+//-----------------------------------------------------------------------------
+class CJobScratchAllocator
+{
+public:
+	CJobScratchAllocator( int nBlockSize = JOB_SCRATCH_BLOCK_SIZE ) : m_nBlockSize( nBlockSize ) {}
+
+	void *Alloc( int nBytes, int nAlign = 16 )
+	{
+		// Blocks come from malloc, so that's as far as alignment goes
+		Assert( nAlign <= 16 );
+
+		Arena_t &arena = m_Arenas.Local();
+
+		if ( arena.m_iBlock >= 0 )
+		{
+			int nStart = ALIGN_VALUE( arena.m_nUsed, nAlign );
+			if ( nStart + nBytes <= arena.m_Blocks[arena.m_iBlock].m_nSize )
+			{
+				arena.m_nUsed = nStart + nBytes;
+				return arena.m_Blocks[arena.m_iBlock].m_pMemory + nStart;
+			}
+		}
+
+		int nSize = MAX( nBytes, m_nBlockSize );
+		arena.m_iBlock++;
+		if ( arena.m_iBlock == arena.m_Blocks.Count() || arena.m_Blocks[arena.m_iBlock].m_nSize < nSize )
+		{
+			Block_t block;
+			block.m_pMemory = (unsigned char *)MemAlloc_AllocAligned( nSize, 16 );
+			block.m_nSize = nSize;
+			arena.m_Blocks.InsertBefore( arena.m_iBlock, block );
+		}
+
+		arena.m_nUsed = nBytes;
+		return arena.m_Blocks[arena.m_iBlock].m_pMemory;
+	}
+
+	template <typename T>
+	T *Alloc( int nCount )
+	{
+		return (T *)Alloc( nCount * sizeof( T ), MIN( (int)__alignof( T ), 16 ) );
+	}
+
+	void Reset()
+	{
+		for ( int i = 0; i < m_Arenas.Count(); i++ )
+		{
+			m_Arenas[i].m_iBlock = -1;
+			m_Arenas[i].m_nUsed = 0;
+		}
+	}
+
+private:
+	struct Block_t
+	{
+		unsigned char	*m_pMemory;
+		int				m_nSize;
+	};
+
+	struct Arena_t
+	{
+		Arena_t() : m_iBlock( -1 ), m_nUsed( 0 ) {}
+		~Arena_t()
+		{
+			for ( int i = 0; i < m_Blocks.Count(); i++ )
+			{
+				MemAlloc_FreeAligned( m_Blocks[i].m_pMemory );
+			}
+		}
+
+		CUtlVector<Block_t>	m_Blocks;
+		int					m_iBlock;
+		int					m_nUsed;
+	};
+
+	CJobPerThread<Arena_t>	m_Arenas;
+	int						m_nBlockSize;
+};
+
+
+//-----------------------------------------------------------------------------
+// Calls body( iFirst, iLast ) over [ iBegin, iEnd ) on the calling thread and
+// the pool. Ranges are at least nGrain long, apart from the last bits of the
+// run, and come in no particular order on any thread. Handing out ranges
+// rather than items lets the body take whatever lock it needs once per range.
+//-----------------------------------------------------------------------------
+template <typename BODY>
+class CParallelForProcessor
+{
+public:
+	CParallelForProcessor( const char *pszDescription, BODY &body ) : m_Body( body ), m_szDescription( pszDescription )
+	{
+		m_iBegin = 0;
+		m_nGrain = 1;
+	}
+
+	void Run( int iBegin, int iEnd, int nGrain, int nMaxParallel = INT_MAX, IThreadPool *pThreadPool = NULL )
+	{
+		tmZone( TELEMETRY_LEVEL0, TMZF_NONE, "Run %s %d", m_szDescription, iEnd - iBegin );
+
+		if ( iEnd <= iBegin )
+			return;
+
+		if ( !pThreadPool )
+		{
+			pThreadPool = g_pThreadPool;
+		}
+
+		m_iBegin = iBegin;
+		m_nGrain = MAX( nGrain, 1 );
+
+		// No more participants than there are grains to go round
+		unsigned nItems = iEnd - iBegin;
+		int nJobs = ( nItems - 1 ) / m_nGrain;
+		nJobs = MIN( nJobs, nMaxParallel );
+		nJobs = MIN( nJobs, pThreadPool ? pThreadPool->NumThreads() : 0 );
+
+		if ( nJobs <= 0 )
+		{
+			m_Body( iBegin, iEnd );
+			return;
+		}
+
+		m_Ranges.Init( stackalloc( CParallelWorkRanges::MemorySize( nJobs + 1 ) ), nJobs + 1, nItems );
+
+		CJob **jobs = (CJob **)stackalloc( nJobs * sizeof( CJob * ) );
+		for ( int i = 0; i < nJobs; i++ )
+		{
+			jobs[i] = pThreadPool->QueueCall( this, &CParallelForProcessor<BODY>::DoExecute );
+			jobs[i]->SetDescription( m_szDescription );
+		}
+
+		DoExecute();
+
+		for ( int i = 0; i < nJobs; i++ )
+		{
+			jobs[i]->Abort(); // will either abort ones that never got a thread, or wait for ones that did
+			jobs[i]->Release();
+		}
+
+		m_Ranges.Shutdown();
+	}
+
+private:
+	void DoExecute()
+	{
+		tmZone( TELEMETRY_LEVEL0, TMZF_NONE, "DoExecute %s", m_szDescription );
+
+		int iRange = m_Ranges.Join();
+		if ( iRange < 0 )
+			return;
+
+		do
+		{
+			unsigned iFirst, nCount;
+			while ( m_Ranges.Claim( iRange, m_nGrain, &iFirst, &nCount ) )
+			{
+				m_Body( m_iBegin + (int)iFirst, m_iBegin + (int)( iFirst + nCount ) );
+			}
+		} while ( m_Ranges.Steal( iRange ) );
+	}
+
+	BODY					&m_Body;
+	int						m_iBegin;
+	unsigned				m_nGrain;
+	CParallelWorkRanges		m_Ranges;
+	const char				*m_szDescription;
+};
+
+template <class OBJECT_TYPE, class FUNCTION_CLASS>
+class CMemberParallelForBody
+{
+public:
+	CMemberParallelForBody( OBJECT_TYPE *pObject, void (FUNCTION_CLASS::*pfnBody)( int, int ) ) : m_pObject( pObject ), m_pfnBody( pfnBody ) {}
+
+	void operator()( int iFirst, int iLast ) { ((*m_pObject).*m_pfnBody)( iFirst, iLast ); }
+
+private:
+	OBJECT_TYPE *m_pObject;
+	void (FUNCTION_CLASS::*m_pfnBody)( int, int );
+};
+
+template <typename BODY>
+inline void ParallelFor( const char *pszDescription, int iBegin, int iEnd, int nGrain, BODY &body, int nMaxParallel = INT_MAX, IThreadPool *pThreadPool = NULL )
+{
+	CParallelForProcessor<BODY> processor( pszDescription, body );
+	processor.Run( iBegin, iEnd, nGrain, nMaxParallel, pThreadPool );
+}
+
+template <typename OBJECT_TYPE, typename FUNCTION_CLASS>
+inline void ParallelFor( const char *pszDescription, int iBegin, int iEnd, int nGrain, OBJECT_TYPE *pObject, void (FUNCTION_CLASS::*pfnBody)( int, int ), int nMaxParallel = INT_MAX, IThreadPool *pThreadPool = NULL )
+{
+	CMemberParallelForBody<OBJECT_TYPE, FUNCTION_CLASS> body( pObject, pfnBody );
+	ParallelFor( pszDescription, iBegin, iEnd, nGrain, body, nMaxParallel, pThreadPool );
+}
+
+
+//-----------------------------------------------------------------------------
+// Fork-join inside a task running on a CJobStealingScheduler: Spawn() hands
+// children to the scheduler and Wait() runs tasks, these or anyone else's,
+// until every child has finished.
+//-----------------------------------------------------------------------------
+class CJobTaskGroup;
+
+abstract_class CJobGroupTask : public CJobStealingTask
+{
+public:
+	CJobGroupTask() : m_pGroup( NULL ) {}
+
+	virtual void Run( CJobStealingWorker *pWorker ) = 0;
+
+private:
+	friend class CJobTaskGroup;
+
+	virtual void Execute( CJobStealingWorker *pWorker );
+
+	CJobTaskGroup *m_pGroup;
+};
+
+class CJobTaskGroup
+{
+public:
+	CJobTaskGroup() : m_nPending( 0 ) {}
+	~CJobTaskGroup()	{ Assert( m_nPending == 0 ); }
+
+	void Spawn( CJobStealingWorker *pWorker, CJobGroupTask *pTask )
+	{
+		pTask->m_pGroup = this;
+		ThreadInterlockedIncrement( &m_nPending );
+		pWorker->Spawn( pTask );
+	}
+
+	void Wait( CJobStealingWorker *pWorker )
+	{
+		pWorker->HelpUntilZero( &m_nPending );
+	}
+
+private:
+	friend class CJobGroupTask;
+
+	volatile int m_nPending;
+};
+
+inline void CJobGroupTask::Execute( CJobStealingWorker *pWorker )
+{
+	CJobTaskGroup *pGroup = m_pGroup;
+	Run( pWorker );
+
+	// Last thing, the task may be gone once the group sees it's done
+	ThreadInterlockedDecrement( &pGroup->m_nPending );
+}
+
+
+//-----------------------------------------------------------------------------
+// Tasks with dependencies between them. Each task runs once everything it
+// depends on has; a continuation runs after every task added before it. The
+// graph can be run again, every frame say, without being rebuilt. The tasks
+// belong to the caller.
+//-----------------------------------------------------------------------------
+typedef int JobTaskHandle_t;
+#define JOB_TASK_HANDLE_INVALID		-1
+
+class CJobTaskGraph
+{
+public:
+	CJobTaskGraph( const char *pszDescription = "CJobTaskGraph", IThreadPool *pThreadPool = NULL ) : m_Scheduler( pThreadPool, pszDescription )
+	{
+		m_Root.m_pGraph = this;
+	}
+
+	~CJobTaskGraph()
+	{
+		RemoveAll();
+	}
+
+	JobTaskHandle_t AddTask( CJobStealingTask *pTask, JobTaskHandle_t hPrerequisite = JOB_TASK_HANDLE_INVALID )
+	{
+		Node_t *pNode = new Node_t;
+		pNode->m_pGraph = this;
+		pNode->m_pTask = pTask;
+		pNode->m_nPrerequisites = 0;
+		pNode->m_nWaiting = 0;
+		JobTaskHandle_t hTask = m_Nodes.AddToTail( pNode );
+
+		if ( hPrerequisite != JOB_TASK_HANDLE_INVALID )
+		{
+			AddDependency( hTask, hPrerequisite );
+		}
+		return hTask;
+	}
+
+	// hTask won't start until hPrerequisite has finished
+	void AddDependency( JobTaskHandle_t hTask, JobTaskHandle_t hPrerequisite )
+	{
+		Assert( hTask != hPrerequisite );
+		m_Nodes[hPrerequisite]->m_Successors.AddToTail( hTask );
+		m_Nodes[hTask]->m_nPrerequisites++;
+	}
+
+	JobTaskHandle_t AddContinuation( CJobStealingTask *pTask )
+	{
+		int nTasks = m_Nodes.Count();
+		JobTaskHandle_t hTask = AddTask( pTask );
+		for ( int i = 0; i < nTasks; i++ )
+		{
+			// Depending on the ends of every chain covers everything before them
+			if ( !m_Nodes[i]->m_Successors.Count() )
+			{
+				AddDependency( hTask, i );
+			}
+		}
+		return hTask;
+	}
+
+	void RemoveAll()
+	{
+		m_Nodes.PurgeAndDeleteElements();
+	}
+
+	int Count() const { return m_Nodes.Count(); }
+
+	void Run( int nMaxParallel = INT_MAX )
+	{
+		if ( !m_Nodes.Count() )
+			return;
+
+		for ( int i = 0; i < m_Nodes.Count(); i++ )
+		{
+			m_Nodes[i]->m_nWaiting = m_Nodes[i]->m_nPrerequisites;
+		}
+
+		m_Scheduler.Run( &m_Root, nMaxParallel );
+
+#ifdef _DEBUG
+		// Anything still waiting is part of a cycle
+		for ( int i = 0; i < m_Nodes.Count(); i++ )
+		{
+			AssertMsg( m_Nodes[i]->m_nWaiting == 0, "CJobTaskGraph has a dependency cycle\n" );
+		}
+#endif
+	}
+
+private:
+	struct Node_t : public CJobStealingTask
+	{
+		virtual void Execute( CJobStealingWorker *pWorker )
+		{
+			m_pTask->Execute( pWorker );
+
+			for ( int i = 0; i < m_Successors.Count(); i++ )
+			{
+				Node_t *pSuccessor = m_pGraph->m_Nodes[m_Successors[i]];
+				if ( ThreadInterlockedDecrement( &pSuccessor->m_nWaiting ) == 0 )
+				{
+					pWorker->Spawn( pSuccessor );
+				}
+			}
+		}
+
+		CJobTaskGraph				*m_pGraph;
+		CJobStealingTask			*m_pTask;
+		CUtlVector<JobTaskHandle_t>	m_Successors;
+		int							m_nPrerequisites;
+		volatile int				m_nWaiting;
+	};
+
+	// Starts everything that doesn't depend on anything
+	struct RootTask_t : public CJobStealingTask
+	{
+		virtual void Execute( CJobStealingWorker *pWorker )
+		{
+			for ( int i = m_pGraph->m_Nodes.Count() - 1; i >= 0; i-- )
+			{
+				Node_t *pNode = m_pGraph->m_Nodes[i];
+				if ( !pNode->m_nPrerequisites )
+				{
+					pWorker->Spawn( pNode );
+				}
+			}
+		}
+
+		CJobTaskGraph *m_pGraph;
+	};
+
+	CUtlVector<Node_t *>	m_Nodes;
+	RootTask_t				m_Root;
+	CJobStealingScheduler	m_Scheduler;
+};
+
+#endif // JOBTASKS_H
@@ -846,13 +846,145 @@ protected:
 	void (FUNCTION_CLASS::*m_pfnEnd)();
 };
 
+//-----------------------------------------------------------------------------
+// Each participant, the calling thread included, starts with its own slice of
+// the items and claims chunks off the front of it, an eighth of what's left
+// at a time, so there's one interlocked op per chunk instead of per item.
+// Once its slice is empty it takes the back half of someone else's and keeps
+// going. A slice is a ( begin, end ) pair packed in 64 bits so claims and
+// steals are a single compare and swap.
+//-----------------------------------------------------------------------------
+#define PARALLEL_PROCESS_CHUNK_SHIFT	3
+#define PARALLEL_PROCESS_RANGE_ALIGN	128
+
+class CParallelWorkRanges
+{
+public:
+	CParallelWorkRanges()
+	{
+		m_pRanges = NULL;
+		m_nRanges = 0;
+		m_nNextRange = 0;
+	}
+
+	// Bytes Init needs for nRanges participants; it's usually stackalloc'd by
+	// whoever waits for the run to finish
+	static size_t MemorySize( unsigned nRanges )	{ return nRanges * sizeof( WorkRange_t ) + PARALLEL_PROCESS_RANGE_ALIGN; }
+
+	void Init( void *pMemory, unsigned nRanges, unsigned nItems )
+	{
+		// Slices are a cache line apart so claiming from one doesn't slow down the others
+		m_pRanges = (WorkRange_t *)( ( (uintp)pMemory + PARALLEL_PROCESS_RANGE_ALIGN - 1 ) & ~(uintp)( PARALLEL_PROCESS_RANGE_ALIGN - 1 ) );
+		m_nRanges = nRanges;
+		for ( unsigned i = 0; i < m_nRanges; i++ )
+		{
+			m_pRanges[i].m_nRange = PackRange( (uint64)nItems * i / m_nRanges, (uint64)nItems * ( i + 1 ) / m_nRanges );
+		}
+		m_nNextRange = 0;
+		ThreadMemoryBarrier();
+	}
+
+	void Shutdown()
+	{
+		m_pRanges = NULL;
+		m_nRanges = 0;
+	}
+
+	// Every participant calls this once to find out which slice is its own;
+	// returns -1 if they're all taken
+	int Join()
+	{
+		unsigned iRange = (unsigned)( ++m_nNextRange - 1 );
+		if ( iRange >= m_nRanges )
+		{
+			Assert( 0 );
+			return -1;
+		}
+		return iRange;
+	}
+
+	// Takes at least nMinChunk items, or whatever's left if that's fewer,
+	// off the front of a participant's own slice
+	bool Claim( int iRange, unsigned nMinChunk, unsigned *pFirst, unsigned *pCount )
+	{
+		WorkRange_t &range = m_pRanges[iRange];
+		int64 nOld = ReadRange( range );
+		for (;;)
+		{
+			unsigned iBegin = RangeBegin( nOld );
+			unsigned iEnd = RangeEnd( nOld );
+			if ( iBegin >= iEnd )
+				return false;
+
+			unsigned nRemaining = iEnd - iBegin;
+			unsigned nCount = MIN( MAX( nRemaining >> PARALLEL_PROCESS_CHUNK_SHIFT, nMinChunk ), nRemaining );
+			int64 nSeen = ThreadInterlockedCompareExchange64( &range.m_nRange, PackRange( iBegin + nCount, iEnd ), nOld );
+			if ( nSeen == nOld )
+			{
+				*pFirst = iBegin;
+				*pCount = nCount;
+				return true;
+			}
+			nOld = nSeen;
+		}
+	}
+
+	// Nobody writes an empty slice but its owner, so the stolen half can just
+	// be stored in the thief's own. Slices only ever shrink or get refilled
+	// with items that were never in them before, so a compare and swap can't
+	// be fooled by a slice going back to an old value.
+	bool Steal( int iThief )
+	{
+		for ( unsigned i = 1; i < m_nRanges; i++ )
+		{
+			WorkRange_t &victim = m_pRanges[( iThief + i ) % m_nRanges];
+			int64 nOld = ReadRange( victim );
+			for (;;)
+			{
+				unsigned iBegin = RangeBegin( nOld );
+				unsigned iEnd = RangeEnd( nOld );
+				if ( iBegin >= iEnd )
+					break;
+
+				unsigned iSplit = iBegin + ( ( iEnd - iBegin ) >> 1 );
+				int64 nSeen = ThreadInterlockedCompareExchange64( &victim.m_nRange, PackRange( iBegin, iSplit ), nOld );
+				if ( nSeen == nOld )
+				{
+					ThreadInterlockedExchange64( &m_pRanges[iThief].m_nRange, PackRange( iSplit, iEnd ) );
+					return true;
+				}
+				nOld = nSeen;
+			}
+		}
+		return false;
+	}
+
+private:
+	struct WorkRange_t
+	{
+		volatile int64	m_nRange;
+		unsigned char	m_Pad[PARALLEL_PROCESS_RANGE_ALIGN - sizeof( int64 )];
+	};
+
+	static int64 PackRange( uint64 iBegin, uint64 iEnd )	{ return (int64)( ( iEnd << 32 ) | iBegin ); }
+	static unsigned RangeBegin( int64 nRange )				{ return (unsigned)( (uint64)nRange & 0xffffffff ); }
+	static unsigned RangeEnd( int64 nRange )				{ return (unsigned)( (uint64)nRange >> 32 ); }
+
+	// Comparing against anything gets back the whole 64 bits at once, even on 32 bit targets
+	static int64 ReadRange( WorkRange_t &range )			{ return ThreadInterlockedCompareExchange64( &range.m_nRange, 0, 0 ); }
+
+	WorkRange_t *		m_pRanges;
+	unsigned			m_nRanges;
+	CInterlockedInt		m_nNextRange;
+};
+
 template <typename ITEM_TYPE, class ITEM_PROCESSOR_TYPE>
 class CParallelProcessor
 {
 public:
 	CParallelProcessor( const char *pszDescription )
 	{
-		m_pItems = m_pLimit= 0;
+		m_pItems = NULL;
 		m_szDescription = pszDescription;
 	}
 
@@ -869,7 +1001,6 @@ public:
 		}
 
 		m_pItems = pItems;
-		m_pLimit = pItems + nItems;
 
 		int nJobs = nItems - 1;
 
@@ -880,7 +1011,7 @@ public:
 
 		if (! pThreadPool )									// only possible on linux
 		{
-			DoExecute( );
+			ExecuteAll( nItems );
 			return;
 		}
 
@@ -890,8 +1021,10 @@ public:
 			nJobs = nThreads;
 		}
 
-		if ( nJobs > 1 )
+		if ( nJobs > 0 )
 		{
+			m_Ranges.Init( stackalloc( CParallelWorkRanges::MemorySize( nJobs + 1 ) ), nJobs + 1, nItems );
+
 			CJob **jobs = (CJob **)stackalloc( nJobs * sizeof(CJob **) );
 			int i = nJobs;
 
@@ -908,45 +1041,68 @@ public:
 				jobs[i]->Abort(); // will either abort ones that never got a thread, or noop on ones that did
 				jobs[i]->Release();
 			}
+
+			m_Ranges.Shutdown();
 		}
 		else
 		{
-			DoExecute();
+			ExecuteAll( nItems );
 		}
 	}
 
 	ITEM_PROCESSOR_TYPE m_ItemProcessor;
 
 private:
-	void DoExecute()
+	void ExecuteAll( unsigned nItems )
 	{
 		tmZone( TELEMETRY_LEVEL0, TMZF_NONE, "DoExecute %s", m_szDescription );
 
-		if ( m_pItems < m_pLimit )
+		m_ItemProcessor.Begin();
+		for ( unsigned i = 0; i < nItems; i++ )
 		{
-			m_ItemProcessor.Begin();
+			m_ItemProcessor.Process( m_pItems[i] );
+		}
+		m_ItemProcessor.End();
+	}
 
-			ITEM_TYPE *pLimit = m_pLimit;
+	void DoExecute()
+	{
+		tmZone( TELEMETRY_LEVEL0, TMZF_NONE, "DoExecute %s", m_szDescription );
 
-			for (;;)
+		int iRange = m_Ranges.Join();
+		if ( iRange < 0 )
+			return;
+
+		bool bBegun = false;
+		do
+		{
+			unsigned iFirst, nCount;
+			while ( m_Ranges.Claim( iRange, 1, &iFirst, &nCount ) )
 			{
-				ITEM_TYPE *pCurrent = m_pItems++;
-				if ( pCurrent < pLimit )
+				if ( !bBegun )
 				{
-					m_ItemProcessor.Process( *pCurrent );
+					m_ItemProcessor.Begin();
+					bBegun = true;
 				}
-				else
+
+				ITEM_TYPE *pCurrent = m_pItems + iFirst;
+				ITEM_TYPE *pLimit = pCurrent + nCount;
+				for ( ; pCurrent < pLimit; pCurrent++ )
 				{
-					break;
+					m_ItemProcessor.Process( *pCurrent );
 				}
 			}
+		} while ( m_Ranges.Steal( iRange ) );
 
+		if ( bBegun )
+		{
 			m_ItemProcessor.End();
 		}
 	}
-	CInterlockedPtr<ITEM_TYPE>	m_pItems;
-	ITEM_TYPE *					m_pLimit;
-	const char *				m_szDescription;
+
+	ITEM_TYPE *				m_pItems;
+	CParallelWorkRanges		m_Ranges;
+	const char *			m_szDescription;
 };
 
 template <typename ITEM_TYPE> 
@@ -14,20 +14,11 @@
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
-//-----------------------------------------------------------------------------
-// Purpose: Comparison function for string sorted associative data structures
-//-----------------------------------------------------------------------------
-
-bool StrLess( const char * const &pszLeft, const char * const &pszRight )
-{
-	return ( Q_stricmp( pszLeft, pszRight) < 0 );
-}
-
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 
 CStringPool::CStringPool()
-  : m_Strings( 32, 256, StrLess )
+  : m_Strings( 256, true )
 {
 }
 
@@ -44,36 +35,23 @@ CStringPool::~CStringPool()
 
 unsigned int CStringPool::Count() const
 {
-	return m_Strings.Count();
+	return m_Strings.GetNumStrings();
 }
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 const char * CStringPool::Find( const char *pszValue )
 {
-	unsigned short i = m_Strings.Find(pszValue);
-	if ( m_Strings.IsValidIndex(i) )
-		return m_Strings[i];
+	UtlHashSymId_t i = m_Strings.Find( pszValue );
+	if ( i != UTL_INVAL_HASH_SYMBOL )
+		return m_Strings.String( i );
 
 	return NULL;
 }
 
 const char * CStringPool::Allocate( const char *pszValue )
 {
-	char	*pszNew;
-
-	unsigned short i 	= m_Strings.Find(pszValue);
-	bool		   bNew = (i == m_Strings.InvalidIndex());
-
-	if ( !bNew )
-		return m_Strings[i];
-
-	pszNew = strdup( pszValue );
-
-	if ( bNew )
-		m_Strings.Insert( pszNew );
-
-	return pszNew;
+	return m_Strings.String( m_Strings.AddString( pszValue ) );
 }
 
 //-----------------------------------------------------------------------------
@@ -81,12 +59,6 @@ const char * CStringPool::Allocate( const char *pszValue )
 
 void CStringPool::FreeAll()
 {
-	unsigned short i = m_Strings.FirstInorder();
-	while ( i != m_Strings.InvalidIndex() )
-	{
-		free( (void *)m_Strings[i] );
-		i = m_Strings.NextInorder(i);
-	}
 	m_Strings.RemoveAll();
 }
 
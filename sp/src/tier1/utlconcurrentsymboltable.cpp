@@ -0,0 +1,307 @@
+//=============================================================================//
+//
+// Purpose: A string interning table that can be used from many threads at once
+//
+//=============================================================================//
+
+#include "tier1/utlconcurrentsymboltable.h"
+#include "tier1/strtools.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define MIN_CONCURRENT_SYMBOL_SLOTS			16
+#define MIN_CONCURRENT_SYMBOL_BLOCK_SIZE	1024
+#define MAX_CONCURRENT_SYMBOL_BLOCK_SIZE	65536
+
+// Indices in a shard have to fit in the handle above the shard bits
+#define MAX_CONCURRENT_SYMBOL_SHARD_INDEX	( ( 1u << ( 32 - SHARD_BITS ) ) - 2 )
+
+
+//-----------------------------------------------------------------------------
+// constructor, destructor
+//-----------------------------------------------------------------------------
+CUtlConcurrentSymbolTable::CUtlConcurrentSymbolTable( bool bCaseInsensitive ) : m_bInsensitive( bCaseInsensitive )
+{
+	for ( int i = 0; i < SHARD_COUNT; i++ )
+	{
+		Shard_t &shard = m_Shards[i];
+		shard.m_pSlots = NULL;
+		memset( (void *)shard.m_ppChunks, 0, sizeof( shard.m_ppChunks ) );
+		shard.m_nCount = 0;
+		shard.m_pBlockCur = NULL;
+		shard.m_nBlockFree = 0;
+		shard.m_nBlockBytes = 0;
+	}
+	m_nStrings = 0;
+}
+
+CUtlConcurrentSymbolTable::~CUtlConcurrentSymbolTable()
+{
+	RemoveAll();
+}
+
+
+//-----------------------------------------------------------------------------
+// Chunk c holds FIRST_CHUNK_SIZE << c strings, starting at index
+// FIRST_CHUNK_SIZE * ( ( 1 << c ) - 1 )
+//-----------------------------------------------------------------------------
+void CUtlConcurrentSymbolTable::ChunkFromIndex( int nIndex, int *pChunk, int *pOffset )
+{
+	unsigned int nScaled = (unsigned int)nIndex / FIRST_CHUNK_SIZE + 1;
+
+	int nChunk = 0;
+	while ( nScaled >>= 1 )
+	{
+		nChunk++;
+	}
+
+	*pChunk = nChunk;
+	*pOffset = nIndex - FIRST_CHUNK_SIZE * ( ( 1 << nChunk ) - 1 );
+}
+
+const char *CUtlConcurrentSymbolTable::ShardString( const Shard_t &shard, int nIndex ) const
+{
+	int nChunk, nOffset;
+	ChunkFromIndex( nIndex, &nChunk, &nOffset );
+	return shard.m_ppChunks[nChunk][nOffset];
+}
+
+
+//-----------------------------------------------------------------------------
+// Linear probing over a published slot array. Returns the index in the shard
+// or -1. Slots are filled hash first and index last, so a slot with an index
+// always has its hash and string in place.
+//-----------------------------------------------------------------------------
+int CUtlConcurrentSymbolTable::FindIndex( const SlotArray_t *pSlots, const char *pString, unsigned int nHash, const Shard_t &shard ) const
+{
+	if ( !pSlots )
+		return -1;
+
+	int nMask = pSlots->m_nMask;
+	int i = nHash & nMask;
+	for ( ;; )
+	{
+		const Slot_t &slot = pSlots->m_Slots[i];
+		unsigned int nIndex = slot.m_nIndex;
+		if ( !nIndex )
+			return -1;
+
+		ThreadMemoryBarrier();
+
+		if ( slot.m_nHash == nHash )
+		{
+			const char *pSlotString = ShardString( shard, nIndex - 1 );
+			if ( m_bInsensitive ? !V_stricmp( pSlotString, pString ) : !V_strcmp( pSlotString, pString ) )
+				return nIndex - 1;
+		}
+
+		i = ( i + 1 ) & nMask;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Doubles the shard's slot array. Called with the shard locked. Readers that
+// already loaded the old array keep probing it safely, so it's only retired.
+//-----------------------------------------------------------------------------
+void CUtlConcurrentSymbolTable::GrowSlots( Shard_t &shard )
+{
+	SlotArray_t *pOld = shard.m_pSlots;
+	int nSlots = pOld ? ( pOld->m_nMask + 1 ) * 2 : MIN_CONCURRENT_SYMBOL_SLOTS;
+
+	SlotArray_t *pNew = (SlotArray_t *)malloc( sizeof( SlotArray_t ) + ( nSlots - 1 ) * sizeof( Slot_t ) );
+	pNew->m_pRetired = pOld;
+	pNew->m_nMask = nSlots - 1;
+	memset( pNew->m_Slots, 0, nSlots * sizeof( Slot_t ) );
+
+	if ( pOld )
+	{
+		for ( int i = 0; i <= pOld->m_nMask; i++ )
+		{
+			const Slot_t &slot = pOld->m_Slots[i];
+			if ( !slot.m_nIndex )
+				continue;
+
+			int j = slot.m_nHash & pNew->m_nMask;
+			while ( pNew->m_Slots[j].m_nIndex )
+			{
+				j = ( j + 1 ) & pNew->m_nMask;
+			}
+			pNew->m_Slots[j].m_nHash = slot.m_nHash;
+			pNew->m_Slots[j].m_nIndex = slot.m_nIndex;
+		}
+	}
+
+	// The array has to be complete before anyone can see it
+	ThreadMemoryBarrier();
+	shard.m_pSlots = pNew;
+}
+
+
+//-----------------------------------------------------------------------------
+// Bump allocates the string out of the shard's current block. Called with the
+// shard locked.
+//-----------------------------------------------------------------------------
+const char *CUtlConcurrentSymbolTable::CopyString( Shard_t &shard, const char *pString, int nLen )
+{
+	if ( nLen > shard.m_nBlockFree )
+	{
+		int nBlockSize = clamp( shard.m_nBlockBytes, MIN_CONCURRENT_SYMBOL_BLOCK_SIZE, MAX_CONCURRENT_SYMBOL_BLOCK_SIZE );
+		nBlockSize = MAX( nBlockSize, nLen );
+
+		shard.m_pBlockCur = (char *)malloc( nBlockSize );
+		shard.m_nBlockFree = nBlockSize;
+		shard.m_nBlockBytes += nBlockSize;
+		shard.m_Blocks.AddToTail( shard.m_pBlockCur );
+	}
+
+	char *pCopy = shard.m_pBlockCur;
+	memcpy( pCopy, pString, nLen );
+	shard.m_pBlockCur += nLen;
+	shard.m_nBlockFree -= nLen;
+	return pCopy;
+}
+
+
+//-----------------------------------------------------------------------------
+// Finds and/or creates a symbol based on the string
+//-----------------------------------------------------------------------------
+UtlHashSymId_t CUtlConcurrentSymbolTable::AddString( const char *pString )
+{
+	if ( !pString )
+		return UTL_INVAL_HASH_SYMBOL;
+
+	int nLen;
+	unsigned int nHash = UtlHashSymbol_HashString( pString, m_bInsensitive, &nLen );
+	int iShard = GetShard( nHash );
+	Shard_t &shard = m_Shards[iShard];
+
+	// Most adds are for strings that are already in, so look without the lock first
+	int nIndex = FindIndex( shard.m_pSlots, pString, nHash, shard );
+	if ( nIndex >= 0 )
+		return ( (UtlHashSymId_t)nIndex << SHARD_BITS ) | iShard;
+
+	AUTO_LOCK( shard.m_Lock );
+
+	// Someone may have added it since
+	nIndex = FindIndex( shard.m_pSlots, pString, nHash, shard );
+	if ( nIndex >= 0 )
+		return ( (UtlHashSymId_t)nIndex << SHARD_BITS ) | iShard;
+
+	nIndex = shard.m_nCount;
+	if ( (unsigned int)nIndex > MAX_CONCURRENT_SYMBOL_SHARD_INDEX )
+	{
+		AssertMsg( false, "CUtlConcurrentSymbolTable is full\n" );
+		return UTL_INVAL_HASH_SYMBOL;
+	}
+
+	// Keep the load under 3/4
+	if ( !shard.m_pSlots || ( nIndex + 1 ) * 4 > ( shard.m_pSlots->m_nMask + 1 ) * 3 )
+	{
+		GrowSlots( shard );
+	}
+
+	int nChunk, nOffset;
+	ChunkFromIndex( nIndex, &nChunk, &nOffset );
+	if ( !shard.m_ppChunks[nChunk] )
+	{
+		const char **ppChunk = (const char **)malloc( ( FIRST_CHUNK_SIZE << nChunk ) * sizeof( const char * ) );
+		ThreadMemoryBarrier();
+		shard.m_ppChunks[nChunk] = ppChunk;
+	}
+	shard.m_ppChunks[nChunk][nOffset] = CopyString( shard, pString, nLen );
+	shard.m_nCount++;
+
+	// Fill in the slot hash first; readers treat a slot as empty until the index is set
+	SlotArray_t *pSlots = shard.m_pSlots;
+	int i = nHash & pSlots->m_nMask;
+	while ( pSlots->m_Slots[i].m_nIndex )
+	{
+		i = ( i + 1 ) & pSlots->m_nMask;
+	}
+
+	pSlots->m_Slots[i].m_nHash = nHash;
+	ThreadMemoryBarrier();
+	pSlots->m_Slots[i].m_nIndex = nIndex + 1;
+
+	++m_nStrings;
+	return ( (UtlHashSymId_t)nIndex << SHARD_BITS ) | iShard;
+}
+
+
+//-----------------------------------------------------------------------------
+// Finds the symbol for pString
+//-----------------------------------------------------------------------------
+UtlHashSymId_t CUtlConcurrentSymbolTable::Find( const char *pString ) const
+{
+	if ( !pString )
+		return UTL_INVAL_HASH_SYMBOL;
+
+	int nLen;
+	unsigned int nHash = UtlHashSymbol_HashString( pString, m_bInsensitive, &nLen );
+	int iShard = GetShard( nHash );
+	const Shard_t &shard = m_Shards[iShard];
+
+	int nIndex = FindIndex( shard.m_pSlots, pString, nHash, shard );
+	if ( nIndex < 0 )
+		return UTL_INVAL_HASH_SYMBOL;
+
+	return ( (UtlHashSymId_t)nIndex << SHARD_BITS ) | iShard;
+}
+
+
+//-----------------------------------------------------------------------------
+// Look up the string associated with a particular symbol
+//-----------------------------------------------------------------------------
+const char *CUtlConcurrentSymbolTable::String( UtlHashSymId_t id ) const
+{
+	if ( id == UTL_INVAL_HASH_SYMBOL )
+		return "";
+
+	const Shard_t &shard = m_Shards[id & ( SHARD_COUNT - 1 )];
+	int nIndex = (int)( id >> SHARD_BITS );
+
+	// Only handles AddString or Find gave out are valid, and those are always filled in
+	return ShardString( shard, nIndex );
+}
+
+
+//-----------------------------------------------------------------------------
+// Remove all symbols in the table.
+//-----------------------------------------------------------------------------
+void CUtlConcurrentSymbolTable::RemoveAll()
+{
+	for ( int i = 0; i < SHARD_COUNT; i++ )
+	{
+		Shard_t &shard = m_Shards[i];
+
+		SlotArray_t *pSlots = shard.m_pSlots;
+		while ( pSlots )
+		{
+			SlotArray_t *pRetired = pSlots->m_pRetired;
+			free( pSlots );
+			pSlots = pRetired;
+		}
+		shard.m_pSlots = NULL;
+
+		for ( int j = 0; j < MAX_CHUNKS; j++ )
+		{
+			free( (void *)shard.m_ppChunks[j] );
+			shard.m_ppChunks[j] = NULL;
+		}
+
+		for ( int j = 0; j < shard.m_Blocks.Count(); j++ )
+		{
+			free( shard.m_Blocks[j] );
+		}
+		shard.m_Blocks.Purge();
+
+		shard.m_nCount = 0;
+		shard.m_pBlockCur = NULL;
+		shard.m_nBlockFree = 0;
+		shard.m_nBlockBytes = 0;
+	}
+
+	m_nStrings = 0;
+}
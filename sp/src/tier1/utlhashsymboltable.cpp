@@ -0,0 +1,247 @@
+//=============================================================================//
+//
+// Purpose: A string interning table using open addressing and arena storage
+//
+//=============================================================================//
+
+#include "tier1/utlhashsymboltable.h"
+#include "tier1/strtools.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define MIN_HASH_SYMBOL_SLOTS		16
+#define MIN_HASH_SYMBOL_BLOCK_SIZE	4096
+#define MAX_HASH_SYMBOL_BLOCK_SIZE	65536
+
+
+//-----------------------------------------------------------------------------
+// constructor, destructor
+//-----------------------------------------------------------------------------
+CUtlHashSymbolTable::CUtlHashSymbolTable( int nInitSize, bool bCaseInsensitive ) :
+	m_Strings( 0, nInitSize ), m_bInsensitive( bCaseInsensitive )
+{
+	m_pBlockCur = NULL;
+	m_nBlockFree = 0;
+	m_nBlockBytes = 0;
+
+	if ( nInitSize > 0 )
+	{
+		// Room for nInitSize strings under the load limit
+		int nSlots = MIN_HASH_SYMBOL_SLOTS;
+		while ( nSlots * 3 < nInitSize * 4 )
+		{
+			nSlots <<= 1;
+		}
+		Rehash( nSlots );
+	}
+}
+
+CUtlHashSymbolTable::~CUtlHashSymbolTable()
+{
+	RemoveAll();
+}
+
+
+//-----------------------------------------------------------------------------
+// FNV-1a, with ASCII case folded for case-insensitive tables (the same folding
+// V_stricmp does in the C locale). The final mix spreads the high bits down,
+// since slots are picked with the low bits.
+//-----------------------------------------------------------------------------
+unsigned int UtlHashSymbol_HashString( const char *pString, bool bCaseInsensitive, int *pLen )
+{
+	const unsigned char *p = (const unsigned char *)pString;
+	unsigned int nHash = 2166136261u;
+
+	if ( bCaseInsensitive )
+	{
+		for ( ; *p; p++ )
+		{
+			unsigned int c = *p;
+			if ( c - 'A' <= 'Z' - 'A' )
+			{
+				c += 'a' - 'A';
+			}
+			nHash = ( nHash ^ c ) * 16777619u;
+		}
+	}
+	else
+	{
+		for ( ; *p; p++ )
+		{
+			nHash = ( nHash ^ *p ) * 16777619u;
+		}
+	}
+
+	*pLen = (int)( p - (const unsigned char *)pString ) + 1;
+
+	nHash ^= nHash >> 16;
+	nHash *= 0x85ebca6b;
+	nHash ^= nHash >> 13;
+	return nHash;
+}
+
+
+//-----------------------------------------------------------------------------
+// Linear probing. The table is never more than 3/4 full, so this always ends.
+//-----------------------------------------------------------------------------
+int CUtlHashSymbolTable::FindSlot( const char *pString, unsigned int nHash ) const
+{
+	int nMask = m_Slots.Count() - 1;
+	int i = nHash & nMask;
+	for ( ;; )
+	{
+		const Slot_t &slot = m_Slots[i];
+		if ( slot.m_Id == UTL_INVAL_HASH_SYMBOL )
+			return i;
+
+		if ( slot.m_nHash == nHash )
+		{
+			const char *pSlotString = m_Strings[slot.m_Id];
+			if ( m_bInsensitive ? !V_stricmp( pSlotString, pString ) : !V_strcmp( pSlotString, pString ) )
+				return i;
+		}
+
+		i = ( i + 1 ) & nMask;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Reinserts every symbol using the stored hashes
+//-----------------------------------------------------------------------------
+void CUtlHashSymbolTable::Rehash( int nSlots )
+{
+	Assert( IsPowerOfTwo( nSlots ) );
+
+	CUtlVector<Slot_t> oldSlots;
+	oldSlots.Swap( m_Slots );
+
+	m_Slots.SetCount( nSlots );
+	for ( int i = 0; i < nSlots; i++ )
+	{
+		m_Slots[i].m_nHash = 0;
+		m_Slots[i].m_Id = UTL_INVAL_HASH_SYMBOL;
+	}
+
+	int nMask = nSlots - 1;
+	for ( int i = 0; i < oldSlots.Count(); i++ )
+	{
+		const Slot_t &slot = oldSlots[i];
+		if ( slot.m_Id == UTL_INVAL_HASH_SYMBOL )
+			continue;
+
+		int j = slot.m_nHash & nMask;
+		while ( m_Slots[j].m_Id != UTL_INVAL_HASH_SYMBOL )
+		{
+			j = ( j + 1 ) & nMask;
+		}
+		m_Slots[j] = slot;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Bump allocates the string out of the current block. Blocks double in size
+// up to a limit, and strings that don't fit get a block of their own.
+//-----------------------------------------------------------------------------
+const char *CUtlHashSymbolTable::CopyString( const char *pString, int nLen )
+{
+	if ( nLen > m_nBlockFree )
+	{
+		int nBlockSize = clamp( m_nBlockBytes, MIN_HASH_SYMBOL_BLOCK_SIZE, MAX_HASH_SYMBOL_BLOCK_SIZE );
+		nBlockSize = MAX( nBlockSize, nLen );
+
+		m_pBlockCur = (char *)malloc( nBlockSize );
+		m_nBlockFree = nBlockSize;
+		m_nBlockBytes += nBlockSize;
+		m_Blocks.AddToTail( m_pBlockCur );
+	}
+
+	char *pCopy = m_pBlockCur;
+	memcpy( pCopy, pString, nLen );
+	m_pBlockCur += nLen;
+	m_nBlockFree -= nLen;
+	return pCopy;
+}
+
+
+//-----------------------------------------------------------------------------
+// Finds and/or creates a symbol based on the string
+//-----------------------------------------------------------------------------
+UtlHashSymId_t CUtlHashSymbolTable::AddString( const char *pString )
+{
+	if ( !pString )
+		return UTL_INVAL_HASH_SYMBOL;
+
+	// Keep the load under 3/4
+	if ( ( m_Strings.Count() + 1 ) * 4 > m_Slots.Count() * 3 )
+	{
+		Rehash( MAX( m_Slots.Count() * 2, MIN_HASH_SYMBOL_SLOTS ) );
+	}
+
+	int nLen;
+	unsigned int nHash = UtlHashSymbol_HashString( pString, m_bInsensitive, &nLen );
+
+	Slot_t &slot = m_Slots[FindSlot( pString, nHash )];
+	if ( slot.m_Id != UTL_INVAL_HASH_SYMBOL )
+		return slot.m_Id;
+
+	slot.m_nHash = nHash;
+	slot.m_Id = m_Strings.AddToTail( CopyString( pString, nLen ) );
+	return slot.m_Id;
+}
+
+
+//-----------------------------------------------------------------------------
+// Finds the symbol for pString. Doesn't modify the table, so it's safe to
+// call from several threads as long as nothing is adding at the same time.
+//-----------------------------------------------------------------------------
+UtlHashSymId_t CUtlHashSymbolTable::Find( const char *pString ) const
+{
+	if ( !pString || !m_Strings.Count() )
+		return UTL_INVAL_HASH_SYMBOL;
+
+	int nLen;
+	unsigned int nHash = UtlHashSymbol_HashString( pString, m_bInsensitive, &nLen );
+	return m_Slots[FindSlot( pString, nHash )].m_Id;
+}
+
+
+//-----------------------------------------------------------------------------
+// Look up the string associated with a particular symbol
+//-----------------------------------------------------------------------------
+const char *CUtlHashSymbolTable::String( UtlHashSymId_t id ) const
+{
+	if ( id == UTL_INVAL_HASH_SYMBOL )
+		return "";
+
+	Assert( m_Strings.IsValidIndex( id ) );
+	return m_Strings[id];
+}
+
+
+//-----------------------------------------------------------------------------
+// Remove all symbols in the table.
+//-----------------------------------------------------------------------------
+void CUtlHashSymbolTable::RemoveAll()
+{
+	m_Slots.Purge();
+	m_Strings.Purge();
+
+	for ( int i = 0; i < m_Blocks.Count(); i++ )
+	{
+		free( m_Blocks[i] );
+	}
+	m_Blocks.Purge();
+
+	m_pBlockCur = NULL;
+	m_nBlockFree = 0;
+	m_nBlockBytes = 0;
+}
+
+int CUtlHashSymbolTable::GetMemoryUsage() const
+{
+	return m_Slots.NumAllocated() * sizeof( Slot_t ) + m_Strings.NumAllocated() * sizeof( const char * ) +
+		m_Blocks.NumAllocated() * sizeof( char * ) + m_nBlockBytes;
+}